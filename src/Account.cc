@@ -8,6 +8,7 @@
 #include <phosg/Time.hh>
 
 #include "Account.hh"
+#include "AsyncFileWriter.hh"
 
 using namespace std;
 
@@ -406,13 +407,12 @@ void Account::save() const {
     auto json = this->json();
     string json_data = json.serialize(phosg::JSON::SerializeOption::FORMAT | phosg::JSON::SerializeOption::HEX_INTEGERS);
     string filename = phosg::string_printf("system/licenses/%010" PRIu32 ".json", this->account_id);
-    phosg::save_file(filename, json_data);
+    save_file_async(filename, std::move(json_data));
   }
 }
 
 void Account::delete_file() const {
-  string filename = phosg::string_printf("system/licenses/%010" PRIu32 ".json", this->account_id);
-  remove(filename.c_str());
+  delete_file_async(phosg::string_printf("system/licenses/%010" PRIu32 ".json", this->account_id));
 }
 
 size_t AccountIndex::count() const {
@@ -0,0 +1,226 @@
+#include "AsyncFileWriter.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+#include <vector>
+
+#include "Loggers.hh"
+
+using namespace std;
+
+shared_ptr<AsyncFileWriter> global_file_writer;
+
+AsyncFileWriter::AsyncFileWriter()
+    : should_exit(false),
+      thread(&AsyncFileWriter::thread_fn, this) {}
+
+AsyncFileWriter::~AsyncFileWriter() {
+  {
+    lock_guard g(this->lock);
+    this->should_exit = true;
+  }
+  this->work_available.notify_all();
+  this->thread.join();
+}
+
+void AsyncFileWriter::enqueue(const string& filename, optional<string>&& data) {
+  {
+    lock_guard g(this->lock);
+    this->stats.num_requests++;
+    auto it = this->pending.find(filename);
+    if (it != this->pending.end()) {
+      // The file hasn't been written yet, so just replace the data that will
+      // be written. The queued time stays the same, so the latency stats
+      // reflect how long the file was out of date on disk.
+      it->second.data = std::move(data);
+      this->stats.num_coalesced++;
+      return;
+    }
+    this->pending.emplace(filename, PendingWrite{.data = std::move(data), .queued_time = phosg::now()});
+    this->pending_order.emplace_back(filename);
+    this->stats.queue_depth = this->pending.size();
+  }
+  this->work_available.notify_one();
+}
+
+void AsyncFileWriter::write(const string& filename, string&& data) {
+  this->enqueue(filename, std::move(data));
+}
+
+void AsyncFileWriter::remove(const string& filename) {
+  this->enqueue(filename, nullopt);
+}
+
+void AsyncFileWriter::wait_for(const string& filename) {
+  unique_lock g(this->lock);
+  this->work_done.wait(g, [&]() -> bool {
+    return !this->pending.count(filename) && !this->in_progress.count(filename);
+  });
+}
+
+void AsyncFileWriter::flush() {
+  unique_lock g(this->lock);
+  this->work_done.wait(g, [&]() -> bool {
+    return this->pending.empty() && this->in_progress.empty();
+  });
+}
+
+AsyncFileWriter::Stats AsyncFileWriter::get_stats() const {
+  lock_guard g(this->lock);
+  return this->stats;
+}
+
+void AsyncFileWriter::thread_fn() {
+  deque<pair<string, PendingWrite>> batch;
+  for (;;) {
+    {
+      unique_lock g(this->lock);
+      // Waiters check for their own files (or for an empty queue) when woken,
+      // so wake all of them after every batch; otherwise, a wait for a single
+      // file could take as long as writing everything in the queue
+      if (!batch.empty()) {
+        for (const auto& it : batch) {
+          this->in_progress.erase(it.first);
+        }
+        batch.clear();
+        this->work_done.notify_all();
+      }
+
+      this->work_available.wait(g, [&]() -> bool {
+        return this->should_exit || !this->pending_order.empty();
+      });
+      if (this->pending_order.empty()) {
+        // should_exit must be true, and there's nothing left to write
+        return;
+      }
+
+      while (!this->pending_order.empty() && (batch.size() < MAX_BATCH_SIZE)) {
+        auto pending_it = this->pending.find(this->pending_order.front());
+        this->in_progress.emplace(pending_it->first);
+        batch.emplace_back(pending_it->first, std::move(pending_it->second));
+        this->pending.erase(pending_it);
+        this->pending_order.pop_front();
+      }
+      this->stats.queue_depth = this->pending.size();
+    }
+    // If a file is still being written when it's saved again, the new write
+    // goes into pending as usual; it won't be picked up until this batch is
+    // done, since batches are only taken on this thread
+    this->write_batch(batch);
+  }
+}
+
+void AsyncFileWriter::write_batch(deque<pair<string, PendingWrite>>& batch) {
+  // All of the files are written to temporary files first, then they're all
+  // synced, then they're all renamed into place, and finally the directories
+  // containing them are synced. This way, the batch costs one round of syncs
+  // rather than one for each file.
+  struct TempFile {
+    size_t batch_index;
+    string temp_filename;
+    phosg::scoped_fd fd;
+  };
+  vector<TempFile> temp_files;
+  vector<bool> succeeded(batch.size(), false);
+  unordered_set<string> dirs_to_sync;
+  uint64_t bytes_written = 0;
+
+  auto dirname_for_sync = [](const string& filename) -> string {
+    size_t slash_offset = filename.rfind('/');
+    return (slash_offset == string::npos) ? "." : filename.substr(0, slash_offset);
+  };
+
+  for (size_t z = 0; z < batch.size(); z++) {
+    const auto& [filename, pw] = batch[z];
+    if (!pw.data) {
+      if ((::remove(filename.c_str()) != 0) && (errno != ENOENT)) {
+        player_data_log.error("Cannot delete file %s: %s", filename.c_str(), phosg::string_for_error(errno).c_str());
+      } else {
+        succeeded[z] = true;
+        dirs_to_sync.emplace(dirname_for_sync(filename));
+      }
+      continue;
+    }
+
+    string temp_filename = filename + ".tmp";
+    try {
+      phosg::scoped_fd fd(temp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      phosg::writex(fd, pw.data->data(), pw.data->size());
+      temp_files.emplace_back(TempFile{.batch_index = z, .temp_filename = std::move(temp_filename), .fd = std::move(fd)});
+      bytes_written += pw.data->size();
+    } catch (const exception& e) {
+      ::unlink(temp_filename.c_str());
+      player_data_log.error("Cannot write file %s: %s", filename.c_str(), e.what());
+    }
+  }
+
+  for (auto& tf : temp_files) {
+    const string& filename = batch[tf.batch_index].first;
+    if (fsync(tf.fd) != 0) {
+      player_data_log.error("Cannot sync file %s: %s", filename.c_str(), phosg::string_for_error(errno).c_str());
+      tf.fd.close();
+      ::unlink(tf.temp_filename.c_str());
+      continue;
+    }
+    tf.fd.close();
+    if (::rename(tf.temp_filename.c_str(), filename.c_str()) != 0) {
+      player_data_log.error("Cannot rename temporary file for %s: %s", filename.c_str(), phosg::string_for_error(errno).c_str());
+      ::unlink(tf.temp_filename.c_str());
+      continue;
+    }
+    succeeded[tf.batch_index] = true;
+    dirs_to_sync.emplace(dirname_for_sync(filename));
+  }
+
+  for (const auto& dirname : dirs_to_sync) {
+    try {
+      phosg::scoped_fd fd(dirname, O_RDONLY);
+      fsync(fd);
+    } catch (const exception& e) {
+      player_data_log.warning("Cannot sync directory %s: %s", dirname.c_str(), e.what());
+    }
+  }
+
+  uint64_t now = phosg::now();
+  lock_guard g(this->lock);
+  this->stats.num_batches++;
+  this->stats.bytes_written += bytes_written;
+  for (size_t z = 0; z < batch.size(); z++) {
+    if (succeeded[z]) {
+      uint64_t latency_usecs = now - batch[z].second.queued_time;
+      this->stats.num_completed++;
+      this->stats.total_latency_usecs += latency_usecs;
+      this->stats.max_latency_usecs = max<uint64_t>(this->stats.max_latency_usecs, latency_usecs);
+    } else {
+      this->stats.num_errors++;
+    }
+  }
+}
+
+void save_file_async(const string& filename, string&& data) {
+  if (global_file_writer) {
+    global_file_writer->write(filename, std::move(data));
+  } else {
+    phosg::save_file(filename, data);
+  }
+}
+
+void delete_file_async(const string& filename) {
+  if (global_file_writer) {
+    global_file_writer->remove(filename);
+  } else {
+    ::remove(filename.c_str());
+  }
+}
+
+void wait_for_file_write(const string& filename) {
+  if (global_file_writer) {
+    global_file_writer->wait_for(filename);
+  }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+// AsyncFileWriter writes files on a background thread, so that saving player
+// data, accounts, teams, etc. never blocks the event thread on disk I/O. If a
+// file is saved again before the previous write has started, only the latest
+// data is written. Each file is written to a temporary file which is then
+// renamed into place, so a crash never leaves a partially-written file; the
+// fsyncs for all files written together are done as one batch.
+class AsyncFileWriter {
+public:
+  struct Stats {
+    size_t queue_depth = 0; // Files waiting to be written or deleted
+    uint64_t num_requests = 0;
+    uint64_t num_coalesced = 0; // Requests that replaced a pending request for the same file
+    uint64_t num_completed = 0;
+    uint64_t num_errors = 0;
+    uint64_t num_batches = 0;
+    uint64_t bytes_written = 0;
+    // Time from when a file is first queued to when its write is done
+    uint64_t total_latency_usecs = 0;
+    uint64_t max_latency_usecs = 0;
+  };
+
+  AsyncFileWriter();
+  AsyncFileWriter(const AsyncFileWriter&) = delete;
+  AsyncFileWriter(AsyncFileWriter&&) = delete;
+  AsyncFileWriter& operator=(const AsyncFileWriter&) = delete;
+  AsyncFileWriter& operator=(AsyncFileWriter&&) = delete;
+  // Writes all pending files before returning
+  ~AsyncFileWriter();
+
+  void write(const std::string& filename, std::string&& data);
+  void remove(const std::string& filename);
+
+  // Blocks until there are no pending or in-progress writes for the given
+  // file. This must be called before reading a file that may have been saved
+  // recently.
+  void wait_for(const std::string& filename);
+  // Blocks until all pending writes are done
+  void flush();
+
+  Stats get_stats() const;
+
+private:
+  static constexpr size_t MAX_BATCH_SIZE = 64;
+
+  struct PendingWrite {
+    std::optional<std::string> data; // If missing, the file is deleted instead
+    uint64_t queued_time;
+  };
+
+  mutable std::mutex lock;
+  std::condition_variable work_available;
+  std::condition_variable work_done;
+  std::unordered_map<std::string, PendingWrite> pending;
+  std::deque<std::string> pending_order;
+  std::unordered_set<std::string> in_progress;
+  bool should_exit;
+  Stats stats;
+  std::thread thread;
+
+  void enqueue(const std::string& filename, std::optional<std::string>&& data);
+  void thread_fn();
+  void write_batch(std::deque<std::pair<std::string, PendingWrite>>& batch);
+};
+
+// The server's file writer. This is created when the server starts and
+// destroyed (after writing all pending files) when it stops. When this is
+// null (for example, in most CLI actions), the functions below write and
+// delete files immediately instead.
+extern std::shared_ptr<AsyncFileWriter> global_file_writer;
+
+void save_file_async(const std::string& filename, std::string&& data);
+template <typename T>
+void save_object_file_async(const std::string& filename, const T& obj) {
+  save_file_async(filename, std::string(reinterpret_cast<const char*>(&obj), sizeof(T)));
+}
+void delete_file_async(const std::string& filename);
+void wait_for_file_write(const std::string& filename);
@@ -11,7 +11,9 @@
 #include <phosg/Time.hh>
 
 #include "Loggers.hh"
+#include "Metrics.hh"
 #include "Version.hh"
+#include "Watchdog.hh"
 
 using namespace std;
 
@@ -40,7 +42,11 @@ Channel::Channel(
       terminal_recv_color(terminal_recv_color),
       on_command_received(on_command_received),
       on_error(on_error),
-      context_obj(context_obj) {
+      on_output(nullptr),
+      context_obj(context_obj),
+      recv_header_valid(false),
+      output_low_watermark(0),
+      cork_depth(0) {
 }
 
 Channel::Channel(
@@ -62,7 +68,11 @@ Channel::Channel(
       terminal_recv_color(terminal_recv_color),
       on_command_received(on_command_received),
       on_error(on_error),
-      context_obj(context_obj) {
+      on_output(nullptr),
+      context_obj(context_obj),
+      recv_header_valid(false),
+      output_low_watermark(0),
+      cork_depth(0) {
   this->set_bufferevent(bev, virtual_network_id);
 }
 
@@ -72,6 +82,9 @@ void Channel::replace_with(
     on_error_t on_error,
     void* context_obj,
     const std::string& name) {
+  // The new owner hasn't asked for output notifications, so they should be
+  // sent only when the buffer is empty, as for a new channel
+  this->output_low_watermark = 0;
   this->set_bufferevent(other.bev.release(), other.virtual_network_id);
   this->local_addr = other.local_addr;
   this->remote_addr = other.remote_addr;
@@ -79,11 +92,14 @@ void Channel::replace_with(
   this->language = other.language;
   this->crypt_in = other.crypt_in;
   this->crypt_out = other.crypt_out;
+  this->recv_header = other.recv_header;
+  this->recv_header_valid = other.recv_header_valid;
   this->name = name;
   this->terminal_send_color = other.terminal_send_color;
   this->terminal_recv_color = other.terminal_recv_color;
   this->on_command_received = on_command_received;
   this->on_error = on_error;
+  this->on_output = nullptr;
   this->context_obj = context_obj;
   other.disconnect(); // Clears crypts, addrs, etc.
 }
@@ -101,8 +117,14 @@ void Channel::set_bufferevent(struct bufferevent* bev, uint64_t virtual_network_
       phosg::get_socket_addresses(fd, &this->local_addr, &this->remote_addr);
     }
 
-    bufferevent_setcb(this->bev.get(), &Channel::dispatch_on_input, nullptr, &Channel::dispatch_on_error, this);
-    bufferevent_enable(this->bev.get(), EV_READ | EV_WRITE);
+    bufferevent_setcb(this->bev.get(), &Channel::dispatch_on_input, &Channel::dispatch_on_output, &Channel::dispatch_on_error, this);
+    bufferevent_setwatermark(this->bev.get(), EV_WRITE, this->output_low_watermark, 0);
+    if ((this->cork_depth == 0) || !this->virtual_network_id) {
+      bufferevent_enable(this->bev.get(), EV_READ | EV_WRITE);
+    } else {
+      bufferevent_enable(this->bev.get(), EV_READ);
+      bufferevent_disable(this->bev.get(), EV_WRITE);
+    }
 
   } else {
     memset(&this->local_addr, 0, sizeof(this->local_addr));
@@ -110,6 +132,17 @@ void Channel::set_bufferevent(struct bufferevent* bev, uint64_t virtual_network_
   }
 }
 
+void Channel::set_output_low_watermark(size_t bytes) {
+  this->output_low_watermark = bytes;
+  if (this->bev.get()) {
+    bufferevent_setwatermark(this->bev.get(), EV_WRITE, this->output_low_watermark, 0);
+  }
+}
+
+size_t Channel::output_buffer_size() const {
+  return this->bev.get() ? evbuffer_get_length(bufferevent_get_output(this->bev.get())) : 0;
+}
+
 void Channel::disconnect() {
   if (this->bev.get()) {
     // If the output buffer is not empty, move the bufferevent into the draining
@@ -138,73 +171,122 @@ void Channel::disconnect() {
         }
       };
 
+      // The write callback must not be called until the buffer is completely
+      // empty, or the rest of the data would be lost when it's freed
       struct bufferevent* bev = this->bev.release();
+      bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
       bufferevent_setcb(bev, nullptr, on_output, on_error, bev);
       bufferevent_disable(bev, EV_READ);
+      bufferevent_enable(bev, EV_WRITE); // In case the channel was corked
     }
   }
 
   memset(&this->local_addr, 0, sizeof(this->local_addr));
   memset(&this->remote_addr, 0, sizeof(this->remote_addr));
   this->virtual_network_id = false;
+  this->output_low_watermark = 0;
   this->crypt_in.reset();
   this->crypt_out.reset();
+  this->recv_header_valid = false;
+}
+
+void Channel::cork() {
+  if ((this->cork_depth++ == 0) && this->bev.get() && this->virtual_network_id) {
+    bufferevent_disable(this->bev.get(), EV_WRITE);
+  }
+}
+
+void Channel::uncork() {
+  if (this->cork_depth == 0) {
+    throw logic_error("channel is not corked");
+  }
+  if ((--this->cork_depth == 0) && this->bev.get() && this->virtual_network_id) {
+    bufferevent_enable(this->bev.get(), EV_WRITE);
+  }
+}
+
+Channel::CorkScope::CorkScope(Channel& ch) : ch(&ch) {
+  this->ch->cork();
+}
+
+Channel::CorkScope::~CorkScope() {
+  this->release();
+}
+
+void Channel::CorkScope::release() {
+  if (this->ch) {
+    this->ch->uncork();
+    this->ch = nullptr;
+  }
 }
 
 Channel::Message Channel::recv() {
   struct evbuffer* buf = bufferevent_get_input(this->bev.get());
 
-  size_t header_size = (this->version == Version::BB_V4) ? 8 : 4;
-  PSOCommandHeader header;
-  if (evbuffer_copyout(buf, &header, header_size) < static_cast<ssize_t>(header_size)) {
-    throw out_of_range("no command available");
+  size_t header_size = PSOCommandHeader::header_size(this->version);
+  if (!this->recv_header_valid) {
+    if (evbuffer_get_length(buf) < header_size) {
+      throw out_of_range("no command available");
+    }
+    // Some encryption algorithms' advancement depends on the decrypted data,
+    // so we can't decrypt the header without advancing and then decrypt it
+    // again later. Instead, we decrypt it once here and keep it until the rest
+    // of the command is available.
+    if (evbuffer_remove(buf, &this->recv_header, header_size) < static_cast<ssize_t>(header_size)) {
+      throw logic_error("enough bytes available, but could not remove them");
+    }
+    if (this->crypt_in.get()) {
+      uint64_t decrypt_start = metrics_now_ns();
+      this->crypt_in->decrypt(&this->recv_header, header_size);
+      global_metrics.decrypt_ns[ServerMetrics::version_slot(this->version)].add(metrics_now_ns() - decrypt_start);
+    }
+    this->recv_header_valid = true;
   }
+  const PSOCommandHeader& header = this->recv_header;
 
-  if (this->crypt_in.get()) {
-    this->crypt_in->decrypt(&header, header_size, false);
+  size_t command_logical_size = header.size(this->version);
+  if (command_logical_size < header_size) {
+    throw runtime_error("command size is smaller than header size");
   }
 
-  size_t command_logical_size = header.size(version);
-
   // If encryption is enabled, BB pads commands to 8-byte boundaries, and this
   // is not reflected in the size field. This logic does not occur if encryption
   // is not yet enabled.
-  size_t command_physical_size = (this->crypt_in.get() && (version == Version::BB_V4))
+  size_t command_physical_size = (this->crypt_in.get() && (this->version == Version::BB_V4))
       ? ((command_logical_size + 7) & ~7)
       : command_logical_size;
-  if (evbuffer_get_length(buf) < command_physical_size) {
+  size_t data_physical_size = command_physical_size - header_size;
+  if (evbuffer_get_length(buf) < data_physical_size) {
     throw out_of_range("no command available");
   }
 
-  // If we get here, then there is a full command in the buffer. Some encryption
-  // algorithms' advancement depends on the decrypted data, so we have to
-  // actually decrypt the header again (with advance=true) to keep them in a
-  // consistent state.
-
-  string header_data(header_size, '\0');
-  if (evbuffer_remove(buf, header_data.data(), header_data.size()) < static_cast<ssize_t>(header_data.size())) {
-    throw logic_error("enough bytes available, but could not remove them");
-  }
-  if (this->crypt_in.get()) {
-    this->crypt_in->decrypt(header_data.data(), header_data.size());
-  }
-
-  string command_data(command_physical_size - header_size, '\0');
-  if (evbuffer_remove(buf, command_data.data(), command_data.size()) < static_cast<ssize_t>(command_data.size())) {
-    throw logic_error("enough bytes available, but could not remove them");
-  }
+  // If we get here, then the rest of the command is in the buffer. Some
+  // versions of PSO DC can send commands whose sizes are not a multiple of 4,
+  // but the server is expected to always use a multiple of 4 bytes when
+  // decrypting (the extra cipher bytes are lost). To emulate this behavior, we
+  // have to round up the size for DC commands here. The data is removed
+  // directly into the reused receive buffer, so there's no intermediate copy.
+  size_t decrypt_size = this->crypt_in.get() ? ((data_physical_size + 3) & (~3)) : data_physical_size;
+  string command_data = std::move(this->recv_buffer);
+  this->recv_buffer.clear();
+  command_data.resize_and_overwrite(decrypt_size, [&](char* data, size_t size) -> size_t {
+    if (evbuffer_remove(buf, data, data_physical_size) < static_cast<ssize_t>(data_physical_size)) {
+      throw logic_error("enough bytes available, but could not remove them");
+    }
+    memset(data + data_physical_size, 0, size - data_physical_size);
+    return size;
+  });
+  this->recv_header_valid = false;
 
+  size_t version_slot = ServerMetrics::version_slot(this->version);
   if (this->crypt_in.get()) {
-    // Some versions of PSO DC can send commands whose sizes are not a multiple
-    // of 4, but the server is expected to always use a multiple of 4 bytes when
-    // decrypting (the extra cipher bytes are lost). To emulate this behavior,
-    // we have to round up the size for DC commands here.
-    size_t orig_size = command_data.size();
-    command_data.resize((orig_size + 3) & (~3), 0);
+    uint64_t decrypt_start = metrics_now_ns();
     this->crypt_in->decrypt(command_data.data(), command_data.size());
-    command_data.resize(orig_size);
+    global_metrics.decrypt_ns[version_slot].add(metrics_now_ns() - decrypt_start);
   }
   command_data.resize(command_logical_size - header_size);
+  global_metrics.commands_received[version_slot][header.command(this->version) & 0xFF].add();
+  global_metrics.bytes_received[version_slot].add(command_physical_size);
 
   if (command_data_log.should_log(phosg::LogLevel::INFO) && (this->terminal_recv_color != phosg::TerminalFormat::END)) {
     if (use_terminal_colors && this->terminal_recv_color != phosg::TerminalFormat::NORMAL) {
@@ -227,7 +309,7 @@ Channel::Message Channel::recv() {
     }
 
     vector<struct iovec> iovs;
-    iovs.emplace_back(iovec{.iov_base = header_data.data(), .iov_len = header_data.size()});
+    iovs.emplace_back(iovec{.iov_base = &this->recv_header, .iov_len = header_size});
     iovs.emplace_back(iovec{.iov_base = command_data.data(), .iov_len = command_data.size()});
     phosg::print_data(stderr, iovs, 0, nullptr, phosg::PrintDataFlags::PRINT_ASCII | phosg::PrintDataFlags::DISABLE_COLOR | phosg::PrintDataFlags::OFFSET_16_BITS);
 
@@ -247,21 +329,16 @@ void Channel::send(uint16_t cmd, uint32_t flag, bool silent) {
   this->send(cmd, flag, nullptr, 0, silent);
 }
 
-void Channel::send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<const void*, size_t>> blocks, bool silent) {
-  if (!this->connected()) {
-    channel_exceptions_log.warning("Attempted to send command on closed channel; dropping data");
-    return;
-  }
-
-  size_t size = 0;
-  for (const auto& b : blocks) {
-    size += b.second;
-  }
-
-  string send_data;
-  size_t logical_size;
+size_t Channel::build_header(
+    PSOCommandHeader& header,
+    size_t& logical_size,
+    Version version,
+    bool encrypted,
+    uint16_t cmd,
+    uint32_t flag,
+    size_t size) {
   size_t send_data_size = 0;
-  switch (this->version) {
+  switch (version) {
     case Version::DC_NTE:
     case Version::DC_V1_11_2000_PROTOTYPE:
     case Version::DC_V1:
@@ -271,37 +348,33 @@ void Channel::send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<cons
     case Version::GC_EP3_NTE:
     case Version::GC_EP3:
     case Version::XB_V3: {
-      PSOCommandHeaderDCV3 header;
-      if (this->crypt_out.get() &&
-          (this->version != Version::DC_NTE) &&
-          (this->version != Version::DC_V1_11_2000_PROTOTYPE) &&
-          (this->version != Version::DC_V1)) {
-        send_data_size = (sizeof(header) + size + 3) & ~3;
+      if (encrypted &&
+          (version != Version::DC_NTE) &&
+          (version != Version::DC_V1_11_2000_PROTOTYPE) &&
+          (version != Version::DC_V1)) {
+        send_data_size = (sizeof(header.dc) + size + 3) & ~3;
       } else {
-        send_data_size = (sizeof(header) + size);
+        send_data_size = (sizeof(header.dc) + size);
       }
       logical_size = send_data_size;
-      header.command = cmd;
-      header.flag = flag;
-      header.size = send_data_size;
-      send_data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+      header.dc.command = cmd;
+      header.dc.flag = flag;
+      header.dc.size = send_data_size;
       break;
     }
     case Version::PC_PATCH:
     case Version::BB_PATCH:
     case Version::PC_NTE:
     case Version::PC_V2: {
-      PSOCommandHeaderPC header;
-      if (this->crypt_out.get()) {
-        send_data_size = (sizeof(header) + size + 3) & ~3;
+      if (encrypted) {
+        send_data_size = (sizeof(header.pc) + size + 3) & ~3;
       } else {
-        send_data_size = (sizeof(header) + size);
+        send_data_size = (sizeof(header.pc) + size);
       }
       logical_size = send_data_size;
-      header.size = send_data_size;
-      header.command = cmd;
-      header.flag = flag;
-      send_data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+      header.pc.size = send_data_size;
+      header.pc.command = cmd;
+      header.pc.flag = flag;
       break;
     }
     case Version::BB_V4: {
@@ -312,17 +385,15 @@ void Channel::send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<cons
       // before encryption is enabled have no size restrictions (except they
       // must include a full header and must fit in the client's receive
       // buffer), and no implicit extra bytes are sent.
-      PSOCommandHeaderBB header;
-      if (this->crypt_out.get()) {
-        send_data_size = (sizeof(header) + size + 7) & ~7;
+      if (encrypted) {
+        send_data_size = (sizeof(header.bb) + size + 7) & ~7;
       } else {
-        send_data_size = (sizeof(header) + size);
+        send_data_size = (sizeof(header.bb) + size);
       }
-      logical_size = (sizeof(header) + size + 3) & ~3;
-      header.size = logical_size;
-      header.command = cmd;
-      header.flag = flag;
-      send_data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+      logical_size = (sizeof(header.bb) + size + 3) & ~3;
+      header.bb.size = logical_size;
+      header.bb.command = cmd;
+      header.bb.flag = flag;
       break;
     }
 
@@ -336,11 +407,29 @@ void Channel::send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<cons
     throw runtime_error("outbound command too large");
   }
 
-  send_data.reserve(send_data_size);
-  for (const auto& b : blocks) {
-    send_data.append(reinterpret_cast<const char*>(b.first), b.second);
+  return send_data_size;
+}
+
+uint8_t* Channel::reserve_send_space(struct evbuffer_iovec& iov, size_t size) {
+  // Commands are built directly in the output buffer, so they don't have to
+  // be assembled in a temporary buffer and copied again. Reserving a single
+  // extent guarantees that the space is contiguous, so we can encrypt it in
+  // place.
+  struct evbuffer* buf = bufferevent_get_output(this->bev.get());
+  if (evbuffer_reserve_space(buf, size, &iov, 1) != 1 || iov.iov_len < size) {
+    throw runtime_error("cannot reserve space in output buffer");
   }
-  send_data.resize(send_data_size, '\0');
+  return reinterpret_cast<uint8_t*>(iov.iov_base);
+}
+
+void Channel::commit_send_data(
+    struct evbuffer_iovec& iov,
+    size_t send_data_size,
+    size_t logical_size,
+    uint16_t cmd,
+    uint32_t flag,
+    bool silent) {
+  uint8_t* send_data = reinterpret_cast<uint8_t*>(iov.iov_base);
 
   if (!silent && (command_data_log.should_log(phosg::LogLevel::INFO)) && (this->terminal_send_color != phosg::TerminalFormat::END)) {
     if (use_terminal_colors && this->terminal_send_color != phosg::TerminalFormat::NORMAL) {
@@ -353,18 +442,88 @@ void Channel::send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<cons
       command_data_log.info("Sending to %s (version=%s command=%02hX flag=%02" PRIX32 ")",
           this->name.c_str(), phosg::name_for_enum(version), cmd, flag);
     }
-    phosg::print_data(stderr, send_data.data(), logical_size, 0, nullptr, phosg::PrintDataFlags::PRINT_ASCII | phosg::PrintDataFlags::DISABLE_COLOR | phosg::PrintDataFlags::OFFSET_16_BITS);
+    phosg::print_data(stderr, send_data, logical_size, 0, nullptr, phosg::PrintDataFlags::PRINT_ASCII | phosg::PrintDataFlags::DISABLE_COLOR | phosg::PrintDataFlags::OFFSET_16_BITS);
     if (use_terminal_colors && this->terminal_send_color != phosg::TerminalFormat::NORMAL) {
       print_color_escape(stderr, phosg::TerminalFormat::NORMAL, phosg::TerminalFormat::END);
     }
   }
 
+  size_t version_slot = ServerMetrics::version_slot(this->version);
   if (this->crypt_out.get()) {
-    this->crypt_out->encrypt(send_data.data(), send_data.size());
+    uint64_t encrypt_start = metrics_now_ns();
+    this->crypt_out->encrypt(send_data, send_data_size);
+    global_metrics.encrypt_ns[version_slot].add(metrics_now_ns() - encrypt_start);
   }
+  global_metrics.commands_sent[version_slot][cmd & 0xFF].add();
+  global_metrics.bytes_sent[version_slot].add(send_data_size);
 
-  struct evbuffer* buf = bufferevent_get_output(this->bev.get());
-  evbuffer_add(buf, send_data.data(), send_data.size());
+  iov.iov_len = send_data_size;
+  if (evbuffer_commit_space(bufferevent_get_output(this->bev.get()), &iov, 1) != 0) {
+    throw runtime_error("cannot commit data to output buffer");
+  }
+}
+
+void Channel::send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<const void*, size_t>> blocks, bool silent) {
+  if (!this->connected()) {
+    channel_exceptions_log.warning("Attempted to send command on closed channel; dropping data");
+    return;
+  }
+
+  size_t size = 0;
+  for (const auto& b : blocks) {
+    size += b.second;
+  }
+
+  PSOCommandHeader header;
+  size_t header_size = PSOCommandHeader::header_size(this->version);
+  size_t logical_size;
+  size_t send_data_size = this->build_header(
+      header, logical_size, this->version, this->crypt_out.get() != nullptr, cmd, flag, size);
+
+  struct evbuffer_iovec iov;
+  uint8_t* send_data = this->reserve_send_space(iov, send_data_size);
+  memcpy(send_data, &header, header_size);
+  size_t offset = header_size;
+  for (const auto& b : blocks) {
+    memcpy(send_data + offset, b.first, b.second);
+    offset += b.second;
+  }
+  memset(send_data + offset, 0, send_data_size - offset);
+
+  this->commit_send_data(iov, send_data_size, logical_size, cmd, flag, silent);
+}
+
+Channel::PreparedMessage Channel::prepare(
+    Version version, bool encrypted, uint16_t cmd, uint32_t flag, const void* data, size_t size) {
+  PreparedMessage ret;
+  ret.version = version;
+  ret.encrypted = encrypted;
+  ret.command = cmd;
+  ret.flag = flag;
+
+  PSOCommandHeader header;
+  size_t header_size = PSOCommandHeader::header_size(version);
+  size_t send_data_size = Channel::build_header(header, ret.logical_size, version, encrypted, cmd, flag, size);
+  ret.data.reserve(send_data_size);
+  ret.data.append(reinterpret_cast<const char*>(&header), header_size);
+  ret.data.append(reinterpret_cast<const char*>(data), size);
+  ret.data.resize(send_data_size, '\0');
+  return ret;
+}
+
+void Channel::send(const PreparedMessage& msg, bool silent) {
+  if (!this->connected()) {
+    channel_exceptions_log.warning("Attempted to send command on closed channel; dropping data");
+    return;
+  }
+  if (!this->can_send(msg)) {
+    throw logic_error("prepared message does not match channel version or encryption state");
+  }
+
+  struct evbuffer_iovec iov;
+  uint8_t* send_data = this->reserve_send_space(iov, msg.data.size());
+  memcpy(send_data, msg.data.data(), msg.data.size());
+  this->commit_send_data(iov, msg.data.size(), msg.logical_size, msg.command, msg.flag, silent);
 }
 
 void Channel::send(uint16_t cmd, uint32_t flag, const void* data, size_t size, bool silent) {
@@ -391,7 +550,11 @@ void Channel::send(const string& data, bool silent) {
 }
 
 void Channel::dispatch_on_input(struct bufferevent*, void* ctx) {
+  WatchdogScope watchdog_scope(EventLoopWatchdog::CallbackType::CHANNEL_INPUT, "Channel::dispatch_on_input");
   Channel* ch = reinterpret_cast<Channel*>(ctx);
+  // Responses to all the commands received in this batch are written
+  // together after the last command is handled
+  CorkScope cork_scope(*ch);
   // The client can be disconnected during on_command_received, so we have to
   // make sure ch->bev is valid every time before calling recv()
   while (ch->bev.get()) {
@@ -402,12 +565,27 @@ void Channel::dispatch_on_input(struct bufferevent*, void* ctx) {
       break;
     } catch (const exception& e) {
       channel_exceptions_log.warning("Error receiving on channel: %s", e.what());
+      // on_error may destroy the channel, so uncork it first
+      cork_scope.release();
       ch->on_error(*ch, BEV_EVENT_ERROR);
-      break;
+      return;
     }
     if (ch->on_command_received) {
       ch->on_command_received(*ch, msg.command, msg.flag, msg.data);
     }
+    // Return the data buffer to the channel so the next command can reuse its
+    // storage, unless the handler caused another command to be received (in
+    // which case the channel already has a buffer)
+    if (ch->recv_buffer.capacity() < msg.data.capacity()) {
+      ch->recv_buffer = std::move(msg.data);
+    }
+  }
+}
+
+void Channel::dispatch_on_output(struct bufferevent*, void* ctx) {
+  Channel* ch = reinterpret_cast<Channel*>(ctx);
+  if (ch->on_output) {
+    ch->on_output(*ch);
   }
 }
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <event2/buffer.h>
 #include <netinet/in.h>
 
 #include <memory>
@@ -32,11 +33,32 @@ struct Channel {
 
   typedef void (*on_command_received_t)(Channel&, uint16_t, uint32_t, std::string&);
   typedef void (*on_error_t)(Channel&, short);
+  typedef void (*on_output_t)(Channel&);
 
   on_command_received_t on_command_received;
   on_error_t on_error;
+  // If set, called when the output buffer drains to output_low_watermark bytes
+  // or fewer after data is written. This is used for sending large amounts of
+  // data (e.g. patch files) without buffering all of it at once.
+  on_output_t on_output;
   void* context_obj;
 
+  // If a command's header has been received but the rest of the command has
+  // not arrived yet, the header is decrypted and removed from the input buffer
+  // and stored here, so it doesn't have to be decrypted again when the rest of
+  // the command arrives. recv_buffer holds the data for the most recent
+  // command; its storage is reused across commands.
+  PSOCommandHeader recv_header;
+  bool recv_header_valid;
+  std::string recv_buffer;
+
+  size_t output_low_watermark;
+
+  // Number of outstanding cork() calls. While this is nonzero and the channel
+  // is a virtual connection, sent commands are queued in the output buffer but
+  // not written.
+  size_t cork_depth;
+
   // Creates an unconnected channel
   Channel(
       Version version,
@@ -72,13 +94,49 @@ struct Channel {
       const std::string& name = "");
 
   void set_bufferevent(struct bufferevent* bev, uint64_t virtual_network_id);
+  void set_output_low_watermark(size_t bytes);
+
+  // Returns the number of bytes in the output buffer that have not been sent
+  // yet (0 if the channel is not connected)
+  size_t output_buffer_size() const;
 
   inline bool connected() const {
     return this->bev.get() != nullptr;
   }
   void disconnect();
 
+  // While a virtual connection is corked, sent commands accumulate in the
+  // output buffer and are written all at once when the channel is uncorked.
+  // Without this, each write to the bufferevent pair would immediately become
+  // a separate frame. This does nothing for socket connections, since libevent
+  // already batches their writes until the event loop runs. cork() and
+  // uncork() calls may be nested; the buffer is flushed when the outermost
+  // cork is removed.
+  void cork();
+  void uncork();
+
+  // Corks the channel for the lifetime of this object
+  class CorkScope {
+  public:
+    explicit CorkScope(Channel& ch);
+    CorkScope(const CorkScope&) = delete;
+    CorkScope(CorkScope&&) = delete;
+    CorkScope& operator=(const CorkScope&) = delete;
+    CorkScope& operator=(CorkScope&&) = delete;
+    ~CorkScope();
+
+    // Uncorks the channel early (e.g. before doing something that may
+    // destroy it)
+    void release();
+
+  private:
+    Channel* ch;
+  };
+
   // Receives a message. Throws std::out_of_range if no messages are available.
+  // The returned message's data takes ownership of recv_buffer's storage; to
+  // avoid reallocating it for each command, the caller can move it back into
+  // recv_buffer when it's done with the message.
   Message recv();
 
   // Sends a message with an automatically-constructed header.
@@ -97,7 +155,47 @@ struct Channel {
   void send(const void* data, size_t size, bool silent = false);
   void send(const std::string& data, bool silent = false);
 
+  // A command whose header and padding have already been built for a specific
+  // version and encryption state. When the same command is sent to many
+  // channels (e.g. to all clients in a lobby), it can be prepared once for
+  // each distinct format and then sent to each matching channel, which then
+  // only has to copy and encrypt it.
+  struct PreparedMessage {
+    Version version;
+    bool encrypted;
+    uint16_t command;
+    uint32_t flag;
+    size_t logical_size;
+    std::string data; // Header, command data, and padding
+  };
+  static PreparedMessage prepare(
+      Version version, bool encrypted, uint16_t cmd, uint32_t flag, const void* data, size_t size);
+  inline bool can_send(const PreparedMessage& msg) const {
+    return (msg.version == this->version) && (msg.encrypted == (this->crypt_out.get() != nullptr));
+  }
+  void send(const PreparedMessage& msg, bool silent = false);
+
 private:
+  // Fills in the header for a command with the given data size. Returns the
+  // total number of bytes to send, including any padding.
+  static size_t build_header(
+      PSOCommandHeader& header,
+      size_t& logical_size,
+      Version version,
+      bool encrypted,
+      uint16_t cmd,
+      uint32_t flag,
+      size_t size);
+  uint8_t* reserve_send_space(struct evbuffer_iovec& iov, size_t size);
+  void commit_send_data(
+      struct evbuffer_iovec& iov,
+      size_t send_data_size,
+      size_t logical_size,
+      uint16_t cmd,
+      uint32_t flag,
+      bool silent);
+
   static void dispatch_on_input(struct bufferevent*, void* ctx);
+  static void dispatch_on_output(struct bufferevent*, void* ctx);
   static void dispatch_on_error(struct bufferevent*, short events, void* ctx);
 };
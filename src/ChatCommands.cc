@@ -1983,16 +1983,16 @@ static void server_command_what(shared_ptr<Client> c, const std::string&) {
   }
 
   float min_dist2 = 0.0f;
-  shared_ptr<const Lobby::FloorItem> nearest_fi;
-  for (const auto& it : l->floor_item_managers.at(c->floor).items) {
-    if (!it.second->visible_to_client(c->lobby_client_id)) {
+  const Lobby::FloorItem* nearest_fi = nullptr;
+  for (const auto* fi : l->floor_item_managers.at(c->floor).items()) {
+    if (!fi->visible_to_client(c->lobby_client_id)) {
       continue;
     }
-    float dx = it.second->x - c->x;
-    float dz = it.second->z - c->z;
+    float dx = fi->x - c->x;
+    float dz = fi->z - c->z;
     float dist2 = (dx * dx) + (dz * dz);
     if (!nearest_fi || (dist2 < min_dist2)) {
-      nearest_fi = it.second;
+      nearest_fi = fi;
       min_dist2 = dist2;
     }
   }
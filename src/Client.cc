@@ -11,11 +11,14 @@
 #include <phosg/Network.hh>
 #include <phosg/Time.hh>
 
+#include "AsyncFileWriter.hh"
 #include "IPStackSimulator.hh"
 #include "Loggers.hh"
+#include "Metrics.hh"
 #include "SendCommands.hh"
 #include "Server.hh"
 #include "Version.hh"
+#include "Watchdog.hh"
 
 using namespace std;
 
@@ -429,6 +432,7 @@ bool Client::can_use_chat_commands() const {
 }
 
 void Client::dispatch_save_game_data(evutil_socket_t, short, void* ctx) {
+  WatchdogScope watchdog_scope(EventLoopWatchdog::CallbackType::TIMER, "Client::dispatch_save_game_data");
   reinterpret_cast<Client*>(ctx)->save_game_data();
 }
 
@@ -442,6 +446,7 @@ void Client::save_game_data() {
 }
 
 void Client::dispatch_send_ping(evutil_socket_t, short, void* ctx) {
+  WatchdogScope watchdog_scope(EventLoopWatchdog::CallbackType::TIMER, "Client::dispatch_send_ping");
   reinterpret_cast<Client*>(ctx)->send_ping();
 }
 
@@ -459,6 +464,7 @@ void Client::send_ping() {
 }
 
 void Client::dispatch_idle_timeout(evutil_socket_t, short, void* ctx) {
+  WatchdogScope watchdog_scope(EventLoopWatchdog::CallbackType::TIMER, "Client::dispatch_idle_timeout");
   reinterpret_cast<Client*>(ctx)->idle_timeout();
 }
 
@@ -735,13 +741,17 @@ void Client::load_all_files() {
     throw logic_error("cannot load BB player data until client is logged in");
   }
 
+  uint64_t load_start = metrics_now_ns();
   this->system_data.reset();
   this->character_data.reset();
   this->guild_card_data.reset();
 
   auto files_manager = this->require_server_state()->player_files_manager;
 
+  // If any of these files were saved recently (e.g. if the player just
+  // disconnected and reconnected), their writes may not be done yet
   string sys_filename = this->system_filename();
+  wait_for_file_write(sys_filename);
   this->system_data = files_manager->get_system(sys_filename);
   if (this->system_data) {
     player_data_log.info("Using loaded system file %s", sys_filename.c_str());
@@ -755,6 +765,7 @@ void Client::load_all_files() {
 
   if (this->bb_character_index >= 0) {
     string char_filename = this->character_filename();
+    wait_for_file_write(char_filename);
     this->character_data = files_manager->get_character(char_filename);
     if (this->character_data) {
       player_data_log.info("Using loaded character file %s", char_filename.c_str());
@@ -784,6 +795,7 @@ void Client::load_all_files() {
   }
 
   string card_filename = this->guild_card_filename();
+  wait_for_file_write(card_filename);
   this->guild_card_data = files_manager->get_guild_card(card_filename);
   if (this->guild_card_data) {
     player_data_log.info("Using loaded Guild Card file %s", card_filename.c_str());
@@ -894,6 +906,8 @@ void Client::load_all_files() {
     this->login->account->save();
     this->last_play_time_update = phosg::now();
   }
+
+  global_metrics.player_files_load_ns.record_since(load_start);
 }
 
 void Client::update_character_data_after_load(shared_ptr<PSOBBCharacterFile> charfile) {
@@ -916,8 +930,10 @@ void Client::save_all() {
     this->save_guild_card_file();
   }
   if (this->external_bank) {
+    uint64_t save_start = metrics_now_ns();
     string filename = this->shared_bank_filename();
-    phosg::save_object_file<PlayerBank200>(filename, *this->external_bank);
+    save_object_file_async<PlayerBank200>(filename, *this->external_bank);
+    global_metrics.player_files_save_ns.record_since(save_start);
     player_data_log.info("Saved shared bank file %s", filename.c_str());
   }
   if (this->external_bank_character) {
@@ -932,23 +948,42 @@ void Client::save_system_file() const {
   if (!this->system_data) {
     throw logic_error("no system file loaded");
   }
+  uint64_t save_start = metrics_now_ns();
   string filename = this->system_filename();
-  phosg::save_object_file(filename, *this->system_data);
+  save_object_file_async(filename, *this->system_data);
+  global_metrics.player_files_save_ns.record_since(save_start);
   player_data_log.info("Saved system file %s", filename.c_str());
 }
 
 void Client::save_character_file(
     const string& filename,
     shared_ptr<const PSOBBBaseSystemFile> system,
-    shared_ptr<const PSOBBCharacterFile> character) {
-  save_psochar(filename, system, character);
+    shared_ptr<const PSOBBCharacterFile> character,
+    bool synchronous) {
+  uint64_t save_start = metrics_now_ns();
+  if (synchronous) {
+    // Make sure an older queued write can't replace this file afterward
+    wait_for_file_write(filename);
+    save_psochar(filename, system, character);
+  } else {
+    save_file_async(filename, serialize_psochar(system, character));
+  }
+  global_metrics.player_files_save_ns.record_since(save_start);
   player_data_log.info("Saved character file %s", filename.c_str());
 }
 
 void Client::save_ep3_character_file(
     const string& filename,
-    const PSOGCEp3CharacterFile::Character& character) {
-  phosg::save_file(filename, &character, sizeof(character));
+    const PSOGCEp3CharacterFile::Character& character,
+    bool synchronous) {
+  uint64_t save_start = metrics_now_ns();
+  if (synchronous) {
+    wait_for_file_write(filename);
+    phosg::save_file(filename, &character, sizeof(character));
+  } else {
+    save_object_file_async(filename, character);
+  }
+  global_metrics.player_files_save_ns.record_since(save_start);
   player_data_log.info("Saved Episode 3 character file %s", filename.c_str());
 }
 
@@ -976,13 +1011,16 @@ void Client::save_guild_card_file() const {
   if (!this->guild_card_data.get()) {
     throw logic_error("no Guild Card file loaded");
   }
+  uint64_t save_start = metrics_now_ns();
   string filename = this->guild_card_filename();
-  phosg::save_object_file(filename, *this->guild_card_data);
+  save_object_file_async(filename, *this->guild_card_data);
+  global_metrics.player_files_save_ns.record_since(save_start);
   player_data_log.info("Saved Guild Card file %s", filename.c_str());
 }
 
 void Client::load_backup_character(uint32_t account_id, size_t index) {
   string filename = this->backup_character_filename(account_id, index, false);
+  wait_for_file_write(filename);
   this->character_data = load_psochar(filename, false).character_file;
   this->update_character_data_after_load(this->character_data);
   this->v1_v2_last_reported_disp.reset();
@@ -990,6 +1028,7 @@ void Client::load_backup_character(uint32_t account_id, size_t index) {
 
 shared_ptr<PSOGCEp3CharacterFile::Character> Client::load_ep3_backup_character(uint32_t account_id, size_t index) {
   string filename = this->backup_character_filename(account_id, index, true);
+  wait_for_file_write(filename);
   auto ch = make_shared<PSOGCEp3CharacterFile::Character>(phosg::load_object_file<PSOGCEp3CharacterFile::Character>(filename));
   this->character_data = PSOBBCharacterFile::create_from_ep3(*ch);
   this->ep3_config = make_shared<Episode3::PlayerConfig>(ch->ep3_config);
@@ -1026,7 +1065,7 @@ std::shared_ptr<PSOBBCharacterFile> Client::current_bank_character() {
 void Client::use_default_bank() {
   if (this->external_bank) {
     string filename = this->shared_bank_filename();
-    phosg::save_object_file<PlayerBank200>(filename, *this->external_bank);
+    save_object_file_async<PlayerBank200>(filename, *this->external_bank);
     this->external_bank.reset();
     player_data_log.info("Detached shared bank %s", filename.c_str());
   }
@@ -1042,6 +1081,7 @@ bool Client::use_shared_bank() {
   this->use_default_bank();
 
   string filename = this->shared_bank_filename();
+  wait_for_file_write(filename);
   auto files_manager = this->require_server_state()->player_files_manager;
   this->external_bank = files_manager->get_bank(filename);
   if (this->external_bank) {
@@ -1066,6 +1106,7 @@ void Client::use_character_bank(int8_t index) {
     auto files_manager = this->require_server_state()->player_files_manager;
 
     string filename = this->character_filename(index);
+    wait_for_file_write(filename);
     this->external_bank_character = files_manager->get_character(filename);
     if (this->external_bank_character) {
       this->external_bank_character_index = index;
@@ -373,13 +373,17 @@ public:
 
   void save_all();
   void save_system_file() const;
+  // If synchronous is true, these write the file before returning (and throw
+  // if it can't be written) instead of queueing the write
   static void save_character_file(
       const std::string& filename,
       std::shared_ptr<const PSOBBBaseSystemFile> sys,
-      std::shared_ptr<const PSOBBCharacterFile> character);
+      std::shared_ptr<const PSOBBCharacterFile> character,
+      bool synchronous = false);
   static void save_ep3_character_file(
       const std::string& filename,
-      const PSOGCEp3CharacterFile::Character& character);
+      const PSOGCEp3CharacterFile::Character& character,
+      bool synchronous = false);
   // Note: This function is not const because it updates the player's play time.
   void save_character_file();
   void save_guild_card_file() const;
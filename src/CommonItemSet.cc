@@ -1,5 +1,7 @@
 #include "CommonItemSet.hh"
 
+#include <algorithm>
+
 #include "AFSArchive.hh"
 #include "EnemyType.hh"
 #include "GSLArchive.hh"
@@ -8,6 +10,33 @@
 
 using namespace std;
 
+void IndexProbabilitySampler::build_lookup() {
+  uint64_t total = this->total();
+  if ((total == 0) || (total > IndexProbabilitySampler::MAX_LOOKUP_SIZE)) {
+    return;
+  }
+  this->lookup.reserve(total);
+  uint64_t prev_cumulative_weight = 0;
+  for (size_t z = 0; z < this->cumulative_weights.size(); z++) {
+    this->lookup.insert(this->lookup.end(), this->cumulative_weights[z] - prev_cumulative_weight, z);
+    prev_cumulative_weight = this->cumulative_weights[z];
+  }
+}
+
+size_t IndexProbabilitySampler::index_for_value(uint64_t value) const {
+  if (!this->lookup.empty()) {
+    return this->lookup[value];
+  }
+  // The result is the first entry whose cumulative weight is greater than the
+  // value; entries with zero weight are skipped since their cumulative weight
+  // equals the previous entry's
+  auto it = upper_bound(this->cumulative_weights.begin(), this->cumulative_weights.end(), value);
+  if (it == this->cumulative_weights.end()) {
+    throw logic_error("selector was not less than rand_max");
+  }
+  return it - this->cumulative_weights.begin();
+}
+
 template <typename IntT, size_t Count>
 phosg::JSON to_json(const parray<IntT, Count>& v) {
   auto ret = phosg::JSON::list();
@@ -136,6 +165,8 @@ CommonItemSet::Table::Table(const phosg::JSON& json, Episode episode)
       }
     }
   }
+
+  this->build_samplers();
 }
 
 static const char* name_for_common_item_class(uint8_t item_class) {
@@ -431,6 +462,43 @@ CommonItemSet::Table::Table(const phosg::StringReader& r, bool is_big_endian, bo
   } else {
     this->parse_itempt_t<false>(r, is_v3);
   }
+  this->build_samplers();
+}
+
+parray<uint8_t, 0x0D> CommonItemSet::Table::weapon_type_prob_table_for_area(uint8_t area_norm) const {
+  parray<uint8_t, 0x0D> ret;
+  ret[0] = 0;
+  for (size_t z = 1; z < 13; z++) {
+    // Technically this should be `if (... < 0)`, but whatever
+    ret[z] = ((area_norm + this->subtype_base_table.at(z - 1)) & 0x80) ? 0 : this->base_weapon_type_prob_table[z - 1];
+  }
+  return ret;
+}
+
+void CommonItemSet::Table::build_samplers() {
+  for (size_t z = 0; z < this->samplers.weapon_type.size(); z++) {
+    this->samplers.weapon_type[z] = IndexProbabilitySampler(this->weapon_type_prob_table_for_area(z));
+  }
+  for (size_t z = 0; z < this->samplers.grind.size(); z++) {
+    this->samplers.grind[z] = IndexProbabilitySampler(this->grind_prob_table, z);
+  }
+  this->samplers.armor_shield_type_index = IndexProbabilitySampler(this->armor_shield_type_index_prob_table);
+  this->samplers.armor_slot_count = IndexProbabilitySampler(this->armor_slot_count_prob_table);
+  for (size_t z = 0; z < this->samplers.bonus_value.size(); z++) {
+    this->samplers.bonus_value[z] = IndexProbabilitySampler(this->bonus_value_prob_table, z);
+  }
+  for (size_t z = 0; z < this->samplers.bonus_type.size(); z++) {
+    this->samplers.bonus_type[z] = IndexProbabilitySampler(this->bonus_type_prob_table, z);
+  }
+  for (size_t z = 0; z < this->samplers.tool_class.size(); z++) {
+    this->samplers.tool_class[z] = IndexProbabilitySampler(this->tool_class_prob_table, z);
+  }
+  for (size_t z = 0; z < this->samplers.technique_index.size(); z++) {
+    this->samplers.technique_index[z] = IndexProbabilitySampler(this->technique_index_prob_table, z);
+  }
+  for (size_t z = 0; z < this->samplers.box_item_class.size(); z++) {
+    this->samplers.box_item_class[z] = IndexProbabilitySampler(this->box_item_class_prob_table, z);
+  }
 }
 
 template <bool BE>
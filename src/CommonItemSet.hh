@@ -3,6 +3,7 @@
 #include <array>
 #include <phosg/Encoding.hh>
 #include <phosg/JSON.hh>
+#include <vector>
 
 #include "GSLArchive.hh"
 #include "PSOEncryption.hh"
@@ -10,6 +11,49 @@
 #include "Text.hh"
 #include "Types.hh"
 
+// An index probability table (see the comments in CommonItemSet::Table),
+// precomputed so that sampling it doesn't have to sum and scan the weights
+// every time. index_for_value(x) returns the same index as the original
+// algorithm (sum the weights, choose x less than the sum, then find the entry
+// whose range contains x), so the caller still uses exactly one random value
+// per sample and results are unchanged. Tables whose weights sum to at most
+// MAX_LOOKUP_SIZE have a direct lookup table, so sampling them is O(1); larger
+// tables use a binary search over the cumulative weights instead.
+class IndexProbabilitySampler {
+public:
+  static constexpr size_t MAX_LOOKUP_SIZE = 0x400;
+
+  IndexProbabilitySampler() = default;
+  template <typename IntT>
+  IndexProbabilitySampler(const IntT* tables, size_t offset, size_t num_values, size_t stride) {
+    uint64_t total = 0;
+    this->cumulative_weights.reserve(num_values);
+    for (size_t z = 0; z < num_values; z++) {
+      total += tables[z * stride + offset];
+      this->cumulative_weights.emplace_back(total);
+    }
+    this->build_lookup();
+  }
+  template <typename IntT, size_t X>
+  explicit IndexProbabilitySampler(const parray<IntT, X>& tables)
+      : IndexProbabilitySampler(tables.data(), 0, X, 1) {}
+  template <typename IntT, size_t X, size_t Y>
+  IndexProbabilitySampler(const parray<parray<IntT, X>, Y>& tables, size_t offset)
+      : IndexProbabilitySampler(tables[0].data(), offset, Y, X) {}
+
+  inline uint64_t total() const {
+    return this->cumulative_weights.empty() ? 0 : this->cumulative_weights.back();
+  }
+  // value must be less than total()
+  size_t index_for_value(uint64_t value) const;
+
+private:
+  std::vector<uint64_t> cumulative_weights;
+  std::vector<uint8_t> lookup;
+
+  void build_lookup();
+};
+
 class CommonItemSet {
 public:
   class Table {
@@ -48,10 +92,34 @@ public:
     parray<uint8_t, 0x0A> unit_max_stars_table;
     parray<parray<uint8_t, 10>, 7> box_item_class_prob_table;
 
+    // Precomputed samplers for the index probability tables above, indexed by
+    // the column (usually area - 1) that ItemCreator uses. These are built
+    // when the table is loaded, so the tables above must not be modified
+    // afterward.
+    struct Samplers {
+      // The base weapon type table has an extra leading zero entry (for no
+      // item), and entries for weapons that can't be found in the area yet are
+      // zeroed; see ItemCreator::generate_common_weapon_variances
+      std::array<IndexProbabilitySampler, 10> weapon_type;
+      std::array<IndexProbabilitySampler, 4> grind;
+      IndexProbabilitySampler armor_shield_type_index;
+      IndexProbabilitySampler armor_slot_count;
+      std::array<IndexProbabilitySampler, 6> bonus_value;
+      std::array<IndexProbabilitySampler, 10> bonus_type;
+      std::array<IndexProbabilitySampler, 10> tool_class;
+      std::array<IndexProbabilitySampler, 10> technique_index;
+      std::array<IndexProbabilitySampler, 10> box_item_class;
+    };
+    Samplers samplers;
+
+    parray<uint8_t, 0x0D> weapon_type_prob_table_for_area(uint8_t area_norm) const;
+
     phosg::JSON json() const;
     void print(FILE* stream) const;
 
   private:
+    void build_samplers();
+
     template <bool BE>
     void parse_itempt_t(const phosg::StringReader& r, bool is_v3);
 
@@ -0,0 +1,305 @@
+#include "CompressedArtifactCache.hh"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <phosg/Filesystem.hh>
+#include <phosg/Hash.hh>
+#include <phosg/Strings.hh>
+
+#include "Compression.hh"
+#include "Loggers.hh"
+#include "Text.hh"
+
+using namespace std;
+
+struct CompressedArtifactCache::Key {
+  string input_hash; // SHA-256 (raw bytes, not hex)
+  size_t input_size;
+  Algorithm algorithm;
+  int64_t level;
+};
+
+struct CompressedArtifactEntryHeader {
+  static constexpr uint32_t MAGIC = 0x4E434145; // 'NCAE'
+  static constexpr uint16_t FORMAT_VERSION = 1;
+
+  be_uint32_t magic;
+  le_uint16_t format_version;
+  uint8_t algorithm;
+  uint8_t unused;
+  le_int64_t level;
+  le_uint64_t input_size;
+  uint8_t input_hash[0x20];
+  le_uint64_t output_size;
+} __packed_ws__(CompressedArtifactEntryHeader, 0x40);
+
+CompressedArtifactCache::Entry::Entry(void* map_addr, size_t map_size, size_t data_offset)
+    : map_addr(map_addr),
+      map_size(map_size),
+      data_offset(data_offset) {}
+
+CompressedArtifactCache::Entry::~Entry() {
+  munmap(this->map_addr, this->map_size);
+}
+
+CompressedArtifactCache::CompressedArtifactCache(const string& directory, uint64_t max_size)
+    : directory(directory),
+      max_size(max_size),
+      directory_usable(true),
+      hits(0),
+      misses(0),
+      write_failures(0),
+      evictions(0),
+      next_temp_file_id(0),
+      total_size(0) {
+  if (!phosg::isdir(this->directory)) {
+    if (::mkdir(this->directory.c_str(), 0755) != 0 && errno != EEXIST) {
+      string error_str = phosg::string_for_error(errno);
+      static_game_data_log.warning("Cannot create compressed artifact cache directory %s (%s); the cache will not be used",
+          this->directory.c_str(), error_str.c_str());
+      this->directory_usable = false;
+    }
+  }
+  if (this->directory_usable) {
+    this->evict_entries();
+  }
+}
+
+CompressedArtifactCache::Stats CompressedArtifactCache::get_stats() const {
+  Stats ret;
+  ret.hits = this->hits.load();
+  ret.misses = this->misses.load();
+  ret.write_failures = this->write_failures.load();
+  ret.evictions = this->evictions.load();
+  return ret;
+}
+
+void CompressedArtifactCache::evict_entries() {
+  lock_guard g(this->evict_lock);
+
+  struct EntryFile {
+    string filename;
+    uint64_t size;
+    uint64_t mtime;
+  };
+  vector<EntryFile> entry_files;
+  uint64_t total_size = 0;
+  try {
+    for (const auto& item : phosg::list_directory(this->directory)) {
+      // Skip temporary files, which end in .tmp instead
+      if (!phosg::ends_with(item, ".bin")) {
+        continue;
+      }
+      string filename = this->directory + "/" + item;
+      struct stat st;
+      if (::stat(filename.c_str(), &st) != 0) {
+        continue;
+      }
+      entry_files.emplace_back(EntryFile{
+          .filename = std::move(filename),
+          .size = static_cast<uint64_t>(st.st_size),
+          .mtime = static_cast<uint64_t>(st.st_mtime)});
+      total_size += st.st_size;
+    }
+  } catch (const exception& e) {
+    static_game_data_log.warning("Cannot list compressed artifact cache directory %s (%s)", this->directory.c_str(), e.what());
+    return;
+  }
+
+  if (this->max_size && (total_size > this->max_size)) {
+    uint64_t target_size = this->max_size - (this->max_size / 4);
+    sort(entry_files.begin(), entry_files.end(), [](const EntryFile& a, const EntryFile& b) {
+      return a.mtime < b.mtime;
+    });
+    size_t num_deleted = 0;
+    for (const auto& ef : entry_files) {
+      if (total_size <= target_size) {
+        break;
+      }
+      // If another process already deleted this entry, it's not in the
+      // directory anymore either way
+      if ((::unlink(ef.filename.c_str()) == 0) || (errno == ENOENT)) {
+        total_size -= ef.size;
+        num_deleted++;
+      }
+    }
+    this->evictions += num_deleted;
+    static_game_data_log.info("Deleted %zu least recently used entries from compressed artifact cache %s (%" PRIu64 " bytes remain)",
+        num_deleted, this->directory.c_str(), total_size);
+  }
+  this->total_size = total_size;
+}
+
+CompressedArtifactCache::Key CompressedArtifactCache::make_key(
+    const void* data, size_t size, Algorithm algorithm, int64_t level) const {
+  // Some algorithms don't have a tunable level; normalize it so callers can't
+  // accidentally create multiple identical entries
+  if ((algorithm == Algorithm::PRS_OPTIMAL) || (algorithm == Algorithm::BC0)) {
+    level = 0;
+  }
+  return Key{.input_hash = phosg::sha256(data, size), .input_size = size, .algorithm = algorithm, .level = level};
+}
+
+string CompressedArtifactCache::filename_for_key(const Key& key) const {
+  string ret = this->directory;
+  ret.push_back('/');
+  for (uint8_t ch : key.input_hash) {
+    ret += phosg::string_printf("%02hhx", ch);
+  }
+  ret += phosg::string_printf("-%hhu-%" PRId64 ".bin", static_cast<uint8_t>(key.algorithm), key.level);
+  return ret;
+}
+
+shared_ptr<const CompressedArtifactCache::Entry> CompressedArtifactCache::get(
+    const void* data, size_t size, Algorithm algorithm, int64_t level) {
+  if (!this->directory_usable) {
+    this->misses++;
+    return nullptr;
+  }
+
+  auto key = this->make_key(data, size, algorithm, level);
+  string filename = this->filename_for_key(key);
+
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    this->misses++;
+    return nullptr;
+  }
+  // Mark the entry as recently used, so it's evicted after less recently
+  // used entries. This can fail if the file belongs to a different user; in
+  // that case the entry may just be evicted sooner than it should be.
+  futimens(fd, nullptr);
+  // The mapping remains valid after the fd is closed
+  struct stat st;
+  void* map_addr = MAP_FAILED;
+  if ((fstat(fd, &st) == 0) && (static_cast<size_t>(st.st_size) >= sizeof(CompressedArtifactEntryHeader))) {
+    map_addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  ::close(fd);
+  if (map_addr == MAP_FAILED) {
+    static_game_data_log.warning("Compressed artifact cache entry %s is unreadable; ignoring it", filename.c_str());
+    this->misses++;
+    return nullptr;
+  }
+
+  auto entry = make_shared<Entry>(map_addr, st.st_size, sizeof(CompressedArtifactEntryHeader));
+  const auto* header = reinterpret_cast<const CompressedArtifactEntryHeader*>(map_addr);
+  if ((header->magic != CompressedArtifactEntryHeader::MAGIC) ||
+      (header->format_version != CompressedArtifactEntryHeader::FORMAT_VERSION) ||
+      (header->algorithm != static_cast<uint8_t>(key.algorithm)) ||
+      (header->level != key.level) ||
+      (header->input_size != key.input_size) ||
+      memcmp(header->input_hash, key.input_hash.data(), sizeof(header->input_hash)) ||
+      (header->output_size != entry->size())) {
+    static_game_data_log.warning("Compressed artifact cache entry %s is corrupt; ignoring it", filename.c_str());
+    this->misses++;
+    return nullptr;
+  }
+
+  this->hits++;
+  return entry;
+}
+
+void CompressedArtifactCache::put(
+    const void* data,
+    size_t size,
+    Algorithm algorithm,
+    int64_t level,
+    const void* compressed_data,
+    size_t compressed_size) {
+  if (!this->directory_usable) {
+    return;
+  }
+
+  auto key = this->make_key(data, size, algorithm, level);
+  string filename = this->filename_for_key(key);
+
+  CompressedArtifactEntryHeader header;
+  header.magic = CompressedArtifactEntryHeader::MAGIC;
+  header.format_version = CompressedArtifactEntryHeader::FORMAT_VERSION;
+  header.algorithm = static_cast<uint8_t>(key.algorithm);
+  header.unused = 0;
+  header.level = key.level;
+  header.input_size = key.input_size;
+  memcpy(header.input_hash, key.input_hash.data(), sizeof(header.input_hash));
+  header.output_size = compressed_size;
+
+  // Write to a temporary file and rename it into place, so other processes
+  // (and other threads in this process) never see a partially-written entry
+  string temp_filename = phosg::string_printf("%s.%d.%zu.tmp",
+      filename.c_str(), static_cast<int>(getpid()), this->next_temp_file_id++);
+  try {
+    {
+      phosg::scoped_fd fd(temp_filename, O_WRONLY | O_CREAT | O_EXCL, 0644);
+      phosg::writex(fd, &header, sizeof(header));
+      phosg::writex(fd, compressed_data, compressed_size);
+    }
+    if (::rename(temp_filename.c_str(), filename.c_str()) != 0) {
+      throw runtime_error("cannot rename temporary file: " + phosg::string_for_error(errno));
+    }
+  } catch (const exception& e) {
+    ::unlink(temp_filename.c_str());
+    static_game_data_log.warning("Cannot write compressed artifact cache entry %s (%s)", filename.c_str(), e.what());
+    this->write_failures++;
+    return;
+  }
+
+  uint64_t entry_size = sizeof(header) + compressed_size;
+  if (this->max_size && (this->total_size.fetch_add(entry_size) + entry_size > this->max_size)) {
+    this->evict_entries();
+  }
+}
+
+string CompressedArtifactCache::compress(const void* data, size_t size, Algorithm algorithm, int64_t level) {
+  auto entry = this->get(data, size, algorithm, level);
+  if (entry) {
+    return entry->str();
+  }
+  string ret = this->compress_uncached(data, size, algorithm, level);
+  this->put(data, size, algorithm, level, ret.data(), ret.size());
+  return ret;
+}
+
+string CompressedArtifactCache::compress(const string& data, Algorithm algorithm, int64_t level) {
+  return this->compress(data.data(), data.size(), algorithm, level);
+}
+
+string CompressedArtifactCache::compress_uncached(const void* data, size_t size, Algorithm algorithm, int64_t level) {
+  switch (algorithm) {
+    case Algorithm::PRS:
+      return prs_compress(data, size, level);
+    case Algorithm::PRS_OPTIMAL:
+      return prs_compress_optimal(data, size);
+    case Algorithm::PRS_CHAINED:
+      return prs_compress_chained(data, size, level);
+    case Algorithm::BC0:
+      return bc0_compress(data, size);
+    default:
+      throw logic_error("invalid compression algorithm");
+  }
+}
+
+string compress_with_artifact_cache(
+    shared_ptr<CompressedArtifactCache> cache,
+    const void* data,
+    size_t size,
+    CompressedArtifactCache::Algorithm algorithm,
+    int64_t level) {
+  return cache
+      ? cache->compress(data, size, algorithm, level)
+      : CompressedArtifactCache::compress_uncached(data, size, algorithm, level);
+}
+
+string compress_with_artifact_cache(
+    shared_ptr<CompressedArtifactCache> cache,
+    const string& data,
+    CompressedArtifactCache::Algorithm algorithm,
+    int64_t level) {
+  return compress_with_artifact_cache(cache, data.data(), data.size(), algorithm, level);
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+// CompressedArtifactCache is a persistent, content-addressed store for the
+// results of compressing static data (quest files, Episode 3 card definitions
+// and maps, lobby banners, etc.). Entries are keyed by the SHA-256 hash of the
+// uncompressed input, the algorithm, and the compression level, so they never
+// need to be invalidated: if the input changes, its key changes too.
+//
+// Each entry is stored in its own file in the cache directory. Entries are
+// written to a temporary file and renamed into place, so multiple server
+// processes can safely share a cache directory. Restarting the server with a
+// populated cache skips all of the (often slow) compression work that would
+// otherwise happen during startup. Entries are memory-mapped when read; get()
+// returns the mapping itself, but compress() copies the entry's data into the
+// returned string, since its callers keep the data for longer than the cache
+// is guaranteed to exist.
+//
+// The total size of the entries is limited to max_size bytes. When the cache
+// grows beyond that, the least recently used entries are deleted until it's
+// at most 3/4 of that size. (An entry's mtime is updated each time it's read,
+// so this works even if the filesystem doesn't track access times.)
+//
+// The cache is only an optimization: if the directory can't be read or
+// written, or an entry is corrupt, the data is compressed as if the cache
+// didn't exist. All methods are thread-safe.
+class CompressedArtifactCache {
+public:
+  enum class Algorithm : uint8_t {
+    PRS = 0, // prs_compress; level is compression_level
+    PRS_OPTIMAL = 1, // prs_compress_optimal; level is ignored
+    PRS_CHAINED = 2, // prs_compress_chained; level is level
+    BC0 = 3, // bc0_compress; level is ignored
+  };
+
+  // A memory-mapped cache entry. The data is valid for as long as the Entry
+  // object exists.
+  class Entry {
+  public:
+    Entry(void* map_addr, size_t map_size, size_t data_offset);
+    Entry(const Entry&) = delete;
+    Entry(Entry&&) = delete;
+    Entry& operator=(const Entry&) = delete;
+    Entry& operator=(Entry&&) = delete;
+    ~Entry();
+
+    inline const void* data() const {
+      return reinterpret_cast<const uint8_t*>(this->map_addr) + this->data_offset;
+    }
+    inline size_t size() const {
+      return this->map_size - this->data_offset;
+    }
+    inline std::string_view view() const {
+      return std::string_view(reinterpret_cast<const char*>(this->data()), this->size());
+    }
+    inline std::string str() const {
+      return std::string(reinterpret_cast<const char*>(this->data()), this->size());
+    }
+
+  private:
+    void* map_addr;
+    size_t map_size;
+    size_t data_offset;
+  };
+
+  struct Stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t write_failures = 0;
+    size_t evictions = 0;
+  };
+
+  static constexpr uint64_t DEFAULT_MAX_SIZE = 256 * 1024 * 1024;
+
+  // Creates the directory if it doesn't exist. If max_size is 0, the cache's
+  // size is not limited.
+  explicit CompressedArtifactCache(const std::string& directory, uint64_t max_size = DEFAULT_MAX_SIZE);
+  CompressedArtifactCache(const CompressedArtifactCache&) = delete;
+  CompressedArtifactCache(CompressedArtifactCache&&) = delete;
+  CompressedArtifactCache& operator=(const CompressedArtifactCache&) = delete;
+  CompressedArtifactCache& operator=(CompressedArtifactCache&&) = delete;
+  ~CompressedArtifactCache() = default;
+
+  inline const std::string& get_directory() const {
+    return this->directory;
+  }
+  inline uint64_t get_max_size() const {
+    return this->max_size;
+  }
+  Stats get_stats() const;
+
+  // Returns the cached compressed form of the given data, or nullptr if it
+  // isn't in the cache.
+  std::shared_ptr<const Entry> get(const void* data, size_t size, Algorithm algorithm, int64_t level = 0);
+  // Adds an entry to the cache. compressed_data must be the result of
+  // compressing data with the given algorithm and level.
+  void put(
+      const void* data,
+      size_t size,
+      Algorithm algorithm,
+      int64_t level,
+      const void* compressed_data,
+      size_t compressed_size);
+
+  // Returns the compressed form of the given data, compressing it (and adding
+  // it to the cache) only if it isn't already in the cache.
+  std::string compress(const void* data, size_t size, Algorithm algorithm, int64_t level = 0);
+  std::string compress(const std::string& data, Algorithm algorithm, int64_t level = 0);
+
+  static std::string compress_uncached(const void* data, size_t size, Algorithm algorithm, int64_t level = 0);
+
+private:
+  struct Key;
+  Key make_key(const void* data, size_t size, Algorithm algorithm, int64_t level) const;
+  std::string filename_for_key(const Key& key) const;
+  // Recomputes total_size from the files in the directory, and deletes the
+  // least recently used entries if it's over max_size
+  void evict_entries();
+
+  std::string directory;
+  uint64_t max_size;
+  bool directory_usable;
+  std::atomic<size_t> hits;
+  std::atomic<size_t> misses;
+  std::atomic<size_t> write_failures;
+  std::atomic<size_t> evictions;
+  std::atomic<size_t> next_temp_file_id;
+  // This is approximate, since other processes may share the directory; it's
+  // recomputed each time entries are evicted
+  std::atomic<uint64_t> total_size;
+  std::mutex evict_lock;
+};
+
+// Compresses data using the given cache, or without any cache if cache is
+// null. This is for callers (mostly constructors of static data indexes)
+// that can also be used outside of the server, where there is no cache.
+std::string compress_with_artifact_cache(
+    std::shared_ptr<CompressedArtifactCache> cache,
+    const void* data,
+    size_t size,
+    CompressedArtifactCache::Algorithm algorithm,
+    int64_t level = 0);
+std::string compress_with_artifact_cache(
+    std::shared_ptr<CompressedArtifactCache> cache,
+    const std::string& data,
+    CompressedArtifactCache::Algorithm algorithm,
+    int64_t level = 0);
@@ -6,8 +6,10 @@
 #include <string.h>
 #include <sys/types.h>
 
+#include <bit>
 #include <phosg/Strings.hh>
 #include <set>
+#include <thread>
 
 #include "Text.hh"
 
@@ -192,6 +194,79 @@ private:
   uint16_t bits;
 };
 
+// This is like ControlStreamReader combined with StringReader, but operates on
+// a raw buffer and is simpler, since the decompressors' inner loops spend most
+// of their time here. As with StringReader, reading beyond the end of the
+// input throws out_of_range.
+class PRSInputReader {
+public:
+  PRSInputReader(const void* data, size_t size, uint16_t control_bits = 0x0000)
+      : data(reinterpret_cast<const uint8_t*>(data)),
+        size(size),
+        offset(0),
+        bits(control_bits) {}
+
+  inline bool eof() const {
+    return this->offset >= this->size;
+  }
+  inline size_t where() const {
+    return this->offset;
+  }
+  inline uint16_t control_bits() const {
+    return this->bits;
+  }
+
+  inline uint8_t get_u8() {
+    if (this->offset >= this->size) {
+      throw out_of_range("end of compressed data");
+    }
+    return this->data[this->offset++];
+  }
+  inline void skip_u8() {
+    if (this->offset >= this->size) {
+      throw out_of_range("end of compressed data");
+    }
+    this->offset++;
+  }
+
+  inline bool read_control() {
+    if (!(this->bits & 0x0100)) {
+      this->bits = 0xFF00 | this->get_u8();
+    }
+    bool ret = this->bits & 1;
+    this->bits >>= 1;
+    return ret;
+  }
+
+private:
+  const uint8_t* data;
+  size_t size;
+  size_t offset;
+  uint16_t bits;
+};
+
+// Copies count bytes from (dest - distance) to dest, one byte at a time
+// semantically (so if distance < count, the copied range repeats). When
+// distance >= 8, each 8-byte block is read entirely from data that has
+// already been written, so the copy can be done a word at a time even though
+// the ranges may overlap. This may write up to 7 bytes past (dest + count).
+static inline void prs_copy_backreference(uint8_t* dest, size_t distance, size_t count) {
+  const uint8_t* src = dest - distance;
+  if (distance >= 8) {
+    for (size_t z = 0; z < count; z += 8) {
+      uint64_t v;
+      memcpy(&v, src + z, 8);
+      memcpy(dest + z, &v, 8);
+    }
+  } else if (distance == 1) {
+    memset(dest, *src, count);
+  } else {
+    for (size_t z = 0; z < count; z++) {
+      dest[z] = src[z];
+    }
+  }
+}
+
 struct PRSPathNode {
   enum class CommandType {
     NONE = 0,
@@ -217,73 +292,401 @@ struct PRSPathNode {
   size_t to_offset = 0;
 };
 
-string prs_compress_optimal(const void* in_data_v, size_t in_size, ProgressCallback progress_fn) {
-  const uint8_t* in_data = reinterpret_cast<const uint8_t*>(in_data_v);
+// Returns the number of bytes that match at a and b, up to max_size. The
+// ranges may overlap, since PRS backreferences may extend past the end of the
+// output.
+static inline size_t prs_match_size(const uint8_t* a, const uint8_t* b, size_t max_size) {
+  size_t z = 0;
+  if constexpr (std::endian::native == std::endian::little) {
+    for (; z + 8 <= max_size; z += 8) {
+      uint64_t a_v, b_v;
+      memcpy(&a_v, a + z, sizeof(a_v));
+      memcpy(&b_v, b + z, sizeof(b_v));
+      if (a_v != b_v) {
+        return z + (countr_zero(a_v ^ b_v) >> 3);
+      }
+    }
+  }
+  while ((z < max_size) && (a[z] == b[z])) {
+    z++;
+  }
+  return z;
+}
 
-  vector<PRSPathNode> nodes;
-  nodes.resize(in_size + 1);
-  nodes[0].bits_used = 18; // Stop command: 2 control bits and 2 data bytes
+// Finds backreferences for PRS compression using hash chains. Each position
+// is hashed by its first 3 bytes, and positions with the same hash are linked
+// together from newest to oldest, so the best match for a position can be
+// found by walking its chain until the candidates are outside the window.
+// Only 3-byte prefixes are chained; 2-byte matches are only useful for short
+// copies, so for those we only need the most recent position with the same
+// first 2 bytes, which is kept in a separate table.
+//
+// max_chain_length limits how many candidates are compared for each position.
+// If it's zero, all candidates within the window are compared, which makes
+// the results exact (that is, the same sizes as WindowIndex would find).
+class PRSMatchFinder {
+public:
+  struct Match {
+    // Best short copy (offset >= -0x100, size in [2, 5]); size is 0 if none
+    ssize_t short_offset = 0;
+    size_t short_size = 0;
+    // Best long or extended copy (offset >= -0x1FFF, size in [3, 0x100]);
+    // size is 0 if none
+    ssize_t long_offset = 0;
+    size_t long_size = 0;
+  };
 
-  size_t copy_progress_max = 3 * in_size;
-  atomic<size_t> copy_progress = 0;
+  PRSMatchFinder(const void* data, size_t size, size_t max_chain_length)
+      : data(reinterpret_cast<const uint8_t*>(data)),
+        size(size),
+        max_chain_length(max_chain_length),
+        heads3(HASH3_COUNT, 0),
+        heads2(0x10000, 0),
+        prev(WINDOW_SIZE, 0) {
+    if (size >= 0xFFFFFFFF) {
+      throw invalid_argument("input is too large");
+    }
+  }
 
-  // Populate all possible short copies
-  std::thread short_window_thread([&]() -> void {
-    WindowIndex<0x100, 5> window(in_data_v, in_size);
-    while (window.offset < in_size) {
-      if (window.offset && (window.offset & 0xFFF) == 0 && progress_fn) {
-        size_t progress = copy_progress.fetch_add(0x1000) + 0x1000;
-        progress_fn(CompressPhase::INDEX, progress, copy_progress_max, 0);
+  void reset() {
+    fill(this->heads3.begin(), this->heads3.end(), 0);
+    fill(this->heads2.begin(), this->heads2.end(), 0);
+    fill(this->prev.begin(), this->prev.end(), 0);
+  }
+
+  // Adds a position to the index. Positions must be added in increasing
+  // order, and find() only returns matches starting at positions that have
+  // already been added.
+  void insert(size_t pos) {
+    // Entries are stored as pos + 1 so that 0 can mean no entry
+    if (pos + 3 <= this->size) {
+      uint32_t& head = this->heads3[this->hash3(pos)];
+      this->prev[pos & (WINDOW_SIZE - 1)] = head;
+      head = pos + 1;
+    }
+    if (pos + 2 <= this->size) {
+      this->heads2[this->data[pos] | (this->data[pos + 1] << 8)] = pos + 1;
+    }
+  }
+
+  // If include_long is false, only the short copy fields in the result are
+  // filled in, and only the short copy window is searched.
+  Match find(size_t pos, bool include_long = true) const {
+    Match ret;
+    size_t max_size = min<size_t>(0x100, this->size - pos);
+    if (max_size < 2) {
+      return ret;
+    }
+    size_t max_short_size = min<size_t>(5, max_size);
+
+    if (max_size >= 3) {
+      size_t chain_remaining = this->max_chain_length ? this->max_chain_length : static_cast<size_t>(-1);
+      for (uint32_t entry = this->heads3[this->hash3(pos)]; entry && chain_remaining; chain_remaining--) {
+        size_t match_pos = entry - 1;
+        size_t distance = pos - match_pos;
+        if (distance > (include_long ? 0x1FFF : 0x100)) {
+          break;
+        }
+        entry = this->prev[match_pos & (WINDOW_SIZE - 1)];
+
+        // If this candidate can't be a better short copy, skip it unless it's
+        // at least as long as the best long copy so far (checking the byte
+        // just past the current best first rejects most candidates cheaply)
+        bool short_eligible = (distance <= 0x100) && (ret.short_size < max_short_size);
+        if (!short_eligible && ret.long_size &&
+            (this->data[match_pos + ret.long_size] != this->data[pos + ret.long_size])) {
+          continue;
+        }
+
+        size_t match_size = prs_match_size(this->data + match_pos, this->data + pos, max_size);
+        if (short_eligible && (min<size_t>(match_size, 5) > ret.short_size) && (match_size >= 2)) {
+          ret.short_offset = -static_cast<ssize_t>(distance);
+          ret.short_size = min<size_t>(match_size, 5);
+        }
+        if (!include_long) {
+          if (ret.short_size == max_short_size) {
+            break;
+          }
+        } else if ((match_size >= 3) && (match_size > ret.long_size)) {
+          ret.long_offset = -static_cast<ssize_t>(distance);
+          ret.long_size = match_size;
+          if (match_size == max_size) {
+            break;
+          }
+        }
       }
-      auto& node = nodes[window.offset];
-      auto match = window.get_best_match();
-      if (match.second >= 2) {
-        node.short_copy_offset = match.first - window.offset;
-        node.max_short_copy_size = match.second;
+    }
+
+    // A 2-byte match may not be in the 3-byte chain, so check for it
+    // separately
+    if (ret.short_size < 2) {
+      uint32_t entry = this->heads2[this->data[pos] | (this->data[pos + 1] << 8)];
+      if (entry && (pos - (entry - 1) <= 0x100)) {
+        ret.short_offset = -static_cast<ssize_t>(pos - (entry - 1));
+        ret.short_size = min<size_t>(prs_match_size(this->data + entry - 1, this->data + pos, max_size), 5);
       }
-      window.advance();
     }
-  });
 
-  // Populate all possible long copies
-  std::thread long_window_thread([&]() -> void {
-    WindowIndex<0x1FFF, 9> window(in_data_v, in_size);
-    while (window.offset < in_size) {
-      if (window.offset && (window.offset & 0xFFF) == 0 && progress_fn) {
-        size_t progress = copy_progress.fetch_add(0x1000) + 0x1000;
-        progress_fn(CompressPhase::INDEX, progress, copy_progress_max, 0);
+    return ret;
+  }
+
+private:
+  static constexpr size_t WINDOW_SIZE = 0x2000;
+  static constexpr size_t HASH3_BITS = 15;
+  static constexpr size_t HASH3_COUNT = 1 << HASH3_BITS;
+
+  const uint8_t* data;
+  size_t size;
+  size_t max_chain_length;
+  vector<uint32_t> heads3;
+  vector<uint32_t> heads2;
+  vector<uint32_t> prev;
+
+  inline size_t hash3(size_t pos) const {
+    uint32_t v = this->data[pos] | (this->data[pos + 1] << 8) | (this->data[pos + 2] << 16);
+    return (v * 0x9E3779B1) >> (32 - HASH3_BITS);
+  }
+};
+
+// Finds the longest long or extended copy at each position in one block of
+// the input, using a suffix array of the block and the window preceding it.
+// Unlike with hash chains, this doesn't have to compare against every earlier
+// position that has the same first few bytes: suffixes are visited in order
+// of decreasing common prefix length, so the search can stop at the first one
+// that's within the window. This makes it much faster than unlimited hash
+// chains on inputs with many repeated short sequences (for example, runs of
+// zeroes in structured data), while still always finding the longest match.
+class PRSSuffixArrayMatchFinder {
+public:
+  PRSSuffixArrayMatchFinder(const uint8_t* data, size_t size, size_t start_offset, size_t end_offset)
+      : data(data),
+        size(size),
+        text_offset((start_offset > 0x1FFF) ? (start_offset - 0x1FFF) : 0) {
+    // The text extends past the end of the block, since copies can too
+    size_t text_end_offset = min<size_t>(end_offset + 0x100, size);
+    size_t n = text_end_offset - this->text_offset;
+    const uint8_t* text = this->data + this->text_offset;
+
+    // Sort all suffixes by their first 0x100 bytes by prefix doubling. After
+    // the round with step size k, suffixes are sorted by their first 2k bytes
+    // and ranks[x] is the index of the first suffix with the same 2k bytes as
+    // suffix x.
+    this->suffixes.resize(n);
+    this->ranks.resize(n);
+    vector<uint32_t> temp_suffixes(n);
+    vector<uint32_t> temp_ranks(n);
+    vector<uint32_t> counts(max<size_t>(n, 0x100) + 1);
+    for (size_t x = 0; x < n; x++) {
+      counts[text[x] + 1]++;
+    }
+    for (size_t x = 1; x < counts.size(); x++) {
+      counts[x] += counts[x - 1];
+    }
+    for (size_t x = 0; x < n; x++) {
+      this->suffixes[counts[text[x]]++] = x;
+    }
+    for (size_t z = 0; z < n; z++) {
+      size_t x = this->suffixes[z];
+      this->ranks[x] = (z > 0 && text[x] == text[this->suffixes[z - 1]]) ? this->ranks[this->suffixes[z - 1]] : z;
+    }
+
+    for (size_t k = 1; k < 0x100; k <<= 1) {
+      // Order by the second half (suffixes that end before it come first),
+      // then stably by the first half
+      size_t w = 0;
+      for (size_t x = n - min(n, k); x < n; x++) {
+        temp_suffixes[w++] = x;
       }
-      auto& node = nodes[window.offset];
-      auto match = window.get_best_match();
-      if (match.second >= 3) {
-        node.long_copy_offset = match.first - window.offset;
-        node.max_long_copy_size = match.second;
+      for (size_t z = 0; z < n; z++) {
+        if (this->suffixes[z] >= k) {
+          temp_suffixes[w++] = this->suffixes[z] - k;
+        }
+      }
+      fill(counts.begin(), counts.end(), 0);
+      for (size_t x = 0; x < n; x++) {
+        counts[this->ranks[x] + 1]++;
+      }
+      for (size_t x = 1; x < counts.size(); x++) {
+        counts[x] += counts[x - 1];
+      }
+      for (size_t z = 0; z < n; z++) {
+        size_t x = temp_suffixes[z];
+        this->suffixes[counts[this->ranks[x]]++] = x;
+      }
+
+      auto second_rank = [&](size_t x) -> ssize_t {
+        return (x + k < n) ? static_cast<ssize_t>(this->ranks[x + k]) : -1;
+      };
+      bool all_distinct = true;
+      for (size_t z = 0; z < n; z++) {
+        size_t x = this->suffixes[z];
+        size_t prev_x = z ? this->suffixes[z - 1] : 0;
+        if (z > 0 && (this->ranks[x] == this->ranks[prev_x]) && (second_rank(x) == second_rank(prev_x))) {
+          temp_ranks[x] = temp_ranks[prev_x];
+          all_distinct = false;
+        } else {
+          temp_ranks[x] = z;
+        }
+      }
+      this->ranks.swap(temp_ranks);
+      if (all_distinct) {
+        break;
       }
-      window.advance();
     }
-  });
 
-  // Populate all possible extended copies
-  std::thread extended_window_thread([&]() -> void {
-    WindowIndex<0x1FFF, 0x100> window(in_data_v, in_size);
-    while (window.offset < in_size) {
-      if (window.offset && (window.offset & 0xFFF) == 0 && progress_fn) {
-        size_t progress = copy_progress.fetch_add(0x1000) + 0x1000;
-        progress_fn(CompressPhase::INDEX, progress, copy_progress_max, 0);
+    // Replace the ranks with each suffix's actual index, and compute the
+    // common prefix length (up to 0x100) of each suffix with the previous one
+    this->common_prefix_sizes.resize(n);
+    for (size_t z = 0; z < n; z++) {
+      size_t x = this->suffixes[z];
+      this->ranks[x] = z;
+      if (z > 0) {
+        size_t prev_x = this->suffixes[z - 1];
+        size_t max_size = min<size_t>(0x100, n - max(x, prev_x));
+        this->common_prefix_sizes[z] = prs_match_size(text + x, text + prev_x, max_size);
       }
-      auto& node = nodes[window.offset];
-      auto match = window.get_best_match();
-      if (match.second >= 1) {
-        node.extended_copy_offset = match.first - window.offset;
-        node.max_extended_copy_size = match.second;
+    }
+  }
+
+  // Returns the offset and size of the longest copy (offset >= -0x1FFF, size
+  // in [3, 0x100]) at pos, or size 0 if there is none.
+  pair<ssize_t, size_t> find(size_t pos) const {
+    size_t x = pos - this->text_offset;
+    size_t z = this->ranks[x];
+    size_t max_size = min<size_t>(0x100, this->size - pos);
+    ssize_t best_offset = 0;
+    size_t best_size = 0;
+
+    // The common prefix length with suffixes further from this one in the
+    // order can only decrease, so in each direction, the first suffix that
+    // starts within the window is the best match in that direction
+    size_t common_size = max_size;
+    for (size_t w = z; w > 0; w--) {
+      common_size = min<size_t>(common_size, this->common_prefix_sizes[w]);
+      if (common_size < 3) {
+        break;
+      }
+      size_t match_x = this->suffixes[w - 1];
+      if ((match_x < x) && (x - match_x <= 0x1FFF)) {
+        best_offset = static_cast<ssize_t>(match_x) - static_cast<ssize_t>(x);
+        best_size = common_size;
+        break;
+      }
+    }
+    common_size = max_size;
+    for (size_t w = z + 1; w < this->suffixes.size(); w++) {
+      common_size = min<size_t>(common_size, this->common_prefix_sizes[w]);
+      if ((common_size < 3) || (common_size <= best_size)) {
+        break;
+      }
+      size_t match_x = this->suffixes[w];
+      if ((match_x < x) && (x - match_x <= 0x1FFF)) {
+        best_offset = static_cast<ssize_t>(match_x) - static_cast<ssize_t>(x);
+        best_size = common_size;
+        break;
       }
-      window.advance();
     }
-  });
+    return make_pair(best_offset, best_size);
+  }
+
+private:
+  const uint8_t* data;
+  size_t size;
+  size_t text_offset;
+  vector<uint32_t> suffixes;
+  vector<uint32_t> ranks;
+  vector<uint16_t> common_prefix_sizes;
+};
+
+// Finds the best short, long, and extended copies at every position in the
+// input. Each thread indexes the input in blocks, starting each block by
+// indexing the preceding window, so the result doesn't depend on the number
+// of threads or how the input is divided.
+static void prs_find_all_matches(
+    vector<PRSPathNode>& nodes,
+    const uint8_t* in_data,
+    size_t in_size,
+    size_t max_chain_length,
+    size_t num_threads,
+    ProgressCallback progress_fn) {
+  static constexpr size_t BLOCK_SIZE = 0x10000;
+
+  auto find_block = [&](PRSMatchFinder& finder, size_t block_index) -> void {
+    size_t start_offset = block_index * BLOCK_SIZE;
+    size_t end_offset = min<size_t>(start_offset + BLOCK_SIZE, in_size);
+    finder.reset();
+    for (size_t z = (start_offset > 0x1FFF) ? (start_offset - 0x1FFF) : 0; z < start_offset; z++) {
+      finder.insert(z);
+    }
+
+    // If max_chain_length is zero, the results must be exact. In that case,
+    // the hash chains are only used for short copies (since their window is
+    // small enough that searching it exhaustively is fast), and a suffix
+    // array is used for long and extended copies instead.
+    unique_ptr<PRSSuffixArrayMatchFinder> sa_finder;
+    if (max_chain_length == 0) {
+      sa_finder = make_unique<PRSSuffixArrayMatchFinder>(in_data, in_size, start_offset, end_offset);
+    }
+
+    for (size_t z = start_offset; z < end_offset; z++) {
+      auto match = finder.find(z, !sa_finder);
+      if (sa_finder) {
+        tie(match.long_offset, match.long_size) = sa_finder->find(z);
+      }
+      auto& node = nodes[z];
+      if (match.short_size >= 2) {
+        node.short_copy_offset = match.short_offset;
+        node.max_short_copy_size = match.short_size;
+      }
+      if (match.long_size >= 3) {
+        node.long_copy_offset = match.long_offset;
+        node.max_long_copy_size = min<size_t>(match.long_size, 9);
+        node.extended_copy_offset = match.long_offset;
+        node.max_extended_copy_size = match.long_size;
+      }
+      finder.insert(z);
+    }
+  };
+
+  size_t num_blocks = (in_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  if (num_threads == 0) {
+    num_threads = thread::hardware_concurrency();
+  }
+  num_threads = min<size_t>(num_threads, num_blocks);
+
+  if (num_threads <= 1) {
+    PRSMatchFinder finder(in_data, in_size, max_chain_length);
+    for (size_t block_index = 0; block_index < num_blocks; block_index++) {
+      if (progress_fn) {
+        progress_fn(CompressPhase::INDEX, block_index * BLOCK_SIZE, in_size, 0);
+      }
+      find_block(finder, block_index);
+    }
+
+  } else {
+    vector<unique_ptr<PRSMatchFinder>> finders;
+    while (finders.size() < num_threads) {
+      finders.emplace_back(make_unique<PRSMatchFinder>(in_data, in_size, max_chain_length));
+    }
+    auto thread_progress_fn = [&](size_t, size_t, size_t current_block_index, uint64_t) -> void {
+      if (progress_fn) {
+        progress_fn(CompressPhase::INDEX, min<size_t>(current_block_index * BLOCK_SIZE, in_size), in_size, 0);
+      }
+    };
+    phosg::parallel_range<size_t>([&](size_t block_index, size_t thread_num) -> bool {
+      find_block(*finders[thread_num], block_index);
+      return false;
+    },
+        0, num_blocks, num_threads, thread_progress_fn);
+  }
+}
 
-  short_window_thread.join();
-  long_window_thread.join();
-  extended_window_thread.join();
+// Generates a PRS command stream from the shortest path through the nodes.
+// nodes must have size in_size + 1, and the copy fields (but not the path
+// fields) must already be filled in.
+static string prs_compress_shortest_path(
+    vector<PRSPathNode>& nodes, const uint8_t* in_data, size_t in_size, ProgressCallback progress_fn) {
+  nodes[0].bits_used = 18; // Stop command: 2 control bits and 2 data bytes
 
   // For each node, populate the literal value, and the best ways to get to the
   // following nodes
@@ -434,10 +837,117 @@ string prs_compress_optimal(const void* in_data_v, size_t in_size, ProgressCallb
   return std::move(w.close());
 }
 
+string prs_compress_optimal(const void* in_data_v, size_t in_size, ProgressCallback progress_fn) {
+  const uint8_t* in_data = reinterpret_cast<const uint8_t*>(in_data_v);
+  vector<PRSPathNode> nodes(in_size + 1);
+  prs_find_all_matches(nodes, in_data, in_size, 0, 0, progress_fn);
+  return prs_compress_shortest_path(nodes, in_data, in_size, progress_fn);
+}
+
 string prs_compress_optimal(const string& data, ProgressCallback progress_fn) {
   return prs_compress_optimal(data.data(), data.size(), progress_fn);
 }
 
+string prs_compress_chained(const void* in_data_v, size_t in_size, size_t level, ProgressCallback progress_fn) {
+  static const array<size_t, 8> max_chain_length_for_level = {4, 16, 64, 16, 64, 256, 1024, 4096};
+  if (level < 1 || level > 9) {
+    throw invalid_argument("compression level must be between 1 and 9");
+  }
+  if (level == 9) {
+    return prs_compress_optimal(in_data_v, in_size, progress_fn);
+  }
+  const uint8_t* in_data = reinterpret_cast<const uint8_t*>(in_data_v);
+  bool lazy = (level >= 4);
+
+  PRSMatchFinder finder(in_data, in_size, max_chain_length_for_level[level - 1]);
+  size_t next_insert_offset = 0;
+  auto find_match = [&](size_t offset) -> PRSMatchFinder::Match {
+    for (; next_insert_offset < offset; next_insert_offset++) {
+      finder.insert(next_insert_offset);
+    }
+    return finder.find(offset);
+  };
+  // A long copy is used if it's longer than the short copy; otherwise, the
+  // short copy is used (if there is one)
+  auto copy_size = [](const PRSMatchFinder::Match& match) -> size_t {
+    return max<size_t>(match.long_size, match.short_size);
+  };
+
+  LZSSInterleavedWriter w;
+  size_t last_progress_fn_call = static_cast<size_t>(-1);
+  PRSMatchFinder::Match next_match;
+  bool next_match_valid = false;
+  for (size_t offset = 0; offset < in_size;) {
+    if (progress_fn && ((offset & ~0xFFF) != (last_progress_fn_call & ~0xFFF))) {
+      last_progress_fn_call = offset;
+      progress_fn(CompressPhase::GENERATE_RESULT, offset, in_size, w.size());
+    }
+
+    auto match = next_match_valid ? next_match : find_match(offset);
+    next_match_valid = false;
+
+    // In lazy mode, if the next position has a longer copy available, write
+    // a literal here and use that copy instead
+    if (lazy && (copy_size(match) >= 2) && (copy_size(match) < 0x100) && (offset + 1 < in_size)) {
+      next_match = find_match(offset + 1);
+      if (copy_size(next_match) > copy_size(match)) {
+        match = PRSMatchFinder::Match();
+        next_match_valid = true;
+      }
+    }
+
+    size_t bytes_consumed;
+    if ((match.long_size >= 3) && (match.long_size > match.short_size)) {
+      w.write_control(false);
+      w.flush_if_ready();
+      w.write_control(true);
+      if (match.long_size <= 9) {
+        uint16_t a = (match.long_offset << 3) | (match.long_size - 2);
+        w.write_data(a & 0xFF);
+        w.write_data(a >> 8);
+      } else {
+        uint16_t a = (match.long_offset << 3);
+        w.write_data(a & 0xFF);
+        w.write_data(a >> 8);
+        w.write_data(match.long_size - 1);
+      }
+      bytes_consumed = match.long_size;
+
+    } else if (match.short_size >= 2) {
+      uint8_t encoded_size = match.short_size - 2;
+      w.write_control(false);
+      w.flush_if_ready();
+      w.write_control(false);
+      w.flush_if_ready();
+      w.write_control(encoded_size & 2);
+      w.flush_if_ready();
+      w.write_control(encoded_size & 1);
+      w.write_data(match.short_offset & 0xFF);
+      bytes_consumed = match.short_size;
+
+    } else {
+      w.write_control(true);
+      w.write_data(in_data[offset]);
+      bytes_consumed = 1;
+    }
+    w.flush_if_ready();
+    offset += bytes_consumed;
+  }
+
+  // Write stop command
+  w.write_control(false);
+  w.flush_if_ready();
+  w.write_control(true);
+  w.write_data(0);
+  w.write_data(0);
+
+  return std::move(w.close());
+}
+
+string prs_compress_chained(const string& data, size_t level, ProgressCallback progress_fn) {
+  return prs_compress_chained(data.data(), data.size(), level, progress_fn);
+}
+
 string prs_compress_pessimal(const void* vdata, size_t size) {
   const uint8_t* in_data = reinterpret_cast<const uint8_t*>(vdata);
 
@@ -874,35 +1384,43 @@ PRSDecompressResult prs_decompress_with_meta(
   // is encountered partway through an opcode, we throw instead, because it's
   // likely the input has been truncated or is malformed in some way.
 
-  phosg::StringWriter w;
-  phosg::StringReader r(data, size);
-  ControlStreamReader cr(r);
+  // The decompressed size is computed first, so the output can be written into
+  // a preallocated buffer instead of being appended to one byte at a time.
+  // This also validates all backreferences, so the loop below doesn't need to
+  // check them.
+  size_t output_size = prs_decompress_size(data, size, max_output_size, allow_unterminated);
 
+  // prs_copy_backreference may write up to 7 bytes past the end of the output
+  PRSDecompressResult ret;
+  ret.data.resize(output_size + 7);
+  uint8_t* out = reinterpret_cast<uint8_t*>(ret.data.data());
+  size_t out_offset = 0;
+
+  PRSInputReader r(data, size);
   while (!r.eof()) {
     // Control 1 = literal byte
-    if (cr.read()) {
-      if (max_output_size && w.size() == max_output_size) {
-        if (allow_unterminated) {
-          return {std::move(w.str()), r.where()};
-        } else {
-          throw runtime_error("maximum output size exceeded");
-        }
+    if (r.read_control()) {
+      // If the output is already full, then max_output_size was exceeded and
+      // allow_unterminated is true (otherwise, prs_decompress_size would have
+      // thrown); in this case, stop before reading the literal byte
+      if (out_offset == output_size) {
+        break;
       }
-      w.put_u8(r.get_u8());
+      out[out_offset++] = r.get_u8();
 
     } else {
-      ssize_t offset;
+      size_t distance;
       size_t count;
 
       // Control 01 = long backreference
-      if (cr.read()) {
+      if (r.read_control()) {
         // The bits stored in the data stream are AAAAABBBCCCCCCCC, which we
         // rearrange into offset = CCCCCCCCAAAAA and size = BBB.
         uint16_t a = r.get_u8();
         a |= (r.get_u8() << 8);
-        offset = (a >> 3) | (~0x1FFF);
+        distance = 0x2000 - (a >> 3);
         // If offset is zero, it's a stop opcode
-        if (offset == ~0x1FFF) {
+        if (distance == 0x2000) {
           break;
         }
         // If the size field is zero, it's an extended backreference (size comes
@@ -915,32 +1433,28 @@ PRSDecompressResult prs_decompress_with_meta(
         // data stream (and 2 is added). Importantly, the control stream bits
         // are read first - this may involve reading another control stream
         // byte, which happens before the offset is read from the data stream.
-        count = cr.read() << 1;
-        count = (count | cr.read()) + 2;
-        offset = r.get_u8() | (~0xFF);
+        count = r.read_control() << 1;
+        count = (count | r.read_control()) + 2;
+        distance = 0x100 - r.get_u8();
       }
 
-      // Copy bytes from the referenced location in the output. Importantly,
-      // copy only one byte at a time, in order to support ranges that cover the
-      // current end of the output.
-      size_t read_offset = w.size() + offset;
-      if (read_offset >= w.size()) {
-        throw runtime_error("backreference offset beyond beginning of output");
+      // As above, the output can only be full here if the result is being
+      // truncated; in that case, copy as much as fits and stop
+      bool truncated = (count > output_size - out_offset);
+      if (truncated) {
+        count = output_size - out_offset;
       }
-      for (size_t z = 0; z < count; z++) {
-        if (max_output_size && w.size() == max_output_size) {
-          if (allow_unterminated) {
-            return {std::move(w.str()), r.where()};
-          } else {
-            throw out_of_range("maximum output size exceeded");
-          }
-        }
-        w.put_u8(w.str()[read_offset + z]);
+      prs_copy_backreference(out + out_offset, distance, count);
+      out_offset += count;
+      if (truncated) {
+        break;
       }
     }
   }
 
-  return {std::move(w.str()), r.where()};
+  ret.data.resize(out_offset);
+  ret.input_bytes_used = r.where();
+  return ret;
 }
 
 PRSDecompressResult prs_decompress_with_meta(const string& data, size_t max_output_size, bool allow_unterminated) {
@@ -959,35 +1473,33 @@ string prs_decompress(const string& data, size_t max_output_size, bool allow_unt
 
 size_t prs_decompress_size(const void* data, size_t size, size_t max_output_size, bool allow_unterminated) {
   size_t ret = 0;
-  phosg::StringReader r(data, size);
-  ControlStreamReader cr(r);
+  PRSInputReader r(data, size);
 
   while (!r.eof()) {
-    if (cr.read()) {
+    if (r.read_control()) {
       ret++;
-      r.get_u8();
+      r.skip_u8();
 
     } else {
-      ssize_t offset;
+      size_t distance;
       size_t count;
 
-      if (cr.read()) {
+      if (r.read_control()) {
         uint16_t a = r.get_u8();
         a |= (r.get_u8() << 8);
-        offset = (a >> 3) | (~0x1FFF);
-        if (offset == ~0x1FFF) {
+        distance = 0x2000 - (a >> 3);
+        if (distance == 0x2000) {
           break;
         }
         count = (a & 7) ? ((a & 7) + 2) : (r.get_u8() + 1);
 
       } else {
-        count = cr.read() << 1;
-        count = (count | cr.read()) + 2;
-        offset = r.get_u8() | (~0xFF);
+        count = r.read_control() << 1;
+        count = (count | r.read_control()) + 2;
+        distance = 0x100 - r.get_u8();
       }
 
-      size_t read_offset = ret + offset;
-      if (read_offset >= ret) {
+      if (distance > ret) {
         throw runtime_error("backreference offset beyond beginning of output");
       }
       ret += count;
@@ -1009,6 +1521,106 @@ size_t prs_decompress_size(const string& data, size_t max_output_size, bool allo
   return prs_decompress_size(data.data(), data.size(), max_output_size, allow_unterminated);
 }
 
+// Decodes a single command from r, appending its result to output. Returns
+// false if the command was a stop command.
+static bool prs_decode_command(PRSInputReader& r, string& output) {
+  if (r.read_control()) {
+    output.push_back(r.get_u8());
+    return true;
+  }
+
+  size_t distance;
+  size_t count;
+  if (r.read_control()) {
+    uint16_t a = r.get_u8();
+    a |= (r.get_u8() << 8);
+    distance = 0x2000 - (a >> 3);
+    if (distance == 0x2000) {
+      return false;
+    }
+    count = (a & 7) ? ((a & 7) + 2) : (r.get_u8() + 1);
+  } else {
+    count = r.read_control() << 1;
+    count = (count | r.read_control()) + 2;
+    distance = 0x100 - r.get_u8();
+  }
+
+  if (distance > output.size()) {
+    throw runtime_error("backreference offset beyond beginning of output");
+  }
+  size_t offset = output.size();
+  output.resize(offset + count + 7);
+  prs_copy_backreference(reinterpret_cast<uint8_t*>(output.data()) + offset, distance, count);
+  output.resize(offset + count);
+  return true;
+}
+
+PRSDecompressor::PRSDecompressor(size_t max_output_size)
+    : max_output_size(max_output_size),
+      done(false),
+      control_bits(0x0000),
+      total_input_bytes(0),
+      output_base_offset(0),
+      output_read_offset(0) {}
+
+void PRSDecompressor::add(const void* data, size_t size) {
+  this->total_input_bytes += size;
+  if (!this->done) {
+    this->input.append(reinterpret_cast<const char*>(data), size);
+    this->decode_available(false);
+  }
+}
+
+void PRSDecompressor::add(const string& data) {
+  this->add(data.data(), data.size());
+}
+
+void PRSDecompressor::decode_available(bool is_final) {
+  // A command is never longer than 4 bytes (a control byte followed by up to 3
+  // data bytes), so until the end of the input, we only decode a command if at
+  // least that many bytes are available. The remaining bytes (if any) are
+  // decoded during the next call, once more data has arrived.
+  static constexpr size_t MAX_COMMAND_SIZE = 4;
+
+  PRSInputReader r(this->input.data(), this->input.size(), this->control_bits);
+  while (!this->done && (is_final ? !r.eof() : (this->input.size() - r.where() >= MAX_COMMAND_SIZE))) {
+    if (!prs_decode_command(r, this->output)) {
+      this->done = true;
+    }
+    if (this->max_output_size && (this->output_size() > this->max_output_size)) {
+      throw out_of_range("maximum output size exceeded");
+    }
+  }
+
+  this->control_bits = r.control_bits();
+  if (this->done) {
+    this->input.clear();
+  } else {
+    this->input.erase(0, r.where());
+  }
+}
+
+string PRSDecompressor::read_output() {
+  string ret = this->output.substr(this->output_read_offset);
+  this->output_read_offset = this->output.size();
+
+  // Backreferences can't go farther back than 0x1FFF bytes, so we only need
+  // to keep that much of the output. To avoid moving the window after every
+  // call, only trim it when it's grown to twice that size.
+  if (this->output.size() > 0x4000) {
+    size_t bytes_to_discard = this->output.size() - 0x2000;
+    this->output.erase(0, bytes_to_discard);
+    this->output_base_offset += bytes_to_discard;
+    this->output_read_offset -= bytes_to_discard;
+  }
+  return ret;
+}
+
+string PRSDecompressor::close() {
+  this->decode_available(true);
+  return this->read_output();
+}
+
 void prs_disassemble(FILE* stream, const void* data, size_t size) {
   size_t output_bytes = 0;
   phosg::StringReader r(data, size);
@@ -1248,73 +1860,103 @@ string bc0_decompress(const string& data) {
   return bc0_decompress(data.data(), data.size());
 }
 
-string bc0_decompress(const void* data, size_t size) {
-  phosg::StringReader r(data, size);
-  phosg::StringWriter w;
-
-  // Unlike PRS, BC0 uses a memo which "rolls over" every 0x1000 bytes. The
-  // boundaries of these "memo pages" are offset by -0x12 bytes for some reason,
-  // so the first output byte corresponds to position 0xFEE on the first memo
-  // page. Backreferences refer to offsets based on the start of memo pages; for
-  // example, if the current output offset is 0x1234, a backreference with
-  // offset 0x123 refers to the byte that was written at offset 0x1111 (because
-  // that byte is at offset 0x111 in the memo, because the memo rolls over every
-  // 0x1000 bytes and the first memo byte was 0x12 bytes before the beginning of
-  // the next page). The memo is initially zeroed from 0 to 0xFEE; it seems PSO
-  // GC doesn't initialize the last 0x12 bytes of the first memo page.
-  parray<uint8_t, 0x1000> memo;
-  uint16_t memo_offset = 0x0FEE;
-
-  // The low byte of this value contains the control stream data; the high bits
-  // specify which low bits are valid. When the last 1 is shifted out of the
-  // high byte, we need to read a new control stream byte to get the next set of
-  // control bits.
+// Decodes BC0 data. If Decode is false, nothing is written to out, and only
+// the output size is computed. Input that ends partway through a command is
+// not an error; the partial command is ignored.
+template <bool Decode>
+static size_t bc0_decompress_t(const uint8_t* in, size_t in_size, uint8_t* out) {
+  // See bc0_decompress for a description of the format. The memo is not
+  // needed here: since each memo byte is also written to the output, we can
+  // find it in the output instead. The memo offset is always equal to
+  // (out_offset + 0xFEE) & 0xFFF, so a backreference to memo offset B refers
+  // to the byte written D bytes earlier, where D = (memo_offset - B) & 0xFFF
+  // (or 0x1000 if that is zero, since the memo byte is read before it's
+  // overwritten). If that byte is before the beginning of the output, it's
+  // still the memo's initial value (zero).
+  size_t in_offset = 0;
+  size_t out_offset = 0;
   uint16_t control_stream_bits = 0x0000;
 
-  while (!r.eof()) {
-    // Read control stream bits if needed
+  while (in_offset < in_size) {
     control_stream_bits >>= 1;
     if ((control_stream_bits & 0x100) == 0) {
-      control_stream_bits = 0xFF00 | r.get_u8();
-      if (r.eof()) {
+      control_stream_bits = 0xFF00 | in[in_offset++];
+      if (in_offset >= in_size) {
         break;
       }
     }
 
-    // Control bit 0 means to perform a backreference copy. The offset and
-    // size are stored in two bytes in the input stream, laid out as follows:
-    // a1 = 0bBBBBBBBB
-    // a2 = 0bAAAACCCC
-    // The offset is the concatenation of bits AAAABBBBBBBB, which refers to a
-    // position in the memo; the number of bytes to copy is (CCCC + 3). The
-    // decompressor copies that many bytes from that offset in the memo, and
-    // writes them to the output and to the current position in the memo.
     if ((control_stream_bits & 1) == 0) {
-      uint8_t a1 = r.get_u8();
-      if (r.eof()) {
+      uint8_t a1 = in[in_offset++];
+      if (in_offset >= in_size) {
         break;
       }
-      uint8_t a2 = r.get_u8();
+      uint8_t a2 = in[in_offset++];
       size_t count = (a2 & 0x0F) + 3;
-      size_t backreference_offset = a1 | ((a2 << 4) & 0xF00);
-      for (size_t z = 0; z < count; z++) {
-        uint8_t v = memo[(backreference_offset + z) & 0x0FFF];
-        w.put_u8(v);
-        memo[memo_offset] = v;
-        memo_offset = (memo_offset + 1) & 0x0FFF;
+      if constexpr (Decode) {
+        size_t backreference_offset = a1 | ((a2 << 4) & 0xF00);
+        size_t distance = (out_offset + 0x0FEE - backreference_offset) & 0x0FFF;
+        if (distance == 0) {
+          distance = 0x1000;
+        }
+        if (distance <= out_offset) {
+          prs_copy_backreference(out + out_offset, distance, count);
+        } else {
+          for (size_t z = 0; z < count; z++) {
+            out[out_offset + z] = (out_offset + z >= distance) ? out[out_offset + z - distance] : 0;
+          }
+        }
       }
+      out_offset += count;
 
-      // Control bit 1 means to write a byte directly from the input to the
-      // output. As above, the byte is also written to the memo.
     } else {
-      uint8_t v = r.get_u8();
-      w.put_u8(v);
-      memo[memo_offset] = v;
-      memo_offset = (memo_offset + 1) & 0x0FFF;
+      if constexpr (Decode) {
+        out[out_offset] = in[in_offset];
+      }
+      in_offset++;
+      out_offset++;
     }
   }
 
-  return std::move(w.str());
+  return out_offset;
+}
+
+string bc0_decompress(const void* data, size_t size) {
+  // Unlike PRS, BC0 uses a memo which "rolls over" every 0x1000 bytes. The
+  // boundaries of these "memo pages" are offset by -0x12 bytes for some reason,
+  // so the first output byte corresponds to position 0xFEE on the first memo
+  // page. Backreferences refer to offsets based on the start of memo pages; for
+  // example, if the current output offset is 0x1234, a backreference with
+  // offset 0x123 refers to the byte that was written at offset 0x1111 (because
+  // that byte is at offset 0x111 in the memo, because the memo rolls over every
+  // 0x1000 bytes and the first memo byte was 0x12 bytes before the beginning of
+  // the next page). The memo is initially zeroed from 0 to 0xFEE; it seems PSO
+  // GC doesn't initialize the last 0x12 bytes of the first memo page.
+
+  // The control stream is read one bit at a time, as in PRS. When the last
+  // control bit has been used, we read a new control stream byte to get the
+  // next 8 control bits.
+
+  // Control bit 0 means to perform a backreference copy. The offset and size
+  // are stored in two bytes in the input stream, laid out as follows:
+  // a1 = 0bBBBBBBBB
+  // a2 = 0bAAAACCCC
+  // The offset is the concatenation of bits AAAABBBBBBBB, which refers to a
+  // position in the memo; the number of bytes to copy is (CCCC + 3). The
+  // decompressor copies that many bytes from that offset in the memo, and
+  // writes them to the output and to the current position in the memo.
+
+  // Control bit 1 means to write a byte directly from the input to the output.
+  // As above, the byte is also written to the memo.
+
+  const uint8_t* in = reinterpret_cast<const uint8_t*>(data);
+  size_t output_size = bc0_decompress_t<false>(in, size, nullptr);
+
+  // prs_copy_backreference may write up to 7 bytes past the end of the output
+  string ret(output_size + 7, '\0');
+  bc0_decompress_t<true>(in, size, reinterpret_cast<uint8_t*>(ret.data()));
+  ret.resize(output_size);
+  return ret;
 }
 
 void bc0_disassemble(FILE* stream, const string& data) {
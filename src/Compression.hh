@@ -172,16 +172,38 @@ std::string prs_compress_indexed(
     ProgressCallback progress_fn = nullptr);
 
 // Compresses data using PRS to the smallest possible output size. This function
-// is slow, but produces results significantly smaller than even Sega's original
-// compressor.
+// is slower than the others, but produces results significantly smaller than
+// even Sega's original compressor. The input is indexed in blocks in parallel
+// on multiple threads; the output does not depend on the number of threads.
 std::string prs_compress_optimal(const void* vdata, size_t size, ProgressCallback progress_fn = nullptr);
 std::string prs_compress_optimal(const std::string& data, ProgressCallback progress_fn = nullptr);
 
+// Compresses data using PRS, using hash chains to find backreferences. This
+// is much faster than prs_compress, and at the higher levels, usually produces
+// smaller output. level specifies the tradeoff between speed and output size:
+//   1-3: Greedily use the longest backreference at every point (like
+//        prs_compress with compression_level=0), comparing at most 4, 16, or
+//        64 earlier positions at each point.
+//   4-8: Like 1-3, but if there's a longer backreference at the next point,
+//        write a literal and use that backreference instead. At most 16, 64,
+//        256, 1024, or 4096 earlier positions are compared at each point.
+//   9:   Same as prs_compress_optimal.
+std::string prs_compress_chained(
+    const void* vdata,
+    size_t size,
+    size_t level = 6,
+    ProgressCallback progress_fn = nullptr);
+std::string prs_compress_chained(
+    const std::string& data,
+    size_t level = 6,
+    ProgressCallback progress_fn = nullptr);
+
 // Compresses data using PRS to the LARGEST possible output size. There is no
 // practical use for this function except for amusement.
 std::string prs_compress_pessimal(const void* vdata, size_t size);
 
-// Decompresses PRS-compressed data.
+// Decompresses PRS-compressed data. The output size is computed before
+// decompressing, so the output is written into a preallocated buffer.
 struct PRSDecompressResult {
   std::string data;
   size_t input_bytes_used;
@@ -196,6 +218,59 @@ std::string prs_decompress(const std::string& data, size_t max_output_size = 0,
 size_t prs_decompress_size(const void* data, size_t size, size_t max_output_size = 0, bool allow_unterminated = false);
 size_t prs_decompress_size(const std::string& data, size_t max_output_size = 0, bool allow_unterminated = false);
 
+// Use this class to decompress PRS data that arrives in multiple chunks (for
+// example, a file sent in a sequence of 13 or A7 commands). To use it, call
+// .add() with each chunk as it arrives; any input that ends partway through a
+// command is buffered until the next call. Call .read_output() at any time to
+// get the data decompressed since the previous call, and call .close() after
+// the last chunk has been added. Only the most recent 8KB of output (the
+// maximum backreference distance) is retained after it has been read.
+class PRSDecompressor {
+public:
+  explicit PRSDecompressor(size_t max_output_size = 0);
+  PRSDecompressor(const PRSDecompressor&) = delete;
+  PRSDecompressor(PRSDecompressor&&) = default;
+  PRSDecompressor& operator=(const PRSDecompressor&) = delete;
+  PRSDecompressor& operator=(PRSDecompressor&&) = default;
+  ~PRSDecompressor() = default;
+
+  void add(const void* data, size_t size);
+  void add(const std::string& data);
+
+  // Returns all data decompressed since the previous call to read_output.
+  std::string read_output();
+  // Throws if the input ended partway through a command. Otherwise, returns
+  // all data not yet returned by read_output.
+  std::string close();
+
+  // Returns true if a stop command was found. Any input after the stop
+  // command is ignored.
+  inline bool is_done() const {
+    return this->done;
+  }
+  // Returns the total number of bytes passed to add().
+  inline size_t input_size() const {
+    return this->total_input_bytes;
+  }
+  // Returns the total number of bytes decompressed so far (including those
+  // already returned by read_output).
+  inline size_t output_size() const {
+    return this->output_base_offset + this->output.size();
+  }
+
+private:
+  void decode_available(bool is_final);
+
+  size_t max_output_size;
+  bool done;
+  std::string input; // Not yet decoded
+  uint16_t control_bits;
+  size_t total_input_bytes;
+  std::string output; // Backreference window, followed by unread output
+  size_t output_base_offset; // Total output bytes before output[0]
+  size_t output_read_offset; // Offset in output of first unread byte
+};
+
 // Prints the command stream from a PRS-compressed buffer.
 void prs_disassemble(FILE* stream, const void* data, size_t size);
 void prs_disassemble(FILE* stream, const std::string& data);
@@ -217,7 +292,8 @@ std::string bc0_compress(const void* in_data_v, size_t in_size, ProgressCallback
 // compression_level=-1 with prs_compress).
 std::string bc0_encode(const void* in_data_v, size_t in_size);
 
-// Decompresses BC0-compressed data.
+// Decompresses BC0-compressed data. Like prs_decompress, this computes the
+// output size first and writes into a preallocated buffer.
 std::string bc0_decompress(const std::string& data);
 std::string bc0_decompress(const void* data, size_t size);
 
@@ -0,0 +1,359 @@
+#include "DecryptionSeedSearch.hh"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <phosg/Encoding.hh>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+#include <thread>
+
+#include "PSOEncryption.hh"
+
+using namespace std;
+
+// Seeds are evaluated LANES at a time, one seed per vector lane. The batch
+// functions are written with GCC vector extensions, so they compile to SIMD
+// instructions for whatever the target supports; on x86-64 Linux, they are
+// additionally compiled for AVX2, and the AVX2 versions are used at runtime if
+// the CPU supports them.
+static constexpr size_t LANES = 8;
+typedef uint32_t lanes_t __attribute__((vector_size(LANES * sizeof(uint32_t))));
+typedef int32_t lanes_mask_t __attribute__((vector_size(LANES * sizeof(int32_t))));
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(__clang__)
+#define SEED_SEARCH_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define SEED_SEARCH_KERNEL
+#endif
+
+// Each plaintext produces up to two patterns (one for each byte order)
+static constexpr size_t MAX_PATTERNS = 64;
+static constexpr uint64_t NUM_SEEDS = 0x100000000;
+static constexpr uint64_t CHUNK_SIZE = 0x10000;
+
+// The V3 cipher's initial state is built from the top bits of the first
+// 17 * 32 outputs of an LCG. Instead of stepping the LCG sequentially (which
+// puts a multiply on the critical path for every bit), we compute each output
+// directly from the seed as seed * LCG_MUL[n] + LCG_ADD[n], so the outputs
+// don't depend on each other.
+static constexpr size_t V3_LCG_STEPS = 17 * 32;
+static constexpr auto V3_LCG_TABLES = []() {
+  array<array<uint32_t, V3_LCG_STEPS>, 2> ret{};
+  uint32_t mul = 1, add = 0;
+  for (size_t z = 0; z < V3_LCG_STEPS; z++) {
+    mul *= 0x5D588B65;
+    add = add * 0x5D588B65 + 1;
+    ret[0][z] = mul;
+    ret[1][z] = add;
+  }
+  return ret;
+}();
+
+namespace {
+
+struct SearchParams {
+  bool is_v3;
+  bool match_little_endian;
+  bool match_big_endian;
+  const string* ciphertext;
+  const vector<pair<string, string>>* plaintexts;
+
+  // One pattern for each (plaintext, byte order) pair. A lane can only match
+  // if all of the words in at least one pattern match the keystream.
+  struct Pattern {
+    vector<uint32_t> masks;
+    vector<uint32_t> targets;
+  };
+  vector<Pattern> patterns;
+  size_t num_words;
+};
+
+} // namespace
+
+static bool mask_match(const void* a, const void* b, const void* m, size_t size) {
+  const uint8_t* a8 = reinterpret_cast<const uint8_t*>(a);
+  const uint8_t* b8 = reinterpret_cast<const uint8_t*>(b);
+  const uint8_t* m8 = reinterpret_cast<const uint8_t*>(m);
+  for (size_t z = 0; z < size; z++) {
+    if ((a8[z] & m8[z]) != (b8[z] & m8[z])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks a single seed using the actual cipher implementations
+static bool verify_seed(const SearchParams& params, uint32_t seed) {
+  size_t size = (params.num_words << 2);
+  string le_decrypt_buf = params.ciphertext->substr(0, size);
+  le_decrypt_buf.resize(size, '\0');
+  string be_decrypt_buf = le_decrypt_buf;
+  if (params.is_v3) {
+    PSOV3Encryption(seed).encrypt_both_endian(le_decrypt_buf.data(), be_decrypt_buf.data(), size);
+  } else {
+    PSOV2Encryption(seed).encrypt_both_endian(le_decrypt_buf.data(), be_decrypt_buf.data(), size);
+  }
+
+  for (const auto& plaintext : *params.plaintexts) {
+    if (params.match_little_endian &&
+        mask_match(le_decrypt_buf.data(), plaintext.first.data(), plaintext.second.data(), plaintext.second.size())) {
+      return true;
+    }
+    if (params.match_big_endian &&
+        mask_match(be_decrypt_buf.data(), plaintext.first.data(), plaintext.second.data(), plaintext.second.size())) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Compares one keystream word (for all lanes) against the corresponding word
+// of each pattern, and clears the lanes in alive that no longer match. Returns
+// false if no lane can match any pattern anymore.
+__attribute__((always_inline)) static inline bool check_keystream_word(
+    const SearchParams& params, lanes_mask_t* alive, const lanes_t& key, size_t word_index) {
+  lanes_mask_t any_alive = {};
+  for (size_t p = 0; p < params.patterns.size(); p++) {
+    const auto& pattern = params.patterns[p];
+    alive[p] &= ((key & pattern.masks[word_index]) == pattern.targets[word_index]);
+    any_alive |= alive[p];
+  }
+  for (size_t l = 0; l < LANES; l++) {
+    if (any_alive[l]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+__attribute__((always_inline)) static inline uint32_t alive_lanes(const SearchParams& params, const lanes_mask_t* alive) {
+  uint32_t ret = 0;
+  for (size_t p = 0; p < params.patterns.size(); p++) {
+    for (size_t l = 0; l < LANES; l++) {
+      if (alive[p][l]) {
+        ret |= (1 << l);
+      }
+    }
+  }
+  return ret;
+}
+
+// Returns a bitmask of the lanes (seeds base_seed + 0 through base_seed +
+// LANES - 1) that match the first words of at least one pattern. The number
+// of words checked is limited to the keystream words available before the
+// first refill; the caller verifies any survivors with the real cipher. alive
+// is scratch space with one entry per pattern.
+SEED_SEARCH_KERNEL static uint32_t check_v3_batch(const SearchParams& params, lanes_mask_t* alive, uint32_t base_seed) {
+  static constexpr size_t STREAM_LENGTH = 521;
+  lanes_t stream[STREAM_LENGTH];
+
+  lanes_t seed;
+  for (size_t l = 0; l < LANES; l++) {
+    seed[l] = base_seed + l;
+  }
+
+  // This is equivalent to the first part of the PSOV3Encryption constructor
+  for (size_t x = 0; x < 17; x++) {
+    lanes_t basekey = {};
+    for (size_t y = 0; y < 32; y++) {
+      size_t step = (x << 5) + y;
+      lanes_t lcg_value = seed * V3_LCG_TABLES[0][step] + V3_LCG_TABLES[1][step];
+      basekey |= (lcg_value >> (31 - y)) & (1U << y);
+    }
+    stream[x] = basekey;
+  }
+  stream[16] = (stream[0] >> 9) ^ (stream[16] << 23) ^ stream[15];
+  for (size_t z = 17; z < STREAM_LENGTH; z++) {
+    stream[z] = stream[z - 1] ^ (stream[z - 17] << 23) ^ (stream[z - 16] >> 9);
+  }
+
+  // The constructor calls update_stream 4 times. We do the first 3 fully, and
+  // the last one lazily, one word at a time, since most batches are rejected
+  // after only a few words.
+  for (size_t round = 0; round < 3; round++) {
+    for (size_t z = 0; z < 32; z++) {
+      stream[z] ^= stream[z + 489];
+    }
+    for (size_t z = 32; z < STREAM_LENGTH; z++) {
+      stream[z] ^= stream[z - 32];
+    }
+  }
+
+  for (size_t p = 0; p < params.patterns.size(); p++) {
+    alive[p] = ~lanes_mask_t{};
+  }
+  size_t num_words = min<size_t>(params.num_words, STREAM_LENGTH);
+  for (size_t z = 0; z < num_words; z++) {
+    stream[z] ^= (z < 32) ? stream[z + 489] : stream[z - 32];
+    if (!check_keystream_word(params, alive, stream[z], z)) {
+      return 0;
+    }
+  }
+
+  return alive_lanes(params, alive);
+}
+
+SEED_SEARCH_KERNEL static uint32_t check_v2_batch(const SearchParams& params, lanes_mask_t* alive, uint32_t base_seed) {
+  static constexpr size_t STREAM_LENGTH = 0x38;
+  lanes_t stream[STREAM_LENGTH + 1];
+
+  // This is equivalent to the PSOV2Encryption constructor, except the last
+  // update_stream call is done lazily (as in check_v3_batch)
+  lanes_t a, b;
+  for (size_t l = 0; l < LANES; l++) {
+    a[l] = 1;
+    b[l] = base_seed + l;
+  }
+  stream[0] = lanes_t{};
+  stream[0x37] = b;
+  for (uint16_t virtual_index = 0x15; virtual_index <= 0x36 * 0x15; virtual_index += 0x15) {
+    stream[virtual_index % 0x37] = a;
+    lanes_t c = b - a;
+    b = a;
+    a = c;
+  }
+  for (size_t round = 0; round < 4; round++) {
+    for (size_t z = 1; z < 0x19; z++) {
+      stream[z] -= stream[z + 0x1F];
+    }
+    for (size_t z = 0x19; z < STREAM_LENGTH; z++) {
+      stream[z] -= stream[z - 0x18];
+    }
+  }
+
+  for (size_t p = 0; p < params.patterns.size(); p++) {
+    alive[p] = ~lanes_mask_t{};
+  }
+  // The keystream starts at offset 1 in the V2 cipher
+  size_t num_words = min<size_t>(params.num_words, STREAM_LENGTH - 1);
+  for (size_t w = 0; w < num_words; w++) {
+    size_t z = w + 1;
+    stream[z] -= (z < 0x19) ? stream[z + 0x1F] : stream[z - 0x18];
+    if (!check_keystream_word(params, alive, stream[z], w)) {
+      return 0;
+    }
+  }
+
+  return alive_lanes(params, alive);
+}
+
+uint64_t find_decryption_seed(
+    const string& ciphertext,
+    const vector<pair<string, string>>& plaintexts,
+    bool is_v3,
+    bool match_little_endian,
+    bool match_big_endian,
+    size_t num_threads) {
+  SearchParams params;
+  params.is_v3 = is_v3;
+  params.match_little_endian = match_little_endian;
+  params.match_big_endian = match_big_endian;
+  params.ciphertext = &ciphertext;
+  params.plaintexts = &plaintexts;
+
+  size_t max_plaintext_size = 0;
+  for (const auto& plaintext : plaintexts) {
+    if (plaintext.first.size() != plaintext.second.size()) {
+      throw logic_error("plaintext and mask are not the same size");
+    }
+    if (plaintext.first.size() > ciphertext.size()) {
+      throw invalid_argument("plaintext is longer than ciphertext");
+    }
+    max_plaintext_size = max<size_t>(max_plaintext_size, plaintext.first.size());
+  }
+  params.num_words = (max_plaintext_size + 3) >> 2;
+
+  // Convert each plaintext into the keystream words it requires. For the
+  // little-endian case, the keystream word k must satisfy
+  // (k & mask) == ((ciphertext ^ plaintext) & mask) when all three are read as
+  // little-endian words; the big-endian case is the same but with all words
+  // read as big-endian.
+  auto add_pattern = [&](const pair<string, string>& plaintext, bool is_big_endian) -> void {
+    auto& pattern = params.patterns.emplace_back();
+    pattern.masks.resize(params.num_words, 0);
+    pattern.targets.resize(params.num_words, 0);
+    for (size_t z = 0; z < plaintext.first.size(); z++) {
+      size_t word_index = z >> 2;
+      size_t shift = is_big_endian ? ((3 - (z & 3)) << 3) : ((z & 3) << 3);
+      uint8_t mask = plaintext.second[z];
+      uint8_t target = (ciphertext[z] ^ plaintext.first[z]) & mask;
+      pattern.masks[word_index] |= static_cast<uint32_t>(mask) << shift;
+      pattern.targets[word_index] |= static_cast<uint32_t>(target) << shift;
+    }
+  };
+  for (const auto& plaintext : plaintexts) {
+    if (match_little_endian) {
+      add_pattern(plaintext, false);
+    }
+    if (match_big_endian) {
+      add_pattern(plaintext, true);
+    }
+  }
+  if (params.patterns.empty()) {
+    return NUM_SEEDS;
+  }
+  if (params.patterns.size() > MAX_PATTERNS) {
+    throw invalid_argument("too many plaintexts");
+  }
+
+  if (num_threads == 0) {
+    num_threads = max<size_t>(thread::hardware_concurrency(), 1);
+  }
+
+  // Each thread repeatedly claims the next unclaimed chunk of seeds, so
+  // threads that get easy chunks (or run on faster cores) just do more of
+  // them. Once a match is found, chunks after it are not searched, but
+  // chunks before it still are, so the lowest matching seed is returned.
+  atomic<uint64_t> next_chunk_start = 0;
+  atomic<uint64_t> seeds_done = 0;
+  atomic<uint64_t> result = NUM_SEEDS;
+  atomic<size_t> threads_running = num_threads;
+  auto thread_fn = [&]() -> void {
+    lanes_mask_t alive[MAX_PATTERNS];
+    for (;;) {
+      uint64_t chunk_start = next_chunk_start.fetch_add(CHUNK_SIZE);
+      if ((chunk_start >= NUM_SEEDS) || (chunk_start >= result.load())) {
+        break;
+      }
+      uint64_t chunk_end = min<uint64_t>(chunk_start + CHUNK_SIZE, NUM_SEEDS);
+      for (uint64_t base_seed = chunk_start; base_seed < chunk_end; base_seed += LANES) {
+        uint32_t lanes = is_v3
+            ? check_v3_batch(params, alive, base_seed)
+            : check_v2_batch(params, alive, base_seed);
+        for (size_t l = 0; lanes; l++, lanes >>= 1) {
+          uint64_t seed = base_seed + l;
+          if ((lanes & 1) && verify_seed(params, seed)) {
+            uint64_t prev_result = result.load();
+            while ((seed < prev_result) && !result.compare_exchange_weak(prev_result, seed)) {
+            }
+            break;
+          }
+        }
+      }
+      seeds_done += (chunk_end - chunk_start);
+    }
+    threads_running--;
+  };
+
+  vector<thread> threads;
+  for (size_t z = 0; z < num_threads; z++) {
+    threads.emplace_back(thread_fn);
+  }
+  while (threads_running.load()) {
+    this_thread::sleep_for(chrono::milliseconds(500));
+    uint64_t done = seeds_done.load();
+    fprintf(stderr, "... %08" PRIX64 "/%08" PRIX64 " (%g%%)    \r",
+        done, NUM_SEEDS, static_cast<double>(done * 100) / NUM_SEEDS);
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  fputc('\n', stderr);
+
+  return result.load();
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Searches all 2^32 PSO V2 or V3 encryption seeds for one that decrypts
+// ciphertext to any of the given plaintexts. Each plaintext is a pair of
+// (data, mask); only bits that are set in the mask are compared. Plaintexts
+// may be shorter than the ciphertext, but not longer. If match_little_endian
+// or match_big_endian is false, the keystream is not applied in that byte
+// order when checking candidates.
+//
+// Seeds are evaluated in batches using SIMD lanes (one seed per lane). Only
+// as much of each keystream as the plaintexts need is generated, and a batch
+// is abandoned as soon as no lane can match. Any candidates that survive the
+// SIMD pass are then checked again with PSOV2Encryption or PSOV3Encryption.
+// Work is distributed among threads in small chunks, so threads that finish
+// early take more work instead of waiting for the others.
+//
+// Returns the lowest matching seed, or 0x100000000 if no seed matches. If
+// num_threads is 0, one thread is used per CPU core.
+uint64_t find_decryption_seed(
+    const std::string& ciphertext,
+    const std::vector<std::pair<std::string, std::string>>& plaintexts,
+    bool is_v3,
+    bool match_little_endian,
+    bool match_big_endian,
+    size_t num_threads = 0);
@@ -0,0 +1,239 @@
+#include "DropSimulation.hh"
+
+#include <math.h>
+
+#include <phosg/Time.hh>
+#include <phosg/Tools.hh>
+#include <thread>
+
+using namespace std;
+
+static bool area_has_drop_tables(Episode episode, uint8_t area) {
+  // This matches the areas accepted by ItemCreator::normalize_area_number
+  switch (episode) {
+    case Episode::EP1:
+      return (area >= 0x01) && (area < 0x11) && (area != 0x0F);
+    case Episode::EP2:
+      return (area >= 0x13) && (area < 0x24);
+    case Episode::EP4:
+      return (area >= 0x24) && (area < 0x2D);
+    default:
+      return false;
+  }
+}
+
+static bool object_type_is_item_box(uint16_t base_type) {
+  switch (base_type) {
+    case 0x0088: // TObjContainerItem
+    case 0x0092: // TObjContainerBase
+    case 0x0161: // TOContainerAncientItemCommon
+    case 0x0162: // TOContainerAncientItemRare
+      return true;
+    default:
+      return false;
+  }
+}
+
+vector<DropSimulation::DropSource> DropSimulation::sources_for_map(
+    const Map& map, const SetDataTableBase& sdt, Episode episode) {
+  vector<DropSource> ret;
+  for (const auto& enemy : map.enemies) {
+    // Aliases are extra entity IDs for an enemy that was already counted
+    if (enemy.alias_entity_id != 0xFFFF) {
+      continue;
+    }
+    uint8_t area = sdt.default_area_for_floor(episode, enemy.floor);
+    if (!area_has_drop_tables(episode, area)) {
+      continue;
+    }
+    uint8_t rt_index;
+    try {
+      rt_index = rare_table_index_for_enemy_type(enemy.type);
+    } catch (const runtime_error&) {
+      continue; // Enemy doesn't drop items (e.g. a boss's subordinate parts)
+    }
+    ret.emplace_back(DropSource{
+        .area = area,
+        .rt_index = rt_index,
+        .is_specialized_box = false,
+        .param3 = 0.0f,
+        .param4 = 0,
+        .param5 = 0,
+        .param6 = 0});
+  }
+
+  for (const auto& obj : map.objects) {
+    if (!object_type_is_item_box(obj.args->base_type)) {
+      continue;
+    }
+    uint8_t area = sdt.default_area_for_floor(episode, obj.floor);
+    if (!area_has_drop_tables(episode, area)) {
+      continue;
+    }
+    ret.emplace_back(DropSource{
+        .area = area,
+        .rt_index = 0xFF,
+        .is_specialized_box = (obj.args->param1 <= 0.0f),
+        .param3 = obj.args->param3,
+        .param4 = obj.args->param4,
+        .param5 = obj.args->param5,
+        .param6 = obj.args->param6});
+  }
+
+  return ret;
+}
+
+void DropSimulation::Result::merge(const Result& other) {
+  this->num_runs += other.num_runs;
+  this->num_enemy_checks += other.num_enemy_checks;
+  this->num_box_checks += other.num_box_checks;
+  this->num_enemy_drops += other.num_enemy_drops;
+  this->num_box_drops += other.num_box_drops;
+  for (const auto& [id, other_stats] : other.items) {
+    auto& stats = this->items[id];
+    stats.enemy_count += other_stats.enemy_count;
+    stats.box_count += other_stats.box_count;
+    stats.rare_count += other_stats.rare_count;
+  }
+}
+
+double DropSimulation::Result::checks_per_second() const {
+  if (this->elapsed_usecs == 0) {
+    return 0.0;
+  }
+  return static_cast<double>(this->num_enemy_checks + this->num_box_checks) * 1000000.0 / this->elapsed_usecs;
+}
+
+DropSimulation::DropSimulation(const Config& config, vector<DropSource> sources)
+    : config(config),
+      sources(std::move(sources)) {}
+
+unique_ptr<ItemCreator> DropSimulation::create_item_creator() const {
+  return make_unique<ItemCreator>(
+      this->config.common_item_set,
+      this->config.rare_item_set,
+      this->config.armor_random_set,
+      this->config.tool_random_set,
+      this->config.weapon_random_set,
+      this->config.tekker_adjustment_set,
+      this->config.item_parameter_table,
+      this->config.stack_limits,
+      this->config.episode,
+      this->config.mode,
+      this->config.difficulty,
+      this->config.section_id,
+      nullptr);
+}
+
+uint32_t DropSimulation::seed_for_run(uint32_t base_seed, uint64_t run_index) {
+  // This is splitmix64 applied to the base seed and run index
+  uint64_t z = (static_cast<uint64_t>(base_seed) << 32) + (run_index + 1) * 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= (z >> 31);
+  return z ^ (z >> 32);
+}
+
+DropSimulation::Result DropSimulation::run(
+    uint32_t base_seed,
+    uint64_t num_runs,
+    size_t num_threads,
+    function<void(uint64_t runs_done)> progress_fn) const {
+  // Runs are done in blocks; within each block, each thread does chunks of
+  // runs. Each thread accumulates into its own Result, and these are merged
+  // after all runs are done.
+  static constexpr uint64_t CHUNK_SIZE = 0x100;
+  static constexpr uint64_t BLOCK_SIZE = 0x10000;
+
+  if (num_threads == 0) {
+    num_threads = thread::hardware_concurrency();
+  }
+  num_threads = max<size_t>(num_threads, 1);
+
+  vector<unique_ptr<ItemCreator>> item_creators;
+  vector<Result> thread_results(num_threads);
+  while (item_creators.size() < num_threads) {
+    item_creators.emplace_back(this->create_item_creator());
+  }
+
+  uint64_t start_usecs = phosg::now();
+  for (uint64_t block_start = 0; block_start < num_runs; block_start += BLOCK_SIZE) {
+    uint64_t block_end = min<uint64_t>(block_start + BLOCK_SIZE, num_runs);
+    uint64_t num_chunks = (block_end - block_start + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+    phosg::parallel_range<uint64_t>([&](uint64_t chunk_index, size_t thread_num) -> bool {
+      auto& ic = *item_creators.at(thread_num);
+      auto& result = thread_results.at(thread_num);
+      uint64_t chunk_start = block_start + chunk_index * CHUNK_SIZE;
+      uint64_t chunk_end = min<uint64_t>(chunk_start + CHUNK_SIZE, block_end);
+      for (uint64_t run_index = chunk_start; run_index < chunk_end; run_index++) {
+        ic.set_random_crypt(make_shared<PSOV2Encryption>(seed_for_run(base_seed, run_index)));
+        for (const auto& src : this->sources) {
+          ItemCreator::DropResult res;
+          if (!src.is_box()) {
+            res = ic.on_monster_item_drop(src.rt_index, src.area);
+            result.num_enemy_checks++;
+          } else if (src.is_specialized_box) {
+            res = ic.on_specialized_box_item_drop(src.area, src.param3, src.param4, src.param5, src.param6);
+            result.num_box_checks++;
+          } else {
+            res = ic.on_box_item_drop(src.area);
+            result.num_box_checks++;
+          }
+          if (res.item.empty()) {
+            continue;
+          }
+          auto& stats = result.items[res.item.primary_identifier()];
+          if (src.is_box()) {
+            stats.box_count++;
+            result.num_box_drops++;
+          } else {
+            stats.enemy_count++;
+            result.num_enemy_drops++;
+          }
+          if (res.is_from_rare_table) {
+            stats.rare_count++;
+          }
+        }
+        result.num_runs++;
+      }
+      return false;
+    },
+        0, num_chunks, num_threads, nullptr);
+
+    if (progress_fn) {
+      progress_fn(block_end);
+    }
+  }
+
+  Result ret;
+  for (const auto& result : thread_results) {
+    ret.merge(result);
+  }
+  ret.elapsed_usecs = phosg::now() - start_usecs;
+  return ret;
+}
+
+pair<double, double> DropSimulation::wilson_interval(uint64_t successes, uint64_t trials, double z) {
+  if (trials == 0) {
+    return make_pair(0.0, 1.0);
+  }
+  double n = trials;
+  double p = static_cast<double>(successes) / n;
+  double z2 = z * z;
+  double denom = 1.0 + z2 / n;
+  double center = (p + z2 / (2.0 * n)) / denom;
+  double half_width = (z / denom) * sqrt(p * (1.0 - p) / n + z2 / (4.0 * n * n));
+  return make_pair(max<double>(0.0, center - half_width), min<double>(1.0, center + half_width));
+}
+
+double DropSimulation::two_proportion_z(uint64_t successes1, uint64_t trials1, uint64_t successes2, uint64_t trials2) {
+  if ((trials1 == 0) || (trials2 == 0)) {
+    return 0.0;
+  }
+  double p1 = static_cast<double>(successes1) / trials1;
+  double p2 = static_cast<double>(successes2) / trials2;
+  double pooled = static_cast<double>(successes1 + successes2) / (trials1 + trials2);
+  double se = sqrt(pooled * (1.0 - pooled) * (1.0 / trials1 + 1.0 / trials2));
+  return (se == 0.0) ? 0.0 : ((p2 - p1) / se);
+}
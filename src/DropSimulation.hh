@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "ItemCreator.hh"
+#include "Map.hh"
+
+// DropSimulation runs simulated map clears through ItemCreator, for the
+// simulate-drops action. Each run checks for a drop from every enemy and box
+// in the map once, using its own random stream (see seed_for_run), so the
+// results depend only on the base seed and the number of runs, not on the
+// number of threads used.
+class DropSimulation {
+public:
+  struct DropSource {
+    uint8_t area;
+    uint8_t rt_index; // 0xFF for boxes
+    bool is_specialized_box;
+    float param3;
+    uint32_t param4;
+    uint32_t param5;
+    uint32_t param6;
+
+    inline bool is_box() const {
+      return this->rt_index == 0xFF;
+    }
+  };
+
+  // Returns one source for each enemy and item box in the map. Enemies and
+  // boxes on floors that have no area in the given episode are skipped.
+  static std::vector<DropSource> sources_for_map(const Map& map, const SetDataTableBase& sdt, Episode episode);
+
+  struct Config {
+    std::shared_ptr<const CommonItemSet> common_item_set;
+    std::shared_ptr<const RareItemSet> rare_item_set;
+    std::shared_ptr<const ArmorRandomSet> armor_random_set;
+    std::shared_ptr<const ToolRandomSet> tool_random_set;
+    std::shared_ptr<const WeaponRandomSet> weapon_random_set;
+    std::shared_ptr<const TekkerAdjustmentSet> tekker_adjustment_set;
+    std::shared_ptr<const ItemParameterTable> item_parameter_table;
+    std::shared_ptr<const ItemData::StackLimits> stack_limits;
+    Episode episode;
+    GameMode mode;
+    uint8_t difficulty;
+    uint8_t section_id;
+  };
+
+  struct ItemStats {
+    uint64_t enemy_count = 0;
+    uint64_t box_count = 0;
+    uint64_t rare_count = 0; // Number of the above that came from the rare table
+  };
+
+  struct Result {
+    uint64_t num_runs = 0;
+    uint64_t num_enemy_checks = 0;
+    uint64_t num_box_checks = 0;
+    uint64_t num_enemy_drops = 0;
+    uint64_t num_box_drops = 0;
+    uint64_t elapsed_usecs = 0;
+    // Keyed by primary identifier (see ItemData::primary_identifier)
+    std::map<uint32_t, ItemStats> items;
+
+    void merge(const Result& other);
+    double checks_per_second() const;
+  };
+
+  DropSimulation(const Config& config, std::vector<DropSource> sources);
+  DropSimulation(const DropSimulation&) = delete;
+  DropSimulation(DropSimulation&&) = delete;
+  DropSimulation& operator=(const DropSimulation&) = delete;
+  DropSimulation& operator=(DropSimulation&&) = delete;
+  ~DropSimulation() = default;
+
+  inline const std::vector<DropSource>& get_sources() const {
+    return this->sources;
+  }
+
+  // Returns the seed for the given run's random stream. PSOV2Encryption's
+  // output is an affine function of its seed (see PSOV2KeystreamModel), so
+  // runs with consecutive seeds would have strongly correlated low bits;
+  // instead, each seed is a hash of the base seed and run index.
+  static uint32_t seed_for_run(uint32_t base_seed, uint64_t run_index);
+
+  // Runs num_runs map clears. If num_threads is 0, one thread per CPU core is
+  // used. progress_fn, if given, is called on the calling thread after each
+  // block of runs is done.
+  Result run(
+      uint32_t base_seed,
+      uint64_t num_runs,
+      size_t num_threads,
+      std::function<void(uint64_t runs_done)> progress_fn = nullptr) const;
+
+  // Returns the Wilson score interval for the given number of successes in
+  // the given number of trials. z = 1.96 gives a 95% confidence interval.
+  static std::pair<double, double> wilson_interval(uint64_t successes, uint64_t trials, double z = 1.96);
+  // Returns the z statistic for the difference between two proportions, using
+  // the pooled standard error. Returns 0 if both proportions are 0 or 1.
+  static double two_proportion_z(uint64_t successes1, uint64_t trials1, uint64_t successes2, uint64_t trials2);
+
+private:
+  Config config;
+  std::vector<DropSource> sources;
+
+  std::unique_ptr<ItemCreator> create_item_creator() const;
+};
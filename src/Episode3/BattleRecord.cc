@@ -4,6 +4,7 @@
 
 #include "../CommandFormats.hh"
 #include "../SendCommands.hh"
+#include "../Watchdog.hh"
 
 using namespace std;
 
@@ -400,6 +401,7 @@ void BattleRecordPlayer::start() {
 }
 
 void BattleRecordPlayer::dispatch_schedule_events(evutil_socket_t, short, void* ctx) {
+  WatchdogScope watchdog_scope(EventLoopWatchdog::CallbackType::TIMER, "BattleRecordPlayer::dispatch_schedule_events");
   reinterpret_cast<BattleRecordPlayer*>(ctx)->schedule_events();
 }
 
@@ -2304,7 +2304,8 @@ CardIndex::CardIndex(
     const string& text_filename,
     const string& decompressed_text_filename,
     const string& dice_text_filename,
-    const string& decompressed_dice_text_filename) {
+    const string& decompressed_dice_text_filename,
+    shared_ptr<CompressedArtifactCache> artifact_cache) {
   unordered_map<uint32_t, vector<string>> card_tags;
   unordered_map<uint32_t, string> card_text;
   try {
@@ -2497,7 +2498,8 @@ CardIndex::CardIndex(
 
     if (this->compressed_card_definitions.empty()) {
       uint64_t start = phosg::now();
-      this->compressed_card_definitions = prs_compress(decompressed_data);
+      this->compressed_card_definitions = compress_with_artifact_cache(
+          artifact_cache, decompressed_data, CompressedArtifactCache::Algorithm::PRS);
       uint64_t diff = phosg::now() - start;
       static_game_data_log.info(
           "Compressed card definitions (%zu bytes -> %zu bytes) in %" PRIu64 "us",
@@ -2515,7 +2517,8 @@ CardIndex::CardIndex(
         defs[x].jp_short_name.clear();
       }
       uint64_t start = phosg::now();
-      this->compressed_card_definitions = prs_compress_optimal(decompressed_data.data(), decompressed_data.size());
+      this->compressed_card_definitions = compress_with_artifact_cache(
+          artifact_cache, decompressed_data, CompressedArtifactCache::Algorithm::PRS_OPTIMAL);
       uint64_t diff = phosg::now() - start;
       static_game_data_log.info(
           "Compressed card definitions (0x%zX bytes -> 0x%zX bytes) in %" PRIu64 "us",
@@ -2582,9 +2585,11 @@ string CardIndex::normalize_card_name(const string& name) {
   return ret;
 }
 
-MapIndex::VersionedMap::VersionedMap(shared_ptr<const MapDefinition> map, uint8_t language)
+MapIndex::VersionedMap::VersionedMap(
+    shared_ptr<const MapDefinition> map, uint8_t language, shared_ptr<CompressedArtifactCache> artifact_cache)
     : map(map),
-      language(language) {}
+      language(language),
+      artifact_cache(artifact_cache) {}
 
 MapIndex::VersionedMap::VersionedMap(std::string&& compressed_data, uint8_t language)
     : language(language),
@@ -2609,12 +2614,14 @@ const std::string& MapIndex::VersionedMap::compressed(bool is_nte) const {
   if (is_nte) {
     if (this->compressed_trial_data.empty()) {
       auto md = this->trial();
-      this->compressed_trial_data = prs_compress(md.get(), sizeof(*md));
+      this->compressed_trial_data = compress_with_artifact_cache(
+          this->artifact_cache, md.get(), sizeof(*md), CompressedArtifactCache::Algorithm::PRS);
     }
     return this->compressed_trial_data;
   } else {
     if (this->compressed_data.empty()) {
-      this->compressed_data = prs_compress(this->map.get(), sizeof(*this->map));
+      this->compressed_data = compress_with_artifact_cache(
+          this->artifact_cache, this->map.get(), sizeof(*this->map), CompressedArtifactCache::Algorithm::PRS);
     }
     return this->compressed_data;
   }
@@ -2662,7 +2669,7 @@ shared_ptr<const MapIndex::VersionedMap> MapIndex::Map::version(uint8_t language
   throw logic_error("no map versions exist");
 }
 
-MapIndex::MapIndex(const string& directory) {
+MapIndex::MapIndex(const string& directory, shared_ptr<CompressedArtifactCache> artifact_cache) {
   for (const auto& filename : phosg::list_directory_sorted(directory)) {
     try {
       string base_filename;
@@ -2706,7 +2713,7 @@ MapIndex::MapIndex(const string& directory) {
 
       shared_ptr<VersionedMap> vm;
       if (decompressed_data) {
-        vm = make_shared<VersionedMap>(decompressed_data, language);
+        vm = make_shared<VersionedMap>(decompressed_data, language, artifact_cache);
       } else if (!compressed_data.empty()) {
         vm = make_shared<VersionedMap>(std::move(compressed_data), language);
       } else {
@@ -13,6 +13,7 @@
 #include <string>
 #include <unordered_map>
 
+#include "../CompressedArtifactCache.hh"
 #include "../PlayerSubordinates.hh"
 #include "../Text.hh"
 #include "../TextIndex.hh"
@@ -1548,7 +1549,8 @@ public:
       const std::string& text_filename = "",
       const std::string& decompressed_text_filename = "",
       const std::string& dice_text_filename = "",
-      const std::string& decompressed_dice_text_filename = "");
+      const std::string& decompressed_dice_text_filename = "",
+      std::shared_ptr<CompressedArtifactCache> artifact_cache = nullptr);
 
   struct CardEntry {
     CardDefinition def;
@@ -1578,14 +1580,17 @@ private:
 
 class MapIndex {
 public:
-  MapIndex(const std::string& directory);
+  MapIndex(const std::string& directory, std::shared_ptr<CompressedArtifactCache> artifact_cache = nullptr);
 
   class VersionedMap {
   public:
     std::shared_ptr<const MapDefinition> map;
     uint8_t language;
 
-    VersionedMap(std::shared_ptr<const MapDefinition> map, uint8_t language);
+    VersionedMap(
+        std::shared_ptr<const MapDefinition> map,
+        uint8_t language,
+        std::shared_ptr<CompressedArtifactCache> artifact_cache = nullptr);
     VersionedMap(std::string&& compressed_data, uint8_t language);
 
     std::shared_ptr<const MapDefinitionTrial> trial() const;
@@ -1595,6 +1600,7 @@ public:
     mutable std::shared_ptr<const MapDefinitionTrial> trial_map;
     mutable std::string compressed_data;
     mutable std::string compressed_trial_data;
+    std::shared_ptr<CompressedArtifactCache> artifact_cache;
   };
 
   class Map {
@@ -7,7 +7,10 @@
 #include <memory>
 #include <stdexcept>
 
+#include "Watchdog.hh"
+
 static void dispatch_forward_to_event_thread(evutil_socket_t, short, void* ctx) {
+  WatchdogScope watchdog_scope(EventLoopWatchdog::CallbackType::FORWARDED, "forward_to_event_thread");
   auto* fn = reinterpret_cast<std::function<void()>*>(ctx);
   (*fn)();
   delete fn;
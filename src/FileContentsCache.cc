@@ -5,6 +5,8 @@
 #include <phosg/Filesystem.hh>
 #include <phosg/Time.hh>
 
+#include "Metrics.hh"
+
 using namespace std;
 
 FileContentsCache::FileContentsCache(uint64_t ttl_usecs) : ttl_usecs(ttl_usecs) {}
@@ -63,10 +65,12 @@ FileContentsCache::GetResult FileContentsCache::get(const std::string& name,
   try {
     auto& entry = this->name_to_file.at(name);
     if (this->ttl_usecs && (t - entry->load_time < this->ttl_usecs)) {
+      global_metrics.file_cache_hits.add();
       return {entry, false};
     }
   } catch (const out_of_range& e) {
   }
+  global_metrics.file_cache_misses.add();
   return {this->replace(name, generate(name)), true};
 }
 
@@ -79,12 +83,17 @@ shared_ptr<const string> ThreadSafeFileCache::get(
     const string& name, std::function<shared_ptr<const string>(const std::string&)> generate) {
   try {
     shared_lock g(this->lock);
-    return this->name_to_file.at(name);
+    auto& ret = this->name_to_file.at(name);
+    global_metrics.file_cache_hits.add();
+    return ret;
   } catch (const out_of_range&) {
     unique_lock g(this->lock);
     auto it = this->name_to_file.find(name);
     if (it == this->name_to_file.end()) {
+      global_metrics.file_cache_misses.add();
       it = this->name_to_file.emplace(name, generate(name)).first;
+    } else {
+      global_metrics.file_cache_hits.add();
     }
     return it->second;
   }
@@ -9,6 +9,8 @@
 
 #include <phosg/Time.hh>
 
+#include "Metrics.hh"
+
 class FileContentsCache {
 public:
   struct File {
@@ -85,10 +87,12 @@ public:
         throw std::runtime_error("cached string size is incorrect");
       }
       if (this->ttl_usecs && (t - f->load_time < this->ttl_usecs)) {
+        global_metrics.file_cache_hits.add();
         return {*reinterpret_cast<const T*>(f->data->data()), f, false};
       }
     } catch (const std::out_of_range& e) {
     }
+    global_metrics.file_cache_misses.add();
     T value = generate(name);
     auto ret = this->replace_obj(name, value);
     ret.generate_called = true;
@@ -10,10 +10,13 @@
 #include <string>
 #include <vector>
 
+#include "AsyncFileWriter.hh"
 #include "EventUtils.hh"
 #include "Loggers.hh"
+#include "Metrics.hh"
 #include "ProxyServer.hh"
 #include "Server.hh"
+#include "Watchdog.hh"
 
 using namespace std;
 
@@ -105,6 +108,18 @@ void HTTPServer::send_response(struct evhttp_request* req, int code, const char*
   HTTPServer::send_response(req, code, content_type, out_buffer.get());
 }
 
+void HTTPServer::send_response(struct evhttp_request* req, int code, const char* content_type, shared_ptr<const string> data) {
+  // The buffer references the string's data directly instead of copying it;
+  // the holder keeps the string alive until libevent is done sending it
+  unique_ptr<struct evbuffer, void (*)(struct evbuffer*)> out_buffer(evbuffer_new(), evbuffer_free);
+  auto* holder = new shared_ptr<const string>(std::move(data));
+  auto cleanup = +[](const void*, size_t, void* h) -> void {
+    delete reinterpret_cast<shared_ptr<const string>*>(h);
+  };
+  evbuffer_add_reference(out_buffer.get(), (*holder)->data(), (*holder)->size(), cleanup, holder);
+  HTTPServer::send_response(req, code, content_type, out_buffer.get());
+}
+
 unordered_multimap<string, string> HTTPServer::parse_url_params(const string& query) {
   unordered_multimap<string, string> params;
   if (query.empty()) {
@@ -493,91 +508,160 @@ phosg::JSON HTTPServer::generate_client_config_json_st(const Client::Config& con
   return ret;
 }
 
-phosg::JSON HTTPServer::generate_account_json_st(shared_ptr<const Account> a) {
-  auto dc_nte_licenses_json = phosg::JSON::list();
-  for (const auto& it : a->dc_nte_licenses) {
-    dc_nte_licenses_json.emplace_back(it.first);
-  }
-  auto dc_licenses_json = phosg::JSON::list();
-  for (const auto& it : a->dc_licenses) {
-    dc_licenses_json.emplace_back(it.first);
+HTTPServer::AccountSnapshot HTTPServer::snapshot_account_st(const Account& a) {
+  AccountSnapshot ret{
+      .account_id = a.account_id,
+      .flags = a.flags,
+      .ban_end_time = a.ban_end_time,
+      .ep3_current_meseta = a.ep3_current_meseta,
+      .ep3_total_meseta_earned = a.ep3_total_meseta_earned,
+      .bb_team_id = a.bb_team_id,
+      .last_player_name = a.last_player_name,
+      .auto_reply_message = a.auto_reply_message,
+      .is_temporary = a.is_temporary,
+      .dc_nte_licenses = {},
+      .dc_licenses = {},
+      .pc_licenses = {},
+      .gc_licenses = {},
+      .xb_licenses = {},
+      .bb_licenses = {},
+      .auto_patches_enabled = vector<string>(a.auto_patches_enabled.begin(), a.auto_patches_enabled.end()),
+  };
+  for (const auto& it : a.dc_nte_licenses) {
+    ret.dc_nte_licenses.emplace_back(it.first);
   }
-  auto pc_licenses_json = phosg::JSON::list();
-  for (const auto& it : a->pc_licenses) {
-    pc_licenses_json.emplace_back(it.first);
+  for (const auto& it : a.dc_licenses) {
+    ret.dc_licenses.emplace_back(it.first);
   }
-  auto gc_licenses_json = phosg::JSON::list();
-  for (const auto& it : a->gc_licenses) {
-    gc_licenses_json.emplace_back(it.first);
+  for (const auto& it : a.pc_licenses) {
+    ret.pc_licenses.emplace_back(it.first);
   }
-  auto xb_licenses_json = phosg::JSON::list();
-  for (const auto& it : a->xb_licenses) {
-    xb_licenses_json.emplace_back(it.first);
+  for (const auto& it : a.gc_licenses) {
+    ret.gc_licenses.emplace_back(it.first);
   }
-  auto bb_licenses_json = phosg::JSON::list();
-  for (const auto& it : a->bb_licenses) {
-    bb_licenses_json.emplace_back(it.first);
+  for (const auto& it : a.xb_licenses) {
+    ret.xb_licenses.emplace_back(it.first);
   }
-  auto auto_patches_json = phosg::JSON::list();
-  for (const auto& it : a->auto_patches_enabled) {
-    auto_patches_json.emplace_back(it);
+  for (const auto& it : a.bb_licenses) {
+    ret.bb_licenses.emplace_back(it.first);
   }
+  return ret;
+}
+
+phosg::JSON HTTPServer::generate_account_json(const AccountSnapshot& a) {
+  auto json_for_list = []<typename T>(const vector<T>& values) -> phosg::JSON {
+    auto ret = phosg::JSON::list();
+    for (const auto& v : values) {
+      ret.emplace_back(v);
+    }
+    return ret;
+  };
   return phosg::JSON::dict({
-      {"AccountID", a->account_id},
-      {"Flags", a->flags},
-      {"BanEndTime", a->ban_end_time ? a->ban_end_time : phosg::JSON(nullptr)},
-      {"Ep3CurrentMeseta", a->ep3_current_meseta},
-      {"Ep3TotalMesetaEarned", a->ep3_total_meseta_earned},
-      {"BBTeamID", a->bb_team_id},
-      {"LastPlayerName", a->last_player_name},
-      {"AutoReplyMessage", a->auto_reply_message},
-      {"IsTemporary", a->is_temporary},
-      {"DCNTELicenses", std::move(dc_nte_licenses_json)},
-      {"DCLicenses", std::move(dc_licenses_json)},
-      {"PCLicenses", std::move(pc_licenses_json)},
-      {"GCLicenses", std::move(gc_licenses_json)},
-      {"XBLicenses", std::move(xb_licenses_json)},
-      {"BBLicenses", std::move(bb_licenses_json)},
-      {"AutoPatchesEnabled", std::move(auto_patches_json)},
+      {"AccountID", a.account_id},
+      {"Flags", a.flags},
+      {"BanEndTime", a.ban_end_time ? a.ban_end_time : phosg::JSON(nullptr)},
+      {"Ep3CurrentMeseta", a.ep3_current_meseta},
+      {"Ep3TotalMesetaEarned", a.ep3_total_meseta_earned},
+      {"BBTeamID", a.bb_team_id},
+      {"LastPlayerName", a.last_player_name},
+      {"AutoReplyMessage", a.auto_reply_message},
+      {"IsTemporary", a.is_temporary},
+      {"DCNTELicenses", json_for_list(a.dc_nte_licenses)},
+      {"DCLicenses", json_for_list(a.dc_licenses)},
+      {"PCLicenses", json_for_list(a.pc_licenses)},
+      {"GCLicenses", json_for_list(a.gc_licenses)},
+      {"XBLicenses", json_for_list(a.xb_licenses)},
+      {"BBLicenses", json_for_list(a.bb_licenses)},
+      {"AutoPatchesEnabled", json_for_list(a.auto_patches_enabled)},
   });
 };
 
-phosg::JSON HTTPServer::generate_game_client_json_st(shared_ptr<const Client> c, shared_ptr<const ItemNameIndex> item_name_index) {
+HTTPServer::GameClientSnapshot HTTPServer::snapshot_game_client_st(shared_ptr<const Client> c, shared_ptr<const ItemNameIndex> item_name_index) {
+  auto l = c->lobby.lock();
+  GameClientSnapshot ret{
+      .id = c->id,
+      .remote_addr = c->channel.remote_addr,
+      .version = c->version(),
+      .sub_version = c->sub_version,
+      .config = c->config,
+      .language = c->language(),
+      .x = c->x,
+      .z = c->z,
+      .floor = c->floor,
+      .can_chat = c->can_chat,
+      .account = nullopt,
+      .in_lobby = (l != nullptr),
+      .lobby_id = l ? l->lobby_id : 0,
+      .lobby_client_id = c->lobby_client_id,
+      .bb_character_index = c->bb_character_index,
+      .character = nullopt,
+      .item_name_index = item_name_index,
+  };
+  if (c->login) {
+    ret.account = snapshot_account_st(*c->login->account);
+  }
+  auto p = c->character(false, false);
+  if (p) {
+    auto& ch = ret.character.emplace(CharacterSnapshot{
+        .inventory = p->inventory,
+        .disp = p->disp,
+        .play_time_seconds = p->play_time_seconds,
+        .auto_reply = p->auto_reply,
+        .info_board = p->info_board,
+        .battle_records = p->battle_records,
+        .challenge_records = p->challenge_records,
+        .material_usage = {},
+        .technique_levels = {},
+    });
+    for (int8_t z = -2; z < 5; z++) {
+      ch.material_usage[z + 2] = p->get_material_usage(static_cast<PSOBBCharacterFile::MaterialType>(z));
+    }
+    for (size_t z = 0; z < ch.technique_levels.size(); z++) {
+      ch.technique_levels[z] = p->get_technique_level(z);
+    }
+  }
+  return ret;
+}
+
+phosg::JSON HTTPServer::generate_game_client_json(const GameClientSnapshot& c) {
   auto ret = phosg::JSON::dict({
-      {"ID", c->id},
-      {"RemoteAddress", phosg::render_sockaddr_storage(c->channel.remote_addr)},
-      {"Version", phosg::name_for_enum(c->version())},
-      {"SubVersion", c->sub_version},
-      {"Config", HTTPServer::generate_client_config_json_st(c->config)},
-      {"Language", name_for_language_code(c->language())},
-      {"LocationX", c->x},
-      {"LocationZ", c->z},
-      {"LocationFloor", c->floor},
-      {"CanChat", c->can_chat},
+      {"ID", c.id},
+      {"RemoteAddress", phosg::render_sockaddr_storage(c.remote_addr)},
+      {"Version", phosg::name_for_enum(c.version)},
+      {"SubVersion", c.sub_version},
+      {"Config", HTTPServer::generate_client_config_json_st(c.config)},
+      {"Language", name_for_language_code(c.language)},
+      {"LocationX", c.x},
+      {"LocationZ", c.z},
+      {"LocationFloor", c.floor},
+      {"CanChat", c.can_chat},
   });
-  ret.emplace("Account", c->login ? HTTPServer::generate_account_json_st(c->login->account) : phosg::JSON(nullptr));
-  auto l = c->lobby.lock();
-  if (l) {
-    ret.emplace("LobbyID", l->lobby_id);
-    ret.emplace("LobbyClientID", c->lobby_client_id);
+  ret.emplace("Account", c.account ? HTTPServer::generate_account_json(*c.account) : phosg::JSON(nullptr));
+  if (c.in_lobby) {
+    ret.emplace("LobbyID", c.lobby_id);
+    ret.emplace("LobbyClientID", c.lobby_client_id);
   }
-  if (c->version() == Version::BB_V4) {
-    ret.emplace("BBCharacterIndex", c->bb_character_index);
+  if (c.version == Version::BB_V4) {
+    ret.emplace("BBCharacterIndex", c.bb_character_index);
   }
-  auto p = c->character(false, false);
+  const auto& p = c.character;
+  const auto& item_name_index = c.item_name_index;
+  auto material_usage = [&](PSOBBCharacterFile::MaterialType which) -> uint8_t {
+    return p->material_usage[static_cast<int8_t>(which) + 2];
+  };
   if (p) {
-    if (!is_ep3(c->version())) {
+    if (!is_ep3(c.version)) {
       ret.emplace("InventoryItems", p->inventory.num_items);
-      if (c->version() != Version::DC_NTE) {
+      if (c.version != Version::DC_NTE) {
         ret.emplace("InventoryLanguage", p->inventory.language);
-        ret.emplace("NumHPMaterialsUsed", p->get_material_usage(PSOBBCharacterFile::MaterialType::HP));
-        ret.emplace("NumTPMaterialsUsed", p->get_material_usage(PSOBBCharacterFile::MaterialType::TP));
-        if (!is_v1_or_v2(c->version())) {
-          ret.emplace("NumPowerMaterialsUsed", p->get_material_usage(PSOBBCharacterFile::MaterialType::POWER));
-          ret.emplace("NumDefMaterialsUsed", p->get_material_usage(PSOBBCharacterFile::MaterialType::DEF));
-          ret.emplace("NumMindMaterialsUsed", p->get_material_usage(PSOBBCharacterFile::MaterialType::MIND));
-          ret.emplace("NumEvadeMaterialsUsed", p->get_material_usage(PSOBBCharacterFile::MaterialType::EVADE));
-          ret.emplace("NumLuckMaterialsUsed", p->get_material_usage(PSOBBCharacterFile::MaterialType::LUCK));
+        ret.emplace("NumHPMaterialsUsed", material_usage(PSOBBCharacterFile::MaterialType::HP));
+        ret.emplace("NumTPMaterialsUsed", material_usage(PSOBBCharacterFile::MaterialType::TP));
+        if (!is_v1_or_v2(c.version)) {
+          ret.emplace("NumPowerMaterialsUsed", material_usage(PSOBBCharacterFile::MaterialType::POWER));
+          ret.emplace("NumDefMaterialsUsed", material_usage(PSOBBCharacterFile::MaterialType::DEF));
+          ret.emplace("NumMindMaterialsUsed", material_usage(PSOBBCharacterFile::MaterialType::MIND));
+          ret.emplace("NumEvadeMaterialsUsed", material_usage(PSOBBCharacterFile::MaterialType::EVADE));
+          ret.emplace("NumLuckMaterialsUsed", material_usage(PSOBBCharacterFile::MaterialType::LUCK));
         }
       }
       phosg::JSON items_json = phosg::JSON::list();
@@ -604,7 +688,7 @@ phosg::JSON HTTPServer::generate_game_client_json_st(shared_ptr<const Client> c,
       ret.emplace("Meseta", p->disp.stats.meseta.load());
       auto tech_levels_json = phosg::JSON::dict();
       for (size_t z = 0; z < 0x13; z++) {
-        auto level = p->get_technique_level(z);
+        auto level = p->technique_levels[z];
         tech_levels_json.emplace(name_for_technique(z), (level != 0xFF) ? level : phosg::JSON(nullptr));
       }
       ret.emplace("TechniqueLevels", std::move(tech_levels_json));
@@ -626,11 +710,11 @@ phosg::JSON HTTPServer::generate_game_client_json_st(shared_ptr<const Client> c,
     ret.emplace("ProportionX", p->disp.visual.proportion_x.load());
     ret.emplace("ProportionY", p->disp.visual.proportion_y.load());
 
-    ret.emplace("Name", p->disp.name.decode(c->language()));
+    ret.emplace("Name", p->disp.name.decode(c.language));
     ret.emplace("PlayTimeSeconds", p->play_time_seconds.load());
 
-    ret.emplace("AutoReply", p->auto_reply.decode(c->language()));
-    ret.emplace("InfoBoard", p->info_board.decode(c->language()));
+    ret.emplace("AutoReply", p->auto_reply.decode(c.language));
+    ret.emplace("InfoBoard", p->info_board.decode(c.language));
     auto battle_place_counts = phosg::JSON::list({
         p->battle_records.place_counts[0].load(),
         p->battle_records.place_counts[1].load(),
@@ -640,7 +724,7 @@ phosg::JSON HTTPServer::generate_game_client_json_st(shared_ptr<const Client> c,
     ret.emplace("BattlePlaceCounts", std::move(battle_place_counts));
     ret.emplace("BattleDisconnectCount", p->battle_records.disconnect_count.load());
 
-    if (!is_ep3(c->version())) {
+    if (!is_ep3(c.version)) {
       auto json_for_challenge_times = []<size_t Count>(const parray<ChallengeTime, Count>& times) -> phosg::JSON {
         auto times_json = phosg::JSON::list();
         for (size_t z = 0; z < times.size(); z++) {
@@ -759,55 +843,167 @@ phosg::JSON HTTPServer::generate_proxy_client_json_st(shared_ptr<const ProxyServ
       ret.emplace("DropMode", "proxy");
       break;
   }
-  ret.emplace("Account", ses->login ? HTTPServer::generate_account_json_st(ses->login->account) : phosg::JSON(nullptr));
+  ret.emplace("Account", ses->login ? HTTPServer::generate_account_json(HTTPServer::snapshot_account_st(*ses->login->account)) : phosg::JSON(nullptr));
   return ret;
 }
 
-phosg::JSON HTTPServer::generate_lobby_json_st(shared_ptr<const Lobby> l, shared_ptr<const ItemNameIndex> item_name_index) {
-  std::array<std::shared_ptr<Client>, 12> clients;
+HTTPServer::LobbySnapshot HTTPServer::snapshot_lobby_st(shared_ptr<const Lobby> l, shared_ptr<const ItemNameIndex> item_name_index) {
+  LobbySnapshot ret{
+      .lobby_id = l->lobby_id,
+      .allowed_versions = l->allowed_versions,
+      .event = l->event,
+      .block = l->block,
+      .leader_id = l->leader_id,
+      .max_clients = l->max_clients,
+      .idle_timeout_usecs = l->idle_timeout_usecs,
+      .enabled_flags = l->enabled_flags,
+      .client_ids = {},
+      .min_level = l->min_level,
+      .max_level = l->max_level,
+      .base_version = l->base_version,
+      .episode = l->episode,
+      .mode = l->mode,
+      .difficulty = l->difficulty,
+      .effective_section_id = l->effective_section_id(),
+      .has_password = !l->password.empty(),
+      .name = l->name,
+      .random_seed = l->random_seed,
+      .variations = l->variations,
+      .base_exp_multiplier = l->base_exp_multiplier,
+      .exp_share_multiplier = l->exp_share_multiplier,
+      .challenge_exp_multiplier = l->challenge_exp_multiplier,
+      .allowed_drop_modes = l->allowed_drop_modes,
+      .drop_mode = l->drop_mode,
+      .challenge_params = nullopt,
+      .floor_items = {},
+      .quest = l->quest,
+      .ep3_battle_state = nullopt,
+      .watched_lobby_id = nullopt,
+      .watcher_lobby_ids = {},
+      .is_replay_lobby = !!l->battle_player,
+      .item_name_index = item_name_index,
+  };
+  for (size_t z = 0; z < l->max_clients; z++) {
+    ret.client_ids[z] = l->clients[z] ? l->clients[z]->id : 0;
+  }
+  if (l->challenge_params) {
+    ret.challenge_params = *l->challenge_params;
+  }
+  for (size_t floor = 0; floor < l->floor_item_managers.size(); floor++) {
+    for (const auto* item : l->floor_item_managers[floor].items()) {
+      ret.floor_items.emplace_back(LobbySnapshot::FloorItem{
+          .floor = floor,
+          .x = item->x,
+          .z = item->z,
+          .drop_number = item->drop_number,
+          .flags = item->flags,
+          .data = item->data,
+      });
+    }
+  }
+
+  auto ep3s = l->ep3_server;
+  if (ep3s) {
+    auto& bs = ret.ep3_battle_state.emplace(LobbySnapshot::Ep3BattleState{
+        .card_index = ep3s->options.card_index,
+        .players = {},
+        .behavior_flags = ep3s->options.behavior_flags,
+        .has_random_crypt = (ep3s->options.opt_rand_crypt != nullptr),
+        .random_seed = ep3s->options.opt_rand_crypt ? ep3s->options.opt_rand_crypt->seed() : 0,
+        .random_offset = ep3s->options.opt_rand_crypt ? ep3s->options.opt_rand_crypt->absolute_offset() : 0,
+        // Tournaments are modified in place, so this can't be deferred to the
+        // HTTP thread like the rest of the lobby's JSON
+        .tournament_json = ep3s->options.tournament ? ep3s->options.tournament->json() : nullptr,
+        .map_number = nullopt,
+        .environment_number = nullopt,
+        .rules = nullopt,
+        .battle_finished = ep3s->battle_finished,
+        .battle_in_progress = ep3s->battle_in_progress,
+        .round_num = ep3s->round_num,
+        .first_team_turn = ep3s->first_team_turn,
+        .current_team_turn1 = ep3s->current_team_turn1,
+        .battle_phase = ep3s->battle_phase,
+        .setup_phase = ep3s->setup_phase,
+        .registration_phase = ep3s->registration_phase,
+        .action_subphase = ep3s->action_subphase,
+        .battle_start_usecs = ep3s->battle_start_usecs,
+        .team_exp = {ep3s->team_exp[0], ep3s->team_exp[1]},
+        .team_dice_bonus = {ep3s->team_dice_bonus[0], ep3s->team_dice_bonus[1]},
+    });
+    for (size_t z = 0; z < 4; z++) {
+      if (ep3s->name_entries[z].present) {
+        auto lc = l->clients[z];
+        auto& player = bs.players[z].emplace(LobbySnapshot::Ep3Player{
+            .name_entry = ep3s->name_entries[z],
+            .deck_entry = nullopt,
+            .language = static_cast<uint8_t>(lc ? lc->language() : 1),
+        });
+        if (ep3s->deck_entries[z]) {
+          player.deck_entry = *ep3s->deck_entries[z];
+        }
+      }
+    }
+    if (ep3s->last_chosen_map) {
+      bs.map_number = ep3s->last_chosen_map->map_number;
+    }
+    if (ep3s->map_and_rules) {
+      bs.environment_number = ep3s->map_and_rules->environment_number;
+      bs.rules = ep3s->map_and_rules->rules;
+    }
+  }
+  auto watched_lobby = l->watched_lobby.lock();
+  if (watched_lobby) {
+    ret.watched_lobby_id = watched_lobby->lobby_id;
+  }
+  for (const auto& watcher_lobby : l->watcher_lobbies) {
+    ret.watcher_lobby_ids.emplace_back(watcher_lobby->lobby_id);
+  }
+  return ret;
+}
 
+phosg::JSON HTTPServer::generate_lobby_json(const LobbySnapshot& l) {
   auto client_ids_json = phosg::JSON::list();
-  for (size_t z = 0; z < l->max_clients; z++) {
-    client_ids_json.emplace_back(l->clients[z] ? l->clients[z]->id : phosg::JSON(nullptr));
+  for (size_t z = 0; z < l.max_clients; z++) {
+    client_ids_json.emplace_back(l.client_ids[z] ? l.client_ids[z] : phosg::JSON(nullptr));
   }
 
   auto ret = phosg::JSON::dict({
-      {"ID", l->lobby_id},
-      {"AllowedVersions", l->allowed_versions},
-      {"Event", l->event},
-      {"LeaderClientID", l->leader_id},
-      {"MaxClients", l->max_clients},
-      {"IdleTimeoutUsecs", l->idle_timeout_usecs},
+      {"ID", l.lobby_id},
+      {"AllowedVersions", l.allowed_versions},
+      {"Event", l.event},
+      {"LeaderClientID", l.leader_id},
+      {"MaxClients", l.max_clients},
+      {"IdleTimeoutUsecs", l.idle_timeout_usecs},
       {"ClientIDs", std::move(client_ids_json)},
-      {"IsGame", l->is_game()},
-      {"IsPersistent", l->check_flag(Lobby::Flag::PERSISTENT)},
+      {"IsGame", l.check_flag(Lobby::Flag::GAME)},
+      {"IsPersistent", l.check_flag(Lobby::Flag::PERSISTENT)},
   });
 
-  if (l->is_game()) {
-    ret.emplace("CheatsEnabled", l->check_flag(Lobby::Flag::CHEATS_ENABLED));
-    ret.emplace("MinLevel", l->min_level + 1);
-    ret.emplace("MaxLevel", l->max_level + 1);
-    ret.emplace("BaseVersion", l->base_version);
-    ret.emplace("Episode", name_for_episode(l->episode));
-    ret.emplace("HasPassword", !l->password.empty());
-    ret.emplace("Name", l->name);
-    ret.emplace("RandomSeed", l->random_seed);
-    if (l->episode != Episode::EP3) {
-      ret.emplace("QuestSelectionInProgress", l->check_flag(Lobby::Flag::QUEST_SELECTION_IN_PROGRESS));
-      ret.emplace("QuestInProgress", l->check_flag(Lobby::Flag::QUEST_IN_PROGRESS));
-      ret.emplace("JoinableQuestInProgress", l->check_flag(Lobby::Flag::JOINABLE_QUEST_IN_PROGRESS));
+  if (l.check_flag(Lobby::Flag::GAME)) {
+    ret.emplace("CheatsEnabled", l.check_flag(Lobby::Flag::CHEATS_ENABLED));
+    ret.emplace("MinLevel", l.min_level + 1);
+    ret.emplace("MaxLevel", l.max_level + 1);
+    ret.emplace("BaseVersion", l.base_version);
+    ret.emplace("Episode", name_for_episode(l.episode));
+    ret.emplace("HasPassword", l.has_password);
+    ret.emplace("Name", l.name);
+    ret.emplace("RandomSeed", l.random_seed);
+    if (l.episode != Episode::EP3) {
+      ret.emplace("QuestSelectionInProgress", l.check_flag(Lobby::Flag::QUEST_SELECTION_IN_PROGRESS));
+      ret.emplace("QuestInProgress", l.check_flag(Lobby::Flag::QUEST_IN_PROGRESS));
+      ret.emplace("JoinableQuestInProgress", l.check_flag(Lobby::Flag::JOINABLE_QUEST_IN_PROGRESS));
       auto variations_json = phosg::JSON::list();
-      for (size_t z = 0; z < l->variations.size(); z++) {
-        variations_json.emplace_back(l->variations[z].load());
+      for (size_t z = 0; z < l.variations.size(); z++) {
+        variations_json.emplace_back(l.variations[z].load());
       }
       ret.emplace("Variations", std::move(variations_json));
-      ret.emplace("SectionID", name_for_section_id(l->effective_section_id()));
-      ret.emplace("Mode", name_for_mode(l->mode));
-      ret.emplace("Difficulty", name_for_difficulty(l->difficulty));
-      ret.emplace("BaseEXPMultiplier", l->base_exp_multiplier);
-      ret.emplace("EXPShareMultiplier", l->exp_share_multiplier);
-      ret.emplace("AllowedDropModes", l->allowed_drop_modes);
-      switch (l->drop_mode) {
+      ret.emplace("SectionID", name_for_section_id(l.effective_section_id));
+      ret.emplace("Mode", name_for_mode(l.mode));
+      ret.emplace("Difficulty", name_for_difficulty(l.difficulty));
+      ret.emplace("BaseEXPMultiplier", l.base_exp_multiplier);
+      ret.emplace("EXPShareMultiplier", l.exp_share_multiplier);
+      ret.emplace("AllowedDropModes", l.allowed_drop_modes);
+      switch (l.drop_mode) {
         case Lobby::DropMode::DISABLED:
           ret.emplace("DropMode", "none");
           break;
@@ -824,64 +1020,60 @@ phosg::JSON HTTPServer::generate_lobby_json_st(shared_ptr<const Lobby> l, shared
           ret.emplace("DropMode", "duplicate");
           break;
       }
-      if (l->mode == GameMode::CHALLENGE) {
-        ret.emplace("ChallengeEXPMultiplier", l->challenge_exp_multiplier);
-        if (l->challenge_params) {
-          ret.emplace("ChallengeStageNumber", l->challenge_params->stage_number);
-          ret.emplace("ChallengeRankColor", l->challenge_params->rank_color);
-          ret.emplace("ChallengeRankText", l->challenge_params->rank_text);
-          ret.emplace("ChallengeRank0ThresholdBitmask", l->challenge_params->rank_thresholds[0].bitmask);
-          ret.emplace("ChallengeRank0ThresholdSeconds", l->challenge_params->rank_thresholds[0].seconds);
-          ret.emplace("ChallengeRank1ThresholdBitmask", l->challenge_params->rank_thresholds[1].bitmask);
-          ret.emplace("ChallengeRank1ThresholdSeconds", l->challenge_params->rank_thresholds[1].seconds);
-          ret.emplace("ChallengeRank2ThresholdBitmask", l->challenge_params->rank_thresholds[2].bitmask);
-          ret.emplace("ChallengeRank2ThresholdSeconds", l->challenge_params->rank_thresholds[2].seconds);
+      if (l.mode == GameMode::CHALLENGE) {
+        ret.emplace("ChallengeEXPMultiplier", l.challenge_exp_multiplier);
+        if (l.challenge_params) {
+          ret.emplace("ChallengeStageNumber", l.challenge_params->stage_number);
+          ret.emplace("ChallengeRankColor", l.challenge_params->rank_color);
+          ret.emplace("ChallengeRankText", l.challenge_params->rank_text);
+          ret.emplace("ChallengeRank0ThresholdBitmask", l.challenge_params->rank_thresholds[0].bitmask);
+          ret.emplace("ChallengeRank0ThresholdSeconds", l.challenge_params->rank_thresholds[0].seconds);
+          ret.emplace("ChallengeRank1ThresholdBitmask", l.challenge_params->rank_thresholds[1].bitmask);
+          ret.emplace("ChallengeRank1ThresholdSeconds", l.challenge_params->rank_thresholds[1].seconds);
+          ret.emplace("ChallengeRank2ThresholdBitmask", l.challenge_params->rank_thresholds[2].bitmask);
+          ret.emplace("ChallengeRank2ThresholdSeconds", l.challenge_params->rank_thresholds[2].seconds);
         }
       }
 
       auto floor_items_json = phosg::JSON::list();
-      for (size_t floor = 0; floor < l->floor_item_managers.size(); floor++) {
-        for (const auto& it : l->floor_item_managers[floor].items) {
-          const auto& item = it.second;
-          auto item_dict = phosg::JSON::dict({
-              {"LocationFloor", floor},
-              {"LocationX", item->x},
-              {"LocationZ", item->z},
-              {"DropNumber", item->drop_number},
-              {"Flags", item->flags},
-              {"Data", item->data.hex()},
-              {"ItemID", item->data.id.load()},
-          });
-          if (item_name_index) {
-            item_dict.emplace("Description", item_name_index->describe_item(item->data, false));
-          }
-          floor_items_json.emplace_back(std::move(item_dict));
+      for (const auto& item : l.floor_items) {
+        auto item_dict = phosg::JSON::dict({
+            {"LocationFloor", item.floor},
+            {"LocationX", item.x},
+            {"LocationZ", item.z},
+            {"DropNumber", item.drop_number},
+            {"Flags", item.flags},
+            {"Data", item.data.hex()},
+            {"ItemID", item.data.id.load()},
+        });
+        if (l.item_name_index) {
+          item_dict.emplace("Description", l.item_name_index->describe_item(item.data, false));
         }
+        floor_items_json.emplace_back(std::move(item_dict));
       }
       ret.emplace("FloorItems", std::move(floor_items_json));
-      ret.emplace("Quest", HTTPServer::generate_quest_json_st(l->quest));
+      ret.emplace("Quest", HTTPServer::generate_quest_json_st(l.quest));
 
     } else {
-      ret.emplace("BattleInProgress", l->check_flag(Lobby::Flag::BATTLE_IN_PROGRESS));
-      ret.emplace("IsSpectatorTeam", l->check_flag(Lobby::Flag::IS_SPECTATOR_TEAM));
-      ret.emplace("SpectatorsForbidden", l->check_flag(Lobby::Flag::SPECTATORS_FORBIDDEN));
+      ret.emplace("BattleInProgress", l.check_flag(Lobby::Flag::BATTLE_IN_PROGRESS));
+      ret.emplace("IsSpectatorTeam", l.check_flag(Lobby::Flag::IS_SPECTATOR_TEAM));
+      ret.emplace("SpectatorsForbidden", l.check_flag(Lobby::Flag::SPECTATORS_FORBIDDEN));
 
-      auto ep3s = l->ep3_server;
-      if (ep3s) {
+      if (l.ep3_battle_state) {
+        const auto& bs = *l.ep3_battle_state;
         auto players_json = phosg::JSON::list();
         for (size_t z = 0; z < 4; z++) {
-          if (!ep3s->name_entries[z].present) {
+          if (!bs.players[z]) {
             players_json.emplace_back(nullptr);
           } else {
-            auto lc = l->clients[z];
-
-            auto deck_entry = ep3s->deck_entries[z];
+            const auto& player = *bs.players[z];
             phosg::JSON deck_json = nullptr;
-            if (deck_entry) {
+            if (player.deck_entry) {
+              const auto& deck_entry = *player.deck_entry;
               auto cards_json = phosg::JSON::list();
-              for (size_t w = 0; w < deck_entry->card_ids.size(); w++) {
+              for (size_t w = 0; w < deck_entry.card_ids.size(); w++) {
                 try {
-                  const auto& ce = ep3s->options.card_index->definition_for_id(deck_entry->card_ids[w]);
+                  const auto& ce = bs.card_index->definition_for_id(deck_entry.card_ids[w]);
                   auto name = ce->def.en_name.decode();
                   if (name.empty()) {
                     name = ce->def.en_short_name.decode();
@@ -894,48 +1086,48 @@ phosg::JSON HTTPServer::generate_lobby_json_st(shared_ptr<const Lobby> l, shared
                   }
                   cards_json.emplace_back(name);
                 } catch (const out_of_range&) {
-                  cards_json.emplace_back(deck_entry->card_ids[w].load());
+                  cards_json.emplace_back(deck_entry.card_ids[w].load());
                 }
               }
               deck_json = phosg::JSON::dict({
-                  {"Name", deck_entry->name.decode(lc ? lc->language() : 1)},
-                  {"TeamID", deck_entry->team_id.load()},
+                  {"Name", deck_entry.name.decode(player.language)},
+                  {"TeamID", deck_entry.team_id.load()},
                   {"Cards", std::move(cards_json)},
-                  {"GodWhimFlag", deck_entry->god_whim_flag},
-                  {"PlayerLevel", deck_entry->player_level.load()},
+                  {"GodWhimFlag", deck_entry.god_whim_flag},
+                  {"PlayerLevel", deck_entry.player_level.load()},
               });
             }
 
             auto player_json = phosg::JSON::dict({
-                {"PlayerName", ep3s->name_entries[z].name.decode(lc ? lc->language() : 1)},
-                {"ClientID", ep3s->name_entries[z].client_id},
-                {"IsCOM", !!ep3s->name_entries[z].is_cpu_player},
+                {"PlayerName", player.name_entry.name.decode(player.language)},
+                {"ClientID", player.name_entry.client_id},
+                {"IsCOM", !!player.name_entry.is_cpu_player},
                 {"Deck", std::move(deck_json)},
             });
             players_json.emplace_back(std::move(player_json));
           }
         }
         auto battle_state_json = phosg::JSON::dict({
-            {"BehaviorFlags", ep3s->options.behavior_flags},
-            {"RandomSeed", ep3s->options.opt_rand_crypt ? ep3s->options.opt_rand_crypt->seed() : phosg::JSON(nullptr)},
-            {"RandomOffset", ep3s->options.opt_rand_crypt ? ep3s->options.opt_rand_crypt->absolute_offset() : phosg::JSON(nullptr)},
-            {"Tournament", ep3s->options.tournament ? ep3s->options.tournament->json() : nullptr},
-            {"MapNumber", ep3s->last_chosen_map ? ep3s->last_chosen_map->map_number : phosg::JSON(nullptr)},
-            {"EnvironmentNumber", ep3s->map_and_rules ? ep3s->map_and_rules->environment_number : phosg::JSON(nullptr)},
-            {"Rules", ep3s->map_and_rules ? ep3s->map_and_rules->rules.json() : nullptr},
+            {"BehaviorFlags", bs.behavior_flags},
+            {"RandomSeed", bs.has_random_crypt ? bs.random_seed : phosg::JSON(nullptr)},
+            {"RandomOffset", bs.has_random_crypt ? bs.random_offset : phosg::JSON(nullptr)},
+            {"Tournament", bs.tournament_json},
+            {"MapNumber", bs.map_number ? *bs.map_number : phosg::JSON(nullptr)},
+            {"EnvironmentNumber", bs.environment_number ? *bs.environment_number : phosg::JSON(nullptr)},
+            {"Rules", bs.rules ? bs.rules->json() : nullptr},
             {"Players", std::move(players_json)},
-            {"IsBattleFinished", ep3s->battle_finished},
-            {"IsBattleInprogress", ep3s->battle_in_progress},
-            {"RoundNumber", ep3s->round_num},
-            {"FirstTeamTurn", ep3s->first_team_turn},
-            {"CurrentTeamTurn", ep3s->current_team_turn1},
-            {"BattlePhase", phosg::name_for_enum(ep3s->battle_phase)},
-            {"SetupPhase", ep3s->setup_phase},
-            {"RegistrationPhase", ep3s->registration_phase},
-            {"ActionSubphase", ep3s->action_subphase},
-            {"BattleStartTimeUsecs", ep3s->battle_start_usecs},
-            {"TeamEXP", phosg::JSON::list({ep3s->team_exp[0], ep3s->team_exp[1]})},
-            {"TeamDiceBonus", phosg::JSON::list({ep3s->team_dice_bonus[0], ep3s->team_dice_bonus[1]})},
+            {"IsBattleFinished", bs.battle_finished},
+            {"IsBattleInprogress", bs.battle_in_progress},
+            {"RoundNumber", bs.round_num},
+            {"FirstTeamTurn", bs.first_team_turn},
+            {"CurrentTeamTurn", bs.current_team_turn1},
+            {"BattlePhase", phosg::name_for_enum(bs.battle_phase)},
+            {"SetupPhase", bs.setup_phase},
+            {"RegistrationPhase", bs.registration_phase},
+            {"ActionSubphase", bs.action_subphase},
+            {"BattleStartTimeUsecs", bs.battle_start_usecs},
+            {"TeamEXP", phosg::JSON::list({bs.team_exp[0], bs.team_exp[1]})},
+            {"TeamDiceBonus", phosg::JSON::list({bs.team_dice_bonus[0], bs.team_dice_bonus[1]})},
         });
         // std::shared_ptr<StateFlags> state_flags;
         // std::array<std::shared_ptr<PlayerState>, 4> player_states;
@@ -943,166 +1135,276 @@ phosg::JSON HTTPServer::generate_lobby_json_st(shared_ptr<const Lobby> l, shared
       } else {
         ret.emplace("Episode3BattleState", nullptr);
       }
-      auto watched_lobby = l->watched_lobby.lock();
-      if (watched_lobby) {
-        ret.emplace("WatchedLobbyID", watched_lobby->lobby_id);
+      if (l.watched_lobby_id) {
+        ret.emplace("WatchedLobbyID", *l.watched_lobby_id);
       }
       auto watcher_lobby_ids_json = phosg::JSON::list();
-      for (const auto& watcher_lobby : l->watcher_lobbies) {
-        watcher_lobby_ids_json.emplace_back(watcher_lobby->lobby_id);
+      for (uint32_t watcher_lobby_id : l.watcher_lobby_ids) {
+        watcher_lobby_ids_json.emplace_back(watcher_lobby_id);
       }
       ret.emplace("WatcherLobbyIDs", std::move(watcher_lobby_ids_json));
-      ret.emplace("IsReplayLobby", !!l->battle_player);
+      ret.emplace("IsReplayLobby", l.is_replay_lobby);
     }
 
   } else { // Not game
-    ret.emplace("IsPublic", l->check_flag(Lobby::Flag::PUBLIC));
-    ret.emplace("IsDefault", l->check_flag(Lobby::Flag::DEFAULT));
-    ret.emplace("IsOverflow", l->check_flag(Lobby::Flag::IS_OVERFLOW));
-    ret.emplace("Block", l->block);
+    ret.emplace("IsPublic", l.check_flag(Lobby::Flag::PUBLIC));
+    ret.emplace("IsDefault", l.check_flag(Lobby::Flag::DEFAULT));
+    ret.emplace("IsOverflow", l.check_flag(Lobby::Flag::IS_OVERFLOW));
+    ret.emplace("Block", l.block);
   }
   return ret;
 }
 
-phosg::JSON HTTPServer::generate_game_server_clients_json() const {
-  return call_on_event_thread<phosg::JSON>(this->state->base, [&]() {
-    auto res = phosg::JSON::list();
-    for (const auto& it : this->state->channel_to_client) {
-      res.emplace_back(this->generate_game_client_json_st(it.second, this->state->item_name_index_opt(it.second->version())));
+phosg::JSON HTTPServer::generate_proxy_server_clients_json_st() const {
+  phosg::JSON res = phosg::JSON::list();
+  if (this->state->proxy_server) {
+    for (const auto& it : this->state->proxy_server->all_sessions()) {
+      res.emplace_back(this->generate_proxy_client_json_st(it.second));
     }
-    return res;
-  });
+  }
+  return res;
 }
 
-phosg::JSON HTTPServer::generate_proxy_server_clients_json() const {
-  return call_on_event_thread<phosg::JSON>(this->state->base, [&]() {
-    phosg::JSON res = phosg::JSON::list();
-    if (this->state->proxy_server) {
-      for (const auto& it : this->state->proxy_server->all_sessions()) {
-        res.emplace_back(this->generate_proxy_client_json_st(it.second));
-      }
+phosg::JSON HTTPServer::generate_server_info_json_st() const {
+  size_t game_count = 0;
+  size_t lobby_count = 0;
+  for (const auto& it : this->state->id_to_lobby) {
+    if (it.second->is_game()) {
+      game_count++;
+    } else {
+      lobby_count++;
     }
-    return res;
+  }
+  uint64_t uptime_usecs = phosg::now() - this->state->creation_time;
+  auto ret = phosg::JSON::dict({
+      {"StartTimeUsecs", this->state->creation_time},
+      {"StartTime", phosg::format_time(this->state->creation_time)},
+      {"UptimeUsecs", uptime_usecs},
+      {"Uptime", phosg::format_duration(uptime_usecs)},
+      {"LobbyCount", lobby_count},
+      {"GameCount", game_count},
+      {"ClientCount", this->state->channel_to_client.size()},
+      {"ProxySessionCount", this->state->proxy_server ? this->state->proxy_server->num_sessions() : 0},
+      {"ServerName", this->state->name},
   });
+  if (global_file_writer) {
+    auto stats = global_file_writer->get_stats();
+    ret.emplace("FileWriter", phosg::JSON::dict({
+        {"QueueDepth", stats.queue_depth},
+        {"Requests", stats.num_requests},
+        {"CoalescedRequests", stats.num_coalesced},
+        {"CompletedRequests", stats.num_completed},
+        {"FailedRequests", stats.num_errors},
+        {"Batches", stats.num_batches},
+        {"BytesWritten", stats.bytes_written},
+        {"AverageLatencyUsecs", stats.num_completed ? (stats.total_latency_usecs / stats.num_completed) : 0},
+        {"MaxLatencyUsecs", stats.max_latency_usecs},
+    }));
+  }
+  return ret;
 }
 
-phosg::JSON HTTPServer::generate_server_info_json() const {
-  return call_on_event_thread<phosg::JSON>(this->state->base, [&]() {
-    size_t game_count = 0;
-    size_t lobby_count = 0;
-    for (const auto& it : this->state->id_to_lobby) {
-      if (it.second->is_game()) {
-        game_count++;
-      } else {
-        lobby_count++;
-      }
+string HTTPServer::generate_state_metrics_st() const {
+  size_t game_count = 0;
+  size_t lobby_count = 0;
+  for (const auto& it : this->state->id_to_lobby) {
+    if (it.second->is_game()) {
+      game_count++;
+    } else {
+      lobby_count++;
     }
-    uint64_t uptime_usecs = phosg::now() - this->state->creation_time;
-    return phosg::JSON::dict({
-        {"StartTimeUsecs", this->state->creation_time},
-        {"StartTime", phosg::format_time(this->state->creation_time)},
-        {"UptimeUsecs", uptime_usecs},
-        {"Uptime", phosg::format_duration(uptime_usecs)},
-        {"LobbyCount", lobby_count},
-        {"GameCount", game_count},
-        {"ClientCount", this->state->channel_to_client.size()},
-        {"ProxySessionCount", this->state->proxy_server ? this->state->proxy_server->num_sessions() : 0},
-        {"ServerName", this->state->name},
-    });
-  });
-}
+  }
+  size_t client_counts[ServerMetrics::NUM_VERSION_SLOTS] = {};
+  for (const auto& it : this->state->channel_to_client) {
+    client_counts[ServerMetrics::version_slot(it.second->version())]++;
+  }
 
-phosg::JSON HTTPServer::generate_lobbies_json() const {
-  return call_on_event_thread<phosg::JSON>(this->state->base, [&]() {
-    phosg::JSON res = phosg::JSON::list();
-    for (const auto& it : this->state->id_to_lobby) {
-      res.emplace_back(this->generate_lobby_json_st(it.second, this->state->item_name_index_opt(it.second->base_version)));
+  string ret;
+  format_prometheus_value(ret, "newserv_uptime_seconds", "gauge", "Time since the server started", (phosg::now() - this->state->creation_time) / 1000000);
+  format_prometheus_value(ret, "newserv_lobbies", "gauge", "Number of lobbies (not including games)", lobby_count);
+  format_prometheus_value(ret, "newserv_games", "gauge", "Number of games", game_count);
+  format_prometheus_value(ret, "newserv_proxy_sessions", "gauge", "Number of proxy sessions",
+      this->state->proxy_server ? this->state->proxy_server->num_sessions() : 0);
+  format_prometheus_header(ret, "newserv_clients", "gauge", "Number of clients connected to the game server");
+  for (size_t z = 0; z < ServerMetrics::NUM_VERSION_SLOTS; z++) {
+    if (client_counts[z]) {
+      ret += phosg::string_printf("newserv_clients{version=\"%s\"} %zu\n",
+          (z < NUM_VERSIONS) ? phosg::name_for_enum(static_cast<Version>(z)) : "UNKNOWN", client_counts[z]);
     }
-    return res;
-  });
+  }
+
+  if (global_file_writer) {
+    auto stats = global_file_writer->get_stats();
+    format_prometheus_value(ret, "newserv_file_writer_queue_depth", "gauge", "Files waiting to be written", stats.queue_depth);
+    format_prometheus_value(ret, "newserv_file_writer_requests_total", "counter", "File write and delete requests", stats.num_requests);
+    format_prometheus_value(ret, "newserv_file_writer_coalesced_total", "counter", "File write requests that replaced a pending request", stats.num_coalesced);
+    format_prometheus_value(ret, "newserv_file_writer_completed_total", "counter", "File writes and deletes completed", stats.num_completed);
+    format_prometheus_value(ret, "newserv_file_writer_errors_total", "counter", "File writes and deletes that failed", stats.num_errors);
+    format_prometheus_value(ret, "newserv_file_writer_written_bytes_total", "counter", "Bytes written by the file writer", stats.bytes_written);
+  }
+  return ret;
 }
 
-phosg::JSON HTTPServer::generate_summary_json() const {
-  auto ret = call_on_event_thread<phosg::JSON>(this->state->base, [&]() {
-    auto clients_json = phosg::JSON::list();
-    for (const auto& it : this->state->channel_to_client) {
-      auto c = it.second;
-      auto p = c->character(false, false);
-      auto l = c->lobby.lock();
-      clients_json.emplace_back(phosg::JSON::dict({
-          {"ID", c->id},
-          {"AccountID", c->login ? c->login->account->account_id : phosg::JSON(nullptr)},
-          {"Name", p ? p->disp.name.decode(it.second->language()) : phosg::JSON(nullptr)},
+phosg::JSON HTTPServer::generate_summary_json_st() const {
+  auto clients_json = phosg::JSON::list();
+  for (const auto& it : this->state->channel_to_client) {
+    auto c = it.second;
+    auto p = c->character(false, false);
+    auto l = c->lobby.lock();
+    clients_json.emplace_back(phosg::JSON::dict({
+        {"ID", c->id},
+        {"AccountID", c->login ? c->login->account->account_id : phosg::JSON(nullptr)},
+        {"Name", p ? p->disp.name.decode(it.second->language()) : phosg::JSON(nullptr)},
+        {"Version", phosg::name_for_enum(it.second->version())},
+        {"Language", name_for_language_code(it.second->language())},
+        {"Level", p ? p->disp.stats.level + 1 : phosg::JSON(nullptr)},
+        {"Class", p ? name_for_char_class(p->disp.visual.char_class) : phosg::JSON(nullptr)},
+        {"SectionID", p ? name_for_section_id(p->disp.visual.section_id) : phosg::JSON(nullptr)},
+        {"LobbyID", l ? l->lobby_id : phosg::JSON(nullptr)},
+    }));
+  }
+
+  auto proxy_clients_json = phosg::JSON::list();
+  if (this->state->proxy_server) {
+    for (const auto& it : this->state->proxy_server->all_sessions()) {
+      proxy_clients_json.emplace_back(phosg::JSON::dict({
+          {"AccountID", it.second->login ? it.second->login->account->account_id : phosg::JSON(nullptr)},
+          {"Name", it.second->character_name},
           {"Version", phosg::name_for_enum(it.second->version())},
           {"Language", name_for_language_code(it.second->language())},
-          {"Level", p ? p->disp.stats.level + 1 : phosg::JSON(nullptr)},
-          {"Class", p ? name_for_char_class(p->disp.visual.char_class) : phosg::JSON(nullptr)},
-          {"SectionID", p ? name_for_section_id(p->disp.visual.section_id) : phosg::JSON(nullptr)},
-          {"LobbyID", l ? l->lobby_id : phosg::JSON(nullptr)},
       }));
     }
+  }
 
-    auto proxy_clients_json = phosg::JSON::list();
-    if (this->state->proxy_server) {
-      for (const auto& it : this->state->proxy_server->all_sessions()) {
-        proxy_clients_json.emplace_back(phosg::JSON::dict({
-            {"AccountID", it.second->login ? it.second->login->account->account_id : phosg::JSON(nullptr)},
-            {"Name", it.second->character_name},
-            {"Version", phosg::name_for_enum(it.second->version())},
-            {"Language", name_for_language_code(it.second->language())},
-        }));
+  auto games_json = phosg::JSON::list();
+  for (const auto& it : this->state->id_to_lobby) {
+    auto l = it.second;
+    if (l->is_game()) {
+      auto game_json = phosg::JSON::dict({
+          {"ID", l->lobby_id},
+          {"Name", l->name},
+          {"BaseVersion", phosg::name_for_enum(l->base_version)},
+          {"Players", l->count_clients()},
+          {"CheatsEnabled", l->check_flag(Lobby::Flag::CHEATS_ENABLED)},
+          {"Episode", name_for_episode(l->episode)},
+          {"HasPassword", !l->password.empty()},
+      });
+      if (l->episode == Episode::EP3) {
+        auto ep3s = l->ep3_server;
+        game_json.emplace("BattleInProgress", l->check_flag(Lobby::Flag::BATTLE_IN_PROGRESS));
+        game_json.emplace("IsSpectatorTeam", l->check_flag(Lobby::Flag::IS_SPECTATOR_TEAM));
+        game_json.emplace("MapNumber", (ep3s && ep3s->last_chosen_map) ? ep3s->last_chosen_map->map_number : phosg::JSON(nullptr));
+        game_json.emplace("Rules", (ep3s && ep3s->map_and_rules) ? ep3s->map_and_rules->rules.json() : nullptr);
+      } else {
+        game_json.emplace("QuestSelectionInProgress", l->check_flag(Lobby::Flag::QUEST_SELECTION_IN_PROGRESS));
+        game_json.emplace("QuestInProgress", l->check_flag(Lobby::Flag::QUEST_IN_PROGRESS));
+        game_json.emplace("JoinableQuestInProgress", l->check_flag(Lobby::Flag::JOINABLE_QUEST_IN_PROGRESS));
+        game_json.emplace("SectionID", name_for_section_id(l->effective_section_id()));
+        game_json.emplace("Mode", name_for_mode(l->mode));
+        game_json.emplace("Difficulty", name_for_difficulty(l->difficulty));
+        game_json.emplace("Quest", this->generate_quest_json_st(l->quest));
       }
+      games_json.emplace_back(std::move(game_json));
     }
+  }
+
+  return phosg::JSON::dict({
+      {"Clients", std::move(clients_json)},
+      {"ProxyClients", std::move(proxy_clients_json)},
+      {"Games", std::move(games_json)},
+  });
+}
 
-    auto games_json = phosg::JSON::list();
+void HTTPServer::add_snapshot_parts_st(StateSnapshot& snapshot, uint8_t parts) const {
+  if (!snapshot.parts) {
+    snapshot.time = phosg::now();
+    snapshot.max_age_usecs = this->state->http_snapshot_max_age_usecs;
+  }
+  if (parts & StateSnapshot::Part::CLIENTS) {
+    snapshot.clients.reserve(this->state->channel_to_client.size());
+    for (const auto& it : this->state->channel_to_client) {
+      snapshot.clients.emplace_back(this->snapshot_game_client_st(it.second, this->state->item_name_index_opt(it.second->version())));
+    }
+  }
+  if (parts & StateSnapshot::Part::LOBBIES) {
+    snapshot.lobbies.reserve(this->state->id_to_lobby.size());
     for (const auto& it : this->state->id_to_lobby) {
-      auto l = it.second;
-      if (l->is_game()) {
-        auto game_json = phosg::JSON::dict({
-            {"ID", l->lobby_id},
-            {"Name", l->name},
-            {"BaseVersion", phosg::name_for_enum(l->base_version)},
-            {"Players", l->count_clients()},
-            {"CheatsEnabled", l->check_flag(Lobby::Flag::CHEATS_ENABLED)},
-            {"Episode", name_for_episode(l->episode)},
-            {"HasPassword", !l->password.empty()},
-        });
-        if (l->episode == Episode::EP3) {
-          auto ep3s = l->ep3_server;
-          game_json.emplace("BattleInProgress", l->check_flag(Lobby::Flag::BATTLE_IN_PROGRESS));
-          game_json.emplace("IsSpectatorTeam", l->check_flag(Lobby::Flag::IS_SPECTATOR_TEAM));
-          game_json.emplace("MapNumber", (ep3s && ep3s->last_chosen_map) ? ep3s->last_chosen_map->map_number : phosg::JSON(nullptr));
-          game_json.emplace("Rules", (ep3s && ep3s->map_and_rules) ? ep3s->map_and_rules->rules.json() : nullptr);
-        } else {
-          game_json.emplace("QuestSelectionInProgress", l->check_flag(Lobby::Flag::QUEST_SELECTION_IN_PROGRESS));
-          game_json.emplace("QuestInProgress", l->check_flag(Lobby::Flag::QUEST_IN_PROGRESS));
-          game_json.emplace("JoinableQuestInProgress", l->check_flag(Lobby::Flag::JOINABLE_QUEST_IN_PROGRESS));
-          game_json.emplace("SectionID", name_for_section_id(l->effective_section_id()));
-          game_json.emplace("Mode", name_for_mode(l->mode));
-          game_json.emplace("Difficulty", name_for_difficulty(l->difficulty));
-          game_json.emplace("Quest", this->generate_quest_json_st(l->quest));
-        }
-        games_json.emplace_back(std::move(game_json));
-      }
+      snapshot.lobbies.emplace_back(this->snapshot_lobby_st(it.second, this->state->item_name_index_opt(it.second->base_version)));
     }
+  }
+  if (parts & StateSnapshot::Part::PROXY_CLIENTS) {
+    snapshot.proxy_clients_json = make_shared<phosg::JSON>(this->generate_proxy_server_clients_json_st());
+  }
+  if (parts & StateSnapshot::Part::SERVER) {
+    snapshot.server_json = make_shared<phosg::JSON>(this->generate_server_info_json_st());
+  }
+  if (parts & StateSnapshot::Part::SUMMARY) {
+    snapshot.summary_json = make_shared<phosg::JSON>(this->generate_summary_json_st());
+  }
+  snapshot.parts |= parts;
+}
 
-    return phosg::JSON::dict({
-        {"Clients", std::move(clients_json)},
-        {"ProxyClients", std::move(proxy_clients_json)},
-        {"Games", std::move(games_json)},
+shared_ptr<HTTPServer::StateSnapshot> HTTPServer::get_snapshot(uint8_t parts) {
+  if (!this->latest_snapshot || (phosg::now() - this->latest_snapshot->time >= this->latest_snapshot->max_age_usecs)) {
+    this->latest_snapshot = make_shared<StateSnapshot>();
+  }
+  uint8_t missing_parts = parts & ~this->latest_snapshot->parts;
+  if (missing_parts) {
+    // This blocks the HTTP thread (but not the event thread) until the event
+    // thread gets around to taking the missing parts. Nothing else uses the
+    // snapshot in the meantime, since only the HTTP thread uses it.
+    auto snapshot = this->latest_snapshot;
+    call_on_event_thread<void>(this->state->base, [&]() {
+      this->add_snapshot_parts_st(*snapshot, missing_parts);
     });
-  });
-  ret.emplace("Server", this->generate_server_info_json());
-  return ret;
+  }
+  return this->latest_snapshot;
 }
 
-phosg::JSON HTTPServer::generate_all_json() const {
-  return phosg::JSON::dict({
-      {"Clients", this->generate_game_server_clients_json()},
-      {"ProxyClients", this->generate_proxy_server_clients_json()},
-      {"Lobbies", this->generate_lobbies_json()},
-      {"Server", this->generate_server_info_json()},
-  });
+shared_ptr<const phosg::JSON> HTTPServer::generate_snapshot_json(shared_ptr<StateSnapshot> snapshot, const string& uri) const {
+  auto get_clients_json = [&]() -> shared_ptr<const phosg::JSON> {
+    if (!snapshot->clients_json) {
+      auto clients_json = make_shared<phosg::JSON>(phosg::JSON::list());
+      for (const auto& c : snapshot->clients) {
+        clients_json->emplace_back(this->generate_game_client_json(c));
+      }
+      snapshot->clients_json = std::move(clients_json);
+    }
+    return snapshot->clients_json;
+  };
+  auto get_lobbies_json = [&]() -> shared_ptr<const phosg::JSON> {
+    if (!snapshot->lobbies_json) {
+      auto lobbies_json = make_shared<phosg::JSON>(phosg::JSON::list());
+      for (const auto& l : snapshot->lobbies) {
+        lobbies_json->emplace_back(this->generate_lobby_json(l));
+      }
+      snapshot->lobbies_json = std::move(lobbies_json);
+    }
+    return snapshot->lobbies_json;
+  };
+
+  if (uri == "/y/clients") {
+    return get_clients_json();
+  } else if (uri == "/y/proxy-clients") {
+    return snapshot->proxy_clients_json;
+  } else if (uri == "/y/lobbies") {
+    return get_lobbies_json();
+  } else if (uri == "/y/server") {
+    return snapshot->server_json;
+  } else if (uri == "/y/summary") {
+    auto ret = make_shared<phosg::JSON>(*snapshot->summary_json);
+    ret->emplace("Server", *snapshot->server_json);
+    return ret;
+  } else if (uri == "/y/all") {
+    return make_shared<phosg::JSON>(phosg::JSON::dict({
+        {"Clients", *get_clients_json()},
+        {"ProxyClients", *snapshot->proxy_clients_json},
+        {"Lobbies", *get_lobbies_json()},
+        {"Server", *snapshot->server_json},
+    }));
+  } else {
+    throw logic_error("invalid snapshot URI");
+  }
 }
 
 phosg::JSON HTTPServer::generate_ep3_cards_json(bool trial) const {
@@ -1154,6 +1456,7 @@ phosg::JSON HTTPServer::generate_rare_table_json(const std::string& table_name)
 
 void HTTPServer::handle_request(struct evhttp_request* req) {
   shared_ptr<const phosg::JSON> ret;
+  shared_ptr<const string> serialized; // If set, ret is ignored
   uint32_t serialize_options = 0;
   uint64_t start_time = phosg::now();
   string uri = evhttp_request_get_uri(req);
@@ -1189,6 +1492,8 @@ void HTTPServer::handle_request(struct evhttp_request* req) {
           "/y/rare-drops/stream",
           "/y/summary",
           "/y/all",
+          "/y/slow-callbacks",
+          "/metrics",
       });
       ret = make_shared<phosg::JSON>(phosg::JSON::dict({{"endpoints", std::move(endpoints_json)}}));
 
@@ -1213,20 +1518,54 @@ void HTTPServer::handle_request(struct evhttp_request* req) {
       ret = make_shared<phosg::JSON>(this->generate_rare_tables_json());
     } else if (!strncmp(uri.c_str(), "/y/data/rare-tables/", 20)) {
       ret = make_shared<phosg::JSON>(this->generate_rare_table_json(uri.substr(20)));
+    } else if (uri == "/y/slow-callbacks") {
+      // This doesn't need to run on the event thread, so it works even if the
+      // event thread is currently stuck
+      auto slow_callbacks_json = phosg::JSON::list();
+      if (this->state->watchdog) {
+        for (const auto& cb : this->state->watchdog->get_slow_callbacks()) {
+          slow_callbacks_json.emplace_back(cb.json());
+        }
+      }
+      ret = make_shared<phosg::JSON>(std::move(slow_callbacks_json));
+
+    } else if (uri == "/metrics") {
+      auto data = make_shared<string>(call_on_event_thread<string>(this->state->base, [&]() {
+        return this->generate_state_metrics_st();
+      }));
+      global_metrics.format_prometheus(*data);
+      this->send_response(req, 200, "text/plain; version=0.0.4", std::move(data));
+      return;
+
     } else if (uri == "/y/data/config") {
       ret = call_on_event_thread<shared_ptr<const phosg::JSON>>(this->state->base, [this]() { return this->state->config_json; });
-    } else if (uri == "/y/clients") {
-      ret = make_shared<phosg::JSON>(this->generate_game_server_clients_json());
-    } else if (uri == "/y/proxy-clients") {
-      ret = make_shared<phosg::JSON>(this->generate_proxy_server_clients_json());
-    } else if (uri == "/y/lobbies") {
-      ret = make_shared<phosg::JSON>(this->generate_lobbies_json());
-    } else if (uri == "/y/server") {
-      ret = make_shared<phosg::JSON>(this->generate_server_info_json());
-    } else if (uri == "/y/summary") {
-      ret = make_shared<phosg::JSON>(this->generate_summary_json());
-    } else if (uri == "/y/all") {
-      ret = make_shared<phosg::JSON>(this->generate_all_json());
+    } else if ((uri == "/y/clients") ||
+        (uri == "/y/proxy-clients") ||
+        (uri == "/y/lobbies") ||
+        (uri == "/y/server") ||
+        (uri == "/y/summary") ||
+        (uri == "/y/all")) {
+      uint8_t parts;
+      if (uri == "/y/clients") {
+        parts = StateSnapshot::Part::CLIENTS;
+      } else if (uri == "/y/proxy-clients") {
+        parts = StateSnapshot::Part::PROXY_CLIENTS;
+      } else if (uri == "/y/lobbies") {
+        parts = StateSnapshot::Part::LOBBIES;
+      } else if (uri == "/y/server") {
+        parts = StateSnapshot::Part::SERVER;
+      } else if (uri == "/y/summary") {
+        parts = StateSnapshot::Part::SUMMARY | StateSnapshot::Part::SERVER;
+      } else {
+        parts = StateSnapshot::Part::CLIENTS | StateSnapshot::Part::PROXY_CLIENTS | StateSnapshot::Part::LOBBIES | StateSnapshot::Part::SERVER;
+      }
+      auto snapshot = this->get_snapshot(parts);
+      auto& cached = snapshot->serialized_responses[phosg::string_printf("%s:%" PRIX32, uri.c_str(), serialize_options)];
+      if (!cached) {
+        auto json = this->generate_snapshot_json(snapshot, uri);
+        cached = make_shared<string>(json->serialize(phosg::JSON::SerializeOption::ESCAPE_CONTROLS_ONLY | serialize_options));
+      }
+      serialized = cached;
 
     } else {
       throw http_error(404, "unknown action");
@@ -1247,15 +1586,12 @@ void HTTPServer::handle_request(struct evhttp_request* req) {
   }
 
   uint64_t handler_end = phosg::now();
-  unique_ptr<struct evbuffer, void (*)(struct evbuffer*)> out_buffer(evbuffer_new(), evbuffer_free);
-  string* serialized = new string(ret->serialize(phosg::JSON::SerializeOption::ESCAPE_CONTROLS_ONLY | serialize_options));
+  if (!serialized) {
+    serialized = make_shared<string>(ret->serialize(phosg::JSON::SerializeOption::ESCAPE_CONTROLS_ONLY | serialize_options));
+  }
   size_t size = serialized->size();
   uint64_t serialize_end = phosg::now();
-  auto cleanup = +[](const void*, size_t, void* s) -> void {
-    delete reinterpret_cast<string*>(s);
-  };
-  evbuffer_add_reference(out_buffer.get(), serialized->data(), serialized->size(), cleanup, serialized);
-  this->send_response(req, 200, "application/json", out_buffer.get());
+  this->send_response(req, 200, "application/json", std::move(serialized));
 
   string handler_time = phosg::format_duration(handler_end - start_time);
   string serialize_time = phosg::format_duration(serialize_end - handler_end);
@@ -5,8 +5,11 @@
 #include <event2/http.h>
 #include <stdlib.h>
 
+#include <array>
 #include <memory>
+#include <optional>
 #include <string>
+#include <vector>
 
 #include "ProxyServer.hh"
 #include "ServerState.hh"
@@ -63,6 +66,175 @@ protected:
 
   std::unordered_map<struct bufferevent*, std::shared_ptr<WebsocketClient>> bev_to_websocket_client;
 
+  // The snapshot structures below contain copies of only the fields that the
+  // JSON generators use, so that taking a snapshot on the event thread is
+  // cheap and the JSON can be generated on the HTTP thread.
+  struct AccountSnapshot {
+    uint32_t account_id;
+    uint32_t flags;
+    uint64_t ban_end_time;
+    uint32_t ep3_current_meseta;
+    uint32_t ep3_total_meseta_earned;
+    uint32_t bb_team_id;
+    std::string last_player_name;
+    std::string auto_reply_message;
+    bool is_temporary;
+    std::vector<std::string> dc_nte_licenses;
+    std::vector<uint32_t> dc_licenses;
+    std::vector<uint32_t> pc_licenses;
+    std::vector<uint32_t> gc_licenses;
+    std::vector<std::string> xb_licenses;
+    std::vector<std::string> bb_licenses;
+    std::vector<std::string> auto_patches_enabled;
+  };
+
+  // This omits the bank, quest flags, Guild Card, etc., which are most of the
+  // size of a PSOBBCharacterFile
+  struct CharacterSnapshot {
+    PlayerInventory inventory;
+    PlayerDispDataBB disp;
+    le_uint32_t play_time_seconds;
+    pstring<TextEncoding::UTF16, 0x00AC> auto_reply;
+    pstring<TextEncoding::UTF16, 0x00AC> info_board;
+    PlayerRecordsBattle battle_records;
+    PlayerRecordsChallengeBB challenge_records;
+    // Indexed by PSOBBCharacterFile::MaterialType + 2
+    std::array<uint8_t, 7> material_usage;
+    std::array<uint8_t, 0x13> technique_levels;
+  };
+
+  struct GameClientSnapshot {
+    uint64_t id;
+    struct sockaddr_storage remote_addr;
+    Version version;
+    int32_t sub_version;
+    Client::Config config;
+    uint8_t language;
+    float x;
+    float z;
+    uint32_t floor;
+    bool can_chat;
+    std::optional<AccountSnapshot> account; // Missing if not logged in
+    bool in_lobby;
+    uint32_t lobby_id; // Only valid if in_lobby is true
+    uint8_t lobby_client_id;
+    int8_t bb_character_index;
+    std::optional<CharacterSnapshot> character;
+    std::shared_ptr<const ItemNameIndex> item_name_index; // May be null
+  };
+
+  struct LobbySnapshot {
+    struct FloorItem {
+      size_t floor;
+      float x;
+      float z;
+      uint64_t drop_number;
+      uint16_t flags;
+      ItemData data;
+    };
+    struct Ep3Player {
+      Episode3::NameEntry name_entry;
+      std::optional<Episode3::DeckEntry> deck_entry;
+      uint8_t language;
+    };
+    struct Ep3BattleState {
+      std::shared_ptr<const Episode3::CardIndex> card_index;
+      std::array<std::optional<Ep3Player>, 4> players; // Missing if not present
+      uint32_t behavior_flags;
+      bool has_random_crypt;
+      uint32_t random_seed;
+      uint32_t random_offset;
+      phosg::JSON tournament_json; // Null if not a tournament match
+      std::optional<uint32_t> map_number;
+      std::optional<uint8_t> environment_number;
+      std::optional<Episode3::Rules> rules;
+      uint32_t battle_finished;
+      uint32_t battle_in_progress;
+      uint32_t round_num;
+      uint8_t first_team_turn;
+      uint8_t current_team_turn1;
+      Episode3::BattlePhase battle_phase;
+      Episode3::SetupPhase setup_phase;
+      Episode3::RegistrationPhase registration_phase;
+      Episode3::ActionSubphase action_subphase;
+      uint64_t battle_start_usecs;
+      std::array<int16_t, 2> team_exp;
+      std::array<int16_t, 2> team_dice_bonus;
+    };
+
+    uint32_t lobby_id;
+    uint16_t allowed_versions;
+    uint8_t event;
+    uint8_t block;
+    uint8_t leader_id;
+    uint8_t max_clients;
+    uint64_t idle_timeout_usecs;
+    uint32_t enabled_flags;
+    std::array<uint64_t, 12> client_ids; // 0 = no client in slot
+    uint32_t min_level;
+    uint32_t max_level;
+    Version base_version;
+    Episode episode;
+    GameMode mode;
+    uint8_t difficulty;
+    uint8_t effective_section_id;
+    bool has_password;
+    std::string name;
+    uint32_t random_seed;
+    parray<le_uint32_t, 0x20> variations;
+    uint16_t base_exp_multiplier;
+    float exp_share_multiplier;
+    float challenge_exp_multiplier;
+    uint8_t allowed_drop_modes;
+    Lobby::DropMode drop_mode;
+    std::optional<Lobby::ChallengeParameters> challenge_params;
+    std::vector<FloorItem> floor_items;
+    std::shared_ptr<const Quest> quest; // May be null
+    std::optional<Ep3BattleState> ep3_battle_state; // Missing if no Ep3 server
+    std::optional<uint32_t> watched_lobby_id;
+    std::vector<uint32_t> watcher_lobby_ids;
+    bool is_replay_lobby;
+    std::shared_ptr<const ItemNameIndex> item_name_index; // May be null
+
+    [[nodiscard]] inline bool check_flag(Lobby::Flag flag) const {
+      return !!(this->enabled_flags & static_cast<uint32_t>(flag));
+    }
+  };
+
+  // The HTTP thread keeps a StateSnapshot for up to HTTPSnapshotMaxAge, and
+  // all requests within its lifetime share it. Each part of the snapshot is
+  // taken on the event thread the first time a request needs it, so requests
+  // for one endpoint don't make the event thread do the work for the others.
+  // The client and lobby parts are copies of plain data, and their JSON is
+  // generated on the HTTP thread; the other parts are small enough that their
+  // JSON is generated directly on the event thread. Responses generated from
+  // a snapshot are serialized only once for each combination of URI and
+  // serialization options.
+  struct StateSnapshot {
+    enum Part : uint8_t {
+      CLIENTS = 0x01,
+      PROXY_CLIENTS = 0x02,
+      LOBBIES = 0x04,
+      SERVER = 0x08,
+      SUMMARY = 0x10,
+    };
+
+    uint64_t time = 0; // When the first part was taken
+    uint64_t max_age_usecs = 0;
+    uint8_t parts = 0; // Which of the fields below are present
+    std::vector<GameClientSnapshot> clients;
+    std::vector<LobbySnapshot> lobbies;
+    std::shared_ptr<const phosg::JSON> proxy_clients_json;
+    std::shared_ptr<const phosg::JSON> server_json;
+    std::shared_ptr<const phosg::JSON> summary_json; // Without the Server field
+
+    // These are generated on first use
+    std::shared_ptr<const phosg::JSON> clients_json;
+    std::shared_ptr<const phosg::JSON> lobbies_json;
+    std::unordered_map<std::string, std::shared_ptr<const std::string>> serialized_responses;
+  };
+  std::shared_ptr<StateSnapshot> latest_snapshot; // Only accessed on the HTTP thread
+
   std::shared_ptr<WebsocketClient> enable_websockets(struct evhttp_request* req);
 
   static void dispatch_on_websocket_read(struct bufferevent* bev, void* ctx);
@@ -85,6 +257,7 @@ protected:
 
   static const std::unordered_map<int, const char*> explanation_for_response_code;
   static void send_response(struct evhttp_request* req, int code, const char* content_type, struct evbuffer* b);
+  static void send_response(struct evhttp_request* req, int code, const char* content_type, std::shared_ptr<const std::string> data);
   static void send_response(struct evhttp_request* req, int code, const char* content_type, const char* fmt, ...);
 
   static std::unordered_multimap<std::string, std::string> parse_url_params(const std::string& query);
@@ -96,16 +269,25 @@ protected:
 
   static phosg::JSON generate_quest_json_st(std::shared_ptr<const Quest> q);
   static phosg::JSON generate_client_config_json_st(const Client::Config& config);
-  static phosg::JSON generate_account_json_st(std::shared_ptr<const Account> a);
-  static phosg::JSON generate_game_client_json_st(std::shared_ptr<const Client> c, std::shared_ptr<const ItemNameIndex> item_name_index);
+  static AccountSnapshot snapshot_account_st(const Account& a);
+  static phosg::JSON generate_account_json(const AccountSnapshot& a);
+  static GameClientSnapshot snapshot_game_client_st(std::shared_ptr<const Client> c, std::shared_ptr<const ItemNameIndex> item_name_index);
+  static phosg::JSON generate_game_client_json(const GameClientSnapshot& c);
   static phosg::JSON generate_proxy_client_json_st(std::shared_ptr<const ProxyServer::LinkedSession> ses);
-  static phosg::JSON generate_lobby_json_st(std::shared_ptr<const Lobby> l, std::shared_ptr<const ItemNameIndex> item_name_index);
-  phosg::JSON generate_game_server_clients_json() const;
-  phosg::JSON generate_proxy_server_clients_json() const;
-  phosg::JSON generate_server_info_json() const;
-  phosg::JSON generate_lobbies_json() const;
-  phosg::JSON generate_summary_json() const;
-  phosg::JSON generate_all_json() const;
+  static LobbySnapshot snapshot_lobby_st(std::shared_ptr<const Lobby> l, std::shared_ptr<const ItemNameIndex> item_name_index);
+  static phosg::JSON generate_lobby_json(const LobbySnapshot& l);
+  phosg::JSON generate_proxy_server_clients_json_st() const;
+  phosg::JSON generate_server_info_json_st() const;
+  phosg::JSON generate_summary_json_st() const;
+  void add_snapshot_parts_st(StateSnapshot& snapshot, uint8_t parts) const;
+
+  // Returns the current snapshot, after taking any of the given parts that
+  // it doesn't already have
+  std::shared_ptr<StateSnapshot> get_snapshot(uint8_t parts);
+  std::shared_ptr<const phosg::JSON> generate_snapshot_json(std::shared_ptr<StateSnapshot> snapshot, const std::string& uri) const;
+  // Returns the server state gauges (client and lobby counts, etc.) in the
+  // Prometheus text format; the rest of the metrics are in global_metrics
+  std::string generate_state_metrics_st() const;
 
   phosg::JSON generate_ep3_cards_json(bool trial) const;
   phosg::JSON generate_common_tables_json() const;
@@ -50,12 +50,18 @@ ItemCreator::ItemCreator(
       tekker_adjustment_set(tekker_adjustment_set),
       item_parameter_table(item_parameter_table),
       common_item_set(common_item_set),
-      pt(common_item_set->get_table(this->episode, this->mode, this->difficulty, this->section_id)),
+      rare_specs(nullptr),
       restrictions(restrictions),
       opt_rand_crypt(opt_rand_crypt ? make_shared<PSOV2Encryption>(opt_rand_crypt->seed()) : nullptr) {
+  this->update_tables_for_section_id();
   this->generate_unit_stars_tables();
 }
 
+void ItemCreator::update_tables_for_section_id() {
+  this->pt = this->common_item_set->get_table(this->episode, this->mode, this->difficulty, this->section_id);
+  this->rare_specs = this->rare_item_set->get_collection_if_exists(this->mode, this->episode, this->difficulty, this->section_id);
+}
+
 void ItemCreator::set_random_crypt(shared_ptr<PSOLFGEncryption> new_random_crypt) {
   this->opt_rand_crypt = new_random_crypt;
 }
@@ -69,7 +75,7 @@ void ItemCreator::set_section_id(uint8_t new_section_id) {
         abbreviation_for_mode(mode),
         abbreviation_for_difficulty(difficulty),
         this->section_id);
-    this->pt = common_item_set->get_table(this->episode, this->mode, this->difficulty, this->section_id);
+    this->update_tables_for_section_id();
   }
 }
 
@@ -175,7 +181,8 @@ ItemCreator::DropResult ItemCreator::on_box_item_drop_with_area_norm(uint8_t are
   if (!res.item.empty()) {
     res.is_from_rare_table = true;
   } else {
-    uint8_t item_class = this->get_rand_from_weighted_tables_2d_vertical(this->pt->box_item_class_prob_table, area_norm);
+    uint8_t item_class = this->get_rand_from_weighted_tables_2d_vertical(
+        this->pt->box_item_class_prob_table, this->pt->samplers.box_item_class, area_norm);
     this->log.info("Item class is %02hhX", item_class);
     switch (item_class) {
       case 0: // Weapon
@@ -296,9 +303,10 @@ ItemData ItemCreator::check_rare_specs_and_create_rare_box_item(uint8_t area_nor
     return item;
   }
 
-  auto rare_specs = this->rare_item_set->get_box_specs(
-      this->mode, this->episode, this->difficulty, this->section_id, area_norm + 1);
-  for (const auto& spec : rare_specs) {
+  if (!this->rare_specs) {
+    return item;
+  }
+  for (const auto& spec : this->rare_specs->box_specs(area_norm + 1)) {
     item = this->check_rate_and_create_rare_item(spec, area_norm);
     if (!item.empty()) {
       if (this->log.should_log(phosg::LogLevel::INFO)) {
@@ -352,14 +360,12 @@ bool ItemCreator::should_allow_meseta_drops() const {
 
 ItemData ItemCreator::check_rare_spec_and_create_rare_enemy_item(uint32_t enemy_type, uint8_t area_norm) {
   ItemData item;
-  if (this->are_rare_drops_allowed() && (enemy_type > 0) && (enemy_type < 0x58)) {
+  if (this->are_rare_drops_allowed() && this->rare_specs && (enemy_type > 0) && (enemy_type < 0x58)) {
     // Note: In the original implementation, enemies can only have one possible
     // rare drop. In our implementation, they can have multiple rare drops if
     // JSONRareItemSet is used (the other RareItemSet implementations never
     // return multiple drops for an enemy type).
-    auto rare_specs = this->rare_item_set->get_enemy_specs(
-        this->mode, this->episode, this->difficulty, this->section_id, enemy_type);
-    for (const auto& spec : rare_specs) {
+    for (const auto& spec : this->rare_specs->enemy_specs(enemy_type)) {
       item = this->check_rate_and_create_rare_item(spec, area_norm);
       if (!item.empty()) {
         if (this->log.should_log(phosg::LogLevel::INFO)) {
@@ -431,8 +437,10 @@ void ItemCreator::generate_rare_weapon_bonuses(ItemData& item, uint32_t random_s
   }
 
   for (size_t z = 0; z < 6; z += 2) {
-    uint8_t bonus_type = this->get_rand_from_weighted_tables_2d_vertical(this->pt->bonus_type_prob_table, random_sample);
-    int16_t bonus_value = this->get_rand_from_weighted_tables_2d_vertical(this->pt->bonus_value_prob_table, 5);
+    uint8_t bonus_type = this->get_rand_from_weighted_tables_2d_vertical(
+        this->pt->bonus_type_prob_table, this->pt->samplers.bonus_type, random_sample);
+    int16_t bonus_value = this->get_rand_from_weighted_tables_2d_vertical(
+        this->pt->bonus_value_prob_table, this->pt->samplers.bonus_value, 5);
     item.data1[z + 6] = bonus_type;
     item.data1[z + 7] = bonus_value * 5 - 10;
     // Note: The original code has a special case here, which divides
@@ -454,8 +462,10 @@ void ItemCreator::generate_common_weapon_bonuses(ItemData& item, uint8_t area_no
     if (spec == 0xFF) {
       this->log.info("Bonus %zu is forbidden", row);
     } else {
-      item.data1[(row * 2) + 6] = this->get_rand_from_weighted_tables_2d_vertical(this->pt->bonus_type_prob_table, area_norm);
-      int16_t amount = this->get_rand_from_weighted_tables_2d_vertical(this->pt->bonus_value_prob_table, spec);
+      item.data1[(row * 2) + 6] = this->get_rand_from_weighted_tables_2d_vertical(
+          this->pt->bonus_type_prob_table, this->pt->samplers.bonus_type, area_norm);
+      int16_t amount = this->get_rand_from_weighted_tables_2d_vertical(
+          this->pt->bonus_value_prob_table, this->pt->samplers.bonus_value, spec);
       item.data1[(row * 2) + 7] = amount * 5 - 10;
       this->log.info("Bonus %zu generated as %02hhX %02hhX from area_norm %02hhX and spec %02hhX", row, item.data1[(row * 2) + 6], item.data1[(row * 2) + 7], area_norm, spec);
     }
@@ -658,7 +668,7 @@ void ItemCreator::generate_common_item_variances(uint32_t area_norm, ItemData& i
 void ItemCreator::generate_common_armor_or_shield_type_and_variances(char area_norm, ItemData& item) {
   this->generate_common_armor_slots_and_bonuses(item);
 
-  uint8_t type = this->get_rand_from_weighted_tables_1d(this->pt->armor_shield_type_index_prob_table);
+  uint8_t type = this->get_rand_from_sampler(this->pt->samplers.armor_shield_type_index);
   item.data1[2] = area_norm + type + this->pt->armor_or_shield_type_bias;
   if (item.data1[2] < 3) {
     item.data1[2] = 0;
@@ -684,13 +694,14 @@ void ItemCreator::generate_common_armor_slots_and_bonuses(ItemData& item) {
 }
 
 void ItemCreator::generate_common_armor_slot_count(ItemData& item) {
-  item.data1[5] = this->get_rand_from_weighted_tables_1d(this->pt->armor_slot_count_prob_table);
+  item.data1[5] = this->get_rand_from_sampler(this->pt->samplers.armor_slot_count);
 }
 
 void ItemCreator::generate_common_tool_variances(uint32_t area_norm, ItemData& item) {
   item.clear();
 
-  uint8_t tool_class = this->get_rand_from_weighted_tables_2d_vertical(this->pt->tool_class_prob_table, area_norm);
+  uint8_t tool_class = this->get_rand_from_weighted_tables_2d_vertical(
+      this->pt->tool_class_prob_table, this->pt->samplers.tool_class, area_norm);
   if ((!is_v1_or_v2(this->logic_version) || (this->logic_version == Version::GC_NTE)) && (tool_class == 0x1A)) {
     tool_class = 0x73;
   }
@@ -715,7 +726,8 @@ void ItemCreator::generate_common_tool_variances(uint32_t area_norm, ItemData& i
   }
 
   if (item.data1[1] == 0x02) { // Tech disk
-    item.data1[4] = this->get_rand_from_weighted_tables_2d_vertical(this->pt->technique_index_prob_table, area_norm);
+    item.data1[4] = this->get_rand_from_weighted_tables_2d_vertical(
+        this->pt->technique_index_prob_table, this->pt->samplers.technique_index, area_norm);
     item.data1[2] = this->generate_tech_disk_level(item.data1[4], area_norm);
     this->clear_tool_item_if_invalid(item);
   }
@@ -753,27 +765,23 @@ void ItemCreator::generate_common_weapon_variances(uint8_t area_norm, ItemData&
   item.clear();
   item.data1[0] = 0x00;
 
+  // The table is only needed here for logging, or if there's no precomputed
+  // sampler for this area
+  const auto& samplers = this->pt->samplers.weapon_type;
+  bool has_sampler = (area_norm < samplers.size());
   parray<uint8_t, 0x0D> weapon_type_prob_table;
-  weapon_type_prob_table[0] = 0;
-  memmove(
-      weapon_type_prob_table.data() + 1,
-      this->pt->base_weapon_type_prob_table.data(),
-      0x0C);
-
-  for (size_t z = 1; z < 13; z++) {
-    // Technically this should be `if (... < 0)`, but whatever
-    if ((area_norm + this->pt->subtype_base_table.at(z - 1)) & 0x80) {
-      weapon_type_prob_table[z] = 0;
-    }
-  }
-
-  this->log.info("Subtype table: %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX",
-      weapon_type_prob_table[0], weapon_type_prob_table[1], weapon_type_prob_table[2], weapon_type_prob_table[3],
-      weapon_type_prob_table[4], weapon_type_prob_table[5], weapon_type_prob_table[6], weapon_type_prob_table[7],
-      weapon_type_prob_table[8], weapon_type_prob_table[9], weapon_type_prob_table[10], weapon_type_prob_table[11],
-      weapon_type_prob_table[12]);
-
-  item.data1[1] = this->get_rand_from_weighted_tables_1d(weapon_type_prob_table);
+  if (!has_sampler || this->log.should_log(phosg::LogLevel::INFO)) {
+    weapon_type_prob_table = this->pt->weapon_type_prob_table_for_area(area_norm);
+    this->log.info("Subtype table: %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX %02hhX",
+        weapon_type_prob_table[0], weapon_type_prob_table[1], weapon_type_prob_table[2], weapon_type_prob_table[3],
+        weapon_type_prob_table[4], weapon_type_prob_table[5], weapon_type_prob_table[6], weapon_type_prob_table[7],
+        weapon_type_prob_table[8], weapon_type_prob_table[9], weapon_type_prob_table[10], weapon_type_prob_table[11],
+        weapon_type_prob_table[12]);
+  }
+
+  item.data1[1] = has_sampler
+      ? this->get_rand_from_sampler(samplers[area_norm])
+      : this->get_rand_from_weighted_tables_1d(weapon_type_prob_table);
   if (item.data1[1] == 0) {
     this->log.info("00 chosen from subtype table; skipping item");
     item.clear();
@@ -799,7 +807,7 @@ void ItemCreator::generate_common_weapon_variances(uint8_t area_norm, ItemData&
 void ItemCreator::generate_common_weapon_grind(ItemData& item, uint8_t offset_within_subtype_range) {
   if (item.data1[0] == 0) {
     uint8_t offset = clamp<uint8_t>(offset_within_subtype_range, 0, 3);
-    item.data1[3] = this->get_rand_from_weighted_tables_2d_vertical(this->pt->grind_prob_table, offset);
+    item.data1[3] = this->get_rand_from_sampler(this->pt->samplers.grind.at(offset));
     this->log.info("Generated grind %02hhX from offset within subtype range %02hhX", item.data1[3], offset_within_subtype_range);
   }
 }
@@ -936,6 +944,14 @@ void ItemCreator::generate_common_unit_variances(uint8_t stars, ItemData& item)
       result.unit, result.modifier, results.size(), stars);
 }
 
+size_t ItemCreator::get_rand_from_sampler(const IndexProbabilitySampler& sampler) {
+  uint64_t rand_max = sampler.total();
+  if (rand_max == 0) {
+    throw runtime_error("weighted table is empty");
+  }
+  return sampler.index_for_value(this->rand_int(rand_max));
+}
+
 // Returns a weighted random result, indicating the chosen position in the
 // weighted table.
 //
@@ -973,6 +989,18 @@ IntT ItemCreator::get_rand_from_weighted_tables_2d_vertical(const parray<parray<
   return ItemCreator::get_rand_from_weighted_tables<IntT>(tables[0].data(), offset, Y, X);
 }
 
+template <typename IntT, size_t X, size_t Y, size_t NumSamplers>
+IntT ItemCreator::get_rand_from_weighted_tables_2d_vertical(
+    const parray<parray<IntT, X>, Y>& tables,
+    const array<IndexProbabilitySampler, NumSamplers>& samplers,
+    size_t offset) {
+  // Offsets beyond the precomputed columns read past the end of each row, as
+  // the original code does, so they don't have samplers
+  return (offset < NumSamplers)
+      ? this->get_rand_from_sampler(samplers[offset])
+      : this->get_rand_from_weighted_tables_2d_vertical(tables, offset);
+}
+
 vector<ItemData> ItemCreator::generate_armor_shop_contents(size_t player_level) {
   vector<ItemData> shop;
   this->generate_armor_shop_armors(shop, player_level);
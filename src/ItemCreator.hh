@@ -73,6 +73,9 @@ private:
   std::shared_ptr<const ItemParameterTable> item_parameter_table;
   std::shared_ptr<const CommonItemSet> common_item_set;
   std::shared_ptr<const CommonItemSet::Table> pt;
+  // Rare specs for this creator's mode, episode, difficulty, and section ID
+  // (points into rare_item_set; null if there are none)
+  const RareItemSet::SpecCollection* rare_specs;
   std::shared_ptr<const BattleRules> restrictions;
 
   struct UnitResult {
@@ -176,6 +179,9 @@ private:
   void generate_weapon_shop_item_bonus1(ItemData& item, size_t player_level);
   void generate_weapon_shop_item_bonus2(ItemData& item, size_t player_level);
 
+  void update_tables_for_section_id();
+
+  size_t get_rand_from_sampler(const IndexProbabilitySampler& sampler);
   template <typename IntT>
   IntT get_rand_from_weighted_tables(
       const IntT* tables, size_t offset, size_t num_values, size_t stride);
@@ -184,4 +190,9 @@ private:
   template <typename IntT, size_t X, size_t Y>
   IntT get_rand_from_weighted_tables_2d_vertical(
       const parray<parray<IntT, X>, Y>& tables, size_t offset);
+  template <typename IntT, size_t X, size_t Y, size_t NumSamplers>
+  IntT get_rand_from_weighted_tables_2d_vertical(
+      const parray<parray<IntT, X>, Y>& tables,
+      const std::array<IndexProbabilitySampler, NumSamplers>& samplers,
+      size_t offset);
 };
@@ -2,12 +2,15 @@
 
 #include <string.h>
 
+#include <algorithm>
+#include <bit>
 #include <phosg/Random.hh>
 
 #include "Compression.hh"
 #include "Loggers.hh"
 #include "SendCommands.hh"
 #include "Text.hh"
+#include "Watchdog.hh"
 
 using namespace std;
 
@@ -19,118 +22,255 @@ Lobby::FloorItemManager::FloorItemManager(uint32_t lobby_id, uint8_t floor)
     : log(phosg::string_printf("[Lobby:%08" PRIX32 ":FloorItems:%02hhX] ", lobby_id, floor), lobby_log.min_level),
       next_drop_number(0) {}
 
+vector<Lobby::FloorItemManager::IndexEntry>::iterator Lobby::FloorItemManager::index_lower_bound(uint32_t item_id) {
+  return lower_bound(this->index.begin(), this->index.end(), item_id, [](const IndexEntry& e, uint32_t item_id) -> bool {
+    return e.item_id < item_id;
+  });
+}
+
+vector<Lobby::FloorItemManager::IndexEntry>::const_iterator Lobby::FloorItemManager::index_lower_bound(uint32_t item_id) const {
+  return lower_bound(this->index.begin(), this->index.end(), item_id, [](const IndexEntry& e, uint32_t item_id) -> bool {
+    return e.item_id < item_id;
+  });
+}
+
 bool Lobby::FloorItemManager::exists(uint32_t item_id) const {
-  return this->items.count(item_id);
+  auto it = this->index_lower_bound(item_id);
+  return (it != this->index.end()) && (it->item_id == item_id);
 }
 
-shared_ptr<Lobby::FloorItem> Lobby::FloorItemManager::find(uint32_t item_id) const {
-  return this->items.at(item_id);
+const Lobby::FloorItem& Lobby::FloorItemManager::find(uint32_t item_id) const {
+  auto it = this->index_lower_bound(item_id);
+  if ((it == this->index.end()) || (it->item_id != item_id)) {
+    throw out_of_range("item not present");
+  }
+  return this->slots[it->slot_index].item;
 }
 
 void Lobby::FloorItemManager::add(const ItemData& item, float x, float z, uint16_t flags) {
-  auto fi = make_shared<FloorItem>();
-  fi->data = item;
-  fi->x = x;
-  fi->z = z;
-  fi->drop_number = this->next_drop_number++;
-  fi->flags = flags;
+  FloorItem fi;
+  fi.data = item;
+  fi.x = x;
+  fi.z = z;
+  fi.drop_number = this->next_drop_number++;
+  fi.flags = flags;
   this->add(fi);
 }
 
-void Lobby::FloorItemManager::add(shared_ptr<Lobby::FloorItem> fi) {
-  if (fi->flags == 0) {
+void Lobby::FloorItemManager::link_into_queue(uint8_t client_id, uint32_t slot_index) {
+  // New items always have the highest drop number, so they go at the end of
+  // the queue. Items that are put back after a failed pickup keep their
+  // original drop number, so we may have to walk back a bit to find the right
+  // place for them.
+  auto& queue = this->queues[client_id];
+  uint64_t drop_number = this->slots[slot_index].item.drop_number;
+  uint32_t prev_index = queue.tail;
+  while ((prev_index != NO_SLOT) && (this->slots[prev_index].item.drop_number > drop_number)) {
+    prev_index = this->slots[prev_index].queue_prev[client_id];
+  }
+  uint32_t next_index = (prev_index == NO_SLOT) ? queue.head : this->slots[prev_index].queue_next[client_id];
+
+  auto& slot = this->slots[slot_index];
+  slot.queue_prev[client_id] = prev_index;
+  slot.queue_next[client_id] = next_index;
+  if (prev_index == NO_SLOT) {
+    queue.head = slot_index;
+  } else {
+    this->slots[prev_index].queue_next[client_id] = slot_index;
+  }
+  if (next_index == NO_SLOT) {
+    queue.tail = slot_index;
+  } else {
+    this->slots[next_index].queue_prev[client_id] = slot_index;
+  }
+  queue.size++;
+}
+
+void Lobby::FloorItemManager::unlink_from_queue(uint8_t client_id, uint32_t slot_index) {
+  auto& queue = this->queues[client_id];
+  auto& slot = this->slots[slot_index];
+  uint32_t prev_index = slot.queue_prev[client_id];
+  uint32_t next_index = slot.queue_next[client_id];
+  if (prev_index == NO_SLOT) {
+    if (queue.head != slot_index) {
+      throw logic_error("item queue for client is inconsistent");
+    }
+    queue.head = next_index;
+  } else {
+    this->slots[prev_index].queue_next[client_id] = next_index;
+  }
+  if (next_index == NO_SLOT) {
+    if (queue.tail != slot_index) {
+      throw logic_error("item queue for client is inconsistent");
+    }
+    queue.tail = prev_index;
+  } else {
+    this->slots[next_index].queue_prev[client_id] = prev_index;
+  }
+  slot.queue_prev[client_id] = NO_SLOT;
+  slot.queue_next[client_id] = NO_SLOT;
+  queue.size--;
+}
+
+void Lobby::FloorItemManager::add(const FloorItem& fi) {
+  if ((fi.flags & 0x0FFF) == 0) {
     throw logic_error("floor item is not visible to any player");
   }
 
-  auto emplace_ret = this->items.emplace(fi->data.id, fi);
-  if (!emplace_ret.second) {
+  auto index_it = this->index_lower_bound(fi.data.id);
+  if ((index_it != this->index.end()) && (index_it->item_id == fi.data.id)) {
     throw runtime_error("floor item already exists with the same ID");
   }
+
+  uint32_t slot_index;
+  if (!this->free_slot_indexes.empty()) {
+    slot_index = this->free_slot_indexes.back();
+    this->free_slot_indexes.pop_back();
+  } else {
+    slot_index = this->slots.size();
+    this->slots.emplace_back();
+    size_t num_words = (this->slots.size() + 63) >> 6;
+    if (this->used_slots.size() < num_words) {
+      this->used_slots.resize(num_words, 0);
+      for (auto& bits : this->visible_slots) {
+        bits.resize(num_words, 0);
+      }
+    }
+  }
+  this->index.insert(index_it, IndexEntry{.item_id = fi.data.id, .slot_index = slot_index});
+
+  auto& slot = this->slots[slot_index];
+  slot.item = fi;
+  slot.queue_prev.fill(NO_SLOT);
+  slot.queue_next.fill(NO_SLOT);
+  uint64_t slot_mask = 1ULL << (slot_index & 63);
+  this->used_slots[slot_index >> 6] |= slot_mask;
   for (size_t z = 0; z < 12; z++) {
-    if (fi->visible_to_client(z)) {
-      this->queue_for_client[z].emplace(fi->drop_number, fi);
+    if (fi.visible_to_client(z)) {
+      this->visible_slots[z][slot_index >> 6] |= slot_mask;
+      this->link_into_queue(z, slot_index);
     }
   }
   this->log.info("Added floor item %08" PRIX32 " at %g, %g with drop number %" PRIu64 " with flags %03hX",
-      fi->data.id.load(), fi->x, fi->z, fi->drop_number, fi->flags);
+      fi.data.id.load(), fi.x, fi.z, fi.drop_number, fi.flags);
 }
 
-std::shared_ptr<Lobby::FloorItem> Lobby::FloorItemManager::remove(uint32_t item_id, uint8_t client_id) {
-  auto item_it = this->items.find(item_id);
-  if (item_it == this->items.end()) {
-    throw out_of_range("item not present");
-  }
-  auto fi = item_it->second;
-  if ((client_id != 0xFF) && !fi->visible_to_client(client_id)) {
-    throw runtime_error("client does not have access to item");
-  }
+Lobby::FloorItem Lobby::FloorItemManager::remove_slot(uint32_t slot_index) {
+  auto& slot = this->slots[slot_index];
+  uint64_t slot_mask = 1ULL << (slot_index & 63);
   for (size_t z = 0; z < 12; z++) {
-    if (fi->visible_to_client(z) && !this->queue_for_client[z].erase(fi->drop_number)) {
-      throw logic_error("item queue for client is inconsistent");
+    if (slot.item.visible_to_client(z)) {
+      this->unlink_from_queue(z, slot_index);
+      this->visible_slots[z][slot_index >> 6] &= ~slot_mask;
     }
   }
-  this->items.erase(item_it);
+  this->used_slots[slot_index >> 6] &= ~slot_mask;
+
+  auto index_it = this->index_lower_bound(slot.item.data.id);
+  if ((index_it == this->index.end()) || (index_it->slot_index != slot_index)) {
+    throw logic_error("item index is inconsistent");
+  }
+  this->index.erase(index_it);
+  this->free_slot_indexes.emplace_back(slot_index);
+
   this->log.info("Removed floor item %08" PRIX32 " at %g, %g with drop number %" PRIu64 " with flags %03hX",
-      fi->data.id.load(), fi->x, fi->z, fi->drop_number, fi->flags);
-  return fi;
+      slot.item.data.id.load(), slot.item.x, slot.item.z, slot.item.drop_number, slot.item.flags);
+  return slot.item;
+}
+
+Lobby::FloorItem Lobby::FloorItemManager::remove(uint32_t item_id, uint8_t client_id) {
+  auto index_it = this->index_lower_bound(item_id);
+  if ((index_it == this->index.end()) || (index_it->item_id != item_id)) {
+    throw out_of_range("item not present");
+  }
+  uint32_t slot_index = index_it->slot_index;
+  if ((client_id != 0xFF) && !this->slots[slot_index].item.visible_to_client(client_id)) {
+    throw runtime_error("client does not have access to item");
+  }
+  return this->remove_slot(slot_index);
 }
 
-std::unordered_set<std::shared_ptr<Lobby::FloorItem>> Lobby::FloorItemManager::evict() {
-  unordered_set<shared_ptr<FloorItem>> ret;
+vector<Lobby::FloorItem> Lobby::FloorItemManager::evict() {
+  vector<FloorItem> ret;
   for (size_t z = 0; z < 12; z++) {
-    while (this->queue_for_client[z].size() > 48) {
-      ret.emplace(this->remove(this->queue_for_client[z].begin()->second->data.id, 0xFF));
+    while (this->queues[z].size > MAX_ITEMS_PER_CLIENT) {
+      ret.emplace_back(this->remove_slot(this->queues[z].head));
     }
   }
   this->log.info("Evicted %zu items", ret.size());
   return ret;
 }
 
-void Lobby::FloorItemManager::clear_inaccessible(uint16_t remaining_clients_mask) {
-  unordered_set<uint32_t> item_ids_to_delete;
-  for (const auto& it : this->items) {
-    if ((it.second->flags & remaining_clients_mask) == 0) {
-      item_ids_to_delete.emplace(it.first);
+void Lobby::FloorItemManager::remove_slots_in_bitset(const vector<uint64_t>& slots_to_remove) {
+  for (size_t word_index = 0; word_index < slots_to_remove.size(); word_index++) {
+    uint64_t bits = slots_to_remove[word_index];
+    while (bits) {
+      size_t bit_index = countr_zero(bits);
+      this->remove_slot((word_index << 6) | bit_index);
+      bits &= (bits - 1);
     }
   }
-  for (uint32_t item_id : item_ids_to_delete) {
-    this->remove(item_id, 0xFF);
-  }
-  this->log.info("Deleted %zu inaccessible items", item_ids_to_delete.size());
 }
 
-void Lobby::FloorItemManager::clear_private() {
-  unordered_set<uint32_t> item_ids_to_delete;
-  for (const auto& it : this->items) {
-    if ((it.second->flags & 0x00F) != 0x00F) {
-      item_ids_to_delete.emplace(it.first);
+void Lobby::FloorItemManager::clear_inaccessible(uint16_t remaining_clients_mask) {
+  vector<uint64_t> slots_to_remove = this->used_slots;
+  size_t num_items = 0;
+  for (size_t word_index = 0; word_index < slots_to_remove.size(); word_index++) {
+    uint64_t visible_to_remaining = 0;
+    for (size_t z = 0; z < 12; z++) {
+      if (remaining_clients_mask & (1 << z)) {
+        visible_to_remaining |= this->visible_slots[z][word_index];
+      }
     }
+    slots_to_remove[word_index] &= ~visible_to_remaining;
+    num_items += popcount(slots_to_remove[word_index]);
   }
-  for (uint32_t item_id : item_ids_to_delete) {
-    this->remove(item_id, 0xFF);
-  }
-  this->log.info("Deleted %zu private items", item_ids_to_delete.size());
+  this->remove_slots_in_bitset(slots_to_remove);
+  this->log.info("Deleted %zu inaccessible items", num_items);
+}
+
+void Lobby::FloorItemManager::clear_private() {
+  // Items visible to all of the first four clients are public; all others
+  // are private
+  vector<uint64_t> slots_to_remove = this->used_slots;
+  size_t num_items = 0;
+  for (size_t word_index = 0; word_index < slots_to_remove.size(); word_index++) {
+    uint64_t visible_to_all = this->visible_slots[0][word_index] &
+        this->visible_slots[1][word_index] &
+        this->visible_slots[2][word_index] &
+        this->visible_slots[3][word_index];
+    slots_to_remove[word_index] &= ~visible_to_all;
+    num_items += popcount(slots_to_remove[word_index]);
+  }
+  this->remove_slots_in_bitset(slots_to_remove);
+  this->log.info("Deleted %zu private items", num_items);
 }
 
 void Lobby::FloorItemManager::clear() {
-  size_t num_items = this->items.size();
-  this->items.clear();
-  for (auto& queue : this->queue_for_client) {
-    queue.clear();
-  }
+  // This keeps the allocated memory for the slots and indexes, since the game
+  // will likely drop more items soon
+  size_t num_items = this->index.size();
+  this->slots.clear();
+  this->free_slot_indexes.clear();
+  this->index.clear();
+  this->used_slots.clear();
+  for (auto& bits : this->visible_slots) {
+    bits.clear();
+  }
+  this->queues.fill(Queue());
   this->next_drop_number = 0;
   this->log.info("Deleted %zu items", num_items);
 }
 
 uint32_t Lobby::FloorItemManager::reassign_all_item_ids(uint32_t next_item_id) {
-  ::map<uint32_t, shared_ptr<FloorItem>> old_items;
-  old_items.swap(this->items);
-  for (auto& queue : this->queue_for_client) {
-    queue.clear();
-  }
-  for (auto& it : old_items) {
-    it.second->data.id = next_item_id++;
-    this->add(it.second);
+  // Item IDs are reassigned in increasing order of the existing IDs, so the
+  // index remains sorted and the eviction queues (which are ordered by drop
+  // number) don't change
+  for (auto& e : this->index) {
+    auto& fi = this->slots[e.slot_index].item;
+    this->log.info("Reassigned floor item %08" PRIX32 " to %08" PRIX32, fi.data.id.load(), next_item_id);
+    e.item_id = next_item_id++;
+    fi.data.id = e.item_id;
   }
   return next_item_id;
 }
@@ -319,7 +459,8 @@ shared_ptr<Map> Lobby::load_maps(
     uint32_t random_seed,
     shared_ptr<PSOLFGEncryption> opt_rand_crypt,
     const parray<le_uint32_t, 0x20>& variations,
-    const phosg::PrefixedLogger* log) {
+    const phosg::PrefixedLogger* log,
+    shared_ptr<MapTemplateCache> template_cache) {
   auto enemy_filenames = sdt->map_filenames_for_variations(variations, episode, mode, SetDataTable::FilenameType::ENEMIES);
   auto object_filenames = sdt->map_filenames_for_variations(variations, episode, mode, SetDataTable::FilenameType::OBJECTS);
   auto event_filenames = sdt->map_filenames_for_variations(variations, episode, mode, SetDataTable::FilenameType::EVENTS);
@@ -337,38 +478,28 @@ shared_ptr<Map> Lobby::load_maps(
       rare_rates,
       random_seed,
       opt_rand_crypt,
-      log);
+      log,
+      template_cache);
 }
 
-shared_ptr<Map> Lobby::load_maps(
+static void add_free_roam_entities(
+    Map& map,
     const vector<string>& enemy_filenames,
     const vector<string>& object_filenames,
     const vector<string>& event_filenames,
     Version version,
     Episode episode,
-    GameMode mode,
     uint8_t difficulty,
     uint8_t event,
-    uint32_t lobby_id,
     function<shared_ptr<const string>(Version, const string&)> get_file_data,
     shared_ptr<const Map::RareEnemyRates> rare_rates,
-    uint32_t rare_seed,
-    shared_ptr<PSOLFGEncryption> opt_rand_crypt,
     const phosg::PrefixedLogger* log) {
-  auto map = make_shared<Map>(version, lobby_id, rare_seed, opt_rand_crypt);
-
-  // Don't load free-roam maps in Challenge mode, since players can't go to
-  // Ragol without a quest loaded
-  if (mode == GameMode::CHALLENGE) {
-    return map;
-  }
-
   for (size_t floor = 0; floor < 0x12; floor++) {
     const auto& floor_enemy_filename = enemy_filenames.at(floor);
     if (!floor_enemy_filename.empty()) {
       auto map_data = get_file_data(version, floor_enemy_filename);
       if (map_data) {
-        map->add_enemies_from_map_data(
+        map.add_enemies_from_map_data(
             episode,
             difficulty,
             event,
@@ -390,7 +521,7 @@ shared_ptr<Map> Lobby::load_maps(
     if (!floor_object_filename.empty()) {
       auto map_data = get_file_data(version, floor_object_filename);
       if (map_data) {
-        map->add_objects_from_map_data(floor, map_data);
+        map.add_objects_from_map_data(floor, map_data);
         if (log) {
           log->info("Loaded objects map %s for floor %02zX", floor_object_filename.c_str(), floor);
         }
@@ -405,7 +536,7 @@ shared_ptr<Map> Lobby::load_maps(
     if (!floor_event_filename.empty()) {
       auto map_data = get_file_data(version, floor_event_filename);
       if (map_data) {
-        map->add_events_from_map_data(floor, map_data->data(), map_data->size());
+        map.add_events_from_map_data(floor, map_data->data(), map_data->size());
         if (log) {
           log->info("Loaded events map %s for floor %02zX", floor_event_filename.c_str(), floor);
         }
@@ -416,8 +547,72 @@ shared_ptr<Map> Lobby::load_maps(
       log->info("No events to load for floor %02zX", floor);
     }
   }
+}
 
-  return map;
+shared_ptr<const Map> Lobby::load_map_template(
+    const vector<string>& enemy_filenames,
+    const vector<string>& object_filenames,
+    const vector<string>& event_filenames,
+    Version version,
+    Episode episode,
+    uint8_t difficulty,
+    uint8_t event,
+    function<shared_ptr<const string>(Version, const string&)> get_file_data,
+    const phosg::PrefixedLogger* log) {
+  auto tmpl = Map::create_template(version);
+  add_free_roam_entities(
+      *tmpl, enemy_filenames, object_filenames, event_filenames, version, episode, difficulty, event, get_file_data, Map::DEFAULT_RARE_ENEMIES, log);
+  return tmpl;
+}
+
+shared_ptr<Map> Lobby::load_maps(
+    const vector<string>& enemy_filenames,
+    const vector<string>& object_filenames,
+    const vector<string>& event_filenames,
+    Version version,
+    Episode episode,
+    GameMode mode,
+    uint8_t difficulty,
+    uint8_t event,
+    uint32_t lobby_id,
+    function<shared_ptr<const string>(Version, const string&)> get_file_data,
+    shared_ptr<const Map::RareEnemyRates> rare_rates,
+    uint32_t rare_seed,
+    shared_ptr<PSOLFGEncryption> opt_rand_crypt,
+    const phosg::PrefixedLogger* log,
+    shared_ptr<MapTemplateCache> template_cache) {
+  // Don't load free-roam maps in Challenge mode, since players can't go to
+  // Ragol without a quest loaded
+  if (mode == GameMode::CHALLENGE) {
+    return make_shared<Map>(version, lobby_id, rare_seed, opt_rand_crypt);
+  }
+
+  if (!template_cache) {
+    auto map = make_shared<Map>(version, lobby_id, rare_seed, opt_rand_crypt);
+    add_free_roam_entities(
+        *map, enemy_filenames, object_filenames, event_filenames, version, episode, difficulty, event, get_file_data, rare_rates, log);
+    return map;
+  }
+
+  // The game mode isn't part of the key because it only affects which map
+  // files are used, and those are part of the key
+  string key = phosg::string_printf("%s/%s/%hhu/%hhu",
+      phosg::name_for_enum(version), name_for_episode(episode), difficulty, event);
+  for (size_t floor = 0; floor < 0x12; floor++) {
+    key += phosg::string_printf("/%s,%s,%s",
+        enemy_filenames.at(floor).c_str(), object_filenames.at(floor).c_str(), event_filenames.at(floor).c_str());
+  }
+  auto tmpl = template_cache->get(key, [&]() -> shared_ptr<const Map> {
+    if (log) {
+      log->info("Creating map template");
+    }
+    return Lobby::load_map_template(
+        enemy_filenames, object_filenames, event_filenames, version, episode, difficulty, event, get_file_data, log);
+  });
+  if (log) {
+    log->info("Creating maps from template");
+  }
+  return make_shared<Map>(*tmpl, lobby_id, rare_seed, opt_rand_crypt, rare_rates);
 }
 
 void Lobby::load_maps() {
@@ -461,7 +656,8 @@ void Lobby::load_maps() {
         this->random_seed,
         this->opt_rand_crypt,
         this->variations,
-        &this->log);
+        &this->log,
+        s->map_template_cache);
 
   } else {
     this->map = make_shared<Map>(this->base_version, this->lobby_id, this->random_seed, this->opt_rand_crypt);
@@ -846,7 +1042,7 @@ bool Lobby::item_exists(uint8_t floor, uint32_t item_id) const {
   return this->floor_item_managers.at(floor).exists(item_id);
 }
 
-shared_ptr<Lobby::FloorItem> Lobby::find_item(uint8_t floor, uint32_t item_id) const {
+const Lobby::FloorItem& Lobby::find_item(uint8_t floor, uint32_t item_id) const {
   return this->floor_item_managers.at(floor).find(item_id);
 }
 
@@ -856,7 +1052,7 @@ void Lobby::add_item(uint8_t floor, const ItemData& data, float x, float z, uint
   this->evict_items_from_floor(floor);
 }
 
-void Lobby::add_item(uint8_t floor, shared_ptr<FloorItem> fi) {
+void Lobby::add_item(uint8_t floor, const FloorItem& fi) {
   auto& m = this->floor_item_managers.at(floor);
   m.add(fi);
   this->evict_items_from_floor(floor);
@@ -870,15 +1066,15 @@ void Lobby::evict_items_from_floor(uint8_t floor) {
     for (const auto& fi : evicted) {
       for (size_t z = 0; z < 12; z++) {
         auto lc = this->clients[z];
-        if (lc && fi->visible_to_client(z)) {
-          send_destroy_floor_item_to_client(lc, fi->data.id, floor);
+        if (lc && fi.visible_to_client(z)) {
+          send_destroy_floor_item_to_client(lc, fi.data.id, floor);
         }
       }
     }
   }
 }
 
-shared_ptr<Lobby::FloorItem> Lobby::remove_item(uint8_t floor, uint32_t item_id, uint8_t requesting_client_id) {
+Lobby::FloorItem Lobby::remove_item(uint8_t floor, uint32_t item_id, uint8_t requesting_client_id) {
   return this->floor_item_managers.at(floor).remove(item_id, requesting_client_id);
 }
 
@@ -952,6 +1148,7 @@ QuestIndex::IncludeCondition Lobby::quest_include_condition() const {
 }
 
 void Lobby::dispatch_on_idle_timeout(evutil_socket_t, short, void* ctx) {
+  WatchdogScope watchdog_scope(EventLoopWatchdog::CallbackType::TIMER, "Lobby::dispatch_on_idle_timeout");
   auto l = reinterpret_cast<Lobby*>(ctx)->shared_from_this();
   if (l->count_clients() == 0) {
     l->log.info("Idle timeout expired");
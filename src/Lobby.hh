@@ -39,27 +39,119 @@ struct Lobby : public std::enable_shared_from_this<Lobby> {
 
     bool visible_to_client(uint8_t client_id) const;
   };
+  // Floor items are stored by value in a slab of slots, which are reused as
+  // items are added and removed, so long-running games don't allocate for each
+  // drop and pickup. Each client's eviction queue is an intrusive linked list
+  // through the slots, and visibility is also tracked as a bitset of slots for
+  // each client, so clearing items that are no longer visible to anyone
+  // doesn't need to look at every item individually.
   struct FloorItemManager {
-    phosg::PrefixedLogger log;
-    uint64_t next_drop_number;
-    // It's important that this is a map and not an unordered_map. See the
-    // comment in send_game_item_state for more details.
-    std::map<uint32_t, std::shared_ptr<FloorItem>> items; // Keyed on item_id
-    std::array<std::map<uint64_t, std::shared_ptr<FloorItem>>, 12> queue_for_client;
+  private:
+    struct Slot;
+    struct IndexEntry {
+      uint32_t item_id;
+      uint32_t slot_index;
+    };
+
+  public:
+    class ItemRange {
+    public:
+      class Iterator {
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = const FloorItem*;
+        using difference_type = std::ptrdiff_t;
+
+        Iterator(const Slot* slots, const IndexEntry* it) : slots(slots), it(it) {}
+        inline const FloorItem* operator*() const {
+          return &this->slots[this->it->slot_index].item;
+        }
+        inline Iterator& operator++() {
+          this->it++;
+          return *this;
+        }
+        inline bool operator==(const Iterator& other) const {
+          return this->it == other.it;
+        }
+
+      private:
+        const Slot* slots;
+        const IndexEntry* it;
+      };
+
+      ItemRange(const Slot* slots, const std::vector<IndexEntry>& index) : slots(slots), index(index) {}
+      inline Iterator begin() const {
+        return Iterator(this->slots, this->index.data());
+      }
+      inline Iterator end() const {
+        return Iterator(this->slots, this->index.data() + this->index.size());
+      }
+      inline size_t size() const {
+        return this->index.size();
+      }
+      inline bool empty() const {
+        return this->index.empty();
+      }
+
+    private:
+      const Slot* slots;
+      const std::vector<IndexEntry>& index;
+    };
 
     FloorItemManager(uint32_t lobby_id, uint8_t floor);
     ~FloorItemManager() = default;
 
     bool exists(uint32_t item_id) const;
-    std::shared_ptr<FloorItem> find(uint32_t item_id) const;
+    const FloorItem& find(uint32_t item_id) const;
     void add(const ItemData& item, float x, float z, uint16_t flags);
-    void add(std::shared_ptr<FloorItem> fi);
-    std::shared_ptr<FloorItem> remove(uint32_t item_id, uint8_t client_id);
-    std::unordered_set<std::shared_ptr<FloorItem>> evict();
+    void add(const FloorItem& fi);
+    FloorItem remove(uint32_t item_id, uint8_t client_id);
+    std::vector<FloorItem> evict();
     void clear_inaccessible(uint16_t remaining_clients_mask);
     void clear_private();
     void clear();
     uint32_t reassign_all_item_ids(uint32_t next_item_id);
+
+    // It's important that items are iterated in increasing order of item ID.
+    // See the comment in send_game_item_state for more details.
+    inline ItemRange items() const {
+      return ItemRange(this->slots.data(), this->index);
+    }
+    inline size_t count_visible_to_client(uint8_t client_id) const {
+      return this->queues.at(client_id).size;
+    }
+
+  private:
+    static constexpr uint32_t NO_SLOT = 0xFFFFFFFF;
+    static constexpr size_t MAX_ITEMS_PER_CLIENT = 48;
+
+    struct Slot {
+      FloorItem item;
+      // Links in each client's eviction queue, which is ordered by drop number
+      std::array<uint32_t, 12> queue_prev;
+      std::array<uint32_t, 12> queue_next;
+    };
+    struct Queue {
+      uint32_t head = NO_SLOT;
+      uint32_t tail = NO_SLOT;
+      uint32_t size = 0;
+    };
+
+    phosg::PrefixedLogger log;
+    uint64_t next_drop_number;
+    std::vector<Slot> slots;
+    std::vector<uint32_t> free_slot_indexes;
+    std::vector<IndexEntry> index; // Sorted by item_id
+    std::vector<uint64_t> used_slots;
+    std::array<std::vector<uint64_t>, 12> visible_slots;
+    std::array<Queue, 12> queues;
+
+    std::vector<IndexEntry>::iterator index_lower_bound(uint32_t item_id);
+    std::vector<IndexEntry>::const_iterator index_lower_bound(uint32_t item_id) const;
+    void link_into_queue(uint8_t client_id, uint32_t slot_index);
+    void unlink_from_queue(uint8_t client_id, uint32_t slot_index);
+    FloorItem remove_slot(uint32_t slot_index);
+    void remove_slots_in_bitset(const std::vector<uint64_t>& slots_to_remove);
   };
   enum class Flag {
     // clang-format off
@@ -231,6 +323,17 @@ struct Lobby : public std::enable_shared_from_this<Lobby> {
       uint32_t random_seed,
       std::shared_ptr<PSOLFGEncryption> opt_rand_crypt,
       const parray<le_uint32_t, 0x20>& variations,
+      const phosg::PrefixedLogger* log = nullptr,
+      std::shared_ptr<MapTemplateCache> template_cache = nullptr);
+  static std::shared_ptr<const Map> load_map_template(
+      const std::vector<std::string>& enemy_filenames,
+      const std::vector<std::string>& object_filenames,
+      const std::vector<std::string>& event_filenames,
+      Version version,
+      Episode episode,
+      uint8_t difficulty,
+      uint8_t event,
+      std::function<std::shared_ptr<const std::string>(Version, const std::string&)> get_file_data,
       const phosg::PrefixedLogger* log = nullptr);
   static std::shared_ptr<Map> load_maps(
       const std::vector<std::string>& enemy_filenames,
@@ -246,7 +349,8 @@ struct Lobby : public std::enable_shared_from_this<Lobby> {
       std::shared_ptr<const Map::RareEnemyRates> rare_rates,
       uint32_t random_seed,
       std::shared_ptr<PSOLFGEncryption> opt_rand_crypt,
-      const phosg::PrefixedLogger* log = nullptr);
+      const phosg::PrefixedLogger* log = nullptr,
+      std::shared_ptr<MapTemplateCache> template_cache = nullptr);
   void load_maps();
   void create_ep3_server();
 
@@ -296,11 +400,11 @@ struct Lobby : public std::enable_shared_from_this<Lobby> {
   JoinError join_error_for_client(std::shared_ptr<Client> c, const std::string* password) const;
 
   bool item_exists(uint8_t floor, uint32_t item_id) const;
-  std::shared_ptr<FloorItem> find_item(uint8_t floor, uint32_t item_id) const;
+  const FloorItem& find_item(uint8_t floor, uint32_t item_id) const;
   void add_item(uint8_t floor, const ItemData& item, float x, float z, uint16_t flags);
-  void add_item(uint8_t floor, std::shared_ptr<FloorItem>);
+  void add_item(uint8_t floor, const FloorItem& fi);
   void evict_items_from_floor(uint8_t floor);
-  std::shared_ptr<FloorItem> remove_item(uint8_t floor, uint32_t item_id, uint8_t requesting_client_id);
+  FloorItem remove_item(uint8_t floor, uint32_t item_id, uint8_t requesting_client_id);
 
   uint32_t generate_item_id(uint8_t client_id);
   void on_item_id_generated_externally(uint32_t item_id);
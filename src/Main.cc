@@ -1,3 +1,5 @@
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
 #include <event2/event.h>
 #include <event2/thread.h>
 #include <pwd.h>
@@ -21,10 +23,13 @@
 #else
 #include "AddressTranslator-Stub.hh"
 #endif
+#include "AsyncFileWriter.hh"
 #include "BMLArchive.hh"
 #include "CatSession.hh"
 #include "Compression.hh"
 #include "DCSerialNumbers.hh"
+#include "DecryptionSeedSearch.hh"
+#include "DropSimulation.hh"
 #include "DNSServer.hh"
 #include "DownloadSession.hh"
 #include "GSLArchive.hh"
@@ -32,13 +37,16 @@
 #include "HTTPServer.hh"
 #include "IPStackSimulator.hh"
 #include "Loggers.hh"
+#include "Metrics.hh"
 #include "NetworkAddresses.hh"
 #include "PSOGCObjectGraph.hh"
 #include "PSOProtocol.hh"
 #include "PatchServer.hh"
 #include "ProxyServer.hh"
 #include "Quest.hh"
+#include "QuestIndexWatcher.hh"
 #include "QuestScript.hh"
+#include "RareEnemySeedSearch.hh"
 #include "ReplaySession.hh"
 #include "Revision.hh"
 #include "SaveFileFormats.hh"
@@ -50,6 +58,7 @@
 #include "StaticGameData.hh"
 #include "Text.hh"
 #include "TextIndex.hh"
+#include "Watchdog.hh"
 
 using namespace std;
 
@@ -275,6 +284,7 @@ static void a_compress_decompress_fn(phosg::Arguments& args) {
   bool is_optimal = args.get<bool>("optimal");
   bool is_pessimal = args.get<bool>("pessimal");
   int8_t compression_level = args.get<int8_t>("compression-level", 0);
+  size_t chained_level = args.get<size_t>("chained", 0);
   size_t bytes = args.get<size_t>("bytes", 0);
   string seed = args.get<string>("seed");
 
@@ -308,6 +318,8 @@ static void a_compress_decompress_fn(phosg::Arguments& args) {
       data = prs_compress_optimal(data.data(), data.size(), optimal_progress_fn);
     } else if (is_pessimal) {
       data = prs_compress_pessimal(data.data(), data.size());
+    } else if (chained_level) {
+      data = prs_compress_chained(data.data(), data.size(), chained_level, progress_fn);
     } else {
       data = prs_compress(data, compression_level, progress_fn);
     }
@@ -382,7 +394,10 @@ Action a_compress_prc("compress-prc", "\
     in valid PRS data which is about 9/8 the size of the input.\n\
     There is also a compressor which produces the absolute smallest output\n\
     size, but uses much more memory and CPU time. To use this compressor, use\n\
-    the --optimal option.\n",
+    the --optimal option.\n\
+    For PRS, PR2, and PRC, the --chained=LEVEL option uses the hash chain\n\
+    compressor instead, which is much faster than the heuristic-based\n\
+    compressor. LEVEL ranges from 1 (fastest) to 9 (same as --optimal).\n",
     a_compress_decompress_fn);
 Action a_decompress_prs("decompress-prs", nullptr, a_compress_decompress_fn);
 Action a_decompress_bc0("decompress-bc0", nullptr, a_compress_decompress_fn);
@@ -395,6 +410,88 @@ Action a_decompress_prc("decompress-prc", "\
     Decompress data compressed using the PRS, PR2, PRC, or BC0 algorithms.\n",
     a_compress_decompress_fn);
 
+Action a_prs_compression_speed_test(
+    "prs-compression-speed-test", "\
+  prs-compression-speed-test [INPUT-FILENAME]\n\
+    Compress the input data with each PRS compressor and compression level,\n\
+    and show the time taken and output size for each. Each result is also\n\
+    checked by decompressing it. Levels 1 and 2 of the heuristic-based\n\
+    compressor are slow on large inputs; to skip them, use the --skip-slow\n\
+    option.\n",
+    +[](phosg::Arguments& args) {
+      bool skip_slow = args.get<bool>("skip-slow");
+      string data = read_input_data(args);
+
+      auto run_test = [&](const string& name, auto&& fn) -> void {
+        uint64_t start = phosg::now();
+        string compressed = fn();
+        uint64_t end = phosg::now();
+        bool correct = (prs_decompress(compressed) == data);
+        string time_str = phosg::format_duration(end - start);
+        string bytes_per_sec_str = phosg::format_size(data.size() / (static_cast<double>(end - start) / 1000000.0));
+        float size_ratio = static_cast<float>(compressed.size() * 100) / data.size();
+        phosg::log_info("%s: %zu => %zu bytes (%g%%) in %s (%s / sec)%s",
+            name.c_str(), data.size(), compressed.size(), size_ratio, time_str.c_str(), bytes_per_sec_str.c_str(),
+            correct ? "" : " (INCORRECT)");
+      };
+
+      for (ssize_t level = 0; level <= (skip_slow ? 0 : 2); level++) {
+        run_test(phosg::string_printf("prs_compress(level=%zd)", level), [&]() { return prs_compress(data, level); });
+      }
+      run_test("prs_compress_indexed", [&]() { return prs_compress_indexed(data); });
+      for (size_t level = 1; level <= 9; level++) {
+        run_test(phosg::string_printf("prs_compress_chained(level=%zu)", level), [&]() { return prs_compress_chained(data, level); });
+      }
+      run_test("prs_compress_optimal", [&]() { return prs_compress_optimal(data); });
+    });
+
+Action a_prs_decompression_speed_test(
+    "prs-decompression-speed-test", "\
+  prs-decompression-speed-test [INPUT-FILENAME] [--iterations=N]\n\
+    Decompress the PRS-compressed input data N times (default 100) with each\n\
+    decompressor, and show the average throughput of each. The streaming\n\
+    decompressor is given the input in 1KB chunks, as if it were being sent\n\
+    in 13 or A7 commands. The decompressed data is also recompressed with\n\
+    BC0 to measure the BC0 decompressor. If any decompressor produces\n\
+    incorrect output, this command fails.\n",
+    +[](phosg::Arguments& args) {
+      size_t iterations = args.get<size_t>("iterations", 100);
+      string data = read_input_data(args);
+      string expected = prs_decompress(data);
+      string bc0_data = bc0_compress(expected);
+
+      // fn returns whether the decompressor's output was correct
+      auto run_test = [&](const string& name, auto&& fn) -> void {
+        bool correct = true;
+        uint64_t start = phosg::now();
+        for (size_t z = 0; z < iterations; z++) {
+          correct &= fn();
+        }
+        uint64_t end = phosg::now();
+        if (!correct) {
+          throw runtime_error(name + " produced incorrect output");
+        }
+        string time_str = phosg::format_duration((end - start) / iterations);
+        string bytes_per_sec_str = phosg::format_size((expected.size() * iterations) / (static_cast<double>(end - start) / 1000000.0));
+        phosg::log_info("%s: %zu => %zu bytes in %s (%s / sec)",
+            name.c_str(), data.size(), expected.size(), time_str.c_str(), bytes_per_sec_str.c_str());
+      };
+
+      run_test("prs_decompress", [&]() { return prs_decompress(data) == expected; });
+      run_test("prs_decompress_size", [&]() { return prs_decompress_size(data) == expected.size(); });
+      run_test("PRSDecompressor", [&]() {
+        PRSDecompressor prs;
+        string ret;
+        for (size_t offset = 0; offset < data.size(); offset += 0x400) {
+          prs.add(data.data() + offset, min<size_t>(data.size() - offset, 0x400));
+          ret += prs.read_output();
+        }
+        ret += prs.close();
+        return ret == expected;
+      });
+      run_test("bc0_decompress", [&]() { return bc0_decompress(bc0_data) == expected; });
+    });
+
 Action a_prs_size(
     "prs-size", "\
   prs-size [INPUT-FILENAME]\n\
@@ -505,6 +602,58 @@ Action a_decrypt_data("decrypt-data", "\
     file formats.\n",
     a_encrypt_decrypt_fn);
 
+Action a_encryption_speed_test(
+    "encryption-speed-test", "\
+  encryption-speed-test [OPTIONS...]\n\
+    Measure the throughput of the PSO encryption algorithms. BB encryption is\n\
+    only measured if the --key=KEY-NAME option is given. Options:\n\
+      --size=SIZE: Number of bytes to encrypt in each call (default 0x400)\n\
+      --total-size=SIZE: Number of bytes to encrypt for each test (default\n\
+          0x10000000)\n",
+    +[](phosg::Arguments& args) {
+      size_t size = args.get<size_t>("size", 0x400) & (~7);
+      size_t total_size = args.get<size_t>("total-size", 0x10000000);
+      if (size == 0) {
+        throw invalid_argument("size must be at least 8");
+      }
+      string data = phosg::random_data(size);
+      string data2 = phosg::random_data(size);
+
+      auto run_test = [&](const char* name, auto&& fn) -> void {
+        uint64_t start = phosg::now();
+        size_t bytes = 0;
+        for (; bytes < total_size; bytes += size) {
+          fn();
+        }
+        uint64_t end = phosg::now();
+        string time_str = phosg::format_duration(end - start);
+        string bytes_per_sec_str = phosg::format_size(bytes / (static_cast<double>(end - start) / 1000000.0));
+        phosg::log_info("%s: %zu bytes in %s (%s / sec)", name, bytes, time_str.c_str(), bytes_per_sec_str.c_str());
+      };
+
+      phosg::log_info("Using %s kernels for V2 and V3 encryption", lfg_kernel_name());
+      {
+        PSOV2Encryption crypt(phosg::random_object<uint32_t>());
+        run_test("V2", [&]() { crypt.encrypt(data.data(), data.size()); });
+        run_test("V2 (big-endian)", [&]() { crypt.encrypt_big_endian(data.data(), data.size()); });
+        run_test("V2 (both-endian)", [&]() { crypt.encrypt_both_endian(data.data(), data2.data(), data.size()); });
+      }
+      {
+        PSOV3Encryption crypt(phosg::random_object<uint32_t>());
+        run_test("V3", [&]() { crypt.encrypt(data.data(), data.size()); });
+        run_test("V3 (big-endian)", [&]() { crypt.encrypt_big_endian(data.data(), data.size()); });
+        run_test("V3 (both-endian)", [&]() { crypt.encrypt_both_endian(data.data(), data2.data(), data.size()); });
+      }
+      string key_name = args.get<string>("key");
+      if (!key_name.empty()) {
+        auto key = phosg::load_object_file<PSOBBEncryption::KeyFile>("system/blueburst/keys/" + key_name + ".nsk");
+        string seed = phosg::random_data(0x30);
+        PSOBBEncryption crypt(key, seed.data(), seed.size());
+        run_test("BB (encrypt)", [&]() { crypt.encrypt(data.data(), data.size()); });
+        run_test("BB (decrypt)", [&]() { crypt.decrypt(data.data(), data.size()); });
+      }
+    });
+
 static void a_encrypt_decrypt_trivial_fn(phosg::Arguments& args) {
   bool is_decrypt = (args.get<string>(0) == "decrypt-trivial-data");
   string seed = args.get<string>("seed");
@@ -1083,7 +1232,6 @@ Action a_find_decryption_seed(
       bool skip_big_endian = args.get<bool>("skip-big-endian");
       size_t num_threads = args.get<size_t>("threads", 0);
 
-      size_t max_plaintext_size = 0;
       vector<pair<string, string>> plaintexts;
       for (const auto& plaintext_ascii : plaintexts_ascii) {
         string mask;
@@ -1091,53 +1239,12 @@ Action a_find_decryption_seed(
         if (data.size() != mask.size()) {
           throw logic_error("plaintext and mask are not the same size");
         }
-        max_plaintext_size = max<size_t>(max_plaintext_size, data.size());
         plaintexts.emplace_back(std::move(data), std::move(mask));
       }
       string ciphertext = phosg::parse_data_string(ciphertext_ascii, nullptr, phosg::ParseDataFlags::ALLOW_FILES);
 
-      auto mask_match = +[](const void* a, const void* b, const void* m, size_t size) -> bool {
-        const uint8_t* a8 = reinterpret_cast<const uint8_t*>(a);
-        const uint8_t* b8 = reinterpret_cast<const uint8_t*>(b);
-        const uint8_t* m8 = reinterpret_cast<const uint8_t*>(m);
-        for (size_t z = 0; z < size; z++) {
-          if ((a8[z] & m8[z]) != (b8[z] & m8[z])) {
-            return false;
-          }
-        }
-        return true;
-      };
-
-      uint64_t seed = phosg::parallel_range<uint64_t>([&](uint64_t seed, size_t) -> bool {
-        string be_decrypt_buf = ciphertext.substr(0, max_plaintext_size);
-        string le_decrypt_buf = ciphertext.substr(0, max_plaintext_size);
-        if (uses_v3_encryption(version)) {
-          PSOV3Encryption(seed).encrypt_both_endian(
-              le_decrypt_buf.data(),
-              be_decrypt_buf.data(),
-              be_decrypt_buf.size());
-        } else {
-          PSOV2Encryption(seed).encrypt_both_endian(
-              le_decrypt_buf.data(),
-              be_decrypt_buf.data(),
-              be_decrypt_buf.size());
-        }
-
-        for (const auto& plaintext : plaintexts) {
-          if (!skip_little_endian) {
-            if (mask_match(le_decrypt_buf.data(), plaintext.first.data(), plaintext.second.data(), plaintext.second.size())) {
-              return true;
-            }
-          }
-          if (!skip_big_endian) {
-            if (mask_match(be_decrypt_buf.data(), plaintext.first.data(), plaintext.second.data(), plaintext.second.size())) {
-              return true;
-            }
-          }
-        }
-        return false;
-      },
-          0, 0x100000000, num_threads);
+      uint64_t seed = find_decryption_seed(
+          ciphertext, plaintexts, uses_v3_encryption(version), !skip_little_endian, !skip_big_endian, num_threads);
 
       if (seed < 0x100000000) {
         phosg::log_info("Found seed %08" PRIX64, seed);
@@ -2245,8 +2352,12 @@ Action a_find_rare_enemy_seeds(
     which variations are used on all versions and which rare rates to use for\n\
     BB. --threads=COUNT controls the number of threads to use for the search\n\
     by default, one thread per CPU core is used. --min-count specifies how many\n\
-    rare enemies must be found to output the seed. Finally, --quest=NAME may be\n\
-    given to use that quest\'s map instead of the free-roam maps.\n",
+    rare enemies must be found to output the seed. --quest=NAME may be given to\n\
+    use that quest\'s map instead of the free-roam maps. Finally, to split the\n\
+    search across multiple processes or machines, use --shard=INDEX/COUNT; this\n\
+    searches only the INDEX-th of COUNT equal parts of the seed range (INDEX\n\
+    starts at 0). The output is sorted by seed, so the outputs from all shards\n\
+    can be combined with merge-rare-enemy-seeds (or concatenated in order).\n",
     +[](phosg::Arguments& args) {
       auto version = get_cli_version(args);
       auto episode = get_cli_episode(args);
@@ -2255,6 +2366,23 @@ Action a_find_rare_enemy_seeds(
       size_t num_threads = args.get<size_t>("threads", 0);
       size_t min_count = args.get<size_t>("min-count", 1);
       string quest_name = args.get<string>("quest", false);
+      string shard_str = args.get<string>("shard", false);
+
+      uint64_t start_seed = 0;
+      uint64_t end_seed = 0x100000000;
+      if (!shard_str.empty()) {
+        auto tokens = phosg::split(shard_str, '/');
+        if (tokens.size() != 2) {
+          throw invalid_argument("--shard must be of the form INDEX/COUNT");
+        }
+        uint64_t shard_index = stoull(tokens[0], nullptr, 0);
+        uint64_t num_shards = stoull(tokens[1], nullptr, 0);
+        if ((num_shards == 0) || (shard_index >= num_shards)) {
+          throw invalid_argument("invalid shard index or count");
+        }
+        start_seed = (0x100000000 * shard_index) / num_shards;
+        end_seed = (0x100000000 * (shard_index + 1)) / num_shards;
+      }
 
       auto s = make_shared<ServerState>(get_config_filename(args));
       shared_ptr<const VersionedQuest> vq;
@@ -2269,12 +2397,14 @@ Action a_find_rare_enemy_seeds(
         if (!vq) {
           throw runtime_error("quest version does not exist");
         }
-      } else if (version == Version::BB_V4) {
-        s->load_config_early();
-      } else if (version == Version::PC_V2) {
-        s->load_patch_indexes(false);
+        if (!vq->dat_contents_decompressed) {
+          throw runtime_error("quest does not have DAT data");
+        }
       } else {
+        s->load_config_early();
         s->clear_file_caches(false);
+        s->load_patch_indexes(false);
+        s->load_set_data_tables(false);
       }
 
       shared_ptr<const Map::RareEnemyRates> rare_rates;
@@ -2286,56 +2416,361 @@ Action a_find_rare_enemy_seeds(
         rare_rates = s->rare_enemy_rates_by_difficulty[difficulty];
       }
 
-      mutex output_lock;
-      auto thread_fn = [&](uint64_t seed, size_t) -> bool {
-        auto random_crypt = make_shared<PSOV2Encryption>(seed);
-        parray<le_uint32_t, 0x20> variations;
+      unique_ptr<RareEnemySeedSearch> search;
+      if (vq) {
+        search = make_unique<RareEnemySeedSearch>(vq->dat_contents_decompressed, version, episode, difficulty, rare_rates);
+      } else {
+        search = make_unique<RareEnemySeedSearch>(
+            s->set_data_table(version, episode, mode, difficulty),
+            bind(&ServerState::load_map_file, s.get(), placeholders::_1, placeholders::_2),
+            version,
+            episode,
+            mode,
+            difficulty,
+            rare_rates);
+      }
+
+      auto on_result = [&](const RareEnemySeedSearch::Result& result) -> void {
+        fprintf(stdout, "%08" PRIX32 ":", result.seed);
+        for (const auto& [index, type] : result.rare_enemies) {
+          fprintf(stdout, " E-%hX:%s", index, phosg::name_for_enum(type));
+        }
+        fputc('\n', stdout);
+      };
+      auto progress_fn = [&](uint64_t next_seed, size_t num_results) -> void {
+        fprintf(stderr, "... %08" PRIX64 " %zu (0x%zX) found\r", next_seed, num_results, num_results);
+      };
+      search->search(start_seed, end_seed, min_count, num_threads, on_result, progress_fn);
+      fputc('\n', stderr);
+    });
 
-        shared_ptr<Map> map;
-        if (vq) {
-          if (!vq->dat_contents_decompressed) {
-            throw runtime_error("quest does not have DAT data");
-          }
-          map = Lobby::load_maps(
-              version, episode, difficulty, 0, 0, rare_rates, seed, random_crypt, vq->dat_contents_decompressed);
+Action a_merge_rare_enemy_seeds(
+    "merge-rare-enemy-seeds", "\
+  merge-rare-enemy-seeds INPUT-FILENAME...\n\
+    Merge the outputs of multiple find-rare-enemy-seeds runs (for example, from\n\
+    different shards) into one list sorted by seed, and write it to stdout.\n",
+    +[](phosg::Arguments& args) {
+      const auto& filenames = args.get_positional();
+      if (filenames.size() < 2) {
+        throw invalid_argument("at least one input filename is required");
+      }
 
-        } else {
-          generate_variations_deprecated(variations, random_crypt, version, episode, (mode == GameMode::SOLO));
-          map = Lobby::load_maps(
-              version,
-              episode,
-              mode,
-              difficulty,
-              0,
-              0,
-              s->set_data_table(version, episode, mode, difficulty),
-              bind(&ServerState::load_map_file, s.get(), placeholders::_1, placeholders::_2),
-              rare_rates,
-              seed,
-              random_crypt,
-              variations);
-        }
-
-        vector<size_t> rare_indexes;
-        for (size_t z = 0; z < map->enemies.size(); z++) {
-          if (enemy_type_is_rare(map->enemies[z].type)) {
-            rare_indexes.emplace_back(z);
+      // Each input is already sorted, so we only need to keep the next line
+      // from each one in memory
+      struct Input {
+        unique_ptr<FILE, void (*)(FILE*)> f;
+        string line;
+        uint64_t seed;
+      };
+      vector<Input> inputs;
+      auto advance = [](Input& input) -> void {
+        input.line.clear();
+        input.seed = 0x100000000;
+        while (input.line.empty() && !feof(input.f.get())) {
+          input.line = phosg::fgets(input.f.get());
+          phosg::strip_trailing_whitespace(input.line);
+        }
+        if (!input.line.empty()) {
+          input.seed = stoul(input.line.substr(0, input.line.find(':')), nullptr, 16);
+        }
+      };
+      for (size_t z = 1; z < filenames.size(); z++) {
+        auto& input = inputs.emplace_back(Input{.f = phosg::fopen_unique(filenames[z], "rt"), .line = "", .seed = 0});
+        advance(input);
+      }
+
+      for (;;) {
+        Input* next_input = nullptr;
+        for (auto& input : inputs) {
+          if (!input.line.empty() && (!next_input || (input.seed < next_input->seed))) {
+            next_input = &input;
           }
         }
+        if (!next_input) {
+          break;
+        }
+        fprintf(stdout, "%s\n", next_input->line.c_str());
+        advance(*next_input);
+      }
+    });
+
+Action a_simulate_drops(
+    "simulate-drops", "\
+  simulate-drops OPTIONS...\n\
+    Simulate clearing a map many times, checking for an item drop from every\n\
+    enemy and box in it, and print the resulting drop rate for each item with\n\
+    a 95% confidence interval. A version option (e.g. --gc) and an episode\n\
+    option (--ep1, --ep2, or --ep4) are required; a difficulty option and a\n\
+    game mode option (--battle, --challenge, or --solo) may also be given.\n\
+    Options:\n\
+      --section-id=NAME: Use this section ID\'s drop tables (default Viridia).\n\
+      --quest=NAME: Use this quest\'s map instead of the free-roam maps. The\n\
+          free-roam maps always use the first variation of each floor.\n\
+      --runs=COUNT: Number of map clears to simulate (default 10000).\n\
+      --seed=SEED: Base random seed (hex). Each run\'s seed is derived from\n\
+          this seed and the run\'s index, so the runs are independent of each\n\
+          other. The map\'s rare enemies are chosen by this seed. The results\n\
+          depend only on the seed and run count, not on the number of\n\
+          threads.\n\
+      --threads=COUNT: Number of threads to use (default one per CPU core).\n\
+      --rare-table=NAME: Use this rare table from system/item-tables instead\n\
+          of the version\'s default (e.g. rare-table-v4).\n\
+      --multiply=X: Multiply all rare drop rates by X.\n\
+    To compare two sets of tables, give one or more of the following options.\n\
+    The same runs are then simulated with the alternate tables, and the rates\n\
+    of each item are compared with a two-proportion z-test; differences with\n\
+    |z| > 1.96 (significant at the 95% level) are marked with a *.\n\
+      --compare-rare-table=NAME: Use this rare table in the second simulation.\n\
+      --compare-multiply=X: Multiply all rare drop rates by X in the second\n\
+          simulation.\n\
+      --compare-common-table=FILENAME: Use this common item table (.json,\n\
+          .gsl, or .gslb) in the second simulation.\n",
+    +[](phosg::Arguments& args) {
+      auto version = get_cli_version(args);
+      auto episode = get_cli_episode(args);
+      auto difficulty = get_cli_difficulty(args);
+      auto mode = get_cli_game_mode(args);
+      if (mode == GameMode::SOLO) {
+        mode = GameMode::NORMAL;
+      }
+      string section_id_name = args.get<string>("section-id", false);
+      uint8_t section_id = section_id_name.empty() ? 0 : section_id_for_name(section_id_name);
+      if (section_id >= 10) {
+        throw invalid_argument("invalid section ID");
+      }
+      string quest_name = args.get<string>("quest", false);
+      uint64_t num_runs = args.get<uint64_t>("runs", 10000);
+      size_t num_threads = args.get<size_t>("threads", 0);
+      string seed_str = args.get<string>("seed", false);
+      uint32_t seed = seed_str.empty() ? 0 : stoul(seed_str, nullptr, 16);
+      string rare_table_name = args.get<string>("rare-table", false);
+      double rate_factor = args.get<double>("multiply", 1.0);
+      string compare_rare_table_name = args.get<string>("compare-rare-table", false);
+      double compare_rate_factor = args.get<double>("compare-multiply", 1.0);
+      string compare_common_table_filename = args.get<string>("compare-common-table", false);
+      bool should_compare = !compare_rare_table_name.empty() ||
+          (compare_rate_factor != 1.0) ||
+          !compare_common_table_filename.empty();
 
-        if (rare_indexes.size() >= min_count) {
-          lock_guard g(output_lock);
-          fprintf(stdout, "%08" PRIX64 ":", seed);
-          for (size_t index : rare_indexes) {
-            fprintf(stdout, " E-%zX:%s", index, phosg::name_for_enum(map->enemies[index].type));
+      auto s = make_shared<ServerState>(get_config_filename(args));
+      s->load_config_early();
+      s->clear_file_caches(false);
+      s->load_patch_indexes(false);
+      s->load_text_index(false);
+      s->load_item_definitions(false);
+      s->load_item_name_indexes(false);
+      s->load_drop_tables(false);
+      s->load_set_data_tables(false);
+      // ItemCreator logs every drop check at the info level, which would make
+      // this far too slow
+      lobby_log.min_level = phosg::LogLevel::WARNING;
+
+      shared_ptr<const CommonItemSet> common_item_set;
+      switch (version) {
+        case Version::DC_NTE:
+        case Version::DC_V1_11_2000_PROTOTYPE:
+        case Version::DC_V1:
+          common_item_set = s->common_item_set_v2;
+          if (rare_table_name.empty()) {
+            rare_table_name = "rare-table-v1";
+          }
+          break;
+        case Version::DC_V2:
+        case Version::PC_NTE:
+        case Version::PC_V2:
+          common_item_set = s->common_item_set_v2;
+          if (rare_table_name.empty()) {
+            rare_table_name = "rare-table-v2";
+          }
+          break;
+        case Version::GC_NTE:
+        case Version::GC_V3:
+        case Version::XB_V3:
+          common_item_set = s->common_item_set_v3_v4;
+          if (rare_table_name.empty()) {
+            rare_table_name = "rare-table-v3";
+          }
+          break;
+        case Version::BB_V4:
+          common_item_set = s->common_item_set_v3_v4;
+          if (rare_table_name.empty()) {
+            rare_table_name = "rare-table-v4";
           }
-          fprintf(stdout, "\n");
+          break;
+        default:
+          throw runtime_error("cannot simulate drops for this version");
+      }
+
+      auto get_rare_item_set = [&](const string& name, double factor) -> shared_ptr<const RareItemSet> {
+        auto it = s->rare_item_sets.find(name);
+        if (it == s->rare_item_sets.end()) {
+          throw runtime_error("rare table " + name + " does not exist");
+        }
+        if (factor == 1.0) {
+          return it->second;
         }
+        auto rs = make_shared<RareItemSet>(*it->second);
+        rs->multiply_all_rates(factor);
+        return rs;
+      };
 
-        return false;
+      shared_ptr<const Map::RareEnemyRates> rare_rates;
+      if (version != Version::BB_V4) {
+        rare_rates = Map::DEFAULT_RARE_ENEMIES;
+      } else if (mode == GameMode::CHALLENGE) {
+        rare_rates = s->rare_enemy_rates_challenge;
+      } else {
+        rare_rates = s->rare_enemy_rates_by_difficulty[difficulty];
+      }
+
+      auto sdt = s->set_data_table(version, episode, mode, difficulty);
+      shared_ptr<Map> map;
+      if (!quest_name.empty()) {
+        s->load_quest_index(false);
+        auto q = s->quest_index(version)->get(quest_name);
+        if (!q) {
+          throw runtime_error("quest does not exist");
+        }
+        auto vq = q->version(version, 1);
+        if (!vq) {
+          throw runtime_error("quest version does not exist");
+        }
+        if (!vq->dat_contents_decompressed) {
+          throw runtime_error("quest does not have DAT data");
+        }
+        map = Lobby::load_maps(version, episode, difficulty, 0, 0, rare_rates, seed, nullptr, vq->dat_contents_decompressed);
+      } else {
+        parray<le_uint32_t, 0x20> variations;
+        map = Lobby::load_maps(
+            version,
+            episode,
+            mode,
+            difficulty,
+            0,
+            0,
+            sdt,
+            bind(&ServerState::load_map_file, s.get(), placeholders::_1, placeholders::_2),
+            rare_rates,
+            seed,
+            nullptr,
+            variations);
+      }
+
+      DropSimulation::Config config{
+          .common_item_set = common_item_set,
+          .rare_item_set = get_rare_item_set(rare_table_name, rate_factor),
+          .armor_random_set = s->armor_random_set,
+          .tool_random_set = s->tool_random_set,
+          .weapon_random_set = s->weapon_random_sets.at(difficulty),
+          .tekker_adjustment_set = s->tekker_adjustment_set,
+          .item_parameter_table = s->item_parameter_table(version),
+          .stack_limits = s->item_stack_limits(version),
+          .episode = episode,
+          .mode = mode,
+          .difficulty = difficulty,
+          .section_id = section_id,
+      };
+      auto sources = DropSimulation::sources_for_map(*map, *sdt, episode);
+      size_t num_box_sources = 0;
+      for (const auto& src : sources) {
+        num_box_sources += src.is_box();
+      }
+      fprintf(stderr, "Map has %zu enemies and %zu boxes that can drop items\n",
+          sources.size() - num_box_sources, num_box_sources);
+
+      auto run_simulation = [&](const DropSimulation::Config& config) -> DropSimulation::Result {
+        DropSimulation sim(config, sources);
+        auto progress_fn = [&](uint64_t runs_done) -> void {
+          fprintf(stderr, "... %" PRIu64 "/%" PRIu64 " runs\r", runs_done, num_runs);
+        };
+        auto result = sim.run(seed, num_runs, num_threads, progress_fn);
+        fprintf(stderr, "%" PRIu64 " runs done in %s (%g drop checks/s)\n",
+            result.num_runs, phosg::format_duration(result.elapsed_usecs).c_str(), result.checks_per_second());
+        return result;
       };
 
-      phosg::parallel_range<uint64_t>(thread_fn, 0, 0x100000000, num_threads, nullptr);
+      auto item_name = [&](uint32_t primary_identifier) -> string {
+        try {
+          auto item = ItemData::from_primary_identifier(*config.stack_limits, primary_identifier);
+          return s->describe_item(version, item, false);
+        } catch (const exception&) {
+          return phosg::string_printf("(%08" PRIX32 ")", primary_identifier);
+        }
+      };
+
+      auto result = run_simulation(config);
+      if (!should_compare) {
+        fprintf(stdout, "Enemy drops: %" PRIu64 " of %" PRIu64 " checks; box drops: %" PRIu64 " of %" PRIu64 " checks\n",
+            result.num_enemy_drops, result.num_enemy_checks, result.num_box_drops, result.num_box_checks);
+        fprintf(stdout, "ITEM     SOURCE      COUNT  RATE PER CHECK (95%% CI)          RARE  NAME\n");
+        for (const auto& [id, stats] : result.items) {
+          for (bool is_box : {false, true}) {
+            uint64_t count = is_box ? stats.box_count : stats.enemy_count;
+            uint64_t num_checks = is_box ? result.num_box_checks : result.num_enemy_checks;
+            if (count == 0) {
+              continue;
+            }
+            auto [low, high] = DropSimulation::wilson_interval(count, num_checks);
+            fprintf(stdout, "%08" PRIX32 " %-6s %10" PRIu64 "  %.3e [%.3e, %.3e]  %-4s  %s\n",
+                id, is_box ? "box" : "enemy", count, static_cast<double>(count) / num_checks, low, high,
+                stats.rare_count ? "yes" : "", item_name(id).c_str());
+          }
+        }
+        return;
+      }
+
+      auto compare_config = config;
+      if (!compare_rare_table_name.empty() || (compare_rate_factor != 1.0)) {
+        compare_config.rare_item_set = get_rare_item_set(
+            compare_rare_table_name.empty() ? rare_table_name : compare_rare_table_name, compare_rate_factor);
+      }
+      if (!compare_common_table_filename.empty()) {
+        auto data = make_shared<string>(phosg::load_file(compare_common_table_filename));
+        if (phosg::ends_with(compare_common_table_filename, ".json")) {
+          compare_config.common_item_set = make_shared<JSONCommonItemSet>(phosg::JSON::parse(*data));
+        } else if (phosg::ends_with(compare_common_table_filename, ".gsl")) {
+          compare_config.common_item_set = make_shared<GSLV3V4CommonItemSet>(data, false);
+        } else if (phosg::ends_with(compare_common_table_filename, ".gslb")) {
+          compare_config.common_item_set = make_shared<GSLV3V4CommonItemSet>(data, true);
+        } else {
+          throw runtime_error("cannot determine common table format; use a filename ending with .json, .gsl, or .gslb");
+        }
+      }
+      auto compare_result = run_simulation(compare_config);
+
+      fprintf(stdout, "Enemy drops: %" PRIu64 " => %" PRIu64 " of %" PRIu64 " checks; box drops: %" PRIu64 " => %" PRIu64 " of %" PRIu64 " checks\n",
+          result.num_enemy_drops, compare_result.num_enemy_drops, result.num_enemy_checks,
+          result.num_box_drops, compare_result.num_box_drops, result.num_box_checks);
+      fprintf(stdout, "ITEM     SOURCE   RATE BEFORE  RATE AFTER         Z   NAME\n");
+      set<uint32_t> all_ids;
+      for (const auto& it : result.items) {
+        all_ids.emplace(it.first);
+      }
+      for (const auto& it : compare_result.items) {
+        all_ids.emplace(it.first);
+      }
+      static const DropSimulation::ItemStats empty_stats;
+      for (uint32_t id : all_ids) {
+        auto before_it = result.items.find(id);
+        auto after_it = compare_result.items.find(id);
+        const auto& before = (before_it == result.items.end()) ? empty_stats : before_it->second;
+        const auto& after = (after_it == compare_result.items.end()) ? empty_stats : after_it->second;
+        for (bool is_box : {false, true}) {
+          uint64_t before_count = is_box ? before.box_count : before.enemy_count;
+          uint64_t after_count = is_box ? after.box_count : after.enemy_count;
+          uint64_t num_checks = is_box ? result.num_box_checks : result.num_enemy_checks;
+          uint64_t compare_num_checks = is_box ? compare_result.num_box_checks : compare_result.num_enemy_checks;
+          if ((before_count == 0) && (after_count == 0)) {
+            continue;
+          }
+          double z = DropSimulation::two_proportion_z(before_count, num_checks, after_count, compare_num_checks);
+          fprintf(stdout, "%08" PRIX32 " %-6s  %.3e    %.3e  %+8.2f%c  %s\n",
+              id, is_box ? "box" : "enemy",
+              static_cast<double>(before_count) / num_checks,
+              static_cast<double>(after_count) / compare_num_checks,
+              z, (fabs(z) > 1.96) ? '*' : ' ', item_name(id).c_str());
+        }
+      }
     });
 
 Action a_load_maps_test(
@@ -2413,7 +2848,7 @@ Action a_load_maps_test(
                       auto map_data = s->load_map_file(v, events_filename);
                       if (map_data) {
                         map->add_events_from_map_data(floor, map_data->data(), map_data->size());
-                        fprintf(stderr, "%zu events, %zu action bytes]", map->events.size(), map->event_action_stream.size());
+                        fprintf(stderr, "%zu events, %zu action bytes]", map->events.size(), map->get_layout().event_action_stream.size());
                       } else {
                         fprintf(stderr, "__MISSING__]");
                       }
@@ -2454,6 +2889,363 @@ Action a_load_maps_test(
       }
     });
 
+Action a_map_templates_test(
+    "map-templates-test", nullptr, +[](phosg::Arguments& args) {
+      // Creates free-roam maps for several variations and rare seeds both by
+      // loading the map files directly and from a template, and checks that
+      // the results are identical. On BB, rare enemies are chosen with the
+      // game's random number generator, so this also checks that both paths
+      // consume the same random values.
+      auto s = make_shared<ServerState>(get_config_filename(args));
+      s->load_config_early();
+      s->clear_file_caches(false);
+      s->load_patch_indexes(false);
+      s->load_set_data_tables(false);
+      auto get_file_data = bind(&ServerState::load_map_file, s.get(), placeholders::_1, placeholders::_2);
+      auto template_cache = make_shared<MapTemplateCache>();
+      // DEFAULT_RARE_ENEMIES almost never produces rares on BB in a few maps,
+      // so use much higher rates there to make sure the rolls are tested
+      auto bb_rare_rates = make_shared<Map::RareEnemyRates>(0x40000000, 0x40000000);
+
+      auto check_maps = [](const Map& direct, const Map& from_tmpl) -> void {
+        if (direct.enemies.size() != from_tmpl.enemies.size()) {
+          throw runtime_error(phosg::string_printf("enemy count does not match (%zu from files, %zu from template)",
+              direct.enemies.size(), from_tmpl.enemies.size()));
+        }
+        for (size_t z = 0; z < direct.enemies.size(); z++) {
+          const auto& de = direct.enemies[z];
+          const auto& te = from_tmpl.enemies[z];
+          if ((de.enemy_id != te.enemy_id) ||
+              (de.source_index != te.source_index) ||
+              (de.set_index != te.set_index) ||
+              (de.floor != te.floor) ||
+              (de.section != te.section) ||
+              (de.wave_number != te.wave_number) ||
+              (de.type != te.type) ||
+              (de.alias_entity_id != te.alias_entity_id)) {
+            throw runtime_error(phosg::string_printf("enemy %zX does not match (%s from files, %s from template)",
+                z, phosg::name_for_enum(de.type), phosg::name_for_enum(te.type)));
+          }
+          if (direct.find_enemy(de.floor, de.type).enemy_id != from_tmpl.find_enemy(te.floor, te.type).enemy_id) {
+            throw runtime_error(phosg::string_printf("enemy lookup by floor and type does not match for enemy %zX", z));
+          }
+        }
+        if (direct.rare_enemy_indexes != from_tmpl.rare_enemy_indexes) {
+          throw runtime_error("rare enemy indexes do not match");
+        }
+        if (direct.enemy_set_flags.size() != from_tmpl.enemy_set_flags.size()) {
+          throw runtime_error("enemy set count does not match");
+        }
+        if (direct.objects.size() != from_tmpl.objects.size()) {
+          throw runtime_error("object count does not match");
+        }
+        for (size_t z = 0; z < direct.objects.size(); z++) {
+          const auto& dobj = direct.objects[z];
+          const auto& tobj = from_tmpl.objects[z];
+          if ((dobj.floor != tobj.floor) ||
+              (dobj.object_id != tobj.object_id) ||
+              (dobj.source_index != tobj.source_index) ||
+              memcmp(dobj.args, tobj.args, sizeof(*dobj.args))) {
+            throw runtime_error(phosg::string_printf("object %zX does not match", z));
+          }
+        }
+        if (direct.events.size() != from_tmpl.events.size()) {
+          throw runtime_error("event count does not match");
+        }
+        for (size_t z = 0; z < direct.events.size(); z++) {
+          if (direct.events[z].str() != from_tmpl.events[z].str()) {
+            throw runtime_error(phosg::string_printf("event %zX does not match", z));
+          }
+        }
+        if (direct.get_layout().event_action_stream != from_tmpl.get_layout().event_action_stream) {
+          throw runtime_error("event action stream does not match");
+        }
+      };
+
+      size_t num_maps = 0;
+      size_t num_rare_enemies = 0;
+      for (size_t v_s = NUM_PATCH_VERSIONS; v_s < NUM_VERSIONS; v_s++) {
+        Version v = static_cast<Version>(v_s);
+        if (is_ep3(v)) {
+          continue;
+        }
+        const array<Episode, 3> episodes = {Episode::EP1, Episode::EP2, Episode::EP4};
+        for (Episode episode : episodes) {
+          if (episode == Episode::EP4 && !is_v4(v)) {
+            continue;
+          }
+          if (episode == Episode::EP2 && is_v1_or_v2(v) && (v != Version::GC_NTE)) {
+            continue;
+          }
+          const array<GameMode, 3> modes = {GameMode::NORMAL, GameMode::BATTLE, GameMode::SOLO};
+          for (GameMode mode : modes) {
+            if (mode == GameMode::BATTLE && is_v1(v)) {
+              continue;
+            }
+            if (mode == GameMode::SOLO && !is_v4(v)) {
+              continue;
+            }
+            for (uint8_t difficulty = 0; difficulty < 4; difficulty++) {
+              if (difficulty == 3 && is_v1(v)) {
+                continue;
+              }
+              auto sdt = s->set_data_table(v, episode, mode, difficulty);
+              auto rare_rates = (v == Version::BB_V4) ? bb_rare_rates : Map::DEFAULT_RARE_ENEMIES;
+              size_t num_rare_enemies_before = num_rare_enemies;
+              for (uint32_t variations_seed = 0; variations_seed < 3; variations_seed++) {
+                auto variations = sdt->generate_variations(
+                    episode, mode == GameMode::SOLO, make_shared<PSOV2Encryption>(variations_seed));
+                for (uint32_t rare_seed = 0; rare_seed < 0x40000000; rare_seed += 0x07654321) {
+                  auto direct_crypt = make_shared<PSOV2Encryption>(rare_seed);
+                  auto direct = Lobby::load_maps(
+                      v, episode, mode, difficulty, 0, 0, sdt, get_file_data, rare_rates, rare_seed, direct_crypt, variations);
+                  auto tmpl_crypt = make_shared<PSOV2Encryption>(rare_seed);
+                  auto from_tmpl = Lobby::load_maps(
+                      v, episode, mode, difficulty, 0, 0, sdt, get_file_data, rare_rates, rare_seed, tmpl_crypt, variations, nullptr, template_cache);
+                  try {
+                    check_maps(*direct, *from_tmpl);
+                    if (direct_crypt->next() != tmpl_crypt->next()) {
+                      throw runtime_error("random state after loading maps does not match");
+                    }
+                  } catch (const exception& e) {
+                    throw runtime_error(phosg::string_printf("%s %s %s %s (variations seed %" PRIu32 ", rare seed %08" PRIX32 "): %s",
+                        phosg::name_for_enum(v), name_for_episode(episode), name_for_mode(mode), name_for_difficulty(difficulty),
+                        variations_seed, rare_seed, e.what()));
+                  }
+                  num_maps++;
+                  num_rare_enemies += direct->rare_enemy_indexes.size();
+                }
+              }
+              fprintf(stderr, "... %s %s %s %s: %zu rare enemies\n",
+                  phosg::name_for_enum(v), name_for_episode(episode), name_for_mode(mode), name_for_difficulty(difficulty),
+                  num_rare_enemies - num_rare_enemies_before);
+            }
+          }
+        }
+      }
+      if (num_rare_enemies == 0) {
+        throw runtime_error("no rare enemies were chosen in any map");
+      }
+      fprintf(stderr, "%zu maps matched (%zu rare enemies)\n", num_maps, num_rare_enemies);
+    });
+
+Action a_floor_items_test(
+    "floor-items-test", nullptr, +[](phosg::Arguments&) {
+      // Runs a long deterministic sequence of random operations on a
+      // FloorItemManager and on a simple model of it (which behaves the same
+      // way as the original map-based implementation), and checks that the
+      // items, their iteration order, each client's visible item count, and
+      // the evicted items always match.
+      using FloorItem = Lobby::FloorItem;
+      struct ReferenceFloorItems {
+        map<uint32_t, FloorItem> items;
+        array<map<uint64_t, uint32_t>, 12> queue_for_client; // drop_number -> item_id
+
+        void add(const FloorItem& fi) {
+          this->items.emplace(fi.data.id, fi);
+          for (size_t z = 0; z < 12; z++) {
+            if (fi.visible_to_client(z)) {
+              this->queue_for_client[z].emplace(fi.drop_number, fi.data.id);
+            }
+          }
+        }
+        FloorItem remove(uint32_t item_id) {
+          FloorItem fi = this->items.at(item_id);
+          for (size_t z = 0; z < 12; z++) {
+            if (fi.visible_to_client(z)) {
+              this->queue_for_client[z].erase(fi.drop_number);
+            }
+          }
+          this->items.erase(item_id);
+          return fi;
+        }
+        set<uint32_t> evict() {
+          set<uint32_t> ret;
+          for (size_t z = 0; z < 12; z++) {
+            while (this->queue_for_client[z].size() > 48) {
+              uint32_t item_id = this->queue_for_client[z].begin()->second;
+              this->remove(item_id);
+              ret.emplace(item_id);
+            }
+          }
+          return ret;
+        }
+        void remove_if(function<bool(const FloorItem&)> pred) {
+          vector<uint32_t> item_ids;
+          for (const auto& it : this->items) {
+            if (pred(it.second)) {
+              item_ids.emplace_back(it.first);
+            }
+          }
+          for (uint32_t item_id : item_ids) {
+            this->remove(item_id);
+          }
+        }
+      };
+
+      auto check_equal = [](const Lobby::FloorItemManager& m, const ReferenceFloorItems& ref) -> void {
+        if (m.items().size() != ref.items.size()) {
+          throw runtime_error(phosg::string_printf("item count does not match (%zu, expected %zu)", m.items().size(), ref.items.size()));
+        }
+        auto ref_it = ref.items.begin();
+        for (const auto* fi : m.items()) {
+          const auto& ref_fi = ref_it->second;
+          if ((fi->data.id != ref_fi.data.id) ||
+              (fi->data != ref_fi.data) ||
+              (fi->x != ref_fi.x) ||
+              (fi->z != ref_fi.z) ||
+              (fi->drop_number != ref_fi.drop_number) ||
+              (fi->flags != ref_fi.flags)) {
+            throw runtime_error(phosg::string_printf("item %08" PRIX32 " does not match (expected %08" PRIX32 ")",
+                fi->data.id.load(), ref_fi.data.id.load()));
+          }
+          ref_it++;
+        }
+        for (size_t z = 0; z < 12; z++) {
+          if (m.count_visible_to_client(z) != ref.queue_for_client[z].size()) {
+            throw runtime_error(phosg::string_printf("client %zu can see %zu items (expected %zu)",
+                z, m.count_visible_to_client(z), ref.queue_for_client[z].size()));
+          }
+        }
+      };
+
+      size_t num_operations = 0;
+      size_t num_evicted = 0;
+      for (uint32_t seed = 0; seed < 8; seed++) {
+        PSOV2Encryption random(seed);
+        Lobby::FloorItemManager m(0, 0);
+        ReferenceFloorItems ref;
+        uint64_t next_drop_number = 0;
+        uint32_t next_item_id = 0x00010000;
+        auto random_item_id = [&]() -> uint32_t {
+          auto it = ref.items.begin();
+          advance(it, random.next() % ref.items.size());
+          return it->first;
+        };
+
+        for (size_t step = 0; step < 20000; step++) {
+          uint32_t op = random.next() % 100;
+          try {
+            if (op < 45 || ref.items.empty()) {
+              // Most items are visible to everyone, but some are private or
+              // visible to only a few clients
+              uint16_t flags;
+              uint32_t visibility_type = random.next() % 4;
+              if (visibility_type == 0) {
+                flags = 0x00F;
+              } else if (visibility_type == 1) {
+                flags = 1 << (random.next() % 4);
+              } else {
+                flags = (random.next() & 0x0FFF) | 1;
+              }
+              if (random.next() & 1) {
+                flags |= 0x1000;
+              }
+              ItemData item;
+              // Item IDs usually increase, but not always (e.g. when a player
+              // drops an item from their inventory)
+              item.id = (random.next() % 8) ? next_item_id++ : (random.next() & 0xFFFF);
+              item.data1[0] = random.next() % 3;
+              item.data1[2] = random.next();
+              float x = static_cast<int32_t>(random.next() % 2000) - 1000;
+              float z = static_cast<int32_t>(random.next() % 2000) - 1000;
+              if (ref.items.count(item.id)) {
+                continue;
+              }
+              m.add(item, x, z, flags);
+              ref.add(FloorItem{.data = item, .x = x, .z = z, .drop_number = next_drop_number++, .flags = flags});
+
+            } else if (op < 75) {
+              uint32_t item_id = random_item_id();
+              uint32_t client_id_r = random.next() % 5;
+              uint8_t client_id = (client_id_r == 4) ? 0xFF : client_id_r;
+              bool expect_allowed = (client_id == 0xFF) || ref.items.at(item_id).visible_to_client(client_id);
+              FloorItem fi;
+              try {
+                fi = m.remove(item_id, client_id);
+              } catch (const runtime_error&) {
+                if (expect_allowed) {
+                  throw;
+                }
+                continue;
+              }
+              if (!expect_allowed) {
+                throw runtime_error("client removed an item it cannot see");
+              }
+              FloorItem ref_fi = ref.remove(item_id);
+              if ((fi.data != ref_fi.data) || (fi.drop_number != ref_fi.drop_number) || (fi.flags != ref_fi.flags)) {
+                throw runtime_error("removed item does not match");
+              }
+              // Sometimes put the item back, as if the pickup failed; it must
+              // keep its original place in the eviction queues
+              if ((random.next() % 4) == 0) {
+                m.add(fi);
+                ref.add(fi);
+              }
+
+            } else if (op < 95) {
+              auto evicted = m.evict();
+              set<uint32_t> evicted_ids;
+              for (const auto& fi : evicted) {
+                evicted_ids.emplace(fi.data.id);
+              }
+              if (evicted_ids != ref.evict()) {
+                throw runtime_error("evicted items do not match");
+              }
+              num_evicted += evicted_ids.size();
+
+            } else if (op < 97) {
+              uint16_t remaining_clients_mask = random.next() & 0x0FFF;
+              m.clear_inaccessible(remaining_clients_mask);
+              ref.remove_if([&](const FloorItem& fi) -> bool { return !(fi.flags & remaining_clients_mask); });
+
+            } else if (op < 98) {
+              m.clear_private();
+              ref.remove_if([&](const FloorItem& fi) -> bool { return (fi.flags & 0x00F) != 0x00F; });
+
+            } else if (op < 99) {
+              uint32_t base_item_id = 0x00800000 + (random.next() & 0xFFFF);
+              uint32_t end_item_id = m.reassign_all_item_ids(base_item_id);
+              ReferenceFloorItems new_ref;
+              uint32_t ref_item_id = base_item_id;
+              for (auto& it : ref.items) {
+                it.second.data.id = ref_item_id++;
+                new_ref.add(it.second);
+              }
+              ref = std::move(new_ref);
+              if (end_item_id != ref_item_id) {
+                throw runtime_error("next item ID after reassignment does not match");
+              }
+
+            } else {
+              m.clear();
+              ref = ReferenceFloorItems();
+              next_drop_number = 0;
+            }
+
+            check_equal(m, ref);
+            for (size_t z = 0; z < 4; z++) {
+              uint32_t item_id = random.next() & 0x00FFFFFF;
+              if (m.exists(item_id) != (ref.items.count(item_id) != 0)) {
+                throw runtime_error("item existence does not match");
+              }
+            }
+            if (!ref.items.empty()) {
+              uint32_t item_id = random_item_id();
+              if (m.find(item_id).drop_number != ref.items.at(item_id).drop_number) {
+                throw runtime_error("found item does not match");
+              }
+            }
+            num_operations++;
+
+          } catch (const exception& e) {
+            throw runtime_error(phosg::string_printf("seed %" PRIu32 " step %zu (operation %" PRIu32 "): %s", seed, step, op, e.what()));
+          }
+        }
+      }
+      fprintf(stderr, "%zu operations matched (%zu items evicted)\n", num_operations, num_evicted);
+    });
+
 Action a_parse_object_graph(
     "parse-object-graph", nullptr, +[](phosg::Arguments& args) {
       uint32_t root_object_address = args.get<uint32_t>("root", phosg::Arguments::IntFormat::HEX);
@@ -2550,6 +3342,89 @@ Action a_dc_serial_number_speed_test(
       }
     });
 
+Action a_broadcast_speed_test(
+    "broadcast-speed-test", "\
+  broadcast-speed-test [OPTIONS...]\n\
+    Measure the per-recipient cost of sending the same command to every client\n\
+    in a 12-player game and in a 150-player lobby, both when each command is\n\
+    framed separately for each recipient and when the framed command is built\n\
+    once and only copied and encrypted for each recipient. The version can be\n\
+    given with a version option (e.g. --gc or --dc-v2); the default is GC.\n\
+    Measuring BB requires the --key=KEY-NAME option. Other options:\n\
+      --size=SIZE: Size of the command data in bytes (default 0x24)\n\
+      --iterations=COUNT: Number of broadcasts for each test (default 10000)\n",
+    +[](phosg::Arguments& args) {
+      Version version = get_cli_version(args, Version::GC_V3);
+      size_t data_size = args.get<size_t>("size", 0x24);
+      size_t iterations = args.get<size_t>("iterations", 10000);
+
+      shared_ptr<const PSOBBEncryption::KeyFile> bb_key;
+      if (uses_v4_encryption(version)) {
+        string key_name = args.get<string>("key");
+        if (key_name.empty()) {
+          throw runtime_error("the --key option is required for BB");
+        }
+        bb_key = make_shared<PSOBBEncryption::KeyFile>(
+            phosg::load_object_file<PSOBBEncryption::KeyFile>("system/blueburst/keys/" + key_name + ".nsk"));
+      }
+      auto make_crypt = [&](uint32_t seed) -> shared_ptr<PSOEncryption> {
+        if (uses_v2_encryption(version)) {
+          return make_shared<PSOV2Encryption>(seed);
+        } else if (uses_v3_encryption(version)) {
+          return make_shared<PSOV3Encryption>(seed);
+        } else if (uses_v4_encryption(version)) {
+          string seed_data = phosg::random_data(0x30);
+          return make_shared<PSOBBEncryption>(*bb_key, seed_data.data(), seed_data.size());
+        } else {
+          throw runtime_error("invalid game version");
+        }
+      };
+
+      shared_ptr<struct event_base> base(event_base_new(), event_base_free);
+      string data = phosg::random_data(data_size);
+
+      for (size_t num_recipients : {12, 150}) {
+        vector<unique_ptr<Channel>> channels;
+        for (size_t z = 0; z < num_recipients; z++) {
+          auto& ch = channels.emplace_back(make_unique<Channel>(
+              bufferevent_socket_new(base.get(), -1, 0), 0, version, 1, nullptr, nullptr, nullptr, phosg::string_printf("C-%zX", z)));
+          ch->crypt_out = make_crypt(phosg::random_object<uint32_t>());
+        }
+        auto drain_all = [&]() -> void {
+          for (auto& ch : channels) {
+            struct evbuffer* buf = bufferevent_get_output(ch->bev.get());
+            evbuffer_drain(buf, evbuffer_get_length(buf));
+          }
+        };
+
+        uint64_t start = phosg::now();
+        for (size_t z = 0; z < iterations; z++) {
+          for (auto& ch : channels) {
+            ch->send(0x60, 0x00, data);
+          }
+          drain_all();
+        }
+        uint64_t separate_usecs = phosg::now() - start;
+
+        start = phosg::now();
+        for (size_t z = 0; z < iterations; z++) {
+          auto msg = Channel::prepare(version, true, 0x60, 0x00, data.data(), data.size());
+          for (auto& ch : channels) {
+            ch->send(msg);
+          }
+          drain_all();
+        }
+        uint64_t prepared_usecs = phosg::now() - start;
+
+        double num_sends = iterations * num_recipients;
+        phosg::log_info("%zu recipients: %g ns/recipient when framed separately, %g ns/recipient when framed once (%g%%)",
+            num_recipients,
+            (separate_usecs * 1000.0) / num_sends,
+            (prepared_usecs * 1000.0) / num_sends,
+            (prepared_usecs * 100.0) / separate_usecs);
+      }
+    });
+
 Action a_address_translator(
     "address-translator", nullptr, +[](phosg::Arguments& args) {
       const string& dir = args.get<string>(1, false);
@@ -2709,10 +3584,24 @@ Action a_run_server_replay_log(
         set_function_compiler_available(false);
       }
 
+      global_file_writer = make_shared<AsyncFileWriter>();
+
       shared_ptr<struct event_base> base(event_base_new(), event_base_free);
       auto state = make_shared<ServerState>(base, get_config_filename(args), is_replay);
       state->load_all();
 
+      // This is created before any of the servers are started, since the HTTP
+      // server reads state->watchdog from its own thread. It's created even if
+      // SlowCallbackThreshold is zero, since it also records callback
+      // durations for the metrics.
+      if (!is_replay) {
+        if (state->slow_callback_threshold_usecs) {
+          config_log.info("Enabling event loop watchdog");
+        }
+        state->watchdog = make_shared<EventLoopWatchdog>(state->slow_callback_threshold_usecs);
+        state->watchdog->watch_current_thread();
+      }
+
       if (state->dns_server_port && !is_replay) {
         if (!state->dns_server_addr.empty()) {
           config_log.info("Starting DNS server on %s:%hu", state->dns_server_addr.c_str(), state->dns_server_port);
@@ -2729,6 +3618,8 @@ Action a_run_server_replay_log(
       shared_ptr<ServerShell> shell;
       shared_ptr<ReplaySession> replay_session;
       shared_ptr<SignalWatcher> signal_watcher;
+      shared_ptr<EventLoopLagProbe> lag_probe;
+      shared_ptr<QuestIndexWatcher> quest_index_watcher;
       if (is_replay) {
         config_log.info("Starting proxy server");
         state->proxy_server = make_shared<ProxyServer>(base, state);
@@ -2849,6 +3740,13 @@ Action a_run_server_replay_log(
         config_log.info("Enabling signal watcher");
         signal_watcher = make_shared<SignalWatcher>(state);
 #endif
+
+        lag_probe = make_shared<EventLoopLagProbe>(base);
+
+        if (state->watch_quest_directories) {
+          config_log.info("Enabling quest directory watcher");
+          quest_index_watcher = make_shared<QuestIndexWatcher>(state);
+        }
       }
 
       if (!state->username.empty()) {
@@ -2907,6 +3805,10 @@ Action a_run_server_replay_log(
         state->http_server->wait_for_stop();
       }
       state->proxy_server.reset(); // Break reference cycle
+      state->watchdog.reset();
+
+      config_log.info("Waiting for pending file writes");
+      global_file_writer.reset();
     });
 
 void print_version_info() {
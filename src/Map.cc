@@ -729,7 +729,71 @@ Map::Map(Version version, uint32_t lobby_id, uint32_t rare_seed, std::shared_ptr
     : log(phosg::string_printf("[Lobby:%08" PRIX32 ":map] ", lobby_id), lobby_log.min_level),
       version(version),
       rare_seed(rare_seed),
-      opt_rand_crypt(opt_rand_crypt) {}
+      opt_rand_crypt(opt_rand_crypt),
+      is_template(false),
+      layout(make_shared<Layout>()) {}
+
+Map::Map(
+    const Map& tmpl,
+    uint32_t lobby_id,
+    uint32_t rare_seed,
+    std::shared_ptr<PSOLFGEncryption> opt_rand_crypt,
+    std::shared_ptr<const RareEnemyRates> rare_rates)
+    : log(phosg::string_printf("[Lobby:%08" PRIX32 ":map] ", lobby_id), lobby_log.min_level),
+      version(tmpl.version),
+      rare_seed(rare_seed),
+      opt_rand_crypt(opt_rand_crypt),
+      is_template(false),
+      layout(tmpl.layout),
+      objects(tmpl.objects),
+      enemies(tmpl.enemies),
+      enemy_set_flags(tmpl.enemy_set_flags),
+      events(tmpl.events) {
+  if (!tmpl.is_template) {
+    throw logic_error("cannot create map from non-template map");
+  }
+  // The candidates are in the order their enemies were added, which is the
+  // order in which check_and_log_rare_enemy would have been called if the
+  // map had been loaded directly
+  for (const auto& candidate : tmpl.rare_enemy_candidates) {
+    if (this->check_and_log_rare_enemy(candidate.enemy_index, (*rare_rates).*candidate.rate)) {
+      this->enemies[candidate.enemy_index].type = candidate.rare_type;
+    }
+  }
+}
+
+shared_ptr<Map> Map::create_template(Version version) {
+  auto ret = make_shared<Map>(version, 0, 0, nullptr);
+  ret->log = phosg::PrefixedLogger("[Map template] ", lobby_log.min_level);
+  ret->is_template = true;
+  return ret;
+}
+
+Map::Layout& Map::mutable_layout() {
+  // Maps created from the same template share the layout, so copy it before
+  // modifying it if it's shared
+  if (this->layout.use_count() > 1) {
+    this->layout = make_shared<Layout>(*this->layout);
+  }
+  return *this->layout;
+}
+
+void Map::Layout::sort_indexes() {
+  this->floor_and_event_id_to_index.sort();
+  this->floor_section_and_group_to_object_index.sort();
+  this->floor_section_and_wave_number_to_enemy_index.sort();
+  this->floor_section_and_wave_number_to_event_index.sort();
+  this->floor_and_switch_flag_to_door_index.sort();
+  this->floor_and_type_to_enemy_index.sort();
+}
+
+void Map::sort_indexes() {
+  // If nothing was added, the layout may still be shared with a template, and
+  // it's already sorted, so don't copy it
+  if (this->layout.use_count() == 1) {
+    this->layout->sort_indexes();
+  }
+}
 
 void Map::clear() {
   this->objects.clear();
@@ -757,7 +821,7 @@ void Map::add_objects_from_owned_map_data(uint8_t floor, const void* data, size_
     });
 
     uint64_t k = section_index_key(floor, objects[z].section, objects[z].group);
-    this->floor_section_and_group_to_object_index.emplace(k, object_id);
+    this->mutable_layout().floor_section_and_group_to_object_index.add(k, object_id);
 
     uint32_t base_switch_flag = 0;
     uint32_t num_switch_flags = 0;
@@ -783,10 +847,11 @@ void Map::add_objects_from_owned_map_data(uint8_t floor, const void* data, size_
     }
     if ((num_switch_flags > 1) && !(base_switch_flag & 0xFFFFFF00)) {
       for (size_t z = 0; z < num_switch_flags; z++) {
-        this->floor_and_switch_flag_to_door_index.emplace((floor << 8) | (base_switch_flag + z), object_id);
+        this->mutable_layout().floor_and_switch_flag_to_door_index.add((floor << 8) | (base_switch_flag + z), object_id);
       }
     }
   }
+  this->sort_indexes();
 }
 
 void Map::add_objects_from_map_data(uint8_t floor, std::shared_ptr<const string> data) {
@@ -794,31 +859,26 @@ void Map::add_objects_from_map_data(uint8_t floor, std::shared_ptr<const string>
   this->add_objects_from_owned_map_data(floor, data->data(), data->size());
 }
 
-bool Map::check_and_log_rare_enemy(bool default_is_rare, uint32_t rare_rate) {
-  if (default_is_rare) {
-    return true;
-  }
-
+bool Map::check_and_log_rare_enemy(size_t enemy_index, uint32_t rare_rate) {
   // On BB, rare enemy indexes are generated by the server and sent to the
   // client, so we can use any method we want to choose rares. On other
   // versions, we must match the client's logic, even though it's more
   // computationally expensive.
   if (this->version == Version::BB_V4) {
     if ((this->rare_enemy_indexes.size() < 0x10) && (random_from_optional_crypt(this->opt_rand_crypt) < rare_rate)) {
-      this->rare_enemy_indexes.emplace_back(this->enemies.size());
+      this->rare_enemy_indexes.emplace_back(enemy_index);
       return true;
     }
 
   } else {
-    // TODO: We only need the first value from this crypt, so it's unfortunate
-    // that we have to initialize the entire thing. Find a way to make this
-    // faster.
-    PSOV2Encryption crypt(this->rare_seed + 0x1000 + this->enemies.size());
-    float det = (static_cast<float>((crypt.next() >> 16) & 0xFFFF) / 65536.0f);
-    // On v1 and v2 (and GC NTE), the rare rate is 0.1% instead of 0.2%.
-    float threshold = is_v1_or_v2(this->version) ? 0.001f : 0.002f;
-    if (det < threshold) {
-      this->rare_enemy_indexes.emplace_back(this->enemies.size());
+    // This is the first value from PSOV2Encryption(rare_seed + 0x1000 +
+    // enemy_index), but the model lets us compute it without initializing the
+    // entire crypt
+    static const PSOV2KeystreamModel first_word_model(1);
+    uint32_t value = first_word_model.word(this->rare_seed + 0x1000 + enemy_index, 0);
+    float det = (static_cast<float>((value >> 16) & 0xFFFF) / 65536.0f);
+    if (det < Map::non_bb_rare_enemy_threshold(this->version)) {
+      this->rare_enemy_indexes.emplace_back(enemy_index);
       return true;
     }
   }
@@ -841,7 +901,26 @@ void Map::add_enemy(
     uint16_t enemy_id = this->enemies.size();
     this->enemies.emplace_back(enemy_id, source_index, set_index, floor, e.section, e.wave_number, type, alias_enemy_id);
     uint64_t k = section_index_key(floor, e.section, e.wave_number);
-    this->floor_section_and_wave_number_to_enemy_index.emplace(k, enemy_id);
+    auto& layout = this->mutable_layout();
+    layout.floor_section_and_wave_number_to_enemy_index.add(k, enemy_id);
+    layout.floor_and_type_to_enemy_index.add(floor_and_type_key(floor, type), enemy_id);
+    // In maps created from a template, this enemy may become rare, so it must
+    // also be findable by its rare type
+    if (!this->rare_enemy_candidates.empty() && (this->rare_enemy_candidates.back().enemy_index == enemy_id)) {
+      layout.floor_and_type_to_enemy_index.add(floor_and_type_key(floor, this->rare_enemy_candidates.back().rare_type), enemy_id);
+    }
+  };
+  // This must be called immediately before add() for the enemy it applies to
+  auto choose_rare = [&](bool default_is_rare, uint32_t RareEnemyRates::*rate, EnemyType type, EnemyType rare_type) -> EnemyType {
+    if (default_is_rare) {
+      return rare_type;
+    }
+    size_t enemy_index = this->enemies.size();
+    if (this->is_template) {
+      this->rare_enemy_candidates.emplace_back(RareEnemyCandidate{.enemy_index = enemy_index, .rate = rate, .rare_type = rare_type});
+      return type;
+    }
+    return this->check_and_log_rare_enemy(enemy_index, (*rare_rates).*rate) ? rare_type : type;
   };
 
   EnemyType child_type = EnemyType::UNKNOWN;
@@ -914,47 +993,46 @@ void Map::add_enemy(
 
     case 0x0040: { // TObjEneMoja
       bool default_is_rare = (this->version == Version::BB_V4) ? (e.uparam1 & 1) : (e.uparam1 != 0);
-      add(this->check_and_log_rare_enemy(default_is_rare, rare_rates->hildeblue)
-              ? EnemyType::HILDEBLUE
-              : EnemyType::HILDEBEAR);
+      add(choose_rare(default_is_rare, &RareEnemyRates::hildeblue, EnemyType::HILDEBEAR, EnemyType::HILDEBLUE));
       break;
     }
     case 0x0041: { // TObjEneLappy
       bool default_is_rare = (this->version == Version::BB_V4) ? (e.uparam1 & 1) : (e.uparam1 != 0);
-      bool is_rare = this->check_and_log_rare_enemy(default_is_rare, rare_rates->rappy);
+      EnemyType type, rare_type;
       switch (episode) {
         case Episode::EP1:
-          add(is_rare ? EnemyType::AL_RAPPY : EnemyType::RAG_RAPPY);
+          type = EnemyType::RAG_RAPPY;
+          rare_type = EnemyType::AL_RAPPY;
           break;
         case Episode::EP2:
-          if (is_rare) {
-            switch (event) {
-              case 0x01: // rappy_type 1
-                add(EnemyType::SAINT_RAPPY);
-                break;
-              case 0x04: // rappy_type 2
-                add(EnemyType::EGG_RAPPY);
-                break;
-              case 0x05: // rappy_type 3
-                add(EnemyType::HALLO_RAPPY);
-                break;
-              default:
-                add(EnemyType::LOVE_RAPPY);
-            }
-          } else {
-            add(EnemyType::RAG_RAPPY);
+          type = EnemyType::RAG_RAPPY;
+          switch (event) {
+            case 0x01: // rappy_type 1
+              rare_type = EnemyType::SAINT_RAPPY;
+              break;
+            case 0x04: // rappy_type 2
+              rare_type = EnemyType::EGG_RAPPY;
+              break;
+            case 0x05: // rappy_type 3
+              rare_type = EnemyType::HALLO_RAPPY;
+              break;
+            default:
+              rare_type = EnemyType::LOVE_RAPPY;
           }
           break;
         case Episode::EP4:
           if (e.floor > 0x05) {
-            add(is_rare ? EnemyType::DEL_RAPPY_ALT : EnemyType::SAND_RAPPY_ALT);
+            type = EnemyType::SAND_RAPPY_ALT;
+            rare_type = EnemyType::DEL_RAPPY_ALT;
           } else {
-            add(is_rare ? EnemyType::DEL_RAPPY : EnemyType::SAND_RAPPY);
+            type = EnemyType::SAND_RAPPY;
+            rare_type = EnemyType::DEL_RAPPY;
           }
           break;
         default:
           throw logic_error("invalid episode");
       }
+      add(choose_rare(default_is_rare, &RareEnemyRates::rappy, type, rare_type));
       break;
     }
     case 0x0042: // TObjEneBm3FlyNest
@@ -977,9 +1055,7 @@ void Map::add_enemy(
       if ((episode == Episode::EP2) && (e.floor == 0x11)) {
         add(EnemyType::DEL_LILY);
       } else {
-        add(this->check_and_log_rare_enemy(false, rare_rates->nar_lily)
-                ? EnemyType::NAR_LILY
-                : EnemyType::POISON_LILY);
+        add(choose_rare(false, &RareEnemyRates::nar_lily, EnemyType::POISON_LILY, EnemyType::NAR_LILY));
       }
       break;
     case 0x0062: // TObjEneNanoDrago
@@ -996,9 +1072,11 @@ void Map::add_enemy(
       }
       default_num_children = -1; // Skip adding children (because we do it here)
       for (size_t z = 0; z < 5; z++) {
-        add(this->check_and_log_rare_enemy((this->version == Version::BB_V4) && (e.uparam2 & 1), rare_rates->pouilly_slime)
-                ? EnemyType::POUILLY_SLIME
-                : EnemyType::POFUILLY_SLIME);
+        add(choose_rare(
+            (this->version == Version::BB_V4) && (e.uparam2 & 1),
+            &RareEnemyRates::pouilly_slime,
+            EnemyType::POFUILLY_SLIME,
+            EnemyType::POUILLY_SLIME));
       }
       break;
     case 0x0065: // TObjEnePanarms
@@ -1214,22 +1292,18 @@ void Map::add_enemy(
       }
       break;
     case 0x0112:
-      add(this->check_and_log_rare_enemy(e.uparam1 & 0x01, rare_rates->merissa_aa)
-              ? EnemyType::MERISSA_AA
-              : EnemyType::MERISSA_A);
+      add(choose_rare(e.uparam1 & 0x01, &RareEnemyRates::merissa_aa, EnemyType::MERISSA_A, EnemyType::MERISSA_AA));
       break;
     case 0x0113:
       add(EnemyType::GIRTABLULU);
       break;
-    case 0x0114: {
-      bool is_rare = this->check_and_log_rare_enemy(e.uparam1 & 0x01, rare_rates->pazuzu);
+    case 0x0114:
       if (e.floor > 0x05) {
-        add(is_rare ? EnemyType::PAZUZU_ALT : EnemyType::ZU_ALT);
+        add(choose_rare(e.uparam1 & 0x01, &RareEnemyRates::pazuzu, EnemyType::ZU_ALT, EnemyType::PAZUZU_ALT));
       } else {
-        add(is_rare ? EnemyType::PAZUZU : EnemyType::ZU);
+        add(choose_rare(e.uparam1 & 0x01, &RareEnemyRates::pazuzu, EnemyType::ZU, EnemyType::PAZUZU));
       }
       break;
-    }
     case 0x0115:
       if (e.uparam1 & 2) {
         add(EnemyType::BA_BOOTA);
@@ -1238,25 +1312,21 @@ void Map::add_enemy(
       }
       break;
     case 0x0116:
-      add(this->check_and_log_rare_enemy(e.uparam1 & 0x01, rare_rates->dorphon_eclair)
-              ? EnemyType::DORPHON_ECLAIR
-              : EnemyType::DORPHON);
+      add(choose_rare(e.uparam1 & 0x01, &RareEnemyRates::dorphon_eclair, EnemyType::DORPHON, EnemyType::DORPHON_ECLAIR));
       break;
     case 0x0117: {
       static const EnemyType types[3] = {EnemyType::GORAN, EnemyType::PYRO_GORAN, EnemyType::GORAN_DETONATOR};
       add(types[e.uparam1 % 3]);
       break;
     }
-    case 0x0119: {
-      bool is_rare = this->check_and_log_rare_enemy((e.fparam2 != 0.0f), rare_rates->kondrieu);
-      if (is_rare) {
-        add(EnemyType::KONDRIEU);
-      } else {
-        add((e.uparam1 & 1) ? EnemyType::SHAMBERTIN : EnemyType::SAINT_MILLION);
-      }
+    case 0x0119:
+      add(choose_rare(
+          (e.fparam2 != 0.0f),
+          &RareEnemyRates::kondrieu,
+          (e.uparam1 & 1) ? EnemyType::SHAMBERTIN : EnemyType::SAINT_MILLION,
+          EnemyType::KONDRIEU));
       default_num_children = 0x18;
       break;
-    }
 
     case 0x00C3: // TBoss3VoloptP01
     case 0x00C4: // TBoss3VoloptCore or subclass
@@ -1302,6 +1372,7 @@ void Map::add_enemies_from_map_data(
   for (size_t y = 0; y < entry_count; y++) {
     this->add_enemy(episode, difficulty, event, floor, y, r.get<EnemyEntry>(), rare_rates);
   }
+  this->sort_indexes();
 }
 
 Map::DATParserRandomState::DATParserRandomState(uint32_t rare_seed)
@@ -1392,8 +1463,8 @@ void Map::add_random_enemies_from_map_data(
   }
   wave_events_segment_r.go(wave_events_header.entries_offset);
 
-  size_t action_stream_base_offset = this->event_action_stream.size();
-  this->event_action_stream += wave_events_segment_r.pread(
+  size_t action_stream_base_offset = this->layout->event_action_stream.size();
+  this->mutable_layout().event_action_stream += wave_events_segment_r.pread(
       wave_events_header.action_stream_offset, wave_events_segment_r.size() - wave_events_header.action_stream_offset);
 
   const auto& locations_header = locations_segment_r.get<RandomEnemyLocationsHeader>();
@@ -1500,11 +1571,11 @@ void Map::add_random_enemies_from_map_data(
       }
       if (remaining_waves) {
         /* ev.delay = */ random_state->rand_int_biased(entry.min_delay, entry.max_delay);
-        this->add_event(wave_next_event_id, entry.flags, floor, entry.section, wave_number, this->event_action_stream.size());
-        this->event_action_stream.push_back(0x0C);
+        this->add_event(wave_next_event_id, entry.flags, floor, entry.section, wave_number, this->layout->event_action_stream.size());
+        this->mutable_layout().event_action_stream.push_back(0x0C);
         wave_next_event_id = entry.event_id + wave_number + 10000;
-        this->event_action_stream.append(reinterpret_cast<const char*>(&wave_next_event_id), sizeof(wave_next_event_id));
-        this->event_action_stream.push_back(0x01);
+        this->mutable_layout().event_action_stream.append(reinterpret_cast<const char*>(&wave_next_event_id), sizeof(wave_next_event_id));
+        this->mutable_layout().event_action_stream.push_back(0x01);
         wave_number++;
       }
     }
@@ -1513,6 +1584,7 @@ void Map::add_random_enemies_from_map_data(
     this->add_event(wave_next_event_id, entry.flags, floor, entry.section, wave_number, action_stream_base_offset + entry.action_stream_offset);
     wave_number++;
   }
+  this->sort_indexes();
 }
 
 void Map::add_event(uint32_t event_id, uint16_t flags, uint8_t floor, uint16_t section, uint16_t wave_number, uint32_t action_stream_offset) {
@@ -1526,27 +1598,19 @@ void Map::add_event(uint32_t event_id, uint16_t flags, uint8_t floor, uint16_t s
   ev.action_stream_offset = action_stream_offset;
 
   uint64_t k = (static_cast<uint64_t>(floor) << 32) | event_id;
-  this->floor_and_event_id_to_index.emplace(k, index);
+  this->mutable_layout().floor_and_event_id_to_index.add(k, index);
   k = section_index_key(floor, section, wave_number);
-  this->floor_section_and_wave_number_to_event_index.emplace(k, index);
+  this->mutable_layout().floor_section_and_wave_number_to_event_index.add(k, index);
 }
 
-vector<Map::Event*> Map::get_events(uint8_t floor, uint32_t event_id) {
+Map::EntityRange<Map::Event> Map::get_events(uint8_t floor, uint32_t event_id) {
   uint64_t k = (static_cast<uint64_t>(floor) << 32) | event_id;
-  vector<Event*> ret;
-  for (auto its = this->floor_and_event_id_to_index.equal_range(k); its.first != its.second; its.first++) {
-    ret.emplace_back(&this->events.at(its.first->second));
-  }
-  return ret;
+  return EntityRange<Event>(this->events.data(), this->events.size(), this->layout->floor_and_event_id_to_index.find(k));
 }
 
-vector<const Map::Event*> Map::get_events(uint8_t floor, uint32_t event_id) const {
+Map::EntityRange<const Map::Event> Map::get_events(uint8_t floor, uint32_t event_id) const {
   uint64_t k = (static_cast<uint64_t>(floor) << 32) | event_id;
-  vector<const Event*> ret;
-  for (auto its = this->floor_and_event_id_to_index.equal_range(k); its.first != its.second; its.first++) {
-    ret.emplace_back(&this->events.at(its.first->second));
-  }
-  return ret;
+  return EntityRange<const Event>(this->events.data(), this->events.size(), this->layout->floor_and_event_id_to_index.find(k));
 }
 
 void Map::add_events_from_map_data(uint8_t floor, const void* data, size_t size) {
@@ -1556,8 +1620,8 @@ void Map::add_events_from_map_data(uint8_t floor, const void* data, size_t size)
     throw runtime_error("events section format is not zero");
   }
 
-  size_t action_stream_base_offset = this->event_action_stream.size();
-  this->event_action_stream += r.pread(header.action_stream_offset, r.size() - header.action_stream_offset);
+  size_t action_stream_base_offset = this->layout->event_action_stream.size();
+  this->mutable_layout().event_action_stream += r.pread(header.action_stream_offset, r.size() - header.action_stream_offset);
 
   this->events.reserve(this->events.size() + header.entry_count);
   auto events_r = r.sub(header.entries_offset, sizeof(Event1Entry) * header.entry_count);
@@ -1565,6 +1629,7 @@ void Map::add_events_from_map_data(uint8_t floor, const void* data, size_t size)
     const auto& entry = events_r.get<Event1Entry>();
     this->add_event(entry.event_id, entry.flags, floor, entry.section, entry.wave_number, entry.action_stream_offset + action_stream_base_offset);
   }
+  this->sort_indexes();
 }
 
 vector<Map::DATSectionsForFloor> Map::collect_quest_map_data_sections(const void* data, size_t size) {
@@ -1728,63 +1793,40 @@ Map::Enemy& Map::find_enemy(uint8_t floor, EnemyType type) {
   if (this->enemies.empty()) {
     throw out_of_range("no enemies defined");
   }
-  // TODO: Linear search is bad here. Do something better, like binary search
-  // for the floor start and just linear search through the floor enemies.
-  for (auto& e : this->enemies) {
-    if (e.floor == floor && e.type == type) {
+  // The index also contains enemies that could have become rare but didn't,
+  // so the type still has to be checked
+  for (uint32_t enemy_index : this->layout->floor_and_type_to_enemy_index.find(floor_and_type_key(floor, type))) {
+    auto& e = this->enemies.at(enemy_index);
+    if (e.type == type) {
       return e;
     }
   }
   throw out_of_range("enemy not found");
 }
 
-std::vector<Map::Object*> Map::get_objects(uint8_t floor, uint16_t section, uint16_t group) {
+Map::EntityRange<Map::Object> Map::get_objects(uint8_t floor, uint16_t section, uint16_t group) {
   uint64_t k = section_index_key(floor, section, group);
-  vector<Object*> ret;
-  for (auto its = this->floor_section_and_group_to_object_index.equal_range(k); its.first != its.second; its.first++) {
-    ret.emplace_back(&this->objects.at(its.first->second));
-  }
-  return ret;
+  return EntityRange<Object>(this->objects.data(), this->objects.size(), this->layout->floor_section_and_group_to_object_index.find(k));
 }
 
-std::vector<Map::Enemy*> Map::get_enemies(uint8_t floor, uint16_t section, uint16_t wave_number) {
+Map::EntityRange<Map::Enemy> Map::get_enemies(uint8_t floor, uint16_t section, uint16_t wave_number) {
   uint64_t k = section_index_key(floor, section, wave_number);
-  vector<Enemy*> ret;
-  for (auto its = this->floor_section_and_wave_number_to_enemy_index.equal_range(k); its.first != its.second; its.first++) {
-    ret.emplace_back(&this->enemies.at(its.first->second));
-  }
-  return ret;
+  return EntityRange<Enemy>(this->enemies.data(), this->enemies.size(), this->layout->floor_section_and_wave_number_to_enemy_index.find(k));
 }
 
-std::vector<Map::Event*> Map::get_events(uint8_t floor, uint16_t section, uint16_t wave_number) {
+Map::EntityRange<Map::Event> Map::get_events(uint8_t floor, uint16_t section, uint16_t wave_number) {
   uint64_t k = section_index_key(floor, section, wave_number);
-  vector<Event*> ret;
-  for (auto its = this->floor_section_and_wave_number_to_event_index.equal_range(k); its.first != its.second; its.first++) {
-    ret.emplace_back(&this->events.at(its.first->second));
-  }
-  return ret;
+  return EntityRange<Event>(this->events.data(), this->events.size(), this->layout->floor_section_and_wave_number_to_event_index.find(k));
 }
 
-std::vector<Map::Event*> Map::get_events(uint8_t floor) {
+Map::EntityRange<Map::Event> Map::get_events(uint8_t floor) {
   uint64_t k_start = (static_cast<uint64_t>(floor) << 32);
   uint64_t k_end = (static_cast<uint64_t>(floor + 1) << 32);
-  vector<Event*> ret;
-  for (auto it = this->floor_and_event_id_to_index.lower_bound(k_start);
-       (it != this->floor_and_event_id_to_index.end()) && (it->first < k_end);
-       it++) {
-    ret.emplace_back(&this->events.at(it->second));
-  }
-  return ret;
+  return EntityRange<Event>(this->events.data(), this->events.size(), this->layout->floor_and_event_id_to_index.find_range(k_start, k_end));
 }
 
-vector<Map::Object*> Map::doors_for_switch_flag(uint8_t floor, uint8_t switch_flag) {
-  vector<Map::Object*> ret;
-  for (auto its = this->floor_and_switch_flag_to_door_index.equal_range((floor << 8) | switch_flag);
-       its.first != its.second;
-       its.first++) {
-    ret.emplace_back(&this->objects[its.first->second]);
-  }
-  return ret;
+Map::EntityRange<Map::Object> Map::doors_for_switch_flag(uint8_t floor, uint8_t switch_flag) {
+  return EntityRange<Object>(this->objects.data(), this->objects.size(), this->layout->floor_and_switch_flag_to_door_index.find((floor << 8) | switch_flag));
 }
 
 template <typename EntryT>
@@ -1943,6 +1985,50 @@ string Map::disassemble_quest_data(const void* data, size_t size) {
   return phosg::join(ret, "\n") + "\n";
 }
 
+MapTemplateCache::MapTemplateCache(size_t max_entries)
+    : max_entries(max_entries),
+      hits(0),
+      misses(0) {}
+
+shared_ptr<const Map> MapTemplateCache::get(const string& key, function<shared_ptr<const Map>()> generate) {
+  {
+    shared_lock g(this->lock);
+    auto it = this->key_to_template.find(key);
+    if (it != this->key_to_template.end()) {
+      this->hits++;
+      return it->second;
+    }
+  }
+
+  unique_lock g(this->lock);
+  auto it = this->key_to_template.find(key);
+  if (it != this->key_to_template.end()) {
+    this->hits++;
+    return it->second;
+  }
+  this->misses++;
+  auto tmpl = generate();
+  if (!tmpl->is_template) {
+    throw logic_error("generated map is not a template");
+  }
+  while (!this->keys_in_insertion_order.empty() && (this->key_to_template.size() >= this->max_entries)) {
+    this->key_to_template.erase(this->keys_in_insertion_order.front());
+    this->keys_in_insertion_order.pop_front();
+  }
+  this->key_to_template.emplace(key, tmpl);
+  this->keys_in_insertion_order.emplace_back(key);
+  return tmpl;
+}
+
+MapTemplateCache::Stats MapTemplateCache::get_stats() const {
+  shared_lock g(this->lock);
+  Stats ret;
+  ret.hits = this->hits.load();
+  ret.misses = this->misses.load();
+  ret.entries = this->key_to_template.size();
+  return ret;
+}
+
 SetDataTableBase::SetDataTableBase(Version version) : version(version) {}
 
 parray<le_uint32_t, 0x20> SetDataTableBase::generate_variations(
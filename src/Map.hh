@@ -2,11 +2,18 @@
 
 #include <inttypes.h>
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <memory>
 #include <phosg/Encoding.hh>
 #include <phosg/JSON.hh>
 #include <random>
+#include <shared_mutex>
+#include <span>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "BattleParamsIndex.hh"
@@ -293,19 +300,202 @@ struct Map {
     void generate_shuffled_location_table(const Map::RandomEnemyLocationsHeader& header, phosg::StringReader r, uint16_t section);
   };
 
+  // A multimap from keys to entity indexes. The keys and entity indexes are
+  // stored in separate sorted arrays, so a lookup is a binary search over a
+  // contiguous array of keys, and its result is a contiguous span of entity
+  // indexes. Entries with equal keys are kept in insertion order. add() only
+  // appends the entry; sort() must be called after adding entries and before
+  // looking anything up.
+  template <typename KeyT>
+  class EntityIndex {
+  public:
+    void add(KeyT key, size_t entity_index) {
+      this->keys.emplace_back(key);
+      this->entity_indexes.emplace_back(entity_index);
+    }
+    // Merges the entries added since the last call into the sorted entries
+    void sort() {
+      if (this->sorted_count == this->keys.size()) {
+        return;
+      }
+      std::vector<std::pair<KeyT, uint32_t>> entries;
+      entries.reserve(this->keys.size());
+      for (size_t z = 0; z < this->keys.size(); z++) {
+        entries.emplace_back(this->keys[z], this->entity_indexes[z]);
+      }
+      auto key_less = [](const std::pair<KeyT, uint32_t>& a, const std::pair<KeyT, uint32_t>& b) -> bool {
+        return a.first < b.first;
+      };
+      auto new_begin_it = entries.begin() + this->sorted_count;
+      std::stable_sort(new_begin_it, entries.end(), key_less);
+      std::inplace_merge(entries.begin(), new_begin_it, entries.end(), key_less);
+      for (size_t z = 0; z < entries.size(); z++) {
+        this->keys[z] = entries[z].first;
+        this->entity_indexes[z] = entries[z].second;
+      }
+      this->sorted_count = this->keys.size();
+    }
+    std::span<const uint32_t> find(KeyT key) const {
+      this->check_sorted();
+      auto its = std::equal_range(this->keys.begin(), this->keys.end(), key);
+      return this->span_for(its.first, its.second);
+    }
+    // Returns entity indexes for all keys in [start_key, end_key)
+    std::span<const uint32_t> find_range(KeyT start_key, KeyT end_key) const {
+      this->check_sorted();
+      auto begin_it = std::lower_bound(this->keys.begin(), this->keys.end(), start_key);
+      auto end_it = std::lower_bound(begin_it, this->keys.end(), end_key);
+      return this->span_for(begin_it, end_it);
+    }
+    inline size_t size() const {
+      return this->keys.size();
+    }
+
+  private:
+    std::vector<KeyT> keys;
+    std::vector<uint32_t> entity_indexes;
+    size_t sorted_count = 0;
+
+    inline void check_sorted() const {
+      if (this->sorted_count != this->keys.size()) {
+        throw std::logic_error("entity index was not sorted after adding entries");
+      }
+    }
+
+    std::span<const uint32_t> span_for(
+        typename std::vector<KeyT>::const_iterator begin_it, typename std::vector<KeyT>::const_iterator end_it) const {
+      return std::span<const uint32_t>(
+          this->entity_indexes.data() + (begin_it - this->keys.begin()), end_it - begin_it);
+    }
+  };
+
+  // The result of an index lookup: a non-owning view of the matching entities
+  // that yields pointers to them. This is invalidated if any entities of the
+  // same kind are added to the map.
+  template <typename EntityT>
+  class EntityRange {
+  public:
+    class Iterator {
+    public:
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = EntityT*;
+      using difference_type = std::ptrdiff_t;
+
+      Iterator(EntityT* entities, size_t num_entities, const uint32_t* it)
+          : entities(entities),
+            num_entities(num_entities),
+            it(it) {}
+      inline EntityT* operator*() const {
+        if (*this->it >= this->num_entities) {
+          throw std::out_of_range("entity index out of range");
+        }
+        return &this->entities[*this->it];
+      }
+      inline Iterator& operator++() {
+        this->it++;
+        return *this;
+      }
+      inline bool operator==(const Iterator& other) const {
+        return this->it == other.it;
+      }
+
+    private:
+      EntityT* entities;
+      size_t num_entities;
+      const uint32_t* it;
+    };
+
+    EntityRange(EntityT* entities, size_t num_entities, std::span<const uint32_t> entity_indexes)
+        : entities(entities),
+          num_entities(num_entities),
+          entity_indexes(entity_indexes) {}
+    inline Iterator begin() const {
+      return Iterator(this->entities, this->num_entities, this->entity_indexes.data());
+    }
+    inline Iterator end() const {
+      return Iterator(this->entities, this->num_entities, this->entity_indexes.data() + this->entity_indexes.size());
+    }
+    inline size_t size() const {
+      return this->entity_indexes.size();
+    }
+    inline bool empty() const {
+      return this->entity_indexes.empty();
+    }
+
+  private:
+    EntityT* entities;
+    size_t num_entities;
+    std::span<const uint32_t> entity_indexes;
+  };
+
+  // The parts of a map that don't change after it's loaded: the map data
+  // itself, the event action stream, and the lookup indexes. Maps created from
+  // a template share this with the template (and each other); it's only
+  // copied if entities are added to one of them afterward.
+  struct Layout {
+    std::unordered_set<std::shared_ptr<const std::string>> linked_data;
+    std::string event_action_stream;
+    EntityIndex<uint64_t> floor_and_event_id_to_index;
+    EntityIndex<uint64_t> floor_section_and_group_to_object_index;
+    EntityIndex<uint64_t> floor_section_and_wave_number_to_enemy_index;
+    EntityIndex<uint64_t> floor_section_and_wave_number_to_event_index;
+    EntityIndex<uint16_t> floor_and_switch_flag_to_door_index;
+    // Keys are from floor_and_type_key. Enemies that may become rare in maps
+    // created from a template are in this index under both types.
+    EntityIndex<uint32_t> floor_and_type_to_enemy_index;
+
+    void sort_indexes();
+  };
+
+  static inline uint32_t floor_and_type_key(uint8_t floor, EnemyType type) {
+    return (static_cast<uint32_t>(floor) << 16) | static_cast<uint16_t>(type);
+  }
+
+  // An enemy in a template that may become rare in maps created from it. The
+  // template's enemy has the non-rare type; rare_type is used if the roll
+  // succeeds.
+  struct RareEnemyCandidate {
+    size_t enemy_index;
+    uint32_t RareEnemyRates::*rate;
+    EnemyType rare_type;
+  };
+
   Map(Version version, uint32_t lobby_id, uint32_t rare_seed, std::shared_ptr<PSOLFGEncryption> opt_rand_crypt);
+  // Creates a map from a template (see create_template). Rare enemies are
+  // chosen here, in the same order and with the same random values as if the
+  // map had been loaded from the map files directly.
+  Map(const Map& tmpl,
+      uint32_t lobby_id,
+      uint32_t rare_seed,
+      std::shared_ptr<PSOLFGEncryption> opt_rand_crypt,
+      std::shared_ptr<const RareEnemyRates> rare_rates = DEFAULT_RARE_ENEMIES);
   ~Map() = default;
 
+  // Creates an empty template map. Entities can be added to a template in the
+  // same way as for a normal map, but no rare enemies are chosen; instead,
+  // they are chosen when a map is created from the template. Templates must
+  // not be modified after any maps are created from them.
+  static std::shared_ptr<Map> create_template(Version version);
+
   void clear();
 
   inline void link_owned_data(std::shared_ptr<const std::string> data) {
-    this->linked_data.emplace(data);
+    this->mutable_layout().linked_data.emplace(data);
   }
 
   void add_objects_from_owned_map_data(uint8_t floor, const void* data, size_t size);
   void add_objects_from_map_data(uint8_t floor, std::shared_ptr<const std::string> data);
 
-  bool check_and_log_rare_enemy(bool default_is_rare, uint32_t rare_rate);
+  // On versions other than BB, the client decides which enemies are rare by
+  // comparing a value derived from the rare seed to this threshold. On v1 and
+  // v2 (and GC NTE), the rare rate is 0.1% instead of 0.2%.
+  static inline float non_bb_rare_enemy_threshold(Version version) {
+    return is_v1_or_v2(version) ? 0.001f : 0.002f;
+  }
+  bool check_and_log_rare_enemy(size_t enemy_index, uint32_t rare_rate);
+  // add_enemy and add_event don't sort the lookup indexes, so the caller must
+  // call sort_indexes() when it's done adding entities. The add_*_from_*
+  // functions do this themselves.
   void add_enemy(
       Episode episode,
       uint8_t difficulty,
@@ -340,8 +530,8 @@ struct Map {
       uint16_t section,
       uint16_t wave_number,
       uint32_t action_stream_offset);
-  std::vector<Event*> get_events(uint8_t floor, uint32_t event_id);
-  std::vector<const Event*> get_events(uint8_t floor, uint32_t event_id) const;
+  EntityRange<Event> get_events(uint8_t floor, uint32_t event_id);
+  EntityRange<const Event> get_events(uint8_t floor, uint32_t event_id) const;
   void add_events_from_map_data(uint8_t floor, const void* data, size_t size);
 
   struct DATSectionsForFloor {
@@ -364,34 +554,74 @@ struct Map {
   Enemy& find_enemy(uint16_t enemy_id);
   const Enemy& find_enemy(uint8_t floor, EnemyType type) const;
   Enemy& find_enemy(uint8_t floor, EnemyType type);
-  std::vector<Object*> get_objects(uint8_t floor, uint16_t section, uint16_t wave_number);
-  std::vector<Enemy*> get_enemies(uint8_t floor, uint16_t section, uint16_t wave_number);
-  std::vector<Event*> get_events(uint8_t floor, uint16_t section, uint16_t wave_number);
-  std::vector<Event*> get_events(uint8_t floor);
+  // None of these allocate memory; see EntityRange for how long the results
+  // are valid.
+  EntityRange<Object> get_objects(uint8_t floor, uint16_t section, uint16_t group);
+  EntityRange<Enemy> get_enemies(uint8_t floor, uint16_t section, uint16_t wave_number);
+  EntityRange<Event> get_events(uint8_t floor, uint16_t section, uint16_t wave_number);
+  EntityRange<Event> get_events(uint8_t floor);
 
-  std::vector<Object*> doors_for_switch_flag(uint8_t floor, uint8_t switch_flag);
+  EntityRange<Object> doors_for_switch_flag(uint8_t floor, uint8_t switch_flag);
 
   static std::string disassemble_objects_data(const void* data, size_t size, size_t* object_number = nullptr);
   static std::string disassemble_enemies_data(const void* data, size_t size, size_t* enemy_number = nullptr);
   static std::string disassemble_wave_events_data(const void* data, size_t size, uint8_t floor = 0xFF);
   static std::string disassemble_quest_data(const void* data, size_t size);
 
+  inline const Layout& get_layout() const {
+    return *this->layout;
+  }
+  Layout& mutable_layout();
+  void sort_indexes();
+
   phosg::PrefixedLogger log;
   Version version;
   uint32_t rare_seed;
-  std::unordered_set<std::shared_ptr<const std::string>> linked_data;
   std::shared_ptr<PSOLFGEncryption> opt_rand_crypt;
+  bool is_template;
+  std::shared_ptr<Layout> layout;
   std::vector<Object> objects;
   std::vector<Enemy> enemies;
   std::vector<uint16_t> enemy_set_flags;
   std::vector<size_t> rare_enemy_indexes;
+  std::vector<RareEnemyCandidate> rare_enemy_candidates; // Only used in templates
   std::vector<Event> events;
-  std::string event_action_stream;
-  std::multimap<uint64_t, size_t> floor_and_event_id_to_index;
-  std::unordered_multimap<uint64_t, size_t> floor_section_and_group_to_object_index;
-  std::unordered_multimap<uint64_t, size_t> floor_section_and_wave_number_to_enemy_index;
-  std::unordered_multimap<uint64_t, size_t> floor_section_and_wave_number_to_event_index;
-  std::unordered_multimap<uint16_t, size_t> floor_and_switch_flag_to_door_index;
+};
+
+// MapTemplateCache holds map templates for free-roam games, so games with the
+// same map files (and episode, difficulty, and event) don't each have to parse
+// the map files and build the entity tables and indexes. The key should
+// include everything that affects the map's contents except the rare enemy
+// rates and seed, since those are applied when the game's map is created from
+// the template. When the cache is full, the oldest template is evicted; games
+// that are using it are unaffected.
+class MapTemplateCache {
+public:
+  explicit MapTemplateCache(size_t max_entries = 0x100);
+  MapTemplateCache(const MapTemplateCache&) = delete;
+  MapTemplateCache(MapTemplateCache&&) = delete;
+  MapTemplateCache& operator=(const MapTemplateCache&) = delete;
+  MapTemplateCache& operator=(MapTemplateCache&&) = delete;
+  ~MapTemplateCache() = default;
+
+  struct Stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t entries = 0;
+  };
+
+  // Warning: generate() is called while the lock is held for writing, so it
+  // will block other threads.
+  std::shared_ptr<const Map> get(const std::string& key, std::function<std::shared_ptr<const Map>()> generate);
+  Stats get_stats() const;
+
+private:
+  size_t max_entries;
+  mutable std::shared_mutex lock;
+  std::unordered_map<std::string, std::shared_ptr<const Map>> key_to_template;
+  std::deque<std::string> keys_in_insertion_order;
+  std::atomic<size_t> hits;
+  std::atomic<size_t> misses;
 };
 
 class SetDataTableBase {
@@ -0,0 +1,171 @@
+#include "Metrics.hh"
+
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+
+#include "Watchdog.hh"
+
+using namespace std;
+
+ServerMetrics global_metrics;
+
+size_t MetricHistogram::bucket_for_value(uint64_t v) {
+  if (v < SUB_BUCKETS) {
+    return v;
+  }
+  size_t exponent = 63 - __builtin_clzll(v);
+  if (exponent >= MAX_EXPONENT) {
+    return NUM_BUCKETS - 1;
+  }
+  size_t sub_bucket = (v >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+  return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub_bucket;
+}
+
+uint64_t MetricHistogram::bucket_end(size_t index) {
+  if (index < SUB_BUCKETS) {
+    return index + 1;
+  }
+  size_t exponent = (index / SUB_BUCKETS) + SUB_BUCKET_BITS - 1;
+  size_t sub_bucket = index % SUB_BUCKETS;
+  return static_cast<uint64_t>(SUB_BUCKETS + sub_bucket + 1) << (exponent - SUB_BUCKET_BITS);
+}
+
+void MetricHistogram::format_prometheus(string& out, const char* name, const string& labels) const {
+  uint64_t count = this->get_count();
+  if (count == 0) {
+    return;
+  }
+
+  // Read all the buckets first, so the cumulative counts are consistent with
+  // each other even if values are recorded while this runs
+  uint64_t bucket_counts[NUM_BUCKETS];
+  size_t last_nonempty_index = 0;
+  for (size_t z = 0; z < NUM_BUCKETS; z++) {
+    bucket_counts[z] = this->get_bucket(z);
+    if (bucket_counts[z]) {
+      last_nonempty_index = z;
+    }
+  }
+
+  const char* label_sep = labels.empty() ? "" : ",";
+  uint64_t last_nonempty_end = bucket_end(last_nonempty_index);
+  uint64_t cumulative_count = 0;
+  size_t bucket_index = 0;
+  // Buckets always end at each power of two, so the cumulative count for
+  // each power of two is exact. The first boundary written is 1024ns (~1us).
+  for (size_t exponent = 10; exponent < MAX_EXPONENT; exponent++) {
+    uint64_t boundary = 1ULL << exponent;
+    for (; (bucket_index < NUM_BUCKETS) && (bucket_end(bucket_index) <= boundary); bucket_index++) {
+      cumulative_count += bucket_counts[bucket_index];
+    }
+    out += phosg::string_printf("%s_bucket{%s%sle=\"%.9g\"} %" PRIu64 "\n",
+        name, labels.c_str(), label_sep, static_cast<double>(boundary) / 1000000000.0, cumulative_count);
+    if (boundary >= last_nonempty_end) {
+      break;
+    }
+  }
+  // Use the total count for +Inf, rather than the sum of the buckets, since
+  // Prometheus requires the +Inf bucket to equal _count
+  out += phosg::string_printf("%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels.c_str(), label_sep, count);
+  const char* open_brace = labels.empty() ? "" : "{";
+  const char* close_brace = labels.empty() ? "" : "}";
+  out += phosg::string_printf("%s_sum%s%s%s %.9f\n",
+      name, open_brace, labels.c_str(), close_brace, static_cast<double>(this->get_sum()) / 1000000000.0);
+  out += phosg::string_printf("%s_count%s%s%s %" PRIu64 "\n", name, open_brace, labels.c_str(), close_brace, count);
+}
+
+void format_prometheus_header(string& out, const char* name, const char* type, const char* help) {
+  out += phosg::string_printf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void format_prometheus_value(string& out, const char* name, const char* type, const char* help, uint64_t value) {
+  format_prometheus_header(out, name, type, help);
+  out += phosg::string_printf("%s %" PRIu64 "\n", name, value);
+}
+
+static const char* name_for_version_slot(size_t slot) {
+  return (slot < NUM_VERSIONS) ? phosg::name_for_enum(static_cast<Version>(slot)) : "UNKNOWN";
+}
+
+void ServerMetrics::format_prometheus(string& out) const {
+  auto format_command_counters = [&](const char* name, const char* help, const MetricCounter (&counters)[NUM_VERSION_SLOTS][0x100]) {
+    format_prometheus_header(out, name, "counter", help);
+    for (size_t v = 0; v < NUM_VERSION_SLOTS; v++) {
+      for (size_t cmd = 0; cmd < 0x100; cmd++) {
+        uint64_t value = counters[v][cmd].get();
+        if (value) {
+          out += phosg::string_printf("%s{version=\"%s\",command=\"%02zX\"} %" PRIu64 "\n",
+              name, name_for_version_slot(v), cmd, value);
+        }
+      }
+    }
+  };
+  format_command_counters("newserv_commands_received_total", "Commands received from clients", this->commands_received);
+  format_command_counters("newserv_commands_sent_total", "Commands sent to clients", this->commands_sent);
+
+  auto format_version_counters = [&](const char* name, const char* help, const MetricCounter (&counters)[NUM_VERSION_SLOTS], bool is_ns) {
+    format_prometheus_header(out, name, "counter", help);
+    for (size_t v = 0; v < NUM_VERSION_SLOTS; v++) {
+      uint64_t value = counters[v].get();
+      if (!value) {
+        continue;
+      }
+      if (is_ns) {
+        out += phosg::string_printf("%s{version=\"%s\"} %.9f\n", name, name_for_version_slot(v), static_cast<double>(value) / 1000000000.0);
+      } else {
+        out += phosg::string_printf("%s{version=\"%s\"} %" PRIu64 "\n", name, name_for_version_slot(v), value);
+      }
+    }
+  };
+  format_version_counters("newserv_received_bytes_total", "Bytes received from clients, including headers", this->bytes_received, false);
+  format_version_counters("newserv_sent_bytes_total", "Bytes sent to clients, including headers", this->bytes_sent, false);
+  format_version_counters("newserv_decrypt_seconds_total", "Time spent decrypting received data", this->decrypt_ns, true);
+  format_version_counters("newserv_encrypt_seconds_total", "Time spent encrypting sent data", this->encrypt_ns, true);
+
+  auto format_handler_histograms = [&](const char* name, const char* help, const char* label_name, const MetricHistogram (&histograms)[0x100]) {
+    format_prometheus_header(out, name, "histogram", help);
+    for (size_t z = 0; z < 0x100; z++) {
+      histograms[z].format_prometheus(out, name, phosg::string_printf("%s=\"%02zX\"", label_name, z));
+    }
+  };
+  format_handler_histograms("newserv_command_handler_seconds", "Time spent in game server command handlers", "command", this->command_handler_ns);
+  format_handler_histograms("newserv_subcommand_handler_seconds", "Time spent in game subcommand handlers", "subcommand", this->subcommand_handler_ns);
+
+  format_prometheus_header(out, "newserv_event_loop_lag_seconds", "histogram", "How late the event loop runs timer events");
+  this->event_loop_lag_ns.format_prometheus(out, "newserv_event_loop_lag_seconds", "");
+
+  format_prometheus_header(out, "newserv_callback_seconds", "histogram", "Time spent in event callbacks, by callback type");
+  for (size_t z = 0; z < EventLoopWatchdog::NUM_CALLBACK_TYPES; z++) {
+    const char* type_name = EventLoopWatchdog::name_for_callback_type(static_cast<EventLoopWatchdog::CallbackType>(z));
+    this->callback_ns[z].format_prometheus(out, "newserv_callback_seconds", phosg::string_printf("type=\"%s\"", type_name));
+  }
+
+  format_prometheus_value(out, "newserv_file_cache_hits_total", "counter", "File contents cache lookups that returned cached data", this->file_cache_hits.get());
+  format_prometheus_value(out, "newserv_file_cache_misses_total", "counter", "File contents cache lookups that loaded or generated data", this->file_cache_misses.get());
+
+  format_prometheus_header(out, "newserv_player_files_load_seconds", "histogram", "Time spent loading all of a client's player files");
+  this->player_files_load_ns.format_prometheus(out, "newserv_player_files_load_seconds", "");
+  format_prometheus_header(out, "newserv_player_files_save_seconds", "histogram", "Time spent saving (or queueing writes for) individual player files");
+  this->player_files_save_ns.format_prometheus(out, "newserv_player_files_save_seconds", "");
+}
+
+EventLoopLagProbe::EventLoopLagProbe(shared_ptr<struct event_base> base, uint64_t interval_usecs)
+    : base(base),
+      event(evtimer_new(this->base.get(), &EventLoopLagProbe::dispatch_on_timer, this), event_free),
+      interval_ns(interval_usecs * 1000),
+      expected_time_ns(0) {
+  this->schedule();
+}
+
+void EventLoopLagProbe::schedule() {
+  auto tv = phosg::usecs_to_timeval(this->interval_ns / 1000);
+  this->expected_time_ns = metrics_now_ns() + this->interval_ns;
+  event_add(this->event.get(), &tv);
+}
+
+void EventLoopLagProbe::dispatch_on_timer(evutil_socket_t, short, void* ctx) {
+  auto* probe = reinterpret_cast<EventLoopLagProbe*>(ctx);
+  uint64_t now_ns = metrics_now_ns();
+  global_metrics.event_loop_lag_ns.record((now_ns > probe->expected_time_ns) ? (now_ns - probe->expected_time_ns) : 0);
+  probe->schedule();
+}
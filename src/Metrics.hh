@@ -0,0 +1,166 @@
+#pragma once
+
+#include <event2/event.h>
+#include <inttypes.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include "Version.hh"
+
+// Server metrics, exported by the HTTP server at /metrics in the Prometheus
+// text format. All counters and histograms here are plain relaxed atomics, so
+// updating them never takes a lock; nearly all of them are only updated on
+// the event thread, so the atomic operations are also uncontended.
+
+inline uint64_t metrics_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+class MetricCounter {
+public:
+  MetricCounter() = default;
+  MetricCounter(const MetricCounter&) = delete;
+  MetricCounter(MetricCounter&&) = delete;
+  MetricCounter& operator=(const MetricCounter&) = delete;
+  MetricCounter& operator=(MetricCounter&&) = delete;
+  ~MetricCounter() = default;
+
+  inline void add(uint64_t v = 1) {
+    this->value.fetch_add(v, std::memory_order_relaxed);
+  }
+  inline uint64_t get() const {
+    return this->value.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<uint64_t> value = 0;
+};
+
+// A log-linear histogram of durations in nanoseconds. Each power of two is
+// split into 4 buckets, so any recorded value is known to within 25%. Values
+// of 2^40 ns (about 18 minutes) or more all go into the last bucket.
+class MetricHistogram {
+public:
+  static constexpr size_t SUB_BUCKET_BITS = 2;
+  static constexpr size_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static constexpr size_t MAX_EXPONENT = 40;
+  static constexpr size_t NUM_BUCKETS = (MAX_EXPONENT - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  MetricHistogram() = default;
+  MetricHistogram(const MetricHistogram&) = delete;
+  MetricHistogram(MetricHistogram&&) = delete;
+  MetricHistogram& operator=(const MetricHistogram&) = delete;
+  MetricHistogram& operator=(MetricHistogram&&) = delete;
+  ~MetricHistogram() = default;
+
+  static size_t bucket_for_value(uint64_t v);
+  // Returns the smallest value that does NOT go into the given bucket (or
+  // any bucket before it)
+  static uint64_t bucket_end(size_t index);
+
+  inline void record(uint64_t v) {
+    this->buckets[bucket_for_value(v)].fetch_add(1, std::memory_order_relaxed);
+    this->count.fetch_add(1, std::memory_order_relaxed);
+    this->sum.fetch_add(v, std::memory_order_relaxed);
+  }
+  inline void record_since(uint64_t start_ns) {
+    this->record(metrics_now_ns() - start_ns);
+  }
+
+  inline uint64_t get_count() const {
+    return this->count.load(std::memory_order_relaxed);
+  }
+  inline uint64_t get_sum() const {
+    return this->sum.load(std::memory_order_relaxed);
+  }
+  inline uint64_t get_bucket(size_t index) const {
+    return this->buckets[index].load(std::memory_order_relaxed);
+  }
+
+  // Appends the histogram to out in the Prometheus text format, in seconds.
+  // To keep the output short, only the buckets that end at powers of two
+  // between 1us and the largest recorded value are written. labels may be
+  // empty; if not, it should be like 'name="value",name2="value2"'. Nothing is
+  // written if the histogram is empty.
+  void format_prometheus(std::string& out, const char* name, const std::string& labels) const;
+
+private:
+  std::atomic<uint64_t> buckets[NUM_BUCKETS] = {};
+  std::atomic<uint64_t> count = 0;
+  std::atomic<uint64_t> sum = 0;
+};
+
+struct ServerMetrics {
+  // Index NUM_VERSIONS is used for channels whose version isn't known yet.
+  // Commands are indexed by their low byte only, since that's what the
+  // command handlers are dispatched on (this matters only for BB, which has
+  // some commands like 01EB and 02EB that share a handler).
+  static constexpr size_t NUM_VERSION_SLOTS = NUM_VERSIONS + 1;
+  static inline size_t version_slot(Version v) {
+    size_t ret = static_cast<size_t>(v);
+    return (ret < NUM_VERSIONS) ? ret : NUM_VERSIONS;
+  }
+
+  MetricCounter commands_received[NUM_VERSION_SLOTS][0x100];
+  MetricCounter commands_sent[NUM_VERSION_SLOTS][0x100];
+  MetricCounter bytes_received[NUM_VERSION_SLOTS];
+  MetricCounter bytes_sent[NUM_VERSION_SLOTS];
+  MetricCounter decrypt_ns[NUM_VERSION_SLOTS];
+  MetricCounter encrypt_ns[NUM_VERSION_SLOTS];
+
+  // Game server command handlers (on_command) and game subcommand handlers
+  // (6x, C9, and CB commands), indexed by command or subcommand number
+  MetricHistogram command_handler_ns[0x100];
+  MetricHistogram subcommand_handler_ns[0x100];
+
+  // How late the event loop runs a periodic timer event
+  MetricHistogram event_loop_lag_ns;
+  // Durations of all event callbacks on watched threads, indexed by
+  // EventLoopWatchdog::CallbackType
+  MetricHistogram callback_ns[4];
+
+  MetricCounter file_cache_hits;
+  MetricCounter file_cache_misses;
+
+  // Loading all of a client's files, and saving each individual file (which,
+  // with the async file writer, only serializes and queues it)
+  MetricHistogram player_files_load_ns;
+  MetricHistogram player_files_save_ns;
+
+  // Appends all of the above (but not the metrics that ServerState or other
+  // objects are responsible for) to out
+  void format_prometheus(std::string& out) const;
+};
+
+extern ServerMetrics global_metrics;
+
+// Measures how long the event loop takes to run a timer event after it's
+// due, and records it in global_metrics.event_loop_lag_ns.
+class EventLoopLagProbe {
+public:
+  explicit EventLoopLagProbe(std::shared_ptr<struct event_base> base, uint64_t interval_usecs = 100000);
+  EventLoopLagProbe(const EventLoopLagProbe&) = delete;
+  EventLoopLagProbe(EventLoopLagProbe&&) = delete;
+  EventLoopLagProbe& operator=(const EventLoopLagProbe&) = delete;
+  EventLoopLagProbe& operator=(EventLoopLagProbe&&) = delete;
+  ~EventLoopLagProbe() = default;
+
+private:
+  std::shared_ptr<struct event_base> base;
+  std::unique_ptr<struct event, void (*)(struct event*)> event;
+  uint64_t interval_ns;
+  uint64_t expected_time_ns;
+
+  void schedule();
+  static void dispatch_on_timer(evutil_socket_t, short, void* ctx);
+};
+
+// Appends a metric with no labels in the Prometheus text format
+void format_prometheus_value(std::string& out, const char* name, const char* type, const char* help, uint64_t value);
+void format_prometheus_header(std::string& out, const char* name, const char* type, const char* help);
@@ -3,12 +3,19 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <bit>
 #include <phosg/Encoding.hh>
 #include <phosg/Random.hh>
 #include <phosg/Strings.hh>
 #include <stdexcept>
 #include <string>
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 using namespace std;
 
 // TODO: fix style in this file, especially in psobb functions
@@ -18,6 +25,130 @@ void PSOEncryption::decrypt(void* data, size_t size, bool advance) {
   this->encrypt(data, size, advance);
 }
 
+// Bulk keystream kernels. These XOR or subtract a run of keystream words
+// into a buffer of 32-bit words, which may be unaligned. The scalar versions
+// define the expected behavior; on x86-64, AVX2 versions are used instead if
+// the CPU supports them, and on ARM64, NEON versions are always used.
+
+static constexpr bool HOST_IS_LITTLE_ENDIAN = (std::endian::native == std::endian::little);
+
+static void lfg_xor_words_scalar(void* vdst, const uint32_t* src, size_t count, bool byteswap) {
+  uint8_t* dst = reinterpret_cast<uint8_t*>(vdst);
+  for (size_t x = 0; x < count; x++) {
+    uint32_t v;
+    memcpy(&v, dst + (x << 2), sizeof(v));
+    v ^= byteswap ? phosg::bswap32(src[x]) : src[x];
+    memcpy(dst + (x << 2), &v, sizeof(v));
+  }
+}
+
+static void lfg_sub_words_scalar(uint32_t* dst, const uint32_t* src, size_t count) {
+  for (size_t x = 0; x < count; x++) {
+    dst[x] -= src[x];
+  }
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+__attribute__((target("avx2"))) static void lfg_xor_words_avx2(void* vdst, const uint32_t* src, size_t count, bool byteswap) {
+  uint8_t* dst = reinterpret_cast<uint8_t*>(vdst);
+  const __m256i bswap_mask = _mm256_setr_epi8(
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  size_t x = 0;
+  for (; x + 8 <= count; x += 8) {
+    __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x));
+    if (byteswap) {
+      k = _mm256_shuffle_epi8(k, bswap_mask);
+    }
+    __m256i* d = reinterpret_cast<__m256i*>(dst + (x << 2));
+    _mm256_storeu_si256(d, _mm256_xor_si256(_mm256_loadu_si256(d), k));
+  }
+  lfg_xor_words_scalar(dst + (x << 2), src + x, count - x, byteswap);
+}
+
+__attribute__((target("avx2"))) static void lfg_sub_words_avx2(uint32_t* dst, const uint32_t* src, size_t count) {
+  size_t x = 0;
+  for (; x + 8 <= count; x += 8) {
+    __m256i* d = reinterpret_cast<__m256i*>(dst + x);
+    __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x));
+    _mm256_storeu_si256(d, _mm256_sub_epi32(_mm256_loadu_si256(d), k));
+  }
+  lfg_sub_words_scalar(dst + x, src + x, count - x);
+}
+
+static bool cpu_has_avx2() {
+  static const bool ret = []() -> bool {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+  }();
+  return ret;
+}
+
+static inline void lfg_xor_words(void* dst, const uint32_t* src, size_t count, bool byteswap) {
+  if (cpu_has_avx2()) {
+    lfg_xor_words_avx2(dst, src, count, byteswap);
+  } else {
+    lfg_xor_words_scalar(dst, src, count, byteswap);
+  }
+}
+
+static inline void lfg_sub_words(uint32_t* dst, const uint32_t* src, size_t count) {
+  if (cpu_has_avx2()) {
+    lfg_sub_words_avx2(dst, src, count);
+  } else {
+    lfg_sub_words_scalar(dst, src, count);
+  }
+}
+
+const char* lfg_kernel_name() {
+  return cpu_has_avx2() ? "AVX2" : "scalar";
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+
+static inline void lfg_xor_words(void* vdst, const uint32_t* src, size_t count, bool byteswap) {
+  uint8_t* dst = reinterpret_cast<uint8_t*>(vdst);
+  size_t x = 0;
+  for (; x + 4 <= count; x += 4) {
+    uint8x16_t k = vreinterpretq_u8_u32(vld1q_u32(src + x));
+    if (byteswap) {
+      k = vrev32q_u8(k);
+    }
+    uint8_t* d = dst + (x << 2);
+    vst1q_u8(d, veorq_u8(vld1q_u8(d), k));
+  }
+  lfg_xor_words_scalar(dst + (x << 2), src + x, count - x, byteswap);
+}
+
+static inline void lfg_sub_words(uint32_t* dst, const uint32_t* src, size_t count) {
+  size_t x = 0;
+  for (; x + 4 <= count; x += 4) {
+    vst1q_u32(dst + x, vsubq_u32(vld1q_u32(dst + x), vld1q_u32(src + x)));
+  }
+  lfg_sub_words_scalar(dst + x, src + x, count - x);
+}
+
+const char* lfg_kernel_name() {
+  return "NEON";
+}
+
+#else
+
+static inline void lfg_xor_words(void* dst, const uint32_t* src, size_t count, bool byteswap) {
+  lfg_xor_words_scalar(dst, src, count, byteswap);
+}
+
+static inline void lfg_sub_words(uint32_t* dst, const uint32_t* src, size_t count) {
+  lfg_sub_words_scalar(dst, src, count);
+}
+
+const char* lfg_kernel_name() {
+  return "scalar";
+}
+
+#endif
+
 PSOLFGEncryption::PSOLFGEncryption(
     uint32_t seed, size_t stream_length, size_t end_offset)
     : stream(stream_length, 0),
@@ -37,6 +168,16 @@ uint32_t PSOLFGEncryption::next(bool advance) {
   return ret;
 }
 
+const uint32_t* PSOLFGEncryption::next_words(size_t& count) {
+  if (this->offset == this->end_offset) {
+    this->update_stream();
+  }
+  const uint32_t* ret = &this->stream[this->offset];
+  count = min<size_t>(count, this->end_offset - this->offset);
+  this->offset += count;
+  return ret;
+}
+
 template <bool BE>
 void PSOLFGEncryption::encrypt_t(void* vdata, size_t size, bool advance) {
   if (!advance && (size != 4)) {
@@ -46,8 +187,19 @@ void PSOLFGEncryption::encrypt_t(void* vdata, size_t size, bool advance) {
   size_t uint32_count = size >> 2;
   size_t extra_bytes = size & 3;
   U32T<BE>* data = reinterpret_cast<U32T<BE>*>(vdata);
-  for (size_t x = 0; x < uint32_count; x++) {
-    data[x] ^= this->next(advance);
+  if (!advance) {
+    data[0] ^= this->next(false);
+    return;
+  }
+
+  // Apply the keystream in runs that end at each stream refill, so the inner
+  // loop doesn't have to check for the end of the stream on every word
+  size_t x = 0;
+  while (x < uint32_count) {
+    size_t count = uint32_count - x;
+    const uint32_t* keys = this->next_words(count);
+    lfg_xor_words(&data[x], keys, count, BE == HOST_IS_LITTLE_ENDIAN);
+    x += count;
   }
   if (extra_bytes) {
     U32T<BE> last = 0;
@@ -105,10 +257,20 @@ void PSOLFGEncryption::encrypt_both_endian(
 
   le_uint32_t* le_data = reinterpret_cast<le_uint32_t*>(le_vdata);
   be_uint32_t* be_data = reinterpret_cast<be_uint32_t*>(be_vdata);
-  for (size_t x = 0; x < size; x++) {
-    uint32_t key = this->next(advance);
-    le_data[x] ^= key;
-    be_data[x] ^= key;
+  if (!advance) {
+    uint32_t key = this->next(false);
+    le_data[0] ^= key;
+    be_data[0] ^= key;
+    return;
+  }
+
+  size_t x = 0;
+  while (x < size) {
+    size_t count = size - x;
+    const uint32_t* keys = this->next_words(count);
+    lfg_xor_words(&le_data[x], keys, count, !HOST_IS_LITTLE_ENDIAN);
+    lfg_xor_words(&be_data[x], keys, count, HOST_IS_LITTLE_ENDIAN);
+    x += count;
   }
 }
 
@@ -129,12 +291,18 @@ PSOV2Encryption::PSOV2Encryption(uint32_t seed)
 }
 
 void PSOV2Encryption::update_stream() {
-  for (size_t z = 1; z < 0x19; z++) {
-    this->stream[z] -= this->stream[z + 0x1F];
-  }
-  for (size_t z = 0x19; z < 0x38; z++) {
-    this->stream[z] -= this->stream[z - 0x18];
-  }
+  // This is equivalent to:
+  //   for (size_t z = 1; z < 0x19; z++) {
+  //     this->stream[z] -= this->stream[z + 0x1F];
+  //   }
+  //   for (size_t z = 0x19; z < 0x38; z++) {
+  //     this->stream[z] -= this->stream[z - 0x18];
+  //   }
+  // In the second loop, each word depends on a word 0x18 words before it, so
+  // it can be computed in vectors of up to 0x18 words.
+  uint32_t* s = this->stream.data();
+  lfg_sub_words(s + 1, s + 0x20, 0x18);
+  lfg_sub_words(s + 0x19, s + 0x01, 0x1F);
   this->offset = 1;
   this->cycles++;
 }
@@ -143,6 +311,18 @@ PSOEncryption::Type PSOV2Encryption::type() const {
   return Type::V2;
 }
 
+PSOV2KeystreamModel::PSOV2KeystreamModel(size_t num_words) {
+  this->a.reserve(num_words);
+  this->b.reserve(num_words);
+  PSOV2Encryption crypt0(0);
+  PSOV2Encryption crypt1(1);
+  for (size_t z = 0; z < num_words; z++) {
+    uint32_t word0 = crypt0.next();
+    this->a.emplace_back(word0);
+    this->b.emplace_back(crypt1.next() - word0);
+  }
+}
+
 PSOV3Encryption::PSOV3Encryption(uint32_t seed)
     : PSOLFGEncryption(seed, STREAM_LENGTH, STREAM_LENGTH) {
   uint32_t x, y, basekey, source1, source2, source3;
@@ -178,13 +358,19 @@ PSOV3Encryption::PSOV3Encryption(uint32_t seed)
 }
 
 void PSOV3Encryption::update_stream() {
+  // This is equivalent to:
+  //   for (size_t z = 489; z < STREAM_LENGTH; z++) {
+  //     this->stream[z - 489] ^= this->stream[z];
+  //   }
+  //   for (size_t z = PHASE2_OFFSET; z < STREAM_LENGTH; z++) {
+  //     this->stream[z] ^= this->stream[z - PHASE2_OFFSET];
+  //   }
+  // In the second loop, each word depends on a word PHASE2_OFFSET (32) words
+  // before it, so it can be computed in vectors of up to 32 words.
   static constexpr size_t PHASE2_OFFSET = STREAM_LENGTH - 489;
-  for (size_t z = 489; z < STREAM_LENGTH; z++) {
-    this->stream[z - 489] ^= this->stream[z];
-  }
-  for (size_t z = PHASE2_OFFSET; z < STREAM_LENGTH; z++) {
-    this->stream[z] ^= this->stream[z - PHASE2_OFFSET];
-  }
+  uint32_t* s = this->stream.data();
+  lfg_xor_words(s, s + 489, PHASE2_OFFSET, false);
+  lfg_xor_words(s + PHASE2_OFFSET, s, STREAM_LENGTH - PHASE2_OFFSET, false);
   this->offset = 0;
   this->cycles++;
 }
@@ -193,41 +379,181 @@ PSOEncryption::Type PSOV3Encryption::type() const {
   return Type::V3;
 }
 
+// All subtypes except JSD1 use the same Feistel network. During encryption,
+// each 8-byte block is processed with 4 rounds using 6 of the subkeys; during
+// key expansion, pairs of words are processed with the full 16 rounds using
+// all 18 subkeys. The round function uses all four S-boxes.
+
+static inline uint32_t bb_round_f(const uint32_t* sboxes, uint32_t x) {
+  return ((sboxes[x >> 24] + sboxes[((x >> 16) & 0xFF) + 0x100]) ^ sboxes[((x >> 8) & 0xFF) + 0x200]) +
+      sboxes[(x & 0xFF) + 0x300];
+}
+
+static inline uint32_t bb_load_word(const uint8_t* data) {
+  uint32_t v;
+  memcpy(&v, data, sizeof(v));
+  return HOST_IS_LITTLE_ENDIAN ? v : phosg::bswap32(v);
+}
+
+static inline void bb_store_word(uint8_t* data, uint32_t v) {
+  if (!HOST_IS_LITTLE_ENDIAN) {
+    v = phosg::bswap32(v);
+  }
+  memcpy(data, &v, sizeof(v));
+}
+
+// Encrypts or decrypts blocks, depending on the order of the given subkeys.
+// Blocks don't depend on each other, so two are processed at a time; this
+// allows the S-box loads for one block to overlap with those for the other.
+static void bb_crypt_blocks(
+    void* vdata, size_t num_blocks, const uint32_t* sboxes, uint32_t k0, uint32_t k1, uint32_t k2, uint32_t k3, uint32_t k4, uint32_t k5) {
+  uint8_t* data = reinterpret_cast<uint8_t*>(vdata);
+  uint8_t* data_end = data + (num_blocks << 3);
+  for (; data + 0x10 <= data_end; data += 0x10) {
+    uint32_t l1 = bb_load_word(data) ^ k0;
+    uint32_t r1 = bb_load_word(data + 4);
+    uint32_t l2 = bb_load_word(data + 8) ^ k0;
+    uint32_t r2 = bb_load_word(data + 12);
+    r1 ^= bb_round_f(sboxes, l1) ^ k1;
+    r2 ^= bb_round_f(sboxes, l2) ^ k1;
+    l1 ^= bb_round_f(sboxes, r1) ^ k2;
+    l2 ^= bb_round_f(sboxes, r2) ^ k2;
+    r1 ^= bb_round_f(sboxes, l1) ^ k3;
+    r2 ^= bb_round_f(sboxes, l2) ^ k3;
+    l1 ^= bb_round_f(sboxes, r1) ^ k4;
+    l2 ^= bb_round_f(sboxes, r2) ^ k4;
+    bb_store_word(data, r1 ^ k5);
+    bb_store_word(data + 4, l1);
+    bb_store_word(data + 8, r2 ^ k5);
+    bb_store_word(data + 12, l2);
+  }
+  if (data < data_end) {
+    uint32_t l = bb_load_word(data) ^ k0;
+    uint32_t r = bb_load_word(data + 4);
+    r ^= bb_round_f(sboxes, l) ^ k1;
+    l ^= bb_round_f(sboxes, r) ^ k2;
+    r ^= bb_round_f(sboxes, l) ^ k3;
+    l ^= bb_round_f(sboxes, r) ^ k4;
+    bb_store_word(data, r ^ k5);
+    bb_store_word(data + 4, l);
+  }
+}
+
+// Expands the subkeys and S-boxes for several keys at once. Each key's
+// expansion is a long serial chain of dependent S-box loads, so interleaving
+// independent keys lets the CPU overlap their latencies. This is equivalent
+// to running each key through the following loop separately:
+//   l = 0, r = 0
+//   for each pair of words (a, b) in subkeys, then in sboxes:
+//     l ^= subkeys[0]
+//     for (x = 1; x <= 15; x += 2):
+//       r ^= f(l) ^ subkeys[x]
+//       l ^= f(r) ^ subkeys[x + 1]
+//     a = r ^ subkeys[17], b = l
+//     l = a, r = b
+static constexpr size_t BB_KEY_EXPANSION_LANES = 4;
+
+template <size_t Lanes>
+static void bb_expand_keys_lanes(uint32_t* const* subkeys, uint32_t* const* sboxes) {
+  uint32_t l[Lanes] = {};
+  uint32_t r[Lanes] = {};
+  for (size_t z = 0; z < 0x412; z += 2) {
+    for (size_t w = 0; w < Lanes; w++) {
+      l[w] ^= subkeys[w][0];
+    }
+    for (size_t x = 1; x < 0x10; x += 2) {
+      for (size_t w = 0; w < Lanes; w++) {
+        r[w] ^= bb_round_f(sboxes[w], l[w]) ^ subkeys[w][x];
+      }
+      for (size_t w = 0; w < Lanes; w++) {
+        l[w] ^= bb_round_f(sboxes[w], r[w]) ^ subkeys[w][x + 1];
+      }
+    }
+    for (size_t w = 0; w < Lanes; w++) {
+      uint32_t* dest = (z < 0x12) ? &subkeys[w][z] : &sboxes[w][z - 0x12];
+      uint32_t a = r[w] ^ subkeys[w][0x11];
+      dest[0] = a;
+      dest[1] = l[w];
+      r[w] = l[w];
+      l[w] = a;
+    }
+  }
+}
+
+PSOBBEncryption::PSOBBEncryption(const KeyFile& key) : state(key) {}
+
 PSOBBEncryption::PSOBBEncryption(
     const KeyFile& key, const void* original_seed, size_t seed_size)
     : state(key) {
-  this->apply_seed(original_seed, seed_size);
+  this->mix_seed(original_seed, seed_size);
+  if (this->state.subtype != Subtype::JSD1) {
+    PSOBBEncryption* crypts[1] = {this};
+    PSOBBEncryption::expand_keys(crypts, 1);
+  }
 }
 
-void PSOBBEncryption::encrypt(void* vdata, size_t size, bool advance) {
-  if (this->state.subtype == Subtype::TFS1) {
-    if (size & 7) {
-      throw invalid_argument("size must be a multiple of 8");
+vector<shared_ptr<PSOBBEncryption>> PSOBBEncryption::create_multi(
+    const shared_ptr<const KeyFile>* keys, size_t count, const void* seed, size_t seed_size) {
+  vector<shared_ptr<PSOBBEncryption>> ret;
+  vector<PSOBBEncryption*> to_expand;
+  ret.reserve(count);
+  for (size_t z = 0; z < count; z++) {
+    // make_shared can't be used here since this constructor isn't public
+    auto& crypt = ret.emplace_back(new PSOBBEncryption(*keys[z]));
+    crypt->mix_seed(seed, seed_size);
+    if (crypt->state.subtype != Subtype::JSD1) {
+      to_expand.emplace_back(crypt.get());
     }
+  }
+  PSOBBEncryption::expand_keys(to_expand.data(), to_expand.size());
+  return ret;
+}
 
-    le_uint32_t* dwords = reinterpret_cast<le_uint32_t*>(vdata);
-    for (size_t x = 0; x < (size >> 2); x += 2) {
-      for (size_t y = 0; y < 4; y += 2) {
-        dwords[x] ^= this->state.initial_keys.as32[y];
-        dwords[x + 1] ^= ((this->state.private_keys.as32[dwords[x] >> 24] +
-                              this->state.private_keys.as32[((dwords[x] >> 16) & 0xFF) + 0x100]) ^
-                             this->state.private_keys.as32[((dwords[x] >> 8) & 0xFF) + 0x200]) +
-            this->state.private_keys.as32[(dwords[x] & 0xFF) + 0x300];
-        dwords[x + 1] ^= this->state.initial_keys.as32[y + 1];
-        dwords[x] ^= ((this->state.private_keys.as32[dwords[x + 1] >> 24] +
-                          this->state.private_keys.as32[(dwords[x + 1] >> 16 & 0xFF) + 0x100]) ^
-                         this->state.private_keys.as32[(dwords[x + 1] >> 8 & 0xFF) + 0x200]) +
-            this->state.private_keys.as32[(dwords[x + 1] & 0xFF) + 0x300];
-      }
-      dwords[x] ^= this->state.initial_keys.as32[4];
-      dwords[x + 1] ^= this->state.initial_keys.as32[5];
-
-      uint32_t a = dwords[x];
-      dwords[x] = dwords[x + 1];
-      dwords[x + 1] = a;
+void PSOBBEncryption::expand_keys(PSOBBEncryption* const* crypts, size_t count) {
+  static_assert(BB_KEY_EXPANSION_LANES == 4, "expand_keys must handle all possible lane counts");
+  uint32_t* subkeys[BB_KEY_EXPANSION_LANES];
+  uint32_t* sboxes[BB_KEY_EXPANSION_LANES];
+  for (size_t z = 0; z < count; z += BB_KEY_EXPANSION_LANES) {
+    size_t num_lanes = min<size_t>(BB_KEY_EXPANSION_LANES, count - z);
+    for (size_t w = 0; w < num_lanes; w++) {
+      subkeys[w] = crypts[z + w]->subkeys;
+      sboxes[w] = crypts[z + w]->sboxes;
     }
+    switch (num_lanes) {
+      case 1:
+        bb_expand_keys_lanes<1>(subkeys, sboxes);
+        break;
+      case 2:
+        bb_expand_keys_lanes<2>(subkeys, sboxes);
+        break;
+      case 3:
+        bb_expand_keys_lanes<3>(subkeys, sboxes);
+        break;
+      case 4:
+        bb_expand_keys_lanes<4>(subkeys, sboxes);
+        break;
+    }
+  }
+}
 
-  } else if (this->state.subtype == Subtype::JSD1) {
+void PSOBBEncryption::encrypt_blocks(void* data, size_t num_blocks) const {
+  if (this->state.subtype == Subtype::JSD1) {
+    throw logic_error("JSD1 encryption does not operate on blocks");
+  }
+  const uint32_t* k = this->subkeys;
+  bb_crypt_blocks(data, num_blocks, this->sboxes, k[0], k[1], k[2], k[3], k[4], k[5]);
+}
+
+void PSOBBEncryption::decrypt_blocks(void* data, size_t num_blocks) const {
+  if (this->state.subtype == Subtype::JSD1) {
+    throw logic_error("JSD1 encryption does not operate on blocks");
+  }
+  const uint32_t* k = this->subkeys;
+  bb_crypt_blocks(data, num_blocks, this->sboxes, k[5], k[4], k[3], k[2], k[1], k[0]);
+}
+
+void PSOBBEncryption::encrypt(void* vdata, size_t size, bool advance) {
+  if (this->state.subtype == Subtype::JSD1) {
     if (size & 1) {
       throw invalid_argument("size must be a multiple of 2");
     }
@@ -253,78 +579,17 @@ void PSOBBEncryption::encrypt(void* vdata, size_t size, bool advance) {
       bytes[z + 1] = (a & 0xAA) | (b & 0x55);
     }
 
-  } else { // STANDARD or MOCB1
+
+  } else { // STANDARD, MOCB1, or TFS1
     if (size & 7) {
       throw invalid_argument("size must be a multiple of 8");
     }
-
-    size_t num_dwords = size >> 2;
-    le_uint32_t* data = reinterpret_cast<le_uint32_t*>(vdata);
-    uint32_t edx, ebx, ebp, esi, edi;
-
-    edx = 0;
-    while (edx < num_dwords) {
-      ebx = data[edx] ^ this->state.initial_keys.as32[0];
-      ebp = ((this->state.private_keys.as32[(ebx >> 0x18)] +
-                 this->state.private_keys.as32[((ebx >> 0x10) & 0xFF) + 0x100]) ^
-                this->state.private_keys.as32[((ebx >> 0x8) & 0xFF) + 0x200]) +
-          this->state.private_keys.as32[(ebx & 0xFF) + 0x300];
-      ebp = ebp ^ this->state.initial_keys.as32[1];
-      ebp ^= data[edx + 1];
-      edi = ((this->state.private_keys.as32[(ebp >> 0x18)] +
-                 this->state.private_keys.as32[((ebp >> 0x10) & 0xFF) + 0x100]) ^
-                this->state.private_keys.as32[((ebp >> 0x8) & 0xFF) + 0x200]) +
-          this->state.private_keys.as32[(ebp & 0xFF) + 0x300];
-      edi = edi ^ this->state.initial_keys.as32[2];
-      ebx = ebx ^ edi;
-      esi = ((this->state.private_keys.as32[(ebx >> 0x18)] +
-                 this->state.private_keys.as32[((ebx >> 0x10) & 0xFF) + 0x100]) ^
-                this->state.private_keys.as32[((ebx >> 0x8) & 0xFF) + 0x200]) +
-          this->state.private_keys.as32[(ebx & 0xFF) + 0x300];
-      ebp = ebp ^ esi ^ this->state.initial_keys.as32[3];
-      edi = ((this->state.private_keys.as32[(ebp >> 0x18)] +
-                 this->state.private_keys.as32[((ebp >> 0x10) & 0xFF) + 0x100]) ^
-                this->state.private_keys.as32[((ebp >> 0x8) & 0xFF) + 0x200]) +
-          this->state.private_keys.as32[(ebp & 0xFF) + 0x300];
-      edi = edi ^ this->state.initial_keys.as32[4];
-      ebp = ebp ^ this->state.initial_keys.as32[5];
-      ebx = ebx ^ edi;
-      data[edx] = ebp;
-      data[edx + 1] = ebx;
-      edx += 2;
-    }
+    this->encrypt_blocks(vdata, size >> 3);
   }
 }
 
 void PSOBBEncryption::decrypt(void* vdata, size_t size, bool advance) {
-  if (this->state.subtype == Subtype::TFS1) {
-    if (size & 7) {
-      throw invalid_argument("size must be a multiple of 8");
-    }
-
-    le_uint32_t* dwords = reinterpret_cast<le_uint32_t*>(vdata);
-    for (size_t x = 0; x < (size >> 2); x += 2) {
-      for (size_t y = 4; y > 0; y -= 2) {
-        dwords[x] = dwords[x] ^ this->state.initial_keys.as32[y + 1];
-        dwords[x + 1] ^= ((this->state.private_keys.as32[dwords[x] >> 24] +
-                              this->state.private_keys.as32[((dwords[x] >> 16) & 0xFF) + 0x100]) ^
-                             this->state.private_keys.as32[((dwords[x] >> 8) & 0xFF) + 0x200]) +
-            this->state.private_keys.as32[(dwords[x] & 0xFF) + 0x300];
-        dwords[x + 1] ^= this->state.initial_keys.as32[y];
-        dwords[x] ^= ((this->state.private_keys.as32[dwords[x + 1] >> 24] +
-                          this->state.private_keys.as32[((dwords[x + 1] >> 16) & 0xFF) + 0x100]) ^
-                         this->state.private_keys.as32[((dwords[x + 1] >> 8) & 0xFF) + 0x200]) +
-            this->state.private_keys.as32[(dwords[x + 1] & 0xFF) + 0x300];
-      }
-      dwords[x] ^= this->state.initial_keys.as32[1];
-      dwords[x + 1] ^= this->state.initial_keys.as32[0];
-
-      uint32_t a = dwords[x];
-      dwords[x] = dwords[x + 1];
-      dwords[x + 1] = a;
-    }
-
-  } else if (this->state.subtype == Subtype::JSD1) {
+  if (this->state.subtype == Subtype::JSD1) {
     if (size & 1) {
       throw invalid_argument("size must be a multiple of 2");
     }
@@ -349,46 +614,12 @@ void PSOBBEncryption::decrypt(void* vdata, size_t size, bool advance) {
       this->state.initial_keys.jsd1_stream_offset -= size;
     }
 
-  } else { // STANDARD or MOCB1
+
+  } else { // STANDARD, MOCB1, or TFS1
     if (size & 7) {
       throw invalid_argument("size must be a multiple of 8");
     }
-    size_t num_dwords = size >> 2;
-    le_uint32_t* dwords = reinterpret_cast<le_uint32_t*>(vdata);
-    uint32_t edx, ebx, ebp, esi, edi;
-
-    edx = 0;
-    while (edx < num_dwords) {
-      ebx = dwords[edx];
-      ebx = ebx ^ this->state.initial_keys.as32[5];
-      ebp = ((this->state.private_keys.as32[(ebx >> 0x18)] +
-                 this->state.private_keys.as32[((ebx >> 0x10) & 0xFF) + 0x100]) ^
-                this->state.private_keys.as32[((ebx >> 0x8) & 0xFF) + 0x200]) +
-          this->state.private_keys.as32[(ebx & 0xFF) + 0x300];
-      ebp = ebp ^ this->state.initial_keys.as32[4];
-      ebp ^= dwords[edx + 1];
-      edi = ((this->state.private_keys.as32[(ebp >> 0x18)] +
-                 this->state.private_keys.as32[((ebp >> 0x10) & 0xFF) + 0x100]) ^
-                this->state.private_keys.as32[((ebp >> 0x8) & 0xFF) + 0x200]) +
-          this->state.private_keys.as32[(ebp & 0xFF) + 0x300];
-      edi = edi ^ this->state.initial_keys.as32[3];
-      ebx = ebx ^ edi;
-      esi = ((this->state.private_keys.as32[(ebx >> 0x18)] +
-                 this->state.private_keys.as32[((ebx >> 0x10) & 0xFF) + 0x100]) ^
-                this->state.private_keys.as32[((ebx >> 0x8) & 0xFF) + 0x200]) +
-          this->state.private_keys.as32[(ebx & 0xFF) + 0x300];
-      ebp = ebp ^ esi ^ this->state.initial_keys.as32[2];
-      edi = ((this->state.private_keys.as32[(ebp >> 0x18)] +
-                 this->state.private_keys.as32[((ebp >> 0x10) & 0xFF) + 0x100]) ^
-                this->state.private_keys.as32[((ebp >> 0x8) & 0xFF) + 0x200]) +
-          this->state.private_keys.as32[(ebp & 0xFF) + 0x300];
-      edi = edi ^ this->state.initial_keys.as32[1];
-      ebp = ebp ^ this->state.initial_keys.as32[0];
-      ebx = ebx ^ edi;
-      dwords[edx] = ebp;
-      dwords[edx + 1] = ebx;
-      edx += 2;
-    }
+    this->decrypt_blocks(vdata, size >> 3);
   }
 }
 
@@ -396,26 +627,7 @@ PSOEncryption::Type PSOBBEncryption::type() const {
   return Type::BB;
 }
 
-void PSOBBEncryption::tfs1_scramble(uint32_t* out1, uint32_t* out2) const {
-  uint32_t a = *out1;
-  uint32_t b = *out2;
-  for (size_t x = 0; x < 0x10; x += 2) {
-    a ^= this->state.initial_keys.as32[x];
-    b ^= (((this->state.private_keys.as32[a >> 24] +
-               this->state.private_keys.as32[((a >> 16) & 0xFF) + 0x100]) ^
-              this->state.private_keys.as32[((a >> 8) & 0xFF) + 0x200]) +
-             this->state.private_keys.as32[(a & 0xFF) + 0x300]) ^
-        this->state.initial_keys.as32[x + 1];
-    a ^= ((this->state.private_keys.as32[b >> 24] +
-              this->state.private_keys.as32[((b >> 16) & 0xFF) + 0x100]) ^
-             this->state.private_keys.as32[((b >> 8) & 0xFF) + 0x200]) +
-        this->state.private_keys.as32[(b & 0xFF) + 0x300];
-  }
-  *out1 = this->state.initial_keys.as32[0x11] ^ b;
-  *out2 = this->state.initial_keys.as32[0x10] ^ a;
-}
-
-void PSOBBEncryption::apply_seed(const void* original_seed, size_t seed_size) {
+void PSOBBEncryption::mix_seed(const void* original_seed, size_t seed_size) {
   // Note: This part is done in the 03 command handler in the BB client, and
   // isn't actually part of the encryption library. (Why did they do this?)
   string seed;
@@ -443,25 +655,13 @@ void PSOBBEncryption::apply_seed(const void* original_seed, size_t seed_size) {
       this->state.initial_keys.as32[x >> 2] ^= seed_data;
     }
 
-    uint32_t a = 0, b = 0;
-    for (size_t x = 0; x < 0x12; x += 2) {
-      this->tfs1_scramble(&a, &b);
-      this->state.initial_keys.as32[x] = a;
-      this->state.initial_keys.as32[x + 1] = b;
-    }
-
-    for (size_t x = 0; x < 0x400; x += 2) {
-      this->tfs1_scramble(&a, &b);
-      this->state.private_keys.as32[x] = a;
-      this->state.private_keys.as32[x + 1] = b;
-    }
-
   } else if (this->state.subtype == Subtype::JSD1) {
     size_t seed_offset = 0;
     for (size_t z = 0; z < 0x100; z++) {
       this->state.private_keys.as8[z] = (z + seed[seed_offset]) ^ (static_cast<uint8_t>(seed[seed_offset]) >> 1);
       seed_offset = (seed_offset + 1) % seed.size();
     }
+    return; // JSD1 doesn't use expanded keys
 
   } else { // STANDARD or MOCB1 (they share most of their logic)
     if (seed_size % 3) {
@@ -478,9 +678,8 @@ void PSOBBEncryption::apply_seed(const void* original_seed, size_t seed_size) {
       }
     }
 
-    // This block was formerly postprocess_initial_stream
     {
-      uint32_t eax, ecx, edx, ebx, ebp, esi, edi, ou, x;
+      uint32_t eax, ecx, edx, ebx, ebp;
 
       ecx = 0;
       ebx = 0;
@@ -506,166 +705,18 @@ void PSOBBEncryption::apply_seed(const void* original_seed, size_t seed_size) {
         ecx = edx;
         ebx++;
       }
-
-      ebp = 0;
-      esi = 0;
-      ecx = 0;
-      edi = 0;
-      ebx = 0;
-      edx = 0x48;
-
-      while (edi < edx) {
-        esi = esi ^ this->state.initial_keys.as32[0];
-        eax = esi >> 0x18;
-        ebx = (esi >> 0x10) & 0xFF;
-        eax = this->state.private_keys.as32[eax] + this->state.private_keys.as32[ebx + 0x100];
-        ebx = (esi >> 8) & 0xFF;
-        eax = eax ^ this->state.private_keys.as32[ebx + 0x200];
-        ebx = esi & 0xFF;
-        eax = eax + this->state.private_keys.as32[ebx + 0x300];
-
-        eax = eax ^ this->state.initial_keys.as32[1];
-        ecx = ecx ^ eax;
-        ebx = ecx >> 0x18;
-        eax = (ecx >> 0x10) & 0xFF;
-        ebx = this->state.private_keys.as32[ebx] + this->state.private_keys.as32[eax + 0x100];
-        eax = (ecx >> 8) & 0xFF;
-        ebx = ebx ^ this->state.private_keys.as32[eax + 0x200];
-        eax = ecx & 0xFF;
-        ebx = ebx + this->state.private_keys.as32[eax + 0x300];
-
-        for (x = 0; x <= 5; x++) {
-          ebx = ebx ^ this->state.initial_keys.as32[(x * 2) + 2];
-          esi = esi ^ ebx;
-          ebx = esi >> 0x18;
-          eax = (esi >> 0x10) & 0xFF;
-          ebx = this->state.private_keys.as32[ebx] + this->state.private_keys.as32[eax + 0x100];
-          eax = (esi >> 8) & 0xFF;
-          ebx = ebx ^ this->state.private_keys.as32[eax + 0x200];
-          eax = esi & 0xFF;
-          ebx = ebx + this->state.private_keys.as32[eax + 0x300];
-
-          ebx = ebx ^ this->state.initial_keys.as32[(x * 2) + 3];
-          ecx = ecx ^ ebx;
-          ebx = ecx >> 0x18;
-          eax = (ecx >> 0x10) & 0xFF;
-          ebx = this->state.private_keys.as32[ebx] + this->state.private_keys.as32[eax + 0x100];
-          eax = (ecx >> 8) & 0xFF;
-          ebx = ebx ^ this->state.private_keys.as32[eax + 0x200];
-          eax = ecx & 0xFF;
-          ebx = ebx + this->state.private_keys.as32[eax + 0x300];
-        }
-
-        ebx = ebx ^ this->state.initial_keys.as32[14];
-        esi = esi ^ ebx;
-        eax = esi >> 0x18;
-        ebx = (esi >> 0x10) & 0xFF;
-        eax = this->state.private_keys.as32[eax] + this->state.private_keys.as32[ebx + 0x100];
-        ebx = (esi >> 8) & 0xFF;
-        eax = eax ^ this->state.private_keys.as32[ebx + 0x200];
-        ebx = esi & 0xFF;
-        eax = eax + this->state.private_keys.as32[ebx + 0x300];
-
-        eax = eax ^ this->state.initial_keys.as32[15];
-        eax = ecx ^ eax;
-        ecx = eax >> 0x18;
-        ebx = (eax >> 0x10) & 0xFF;
-        ecx = this->state.private_keys.as32[ecx] + this->state.private_keys.as32[ebx + 0x100];
-        ebx = (eax >> 8) & 0xFF;
-        ecx = ecx ^ this->state.private_keys.as32[ebx + 0x200];
-        ebx = eax & 0xFF;
-        ecx = ecx + this->state.private_keys.as32[ebx + 0x300];
-
-        ecx = ecx ^ this->state.initial_keys.as32[16];
-        ecx = ecx ^ esi;
-        esi = this->state.initial_keys.as32[17];
-        esi = esi ^ eax;
-        this->state.initial_keys.as32[(edi / 4)] = esi;
-        this->state.initial_keys.as32[(edi / 4) + 1] = ecx;
-        edi = edi + 8;
-      }
-
-      eax = 0;
-      edx = 0;
-      ou = 0;
-      while (ou < 0x1000) {
-        edi = 0;
-        edx = 0x400;
-
-        while (edi < edx) {
-          esi = esi ^ this->state.initial_keys.as32[0];
-          eax = esi >> 0x18;
-          ebx = (esi >> 0x10) & 0xFF;
-          eax = this->state.private_keys.as32[eax] + this->state.private_keys.as32[ebx + 0x100];
-          ebx = (esi >> 8) & 0xFF;
-          eax = eax ^ this->state.private_keys.as32[ebx + 0x200];
-          ebx = esi & 0xFF;
-          eax = eax + this->state.private_keys.as32[ebx + 0x300];
-
-          eax = eax ^ this->state.initial_keys.as32[1];
-          ecx = ecx ^ eax;
-          ebx = ecx >> 0x18;
-          eax = (ecx >> 0x10) & 0xFF;
-          ebx = this->state.private_keys.as32[ebx] + this->state.private_keys.as32[eax + 0x100];
-          eax = (ecx >> 8) & 0xFF;
-          ebx = ebx ^ this->state.private_keys.as32[eax + 0x200];
-          eax = ecx & 0xFF;
-          ebx = ebx + this->state.private_keys.as32[eax + 0x300];
-
-          for (x = 0; x <= 5; x++) {
-            ebx = ebx ^ this->state.initial_keys.as32[(x * 2) + 2];
-            esi = esi ^ ebx;
-            ebx = esi >> 0x18;
-            eax = (esi >> 0x10) & 0xFF;
-            ebx = this->state.private_keys.as32[ebx] + this->state.private_keys.as32[eax + 0x100];
-            eax = (esi >> 8) & 0xFF;
-            ebx = ebx ^ this->state.private_keys.as32[eax + 0x200];
-            eax = esi & 0xFF;
-            ebx = ebx + this->state.private_keys.as32[eax + 0x300];
-
-            ebx = ebx ^ this->state.initial_keys.as32[(x * 2) + 3];
-            ecx = ecx ^ ebx;
-            ebx = ecx >> 0x18;
-            eax = (ecx >> 0x10) & 0xFF;
-            ebx = this->state.private_keys.as32[ebx] + this->state.private_keys.as32[eax + 0x100];
-            eax = (ecx >> 8) & 0xFF;
-            ebx = ebx ^ this->state.private_keys.as32[eax + 0x200];
-            eax = ecx & 0xFF;
-            ebx = ebx + this->state.private_keys.as32[eax + 0x300];
-          }
-
-          ebx = ebx ^ this->state.initial_keys.as32[14];
-          esi = esi ^ ebx;
-          eax = esi >> 0x18;
-          ebx = (esi >> 0x10) & 0xFF;
-          eax = this->state.private_keys.as32[eax] + this->state.private_keys.as32[ebx + 0x100];
-          ebx = (esi >> 8) & 0xFF;
-          eax = eax ^ this->state.private_keys.as32[ebx + 0x200];
-          ebx = esi & 0xFF;
-          eax = eax + this->state.private_keys.as32[ebx + 0x300];
-
-          eax = eax ^ this->state.initial_keys.as32[15];
-          eax = ecx ^ eax;
-          ecx = eax >> 0x18;
-          ebx = (eax >> 0x10) & 0xFF;
-          ecx = this->state.private_keys.as32[ecx] + this->state.private_keys.as32[ebx + 0x100];
-          ebx = (eax >> 8) & 0xFF;
-          ecx = ecx ^ this->state.private_keys.as32[ebx + 0x200];
-          ebx = eax & 0xFF;
-          ecx = ecx + this->state.private_keys.as32[ebx + 0x300];
-
-          ecx = ecx ^ this->state.initial_keys.as32[16];
-          ecx = ecx ^ esi;
-          esi = this->state.initial_keys.as32[17];
-          esi = esi ^ eax;
-          this->state.private_keys.as32[(ou / 4) + (edi / 4)] = esi;
-          this->state.private_keys.as32[(ou / 4) + (edi / 4) + 1] = ecx;
-          edi = edi + 8;
-        }
-        ou = ou + 0x400;
-      }
     }
   }
+
+  // The rest of the key setup (formerly postprocess_initial_stream for
+  // STANDARD and MOCB1, and tfs1_scramble for TFS1) is done in expand_keys,
+  // so it can be done for multiple keys at once
+  for (size_t x = 0; x < 0x12; x++) {
+    this->subkeys[x] = this->state.initial_keys.as32[x];
+  }
+  for (size_t x = 0; x < 0x400; x++) {
+    this->sboxes[x] = this->state.private_keys.as32[x];
+  }
 }
 
 PSOV2OrV3DetectorEncryption::PSOV2OrV3DetectorEncryption(
@@ -766,16 +817,23 @@ void PSOBBMultiKeyDetectorEncryption::decrypt(void* data, size_t size, bool adva
       throw logic_error("initial decryption size does not match expected first data size");
     }
 
-    for (const auto& key : this->possible_keys) {
-      this->active_key = key;
-      this->active_crypt = make_shared<PSOBBEncryption>(*this->active_key, this->seed.data(), this->seed.size());
-      string test_data(reinterpret_cast<const char*>(data), size);
-      this->active_crypt->decrypt(test_data.data(), test_data.size(), false);
-      if (this->expected_first_data.count(test_data)) {
-        break;
+    // The key expansion is far more expensive than the trial decryption, so
+    // we expand a few keys at a time (which is faster than one at a time) but
+    // stop as soon as one of them matches. Keys earlier in the list take
+    // priority if multiple keys match.
+    for (size_t z = 0; !this->active_crypt && (z < this->possible_keys.size()); z += BB_KEY_EXPANSION_LANES) {
+      size_t count = min<size_t>(BB_KEY_EXPANSION_LANES, this->possible_keys.size() - z);
+      auto crypts = PSOBBEncryption::create_multi(
+          &this->possible_keys[z], count, this->seed.data(), this->seed.size());
+      for (size_t w = 0; w < count; w++) {
+        string test_data(reinterpret_cast<const char*>(data), size);
+        crypts[w]->decrypt(test_data.data(), test_data.size(), false);
+        if (this->expected_first_data.count(test_data)) {
+          this->active_key = this->possible_keys[z + w];
+          this->active_crypt = std::move(crypts[w]);
+          break;
+        }
       }
-      this->active_key.reset();
-      this->active_crypt.reset();
     }
     if (!this->active_crypt.get()) {
       throw runtime_error("none of the registered private keys are valid for this client");
@@ -68,6 +68,11 @@ protected:
 
   virtual void update_stream() = 0;
 
+  // Returns a pointer to the next count keystream words and advances past
+  // them. If fewer than count words remain before the stream must be
+  // refilled, count is reduced to the number of words actually returned.
+  const uint32_t* next_words(size_t& count);
+
   std::vector<uint32_t> stream;
   size_t offset;
   size_t end_offset;
@@ -75,6 +80,10 @@ protected:
   size_t cycles;
 };
 
+// Returns the name of the instruction set used for bulk keystream operations
+// in PSOV2Encryption and PSOV3Encryption (e.g. "AVX2" or "scalar")
+const char* lfg_kernel_name();
+
 class PSOV2Encryption : public PSOLFGEncryption {
 public:
   explicit PSOV2Encryption(uint32_t seed);
@@ -86,6 +95,28 @@ protected:
   static constexpr size_t STREAM_LENGTH = 0x38;
 };
 
+// PSOV2Encryption's keystream is an affine function of its seed: since the
+// initialization and stream updates only add and subtract words, the Nth word
+// of the keystream for any seed is (a[N] + b[N] * seed) mod 2^32. This class
+// precomputes a and b for the first num_words words of the keystream, so they
+// can be computed for any seed without constructing a PSOV2Encryption. This
+// is much faster when only a few words are needed for each of many seeds.
+class PSOV2KeystreamModel {
+public:
+  explicit PSOV2KeystreamModel(size_t num_words);
+
+  inline size_t size() const {
+    return this->a.size();
+  }
+  inline uint32_t word(uint32_t seed, size_t index) const {
+    return this->a[index] + this->b[index] * seed;
+  }
+
+private:
+  std::vector<uint32_t> a;
+  std::vector<uint32_t> b;
+};
+
 class PSOV3Encryption : public PSOLFGEncryption {
 public:
   explicit PSOV3Encryption(uint32_t key);
@@ -134,16 +165,42 @@ public:
 
   PSOBBEncryption(const KeyFile& key, const void* seed, size_t seed_size);
 
+  // Constructs one PSOBBEncryption for each of the given keys, all using the
+  // same seed. The results are the same as if each were constructed
+  // separately, but the key schedules for several keys are computed at once,
+  // which is significantly faster than computing them one at a time.
+  static std::vector<std::shared_ptr<PSOBBEncryption>> create_multi(
+      const std::shared_ptr<const KeyFile>* keys,
+      size_t count,
+      const void* seed,
+      size_t seed_size);
+
   virtual void encrypt(void* data, size_t size, bool advance = true);
   virtual void decrypt(void* data, size_t size, bool advance = true);
 
+  // Encrypts or decrypts num_blocks 8-byte blocks in place. All subtypes
+  // except JSD1 are block ciphers that don't have any state that changes
+  // during encryption, so these are what encrypt() and decrypt() use for
+  // them. These throw logic_error if the subtype is JSD1.
+  void encrypt_blocks(void* data, size_t num_blocks) const;
+  void decrypt_blocks(void* data, size_t num_blocks) const;
+
   virtual Type type() const;
 
 protected:
+  // For JSD1, the key state is used directly and modified during encryption.
+  // For all other subtypes, only the subtype field in state is used after
+  // construction; the expanded keys are in subkeys and sboxes instead, in
+  // native byte order. sboxes is aligned so each S-box occupies exactly 16
+  // cache lines.
   KeyFile state;
+  alignas(64) uint32_t sboxes[0x400];
+  uint32_t subkeys[0x12];
+
+  explicit PSOBBEncryption(const KeyFile& key);
 
-  void tfs1_scramble(uint32_t* out1, uint32_t* out2) const;
-  void apply_seed(const void* original_seed, size_t seed_size);
+  void mix_seed(const void* original_seed, size_t seed_size);
+  static void expand_keys(PSOBBEncryption* const* crypts, size_t count);
 };
 
 // The following classes provide support for automatically detecting which type
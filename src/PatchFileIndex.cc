@@ -1,52 +1,289 @@
 #include "PatchFileIndex.hh"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include <array>
 #include <functional>
+#include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
-#include <phosg/Hash.hh>
 #include <phosg/Strings.hh>
+#include <phosg/Tools.hh>
 #include <stdexcept>
 
 #include "Loggers.hh"
+#include "Text.hh"
 
 using namespace std;
 
+static constexpr size_t PATCH_CHUNK_SIZE = 0x4000;
+
+////////////////////////////////////////////////////////////////////////////////
+// MappedFile
+
+mutex MappedFile::registry_lock;
+unordered_map<MappedFile::Key, weak_ptr<const MappedFile>, MappedFile::KeyHash> MappedFile::registry;
+
+size_t MappedFile::KeyHash::operator()(const Key& k) const {
+  return hash<uint64_t>()(k.ino) ^ (hash<uint64_t>()(k.dev) << 1) ^ (hash<uint64_t>()(k.mtime) << 2);
+}
+
+shared_ptr<const MappedFile> MappedFile::open(const string& filename, const struct stat& st) {
+  Key key{.dev = st.st_dev, .ino = st.st_ino, .size = static_cast<uint64_t>(st.st_size), .mtime = static_cast<uint64_t>(st.st_mtime)};
+
+  lock_guard g(registry_lock);
+  auto& entry = registry[key];
+  auto ret = entry.lock();
+  if (!ret) {
+    ret.reset(new MappedFile(filename, key));
+    entry = ret;
+  }
+  return ret;
+}
+
+MappedFile::MappedFile(const string& filename, const Key& key)
+    : filename(filename),
+      key(key),
+      fd(::open(filename.c_str(), O_RDONLY | O_CLOEXEC)),
+      map_addr(nullptr),
+      map_size(key.size) {
+  if (this->fd < 0) {
+    throw runtime_error(phosg::string_printf("cannot open %s: %s", filename.c_str(), phosg::string_for_error(errno).c_str()));
+  }
+  // mmap fails for zero-length mappings, so we don't map empty files at all
+  if (this->map_size == 0) {
+    return;
+  }
+  this->map_addr = mmap(nullptr, this->map_size, PROT_READ, MAP_SHARED, this->fd, 0);
+  if (this->map_addr == MAP_FAILED) {
+    string error_str = phosg::string_for_error(errno);
+    ::close(this->fd);
+    throw runtime_error(phosg::string_printf("cannot map %s: %s", filename.c_str(), error_str.c_str()));
+  }
+}
+
+MappedFile::~MappedFile() {
+  if (this->map_addr) {
+    munmap(this->map_addr, this->map_size);
+  }
+  ::close(this->fd);
+
+  lock_guard g(registry_lock);
+  auto it = registry.find(this->key);
+  if ((it != registry.end()) && it->second.expired()) {
+    registry.erase(it);
+  }
+}
+
+void MappedFile::pread(void* dest, size_t offset, size_t size) const {
+  uint8_t* dest_bytes = reinterpret_cast<uint8_t*>(dest);
+  while (size > 0) {
+    ssize_t bytes_read = ::pread(this->fd, dest_bytes, size, offset);
+    if (bytes_read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw runtime_error(phosg::string_printf("cannot read %s: %s", this->filename.c_str(), phosg::string_for_error(errno).c_str()));
+    }
+    if (bytes_read == 0) {
+      throw runtime_error(phosg::string_printf("%s was truncated after it was indexed", this->filename.c_str()));
+    }
+    dest_bytes += bytes_read;
+    offset += bytes_read;
+    size -= bytes_read;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CRC32
+
+static constexpr auto CRC32_TABLES = []() {
+  array<array<uint32_t, 0x100>, 8> tables{};
+  for (uint32_t z = 0; z < 0x100; z++) {
+    uint32_t c = z;
+    for (size_t bit = 0; bit < 8; bit++) {
+      c = (c & 1) ? ((c >> 1) ^ 0xEDB88320) : (c >> 1);
+    }
+    tables[0][z] = c;
+  }
+  for (uint32_t z = 0; z < 0x100; z++) {
+    for (size_t t = 1; t < 8; t++) {
+      tables[t][z] = (tables[t - 1][z] >> 8) ^ tables[0][tables[t - 1][z] & 0xFF];
+    }
+  }
+  return tables;
+}();
+
+uint32_t crc32_slice8(const void* data, size_t size, uint32_t cs) {
+  const auto& t = CRC32_TABLES;
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+  cs = ~cs;
+  for (; size >= 8; p += 8, size -= 8) {
+    uint32_t lo = cs ^ (p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24));
+    uint32_t hi = p[4] | (p[5] << 8) | (p[6] << 16) | (static_cast<uint32_t>(p[7]) << 24);
+    cs = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+        t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+  }
+  for (; size > 0; p++, size--) {
+    cs = t[0][(cs ^ *p) & 0xFF] ^ (cs >> 8);
+  }
+  return ~cs;
+}
+
+// Returns a * b modulo the CRC32 polynomial, where each value is a polynomial
+// in the reflected bit order used by CRC32 (so 0x80000000 is 1)
+static constexpr uint32_t crc32_multiply_mod_p(uint32_t a, uint32_t b) {
+  uint32_t ret = 0;
+  for (uint32_t m = 0x80000000; m; m >>= 1) {
+    if (a & m) {
+      ret ^= b;
+    }
+    b = (b & 1) ? ((b >> 1) ^ 0xEDB88320) : (b >> 1);
+  }
+  return ret;
+}
+
+// CRC32_X2N_TABLE[n] is x^(2^n) modulo the CRC32 polynomial
+static constexpr auto CRC32_X2N_TABLE = []() {
+  array<uint32_t, 64> table{};
+  uint32_t p = 0x40000000; // x^1
+  table[0] = p;
+  for (size_t n = 1; n < table.size(); n++) {
+    table[n] = p = crc32_multiply_mod_p(p, p);
+  }
+  return table;
+}();
+
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t size2) {
+  // Appending size2 bytes to the first block multiplies its CRC by
+  // x^(8 * size2); the initial and final inversions cancel out
+  uint32_t shift = 0x80000000; // x^0
+  uint64_t num_bits = static_cast<uint64_t>(size2) << 3;
+  for (size_t n = 0; num_bits; num_bits >>= 1, n++) {
+    if (num_bits & 1) {
+      shift = crc32_multiply_mod_p(CRC32_X2N_TABLE[n], shift);
+    }
+  }
+  return crc32_multiply_mod_p(shift, crc1) ^ crc2;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Metadata cache
+
+// The metadata cache file (.metadata-cache.bin in the patch directory) is:
+//   PatchMetadataCacheHeader
+//   For each file:
+//     PatchMetadataCacheEntry
+//     Path relative to the patch directory (path_size bytes; no terminator)
+//     le_uint32_t chunk_crcs[(size + 0x3FFF) / 0x4000]
+
+struct PatchMetadataCacheHeader {
+  be_uint32_t magic;
+  le_uint32_t format_version;
+  le_uint32_t num_entries;
+  le_uint32_t unused;
+} __packed_ws__(PatchMetadataCacheHeader, 0x10);
+
+struct PatchMetadataCacheEntry {
+  le_uint64_t size;
+  le_uint64_t mtime;
+  le_uint32_t crc32;
+  le_uint32_t path_size;
+} __packed_ws__(PatchMetadataCacheEntry, 0x18);
+
+static constexpr uint32_t METADATA_CACHE_MAGIC = 0x4E504D43; // 'NPMC'
+static constexpr uint32_t METADATA_CACHE_FORMAT_VERSION = 1;
+
+struct CachedFileMetadata {
+  uint64_t size;
+  uint64_t mtime;
+  uint32_t crc32;
+  vector<uint32_t> chunk_crcs;
+};
+
+static unordered_map<string, CachedFileMetadata> load_metadata_cache(const string& filename) {
+  string data = phosg::load_file(filename);
+  phosg::StringReader r(data);
+
+  const auto& header = r.get<PatchMetadataCacheHeader>();
+  if (header.magic != METADATA_CACHE_MAGIC) {
+    throw runtime_error("metadata cache has incorrect signature");
+  }
+  if (header.format_version != METADATA_CACHE_FORMAT_VERSION) {
+    throw runtime_error("metadata cache is from a different version of newserv");
+  }
+
+  unordered_map<string, CachedFileMetadata> ret;
+  ret.reserve(header.num_entries);
+  for (size_t z = 0; z < header.num_entries; z++) {
+    const auto& e = r.get<PatchMetadataCacheEntry>();
+    string path = r.readx(e.path_size);
+    CachedFileMetadata& md = ret[std::move(path)];
+    md.size = e.size;
+    md.mtime = e.mtime;
+    md.crc32 = e.crc32;
+    size_t num_chunks = (md.size + PATCH_CHUNK_SIZE - 1) / PATCH_CHUNK_SIZE;
+    if (num_chunks * sizeof(le_uint32_t) > r.remaining()) {
+      throw runtime_error("metadata cache is truncated");
+    }
+    md.chunk_crcs.reserve(num_chunks);
+    for (size_t c = 0; c < num_chunks; c++) {
+      md.chunk_crcs.emplace_back(r.get_u32l());
+    }
+  }
+  return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// PatchFileIndex
+
 PatchFileIndex::File::File(PatchFileIndex* index)
     : index(index),
       crc32(0),
       size(0) {}
 
+void PatchFileIndex::File::read(void* dest, size_t offset, size_t size) const {
+  if ((offset > this->size) || (size > this->size - offset)) {
+    throw out_of_range("read extends beyond end of patch file");
+  }
+  this->mapped_data->pread(dest, offset, size);
+}
+
 std::shared_ptr<const std::string> PatchFileIndex::File::load_data() {
   if (!this->loaded_data) {
-    string relative_path = phosg::join(this->path_directories, "/") + "/" + this->name;
-    string full_path = this->index->root_dir + "/" + relative_path;
-    patch_index_log.info("Loading data for %s", relative_path.c_str());
-    this->loaded_data = make_shared<string>(phosg::load_file(full_path));
-    this->size = this->loaded_data->size();
+    auto data = make_shared<string>(this->size, '\0');
+    this->read(data->data(), 0, data->size());
+    this->loaded_data = std::move(data);
   }
   return this->loaded_data;
 }
 
-PatchFileIndex::PatchFileIndex(const string& root_dir)
+PatchFileIndex::PatchFileIndex(const string& root_dir, size_t num_threads)
     : root_dir(root_dir) {
 
-  string metadata_cache_filename = root_dir + "/.metadata-cache.json";
-  phosg::JSON metadata_cache_json;
+  string metadata_cache_filename = root_dir + "/.metadata-cache.bin";
+  unordered_map<string, CachedFileMetadata> metadata_cache;
   try {
-    string metadata_text = phosg::load_file(metadata_cache_filename);
-    metadata_cache_json = phosg::JSON::parse(metadata_text);
+    metadata_cache = load_metadata_cache(metadata_cache_filename);
     patch_index_log.info("Loaded patch metadata cache from %s", metadata_cache_filename.c_str());
+  } catch (const out_of_range&) {
+    patch_index_log.warning("Cannot load patch metadata cache from %s: file is truncated", metadata_cache_filename.c_str());
   } catch (const exception& e) {
-    metadata_cache_json = phosg::JSON::dict();
     patch_index_log.warning("Cannot load patch metadata cache from %s: %s", metadata_cache_filename.c_str(), e.what());
   }
 
-  // Assuming it's rare for patch files to change, we skip writing the metadata
-  // cache if no files were changed at all (which should usually be the case)
-  bool should_write_metadata_cache = false;
-  phosg::JSON new_metadata_cache_json = phosg::JSON::dict();
+  struct PendingFile {
+    shared_ptr<File> file;
+    string relative_path;
+    string full_path;
+    uint64_t mtime;
+    string compute_crc32s_message; // If not empty, should compute crc32s
+  };
+  vector<PendingFile> pending_files;
 
   vector<string> path_directories;
   function<void(const string&)> collect_dir = [&](const string& dir) -> void {
@@ -67,69 +304,33 @@ PatchFileIndex::PatchFileIndex(const string& root_dir)
       if (phosg::isdir(full_item_path)) {
         collect_dir(item);
       } else if (phosg::isfile(full_item_path)) {
-
         auto st = phosg::stat(full_item_path);
+        if (static_cast<uint64_t>(st.st_size) > 0xFFFFFFFF) {
+          throw runtime_error("patch file is too large: " + full_item_path);
+        }
 
-        auto f = make_shared<File>(this);
+        auto& pf = pending_files.emplace_back(PendingFile{
+            .file = make_shared<File>(this),
+            .relative_path = relative_item_path,
+            .full_path = full_item_path,
+            .mtime = static_cast<uint64_t>(st.st_mtime),
+            .compute_crc32s_message = ""});
+        auto& f = pf.file;
         f->path_directories = path_directories;
         f->name = item;
+        f->size = st.st_size;
+        f->mapped_data = MappedFile::open(full_item_path, st);
 
-        string compute_crc32s_message; // If not empty, should compute crc32s
-        phosg::JSON cache_item_json;
-        try {
-          cache_item_json = metadata_cache_json.at(relative_item_path);
-          uint64_t cached_size = cache_item_json.get_int(0);
-          uint64_t cached_mtime = cache_item_json.get_int(1);
-          if (static_cast<uint64_t>(st.st_mtime) != cached_mtime) {
-            throw runtime_error("file has been modified");
-          }
-          if (static_cast<uint64_t>(st.st_size) != cached_size) {
-            throw runtime_error("file size has changed");
-          }
-          f->size = cached_size;
-          f->crc32 = cache_item_json.get_int(2);
-          for (const auto& chunk_crc32_json : cache_item_json.get_list(3)) {
-            f->chunk_crcs.emplace_back(chunk_crc32_json->as_int());
-          }
-
-        } catch (const exception& e) {
-          compute_crc32s_message = e.what();
-        }
-
-        if (!compute_crc32s_message.empty()) {
-          auto data = f->load_data(); // Sets f->size
-          f->crc32 = phosg::crc32(data->data(), f->size);
-          for (size_t x = 0; x < data->size(); x += 0x4000) {
-            size_t chunk_bytes = min<size_t>(f->size - x, 0x4000);
-            f->chunk_crcs.emplace_back(phosg::crc32(data->data() + x, chunk_bytes));
-          }
-
-          // File was modified or cache item was missing; make a new cache item
-          auto chunk_crcs_item = phosg::JSON::list();
-          for (uint32_t chunk_crc : f->chunk_crcs) {
-            chunk_crcs_item.emplace_back(chunk_crc);
-          }
-          new_metadata_cache_json.emplace(
-              relative_item_path, phosg::JSON::list({f->size, st.st_mtime, f->crc32, std::move(chunk_crcs_item)}));
-          should_write_metadata_cache = true;
-
-        } else {
-          // File was not modified and cache item was valid; just use the
-          // existing cache item
-          new_metadata_cache_json.emplace(
-              relative_item_path, std::move(cache_item_json));
-        }
-
-        this->files_by_patch_order.emplace_back(f);
-        this->files_by_name.emplace(relative_item_path, f);
-        if (compute_crc32s_message.empty()) {
-          patch_index_log.info(
-              "Added file %s (%" PRIu32 " bytes; %zu chunks; %08" PRIX32 " from cache)",
-              full_item_path.c_str(), f->size, f->chunk_crcs.size(), f->crc32);
+        auto cache_it = metadata_cache.find(relative_item_path);
+        if (cache_it == metadata_cache.end()) {
+          pf.compute_crc32s_message = "file is not in cache";
+        } else if (cache_it->second.mtime != pf.mtime) {
+          pf.compute_crc32s_message = "file has been modified";
+        } else if (cache_it->second.size != f->size) {
+          pf.compute_crc32s_message = "file size has changed";
         } else {
-          patch_index_log.info(
-              "Added file %s (%" PRIu32 " bytes; %zu chunks; %08" PRIX32 " [%s])",
-              full_item_path.c_str(), f->size, f->chunk_crcs.size(), f->crc32, compute_crc32s_message.c_str());
+          f->crc32 = cache_it->second.crc32;
+          f->chunk_crcs = std::move(cache_it->second.chunk_crcs);
         }
       }
     }
@@ -139,15 +340,90 @@ PatchFileIndex::PatchFileIndex(const string& root_dir)
 
   collect_dir(".");
 
-  if (should_write_metadata_cache) {
-    try {
-      phosg::save_file(metadata_cache_filename, new_metadata_cache_json.serialize());
-      patch_index_log.info("Saved patch metadata cache to %s", metadata_cache_filename.c_str());
-    } catch (const exception& e) {
-      patch_index_log.warning("Cannot save patch metadata cache to %s: %s", metadata_cache_filename.c_str(), e.what());
+  // Compute checksums for all new or modified files in parallel. Each file's
+  // data is only read once: the whole-file CRC is computed from the chunk
+  // CRCs.
+  vector<size_t> compute_indexes;
+  uint64_t compute_bytes = 0;
+  for (size_t z = 0; z < pending_files.size(); z++) {
+    if (!pending_files[z].compute_crc32s_message.empty()) {
+      compute_indexes.emplace_back(z);
+      compute_bytes += pending_files[z].file->size;
+    }
+  }
+  if (!compute_indexes.empty()) {
+    patch_index_log.info("Computing checksums for %zu files (%" PRIu64 " bytes)", compute_indexes.size(), compute_bytes);
+    phosg::parallel_range<size_t>([&](size_t index, size_t) -> bool {
+      // This is the only place the mapping is read; it's done immediately
+      // after the file is opened, so the file is unlikely to have changed
+      auto& f = *pending_files[compute_indexes[index]].file;
+      auto data = f.mapped_data->data();
+      uint32_t crc = 0;
+      f.chunk_crcs.clear();
+      for (size_t x = 0; x < data.size(); x += PATCH_CHUNK_SIZE) {
+        size_t chunk_bytes = min<size_t>(data.size() - x, PATCH_CHUNK_SIZE);
+        uint32_t chunk_crc = crc32_slice8(data.data() + x, chunk_bytes);
+        f.chunk_crcs.emplace_back(chunk_crc);
+        crc = crc32_combine(crc, chunk_crc, chunk_bytes);
+      }
+      f.crc32 = crc;
+      return false;
+    },
+        0, compute_indexes.size(), num_threads, nullptr);
+  }
+
+  for (auto& pf : pending_files) {
+    const auto& f = pf.file;
+    this->files_by_patch_order.emplace_back(f);
+    this->files_by_name.emplace(pf.relative_path, f);
+    if (pf.compute_crc32s_message.empty()) {
+      patch_index_log.info(
+          "Added file %s (%" PRIu32 " bytes; %zu chunks; %08" PRIX32 " from cache)",
+          pf.full_path.c_str(), f->size, f->chunk_crcs.size(), f->crc32);
+    } else {
+      patch_index_log.info(
+          "Added file %s (%" PRIu32 " bytes; %zu chunks; %08" PRIX32 " [%s])",
+          pf.full_path.c_str(), f->size, f->chunk_crcs.size(), f->crc32, pf.compute_crc32s_message.c_str());
     }
-  } else {
+  }
+
+  // Assuming it's rare for patch files to change, we skip writing the metadata
+  // cache if no files were added, changed, or deleted (which should usually be
+  // the case)
+  if (compute_indexes.empty() && (metadata_cache.size() == pending_files.size())) {
     patch_index_log.info("No files were modified; skipping metadata cache update");
+    return;
+  }
+
+  try {
+    phosg::StringWriter w;
+    w.put<PatchMetadataCacheHeader>(PatchMetadataCacheHeader{
+        .magic = METADATA_CACHE_MAGIC,
+        .format_version = METADATA_CACHE_FORMAT_VERSION,
+        .num_entries = pending_files.size(),
+        .unused = 0});
+    for (const auto& pf : pending_files) {
+      w.put<PatchMetadataCacheEntry>(PatchMetadataCacheEntry{
+          .size = pf.file->size,
+          .mtime = pf.mtime,
+          .crc32 = pf.file->crc32,
+          .path_size = pf.relative_path.size()});
+      w.write(pf.relative_path);
+      for (uint32_t chunk_crc : pf.file->chunk_crcs) {
+        w.put_u32l(chunk_crc);
+      }
+    }
+
+    string temp_filename = metadata_cache_filename + ".tmp";
+    phosg::save_file(temp_filename, w.str());
+    if (::rename(temp_filename.c_str(), metadata_cache_filename.c_str()) != 0) {
+      string error_str = phosg::string_for_error(errno);
+      ::unlink(temp_filename.c_str());
+      throw runtime_error("cannot rename temporary file: " + error_str);
+    }
+    patch_index_log.info("Saved patch metadata cache to %s", metadata_cache_filename.c_str());
+  } catch (const exception& e) {
+    patch_index_log.warning("Cannot save patch metadata cache to %s: %s", metadata_cache_filename.c_str(), e.what());
   }
 }
 
@@ -1,26 +1,101 @@
 #pragma once
 
 #include <inttypes.h>
+#include <sys/stat.h>
 
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
+// A read-only memory mapping of an entire file, along with an open file
+// descriptor for it. Mappings are shared: opening the same file (by device
+// and inode) again while a mapping for it still exists returns the existing
+// mapping, so the PC and BB patch indexes (and reloaded indexes) don't map the
+// same file more than once.
+//
+// Reading the mapping crashes the process with SIGBUS if the file has been
+// truncated since it was mapped, so the mapping should only be read right
+// after the file is opened (when indexing it). Use pread() for everything
+// else; it fails with an exception instead.
+class MappedFile {
+public:
+  // st must be the result of stat() on filename
+  static std::shared_ptr<const MappedFile> open(const std::string& filename, const struct stat& st);
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile(MappedFile&&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  MappedFile& operator=(MappedFile&&) = delete;
+  ~MappedFile();
+
+  inline std::string_view data() const {
+    return std::string_view(reinterpret_cast<const char*>(this->map_addr), this->map_size);
+  }
+
+  // Reads size bytes at offset from the file into dest. Throws if the file is
+  // now shorter than that (if it was truncated in place after it was opened).
+  void pread(void* dest, size_t offset, size_t size) const;
+
+private:
+  struct Key {
+    dev_t dev;
+    ino_t ino;
+    uint64_t size;
+    uint64_t mtime;
+    bool operator==(const Key& other) const = default;
+  };
+  struct KeyHash {
+    size_t operator()(const Key& k) const;
+  };
+
+  static std::mutex registry_lock;
+  static std::unordered_map<Key, std::weak_ptr<const MappedFile>, KeyHash> registry;
+
+  std::string filename;
+  Key key;
+  int fd;
+  void* map_addr;
+  size_t map_size;
+
+  MappedFile(const std::string& filename, const Key& key);
+};
+
+// Computes the standard (zlib-compatible) CRC32 of the given data, processing
+// 8 bytes at a time. The result is the same as phosg::crc32's.
+uint32_t crc32_slice8(const void* data, size_t size, uint32_t cs = 0);
+// Returns the CRC32 of the concatenation of two blocks of data, given the
+// CRC32 of each block and the size of the second block (like zlib's
+// crc32_combine)
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t size2);
+
 struct PatchFileIndex {
-  explicit PatchFileIndex(const std::string& root_dir);
+  // If num_threads is 0, one thread per CPU core is used to compute checksums
+  explicit PatchFileIndex(const std::string& root_dir, size_t num_threads = 0);
 
   struct File {
     PatchFileIndex* index;
     std::vector<std::string> path_directories;
     std::string name;
+    std::shared_ptr<const MappedFile> mapped_data;
     std::shared_ptr<const std::string> loaded_data;
     std::vector<uint32_t> chunk_crcs;
     uint32_t crc32;
     uint32_t size;
 
     explicit File(PatchFileIndex* index);
+
+    // Reads part of the file's contents. This is safe to call from any
+    // thread. Patch files should only be replaced by renaming new files over
+    // them; if a file is modified in place after it's indexed, clients may
+    // receive data that doesn't match its checksums, and this throws if the
+    // file was truncated.
+    void read(void* dest, size_t offset, size_t size) const;
+    // Returns a copy of the file's contents. The copy is kept, so this is
+    // only cheap after the first call; this is not thread-safe.
     std::shared_ptr<const std::string> load_data();
   };
 
@@ -232,6 +232,10 @@ void PatchServer::on_0F(shared_ptr<Client> c, string& data) {
 }
 
 void PatchServer::on_10(shared_ptr<Client> c, string&) {
+  if (c->file_transfer) {
+    throw runtime_error("client requested files during a file transfer");
+  }
+
   S_StartFileDownloads_Patch_11 start_cmd = {0, 0};
   for (const auto& req : c->patch_file_checksum_requests) {
     if (!req.response_received) {
@@ -249,33 +253,63 @@ void PatchServer::on_10(shared_ptr<Client> c, string&) {
 
   if (start_cmd.num_files) {
     c->channel.send(0x11, 0x00, start_cmd);
-    vector<string> path_directories;
-    for (const auto& req : c->patch_file_checksum_requests) {
-      if (req.needs_update()) {
-        this->change_to_directory(c, path_directories, req.file->path_directories);
-
-        S_OpenFile_Patch_06 open_cmd = {0, req.file->size, {req.file->name, 1}};
-        c->channel.send(0x06, 0x00, open_cmd);
-
-        for (size_t x = 0; x < req.file->chunk_crcs.size(); x++) {
-          auto data = req.file->load_data();
-          size_t chunk_size = min<uint32_t>(req.file->size - (x * 0x4000), 0x4000);
-
-          vector<pair<const void*, size_t>> blocks;
-          S_WriteFileHeader_Patch_07 cmd_header = {x, req.file->chunk_crcs[x], chunk_size};
-          blocks.emplace_back(&cmd_header, sizeof(cmd_header));
-          blocks.emplace_back(data->data() + (x * 0x4000), chunk_size);
-          c->channel.send(0x07, 0x00, blocks);
-        }
-
-        S_CloseCurrentFile_Patch_08 close_cmd = {0};
-        c->channel.send(0x08, 0x00, close_cmd);
-      }
+    c->file_transfer = make_unique<Client::FileTransfer>();
+    c->channel.on_output = PatchServer::on_client_output;
+    c->channel.set_output_low_watermark(TRANSFER_LOW_WATERMARK_BYTES);
+    try {
+      this->send_file_transfer_chunks(c);
+    } catch (const exception& e) {
+      server_log.warning("Error sending patch files to client: %s", e.what());
+      this->disconnect_client(c);
     }
-    this->change_to_directory(c, path_directories, {});
+  } else {
+    c->channel.send(0x12, 0x00);
   }
+}
+
+void PatchServer::send_file_transfer_chunks(shared_ptr<Client> c) {
+  auto& t = *c->file_transfer;
+  const auto& reqs = c->patch_file_checksum_requests;
+  while (c->channel.connected() && (c->channel.output_buffer_size() < MAX_TRANSFER_BUFFER_BYTES)) {
+    if (!t.file_open) {
+      while ((t.request_index < reqs.size()) && !reqs[t.request_index].needs_update()) {
+        t.request_index++;
+      }
+      if (t.request_index >= reqs.size()) {
+        this->change_to_directory(c, t.path_directories, {});
+        c->channel.send(0x12, 0x00);
+        c->channel.on_output = nullptr;
+        c->channel.set_output_low_watermark(0);
+        c->file_transfer.reset();
+        return;
+      }
+
+      const auto& file = reqs[t.request_index].file;
+      this->change_to_directory(c, t.path_directories, file->path_directories);
+      S_OpenFile_Patch_06 open_cmd = {0, file->size, {file->name, 1}};
+      c->channel.send(0x06, 0x00, open_cmd);
+      t.file_open = true;
+      t.chunk_index = 0;
+    }
 
-  c->channel.send(0x12, 0x00);
+    const auto& file = reqs[t.request_index].file;
+    if (t.chunk_index < file->chunk_crcs.size()) {
+      size_t chunk_size = min<uint32_t>(file->size - (t.chunk_index * 0x4000), 0x4000);
+      t.chunk_data.resize(chunk_size);
+      file->read(t.chunk_data.data(), t.chunk_index * 0x4000, chunk_size);
+      vector<pair<const void*, size_t>> blocks;
+      S_WriteFileHeader_Patch_07 cmd_header = {t.chunk_index, file->chunk_crcs[t.chunk_index], chunk_size};
+      blocks.emplace_back(&cmd_header, sizeof(cmd_header));
+      blocks.emplace_back(t.chunk_data.data(), chunk_size);
+      c->channel.send(0x07, 0x00, blocks);
+      t.chunk_index++;
+    } else {
+      S_CloseCurrentFile_Patch_08 close_cmd = {0};
+      c->channel.send(0x08, 0x00, close_cmd);
+      t.file_open = false;
+      t.request_index++;
+    }
+  }
 }
 
 void PatchServer::disconnect_client(shared_ptr<Client> c) {
@@ -388,6 +422,25 @@ void PatchServer::on_client_input(Channel& ch, uint16_t command, uint32_t, std::
   }
 }
 
+void PatchServer::on_client_output(Channel& ch) {
+  PatchServer* server = reinterpret_cast<PatchServer*>(ch.context_obj);
+  auto it = server->channel_to_client.find(&ch);
+  if (it == server->channel_to_client.end()) {
+    return;
+  }
+  shared_ptr<Client> c = it->second;
+  if (!c->file_transfer) {
+    return;
+  }
+
+  try {
+    server->send_file_transfer_chunks(c);
+  } catch (const exception& e) {
+    server_log.warning("Error sending patch files to client: %s", e.what());
+    server->disconnect_client(c);
+  }
+}
+
 void PatchServer::on_client_error(Channel& ch, short events) {
   PatchServer* server = reinterpret_cast<PatchServer*>(ch.context_obj);
   shared_ptr<Client> c = server->channel_to_client.at(&ch);
@@ -56,6 +56,18 @@ private:
     std::vector<PatchFileChecksumRequest> patch_file_checksum_requests;
     uint64_t idle_timeout_usecs;
 
+    // State of the file transfer started by command 10. Files are sent a few
+    // chunks at a time, as the client's output buffer drains, so that we never
+    // buffer more than about MAX_TRANSFER_BUFFER_BYTES for each client.
+    struct FileTransfer {
+      size_t request_index = 0; // Index in patch_file_checksum_requests
+      size_t chunk_index = 0;
+      bool file_open = false; // True if the client has the current file open
+      std::vector<std::string> path_directories; // Client's current directory
+      std::string chunk_data; // Reused buffer for reading file chunks
+    };
+    std::unique_ptr<FileTransfer> file_transfer;
+
     std::unique_ptr<struct event, void (*)(struct event*)> idle_timeout_event;
 
     Client(
@@ -100,6 +112,11 @@ private:
 
   std::thread th;
 
+  // When a client's output buffer holds more than this many bytes, we stop
+  // sending file chunks until it drains below TRANSFER_LOW_WATERMARK_BYTES
+  static constexpr size_t MAX_TRANSFER_BUFFER_BYTES = 0x40000;
+  static constexpr size_t TRANSFER_LOW_WATERMARK_BYTES = 0x10000;
+
   void send_server_init(std::shared_ptr<Client> c) const;
   void send_message_box(std::shared_ptr<Client> c, const std::string& text) const;
   void send_enter_directory(std::shared_ptr<Client> c, const std::string& dir) const;
@@ -111,6 +128,7 @@ private:
   void on_04(std::shared_ptr<Client> c, std::string& data);
   void on_0F(std::shared_ptr<Client> c, std::string& data);
   void on_10(std::shared_ptr<Client> c, std::string& data);
+  void send_file_transfer_chunks(std::shared_ptr<Client> c);
 
   void disconnect_client(std::shared_ptr<Client> c);
 
@@ -126,6 +144,7 @@ private:
 
   static void on_client_input(Channel& ch, uint16_t command, uint32_t flag, std::string& data);
   static void on_client_error(Channel& ch, short events);
+  static void on_client_output(Channel& ch);
 
   void thread_fn();
 };
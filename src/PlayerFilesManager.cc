@@ -16,6 +16,7 @@
 #include "StaticGameData.hh"
 #include "Text.hh"
 #include "Version.hh"
+#include "Watchdog.hh"
 
 using namespace std;
 
@@ -99,6 +100,7 @@ void PlayerFilesManager::set_bank(const std::string& filename, std::shared_ptr<P
 }
 
 void PlayerFilesManager::clear_expired_files(evutil_socket_t, short, void* ctx) {
+  WatchdogScope watchdog_scope(EventLoopWatchdog::CallbackType::TIMER, "PlayerFilesManager::clear_expired_files");
   auto* self = reinterpret_cast<PlayerFilesManager*>(ctx);
   size_t num_deleted = erase_unused(self->loaded_system_files);
   if (num_deleted) {
@@ -1366,6 +1366,20 @@ static HandlerResult S_13_A7(shared_ptr<ProxyServer::LinkedSession> ses, uint16_
     modified = true;
   }
 
+  if (sf->dat_decompressor) {
+    if (block_offset != sf->dat_decompressor->input_size()) {
+      ses->log.warning("Received out-of-order block for %s; its quest map will not be loaded", sf->basename.c_str());
+      sf->dat_decompressor.reset();
+    } else {
+      try {
+        sf->dat_decompressor->add(cmd.data.data(), cmd.data_size);
+      } catch (const exception& e) {
+        ses->log.warning("Failed to decompress %s (%s); its quest map will not be loaded", sf->basename.c_str(), e.what());
+        sf->dat_decompressor.reset();
+      }
+    }
+  }
+
   if (!sf->output_filename.empty()) {
     ses->log.info("Adding %" PRIu32 " bytes to %s:%02" PRIX32 " => %s:%zX",
         cmd.data_size.load(), sf->basename.c_str(), flag, sf->output_filename.c_str(), block_offset);
@@ -1399,9 +1413,9 @@ static HandlerResult S_13_A7(shared_ptr<ProxyServer::LinkedSession> ses, uint16_
       ses->log.info("Download complete for file %s", sf->basename.c_str());
     }
 
-    if (!sf->is_download && phosg::ends_with(sf->basename, ".dat")) {
-      auto quest_dat_data = make_shared<std::string>(prs_decompress(sf->data));
+    if (sf->dat_decompressor) {
       try {
+        auto quest_dat_data = make_shared<std::string>(sf->dat_decompressor->close());
         ses->map = Lobby::load_maps(
             ses->version(),
             ses->lobby_episode,
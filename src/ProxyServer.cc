@@ -31,6 +31,7 @@
 #include "ReceiveCommands.hh"
 #include "ReceiveSubcommands.hh"
 #include "SendCommands.hh"
+#include "Watchdog.hh"
 
 using namespace std;
 using namespace std::placeholders;
@@ -713,9 +714,14 @@ ProxyServer::LinkedSession::SavingFile::SavingFile(
     : basename(basename),
       output_filename(output_filename),
       is_download(is_download),
-      total_size(total_size) {}
+      total_size(total_size) {
+  if (!this->is_download && phosg::ends_with(this->basename, ".dat")) {
+    this->dat_decompressor = make_unique<PRSDecompressor>();
+  }
+}
 
 void ProxyServer::LinkedSession::dispatch_on_timeout(evutil_socket_t, short, void* ctx) {
+  WatchdogScope watchdog_scope(EventLoopWatchdog::CallbackType::TIMER, "ProxyServer::LinkedSession::dispatch_on_timeout");
   reinterpret_cast<LinkedSession*>(ctx)->on_timeout();
 }
 
@@ -926,6 +932,8 @@ bool ProxyServer::LinkedSession::is_connected() const {
 void ProxyServer::LinkedSession::on_input(Channel& ch, uint16_t command, uint32_t flag, std::string& data) {
   auto* ses = reinterpret_cast<LinkedSession*>(ch.context_obj);
   bool is_server_stream = (&ch == &ses->server_channel);
+  WatchdogScope watchdog_scope(EventLoopWatchdog::CallbackType::COMMAND, "ProxyServer::LinkedSession::on_input");
+  watchdog_scope.set_context(command, ses->id, 0);
 
   try {
     if (is_server_stream) {
@@ -1004,6 +1012,7 @@ void ProxyServer::delete_session(uint64_t id) {
 }
 
 void ProxyServer::dispatch_destroy_sessions(evutil_socket_t, short, void* ctx) {
+  WatchdogScope watchdog_scope(EventLoopWatchdog::CallbackType::TIMER, "ProxyServer::dispatch_destroy_sessions");
   reinterpret_cast<ProxyServer*>(ctx)->destroy_sessions();
 }
 
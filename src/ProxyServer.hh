@@ -12,6 +12,7 @@
 #include <unordered_set>
 #include <vector>
 
+#include "Compression.hh"
 #include "PSOEncryption.hh"
 #include "PSOProtocol.hh"
 #include "ServerState.hh"
@@ -116,6 +117,11 @@ public:
       bool is_download;
       size_t total_size;
       std::string data;
+      // Quest .dat files (not downloads) are decompressed as they arrive, so
+      // the proxy can load the quest's map when the last block is received.
+      // This is null for other files, or if the file's blocks arrived out of
+      // order or it could not be decompressed.
+      std::unique_ptr<PRSDecompressor> dat_decompressor;
 
       SavingFile(
           const std::string& basename,
@@ -480,12 +480,82 @@ shared_ptr<const VersionedQuest> Quest::version(Version v, uint8_t language) con
   return it->second;
 }
 
+static shared_ptr<const VersionedQuest> create_indexed_versioned_quest(
+    uint32_t quest_number, Version version, uint8_t language, const QuestIndex::IndexedVersionedQuest& ivq) {
+  shared_ptr<BattleRules> battle_rules;
+  ssize_t challenge_template_index = -1;
+  uint8_t description_flag = 0;
+  shared_ptr<const IntegralExpression> available_expression;
+  shared_ptr<const IntegralExpression> enabled_expression;
+  bool allow_start_from_chat_command = false;
+  bool force_joinable = false;
+  int16_t lock_status_register = -1;
+  if (ivq.json_contents) {
+    auto metadata_json = phosg::JSON::parse(*ivq.json_contents);
+    try {
+      battle_rules = make_shared<BattleRules>(metadata_json.at("BattleRules"));
+    } catch (const out_of_range&) {
+    }
+    try {
+      challenge_template_index = metadata_json.at("ChallengeTemplateIndex").as_int();
+    } catch (const out_of_range&) {
+    }
+    try {
+      description_flag = metadata_json.at("DescriptionFlag").as_int();
+    } catch (const out_of_range&) {
+    }
+    try {
+      available_expression = make_shared<IntegralExpression>(metadata_json.get_string("AvailableIf"));
+    } catch (const out_of_range&) {
+    }
+    try {
+      enabled_expression = make_shared<IntegralExpression>(metadata_json.get_string("EnabledIf"));
+    } catch (const out_of_range&) {
+    }
+    try {
+      allow_start_from_chat_command = metadata_json.get_bool("AllowStartFromChatCommand");
+    } catch (const out_of_range&) {
+    }
+    try {
+      force_joinable = metadata_json.get_bool("Joinable");
+    } catch (const out_of_range&) {
+    }
+    try {
+      lock_status_register = metadata_json.get_int("LockStatusRegister");
+    } catch (const out_of_range&) {
+    }
+  }
+
+  return make_shared<VersionedQuest>(
+      quest_number,
+      ivq.category_id,
+      version,
+      language,
+      ivq.bin_contents,
+      ivq.dat_contents,
+      ivq.pvr_contents,
+      battle_rules,
+      challenge_template_index,
+      description_flag,
+      available_expression,
+      enabled_expression,
+      allow_start_from_chat_command,
+      force_joinable,
+      lock_status_register);
+}
+
 QuestIndex::QuestIndex(
     const string& directory,
     std::shared_ptr<const QuestCategoryIndex> category_index,
-    bool is_ep3)
+    bool is_ep3,
+    std::shared_ptr<CompressedArtifactCache> artifact_cache,
+    std::shared_ptr<const QuestIndex> previous)
     : directory(directory),
+      is_ep3(is_ep3),
       category_index(category_index) {
+  if (previous && ((previous->directory != this->directory) || (previous->is_ep3 != this->is_ep3))) {
+    previous = nullptr;
+  }
 
   struct FileData {
     std::string filename;
@@ -496,6 +566,8 @@ QuestIndex::QuestIndex(
   map<string, FileData> pvr_files;
   map<string, FileData> json_files;
   map<string, uint32_t> categories;
+  size_t num_source_files_reused = 0;
+  size_t num_versioned_quests_reused = 0;
   for (const auto& cat : this->category_index->categories) {
     // Don't index Ep3 download categories for non-Ep3 quest indexing, and vice
     // versa
@@ -503,20 +575,31 @@ QuestIndex::QuestIndex(
       continue;
     }
 
-    auto add_file = [&](map<string, FileData>& files, const string& basename, const string& filename, string&& value, bool check_chunk_size) {
+    auto add_file = [&](const string& filename, const LoadedFile& loaded_file) {
+      map<string, FileData>* files;
+      switch (loaded_file.type) {
+        case FileType::BIN:
+          files = &bin_files;
+          break;
+        case FileType::DAT:
+          files = &dat_files;
+          break;
+        case FileType::PVR:
+          files = &pvr_files;
+          break;
+        case FileType::JSON:
+          files = &json_files;
+          break;
+        default:
+          throw logic_error("invalid quest file type");
+      }
+      const string& basename = loaded_file.basename;
       if (categories.emplace(basename, cat->category_id).first->second != cat->category_id) {
         throw runtime_error("file " + basename + " exists in multiple categories");
       }
-      auto data_ptr = make_shared<string>(std::move(value));
-      if (!files.emplace(basename, FileData{filename, data_ptr}).second) {
+      if (!files->emplace(basename, FileData{filename, loaded_file.data}).second) {
         throw runtime_error("file " + basename + " already exists");
       }
-      // There is a bug in the client that prevents quests from loading properly
-      // if any file's size is a multiple of 0x400. See the comments on the 13
-      // command in CommandFormats.hh for more details.
-      if (check_chunk_size && !(data_ptr->size() & 0x3FF)) {
-        data_ptr->push_back(0x00);
-      }
     };
 
     string cat_path = directory + "/" + cat->directory_name;
@@ -532,25 +615,42 @@ QuestIndex::QuestIndex(
       string file_path = cat_path + "/" + filename;
       try {
         string orig_filename = filename;
+        string raw_data = phosg::load_file(file_path);
+        uint64_t content_hash = phosg::fnv1a64(raw_data);
+
+        // If the file hasn't changed since the previous index was built, use
+        // the files that were loaded from it then
+        if (previous && !phosg::ends_with(filename, ".txt")) {
+          auto prev_it = previous->source_files.find(file_path);
+          if ((prev_it != previous->source_files.end()) && (prev_it->second->content_hash == content_hash)) {
+            for (const auto& loaded_file : prev_it->second->loaded_files) {
+              add_file(orig_filename, loaded_file);
+            }
+            this->source_files.emplace(file_path, prev_it->second);
+            num_source_files_reused++;
+            continue;
+          }
+        }
+
         string file_data;
         if (phosg::ends_with(filename, ".gci")) {
-          file_data = decode_gci_data(phosg::load_file(file_path));
+          file_data = decode_gci_data(raw_data);
           filename.resize(filename.size() - 4);
         } else if (phosg::ends_with(filename, ".vms")) {
-          file_data = decode_vms_data(phosg::load_file(file_path));
+          file_data = decode_vms_data(raw_data);
           filename.resize(filename.size() - 4);
         } else if (phosg::ends_with(filename, ".dlq")) {
-          file_data = decode_dlq_data(phosg::load_file(file_path));
+          file_data = decode_dlq_data(raw_data);
           filename.resize(filename.size() - 4);
         } else if (phosg::ends_with(filename, ".txt")) {
           string include_dir = phosg::dirname(file_path);
-          file_data = assemble_quest_script(phosg::load_file(file_path), include_dir);
+          file_data = assemble_quest_script(raw_data, include_dir);
           filename.resize(filename.size() - 4);
           if (phosg::ends_with(filename, ".bin")) {
             filename.push_back('d');
           }
         } else {
-          file_data = phosg::load_file(file_path);
+          file_data = std::move(raw_data);
         }
 
         size_t dot_pos = filename.rfind('.');
@@ -563,33 +663,53 @@ QuestIndex::QuestIndex(
           file_basename = phosg::tolower(filename);
         }
 
+        auto source_file = make_shared<SourceFile>();
+        source_file->content_hash = content_hash;
+        auto add_loaded_file = [&](FileType type, string&& value) -> void {
+          auto data_ptr = make_shared<string>(std::move(value));
+          // There is a bug in the client that prevents quests from loading
+          // properly if any file's size is a multiple of 0x400. See the
+          // comments on the 13 command in CommandFormats.hh for more details.
+          if ((type != FileType::JSON) && !(data_ptr->size() & 0x3FF)) {
+            data_ptr->push_back(0x00);
+          }
+          source_file->loaded_files.emplace_back(LoadedFile{type, file_basename, std::move(data_ptr)});
+        };
+
         if (extension == "json") {
-          add_file(json_files, file_basename, orig_filename, std::move(file_data), false);
+          add_loaded_file(FileType::JSON, std::move(file_data));
         } else if (extension == "bin" || extension == "mnm") {
-          add_file(bin_files, file_basename, orig_filename, std::move(file_data), true);
+          add_loaded_file(FileType::BIN, std::move(file_data));
         } else if (extension == "bind" || extension == "mnmd") {
-          add_file(bin_files, file_basename, orig_filename, prs_compress_optimal(file_data), true);
+          add_loaded_file(FileType::BIN,
+              compress_with_artifact_cache(artifact_cache, file_data, CompressedArtifactCache::Algorithm::PRS_OPTIMAL));
         } else if (extension == "dat") {
-          add_file(dat_files, file_basename, orig_filename, std::move(file_data), true);
+          add_loaded_file(FileType::DAT, std::move(file_data));
         } else if (extension == "datd") {
-          add_file(dat_files, file_basename, orig_filename, prs_compress_optimal(file_data), true);
+          add_loaded_file(FileType::DAT,
+              compress_with_artifact_cache(artifact_cache, file_data, CompressedArtifactCache::Algorithm::PRS_OPTIMAL));
         } else if (extension == "pvr") {
-          add_file(pvr_files, file_basename, orig_filename, std::move(file_data), true);
+          add_loaded_file(FileType::PVR, std::move(file_data));
         } else if (extension == "qst") {
           auto files = decode_qst_data(file_data);
           for (auto& it : files) {
             if (phosg::ends_with(it.first, ".bin")) {
-              add_file(bin_files, file_basename, orig_filename, std::move(it.second), true);
+              add_loaded_file(FileType::BIN, std::move(it.second));
             } else if (phosg::ends_with(it.first, ".dat")) {
-              add_file(dat_files, file_basename, orig_filename, std::move(it.second), true);
+              add_loaded_file(FileType::DAT, std::move(it.second));
             } else if (phosg::ends_with(it.first, ".pvr")) {
-              add_file(pvr_files, file_basename, orig_filename, std::move(it.second), true);
+              add_loaded_file(FileType::PVR, std::move(it.second));
             } else {
               throw runtime_error("qst file contains unsupported file type: " + it.first);
             }
           }
         }
 
+        for (const auto& loaded_file : source_file->loaded_files) {
+          add_file(orig_filename, loaded_file);
+        }
+        this->source_files.emplace(file_path, std::move(source_file));
+
       } catch (const exception& e) {
         static_game_data_log.warning("(%s) Failed to load quest file: (%s)", filename.c_str(), e.what());
       }
@@ -681,16 +801,8 @@ QuestIndex::QuestIndex(
         }
       }
 
-      // Load the quest's metadata phosg::JSON file, if it exists
+      // Find the quest's metadata JSON file, if it exists
       const FileData* json_filedata = nullptr;
-      shared_ptr<BattleRules> battle_rules;
-      ssize_t challenge_template_index = -1;
-      uint8_t description_flag = 0;
-      shared_ptr<const IntegralExpression> available_expression;
-      shared_ptr<const IntegralExpression> enabled_expression;
-      bool allow_start_from_chat_command = false;
-      bool force_joinable = false;
-      int16_t lock_status_register = -1;
       try {
         json_filedata = &json_files.at(basename);
       } catch (const out_of_range&) {
@@ -703,58 +815,37 @@ QuestIndex::QuestIndex(
           }
         }
       }
-      if (json_filedata) {
-        auto metadata_json = phosg::JSON::parse(*json_filedata->data);
-        try {
-          battle_rules = make_shared<BattleRules>(metadata_json.at("BattleRules"));
-        } catch (const out_of_range&) {
-        }
-        try {
-          challenge_template_index = metadata_json.at("ChallengeTemplateIndex").as_int();
-        } catch (const out_of_range&) {
-        }
-        try {
-          description_flag = metadata_json.at("DescriptionFlag").as_int();
-        } catch (const out_of_range&) {
-        }
-        try {
-          available_expression = make_shared<IntegralExpression>(metadata_json.get_string("AvailableIf"));
-        } catch (const out_of_range&) {
-        }
-        try {
-          enabled_expression = make_shared<IntegralExpression>(metadata_json.get_string("EnabledIf"));
-        } catch (const out_of_range&) {
-        }
-        try {
-          allow_start_from_chat_command = metadata_json.get_bool("AllowStartFromChatCommand");
-        } catch (const out_of_range&) {
-        }
-        try {
-          force_joinable = metadata_json.get_bool("Joinable");
-        } catch (const out_of_range&) {
-        }
-        try {
-          lock_status_register = metadata_json.get_int("LockStatusRegister");
-        } catch (const out_of_range&) {
+
+      IndexedVersionedQuest ivq{
+          .category_id = category_id,
+          .bin_contents = bin_filedata->data,
+          .dat_contents = dat_filedata ? dat_filedata->data : nullptr,
+          .pvr_contents = pvr_filedata ? pvr_filedata->data : nullptr,
+          .json_contents = json_filedata ? json_filedata->data : nullptr,
+          .vq = nullptr,
+      };
+
+      // If none of the quest's files have changed since the previous index
+      // was built, use the VersionedQuest from the previous index instead of
+      // parsing the files again. (Unchanged files are shared between the
+      // indexes, so comparing pointers is sufficient here.)
+      if (previous) {
+        auto prev_it = previous->indexed_versioned_quests.find(basename);
+        if ((prev_it != previous->indexed_versioned_quests.end()) &&
+            (prev_it->second.category_id == ivq.category_id) &&
+            (prev_it->second.bin_contents == ivq.bin_contents) &&
+            (prev_it->second.dat_contents == ivq.dat_contents) &&
+            (prev_it->second.pvr_contents == ivq.pvr_contents) &&
+            (prev_it->second.json_contents == ivq.json_contents)) {
+          ivq.vq = prev_it->second.vq;
+          num_versioned_quests_reused++;
         }
       }
-
-      auto vq = make_shared<VersionedQuest>(
-          quest_number,
-          category_id,
-          version,
-          language,
-          bin_filedata->data,
-          dat_filedata ? dat_filedata->data : nullptr,
-          pvr_filedata ? pvr_filedata->data : nullptr,
-          battle_rules,
-          challenge_template_index,
-          description_flag,
-          available_expression,
-          enabled_expression,
-          allow_start_from_chat_command,
-          force_joinable,
-          lock_status_register);
+      if (!ivq.vq) {
+        ivq.vq = create_indexed_versioned_quest(quest_number, version, language, ivq);
+      }
+      auto vq = ivq.vq;
+      this->indexed_versioned_quests.emplace(basename, std::move(ivq));
 
       auto category_name = this->category_index->at(vq->category_id)->name;
       string filenames_str = bin_filedata->filename;
@@ -796,6 +887,13 @@ QuestIndex::QuestIndex(
       static_game_data_log.warning("(%s) Failed to index quest file: (%s)", basename.c_str(), e.what());
     }
   }
+
+  if (previous) {
+    static_game_data_log.info("Reused %zu/%zu unchanged files and %zu/%zu quest versions from the previous index of %s",
+        num_source_files_reused, this->source_files.size(),
+        num_versioned_quests_reused, this->indexed_versioned_quests.size(),
+        this->directory.c_str());
+  }
 }
 
 shared_ptr<const Quest> QuestIndex::get(uint32_t quest_number) const {
@@ -8,6 +8,7 @@
 #include <unordered_map>
 #include <vector>
 
+#include "CompressedArtifactCache.hh"
 #include "IntegralExpression.hh"
 #include "PlayerSubordinates.hh"
 #include "QuestScript.hh"
@@ -151,13 +152,61 @@ struct QuestIndex {
   using IncludeCondition = std::function<IncludeState(std::shared_ptr<const Quest>)>;
 
   std::string directory;
+  bool is_ep3;
   std::shared_ptr<const QuestCategoryIndex> category_index;
 
   std::map<uint32_t, std::shared_ptr<Quest>> quests_by_number;
   std::map<std::string, std::shared_ptr<Quest>> quests_by_name;
   std::map<uint32_t, std::map<uint32_t, std::shared_ptr<Quest>>> quests_by_category_id_and_number;
 
-  QuestIndex(const std::string& directory, std::shared_ptr<const QuestCategoryIndex> category_index, bool is_ep3);
+  // The following structures describe the files that the index was built
+  // from. They're used to build the next index incrementally when the quest
+  // files are reloaded (see the constructor).
+  enum class FileType {
+    BIN = 0,
+    DAT,
+    PVR,
+    JSON,
+  };
+  struct LoadedFile {
+    FileType type;
+    std::string basename;
+    std::shared_ptr<const std::string> data;
+  };
+  struct SourceFile {
+    uint64_t content_hash; // fnv1a64 of the file's contents on disk
+    // Some source files produce more than one loaded file (e.g. .qst)
+    std::vector<LoadedFile> loaded_files;
+  };
+  struct IndexedVersionedQuest {
+    uint32_t category_id;
+    std::shared_ptr<const std::string> bin_contents;
+    std::shared_ptr<const std::string> dat_contents;
+    std::shared_ptr<const std::string> pvr_contents;
+    std::shared_ptr<const std::string> json_contents;
+    std::shared_ptr<const VersionedQuest> vq;
+  };
+  // Keyed by path (relative to the current directory, not to this->directory)
+  std::unordered_map<std::string, std::shared_ptr<const SourceFile>> source_files;
+  // Keyed by the .bin file's basename (e.g. q058-gc-e)
+  std::unordered_map<std::string, IndexedVersionedQuest> indexed_versioned_quests;
+
+  // If artifact_cache is not null, it's used to avoid recompressing
+  // uncompressed quest files (.bind, .datd, etc.) that haven't changed.
+  //
+  // If previous is not null, the index is built incrementally: files whose
+  // contents haven't changed since previous was built are not decoded again,
+  // and versioned quests whose files are all unchanged are not parsed again
+  // (the new index shares these objects with previous instead). .txt files are
+  // always assembled again, since they may include other files. previous is
+  // only used if it was built from the same directory with the same is_ep3
+  // value; it isn't modified.
+  QuestIndex(
+      const std::string& directory,
+      std::shared_ptr<const QuestCategoryIndex> category_index,
+      bool is_ep3,
+      std::shared_ptr<CompressedArtifactCache> artifact_cache = nullptr,
+      std::shared_ptr<const QuestIndex> previous = nullptr);
 
   std::shared_ptr<const Quest> get(uint32_t quest_number) const;
   std::shared_ptr<const Quest> get(const std::string& name) const;
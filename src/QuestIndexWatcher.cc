@@ -0,0 +1,182 @@
+#include "QuestIndexWatcher.hh"
+
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <phosg/Filesystem.hh>
+#include <phosg/Time.hh>
+
+#include "Loggers.hh"
+#include "Watchdog.hh"
+
+using namespace std;
+
+QuestIndexWatcher::QuestIndexWatcher(shared_ptr<ServerState> state, uint64_t reload_delay_usecs)
+    : log("[QuestIndexWatcher] "),
+      state(state),
+      reload_delay_usecs(reload_delay_usecs),
+      inotify_fd(-1),
+      inotify_event(nullptr, event_free),
+      reload_timer_event(nullptr, event_free),
+      reload_requested(false),
+      should_exit(false) {
+#ifdef __linux__
+  this->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (this->inotify_fd < 0) {
+    string error_str = phosg::string_for_error(errno);
+    this->log.warning("Cannot create inotify instance (%s); quest files will not be reloaded automatically", error_str.c_str());
+    return;
+  }
+  this->add_watches("system/quests");
+  this->add_watches("system/ep3/maps-download");
+
+  this->inotify_event.reset(event_new(
+      this->state->base.get(), this->inotify_fd, EV_READ | EV_PERSIST, &QuestIndexWatcher::dispatch_on_inotify_readable, this));
+  event_add(this->inotify_event.get(), nullptr);
+  this->reload_timer_event.reset(event_new(
+      this->state->base.get(), -1, EV_TIMEOUT, &QuestIndexWatcher::dispatch_on_reload_timer, this));
+  this->reload_thread = thread(&QuestIndexWatcher::reload_thread_fn, this);
+  this->log.info("Watching %zu quest directories", this->watch_descriptor_to_path.size());
+#else
+  this->log.warning("Watching quest directories is not supported on this platform");
+#endif
+}
+
+QuestIndexWatcher::~QuestIndexWatcher() {
+  if (this->reload_thread.joinable()) {
+    {
+      lock_guard g(this->reload_lock);
+      this->should_exit = true;
+    }
+    this->reload_cv.notify_one();
+    this->reload_thread.join();
+  }
+  // The events must be deleted before the fd is closed
+  this->inotify_event.reset();
+  this->reload_timer_event.reset();
+  if (this->inotify_fd >= 0) {
+    ::close(this->inotify_fd);
+  }
+}
+
+void QuestIndexWatcher::add_watches(const string& path) {
+#ifdef __linux__
+  if (!phosg::isdir(path)) {
+    return;
+  }
+  // Quest categories are subdirectories, and inotify doesn't watch
+  // directories recursively, so we have to add a watch for each one
+  uint32_t mask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+  int wd = inotify_add_watch(this->inotify_fd, path.c_str(), mask);
+  if (wd < 0) {
+    string error_str = phosg::string_for_error(errno);
+    this->log.warning("Cannot watch directory %s (%s)", path.c_str(), error_str.c_str());
+    return;
+  }
+  this->watch_descriptor_to_path[wd] = path;
+  for (const auto& item : phosg::list_directory(path)) {
+    string item_path = path + "/" + item;
+    if (phosg::isdir(item_path)) {
+      this->add_watches(item_path);
+    }
+  }
+#else
+  (void)path;
+#endif
+}
+
+void QuestIndexWatcher::dispatch_on_inotify_readable(evutil_socket_t, short, void* ctx) {
+  reinterpret_cast<QuestIndexWatcher*>(ctx)->on_inotify_readable();
+}
+
+void QuestIndexWatcher::on_inotify_readable() {
+#ifdef __linux__
+  bool any_changes = false;
+  alignas(struct inotify_event) char buf[0x1000];
+  for (;;) {
+    ssize_t bytes_read = ::read(this->inotify_fd, buf, sizeof(buf));
+    if (bytes_read <= 0) {
+      if ((bytes_read < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+        string error_str = phosg::string_for_error(errno);
+        this->log.warning("Cannot read from inotify instance (%s)", error_str.c_str());
+      }
+      break;
+    }
+
+    for (ssize_t offset = 0; offset < bytes_read;) {
+      const auto* ev = reinterpret_cast<const struct inotify_event*>(buf + offset);
+      offset += sizeof(struct inotify_event) + ev->len;
+
+      if (ev->mask & IN_IGNORED) {
+        this->watch_descriptor_to_path.erase(ev->wd);
+        continue;
+      }
+      if (ev->mask & IN_Q_OVERFLOW) {
+        any_changes = true;
+        continue;
+      }
+      auto path_it = this->watch_descriptor_to_path.find(ev->wd);
+      if ((path_it == this->watch_descriptor_to_path.end()) || (ev->len == 0)) {
+        continue;
+      }
+      string name = ev->name;
+      // Many editors create hidden or temporary files while saving; changes to
+      // these alone shouldn't cause a reload
+      if (name.empty() || (name[0] == '.') || phosg::ends_with(name, ".tmp") || phosg::ends_with(name, "~")) {
+        continue;
+      }
+      if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+        this->add_watches(path_it->second + "/" + name);
+      }
+      any_changes = true;
+    }
+  }
+
+  if (any_changes) {
+    // Restart the timer, so the reload happens reload_delay_usecs after the
+    // last change
+    auto tv = phosg::usecs_to_timeval(this->reload_delay_usecs);
+    event_add(this->reload_timer_event.get(), &tv);
+  }
+#endif
+}
+
+void QuestIndexWatcher::dispatch_on_reload_timer(evutil_socket_t, short, void* ctx) {
+  WatchdogScope watchdog_scope(EventLoopWatchdog::CallbackType::TIMER, "QuestIndexWatcher::dispatch_on_reload_timer");
+  reinterpret_cast<QuestIndexWatcher*>(ctx)->on_reload_timer();
+}
+
+void QuestIndexWatcher::on_reload_timer() {
+  {
+    lock_guard g(this->reload_lock);
+    this->reload_requested = true;
+  }
+  this->reload_cv.notify_one();
+}
+
+void QuestIndexWatcher::reload_thread_fn() {
+  unique_lock g(this->reload_lock);
+  for (;;) {
+    this->reload_cv.wait(g, [&]() { return this->should_exit || this->reload_requested; });
+    if (this->should_exit) {
+      return;
+    }
+    this->reload_requested = false;
+    g.unlock();
+
+    this->log.info("Quest files changed; reloading quest index");
+    uint64_t start = phosg::now();
+    try {
+      this->state->load_quest_index(true);
+      this->log.info("Quest index reloaded in %s", phosg::format_duration(phosg::now() - start).c_str());
+    } catch (const exception& e) {
+      this->log.warning("Failed to reload quest index: %s", e.what());
+    }
+
+    g.lock();
+  }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <event2/event.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <phosg/Strings.hh>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "ServerState.hh"
+
+// QuestIndexWatcher watches the quest directories (system/quests and
+// system/ep3/maps-download) for changes, and reloads the quest indexes when
+// any files in them are created, modified, renamed, or deleted. Reloads are
+// delayed until no changes have occurred for a short time, so copying many
+// quest files at once only results in one reload. Reloads happen on a
+// separate thread, so they don't block the event thread; since reloads are
+// incremental (see QuestIndex's constructor), changes typically go live very
+// quickly.
+//
+// This is only supported on Linux (it uses inotify). On other platforms, the
+// constructor logs a warning and the watcher does nothing.
+class QuestIndexWatcher {
+public:
+  explicit QuestIndexWatcher(std::shared_ptr<ServerState> state, uint64_t reload_delay_usecs = 250000);
+  QuestIndexWatcher(const QuestIndexWatcher&) = delete;
+  QuestIndexWatcher(QuestIndexWatcher&&) = delete;
+  QuestIndexWatcher& operator=(const QuestIndexWatcher&) = delete;
+  QuestIndexWatcher& operator=(QuestIndexWatcher&&) = delete;
+  ~QuestIndexWatcher();
+
+protected:
+  phosg::PrefixedLogger log;
+  std::shared_ptr<ServerState> state;
+  uint64_t reload_delay_usecs;
+  int inotify_fd;
+  std::unordered_map<int, std::string> watch_descriptor_to_path;
+  std::unique_ptr<struct event, void (*)(struct event*)> inotify_event;
+  std::unique_ptr<struct event, void (*)(struct event*)> reload_timer_event;
+
+  std::mutex reload_lock;
+  std::condition_variable reload_cv;
+  bool reload_requested;
+  bool should_exit;
+  std::thread reload_thread;
+
+  void add_watches(const std::string& path);
+
+  static void dispatch_on_inotify_readable(evutil_socket_t, short, void* ctx);
+  void on_inotify_readable();
+  static void dispatch_on_reload_timer(evutil_socket_t, short, void* ctx);
+  void on_reload_timer();
+
+  void reload_thread_fn();
+};
@@ -0,0 +1,315 @@
+#include "RareEnemySeedSearch.hh"
+
+#include <phosg/Strings.hh>
+#include <phosg/Tools.hh>
+#include <thread>
+
+#include "Lobby.hh"
+
+using namespace std;
+
+// Every enemy ID is 16 bits, so no map has more candidates than this
+static constexpr size_t MAX_RARE_ENEMY_CANDIDATES = 0x10000;
+
+RareEnemySeedSearch::RareEnemySeedSearch(
+    shared_ptr<const SetDataTableBase> sdt,
+    function<shared_ptr<const string>(Version, const string&)> get_file_data,
+    Version version,
+    Episode episode,
+    GameMode mode,
+    uint8_t difficulty,
+    shared_ptr<const Map::RareEnemyRates> rare_rates)
+    : sdt(sdt),
+      get_file_data(get_file_data),
+      version(version),
+      episode(episode),
+      mode(mode),
+      difficulty(difficulty),
+      rare_rates(rare_rates),
+      use_templates(true),
+      keystream_model(0),
+      non_bb_rare_threshold(this->compute_non_bb_rare_threshold(version)) {
+  // This must match the order in which SetDataTableBase::generate_variations
+  // draws random values: one for each variation with more than one possible
+  // value
+  bool is_solo = (mode == GameMode::SOLO);
+  for (size_t floor = 0; floor < 0x10; floor++) {
+    auto num_vars = this->sdt->num_free_roam_variations_for_floor(episode, is_solo, floor);
+    if (num_vars.first > 1) {
+      this->variation_draws.emplace_back(VariationDraw{.variation_index = floor * 2, .num_values = num_vars.first});
+    }
+    if (num_vars.second > 1) {
+      this->variation_draws.emplace_back(VariationDraw{.variation_index = floor * 2 + 1, .num_values = num_vars.second});
+    }
+  }
+  this->keystream_model = PSOV2KeystreamModel(this->variation_draws.size() + MAX_RARE_ENEMY_CANDIDATES);
+}
+
+RareEnemySeedSearch::RareEnemySeedSearch(
+    shared_ptr<const string> quest_dat_contents_decompressed,
+    Version version,
+    Episode episode,
+    uint8_t difficulty,
+    shared_ptr<const Map::RareEnemyRates> rare_rates)
+    : quest_dat_contents_decompressed(quest_dat_contents_decompressed),
+      version(version),
+      episode(episode),
+      mode(GameMode::NORMAL),
+      difficulty(difficulty),
+      rare_rates(rare_rates),
+      use_templates(true),
+      keystream_model(MAX_RARE_ENEMY_CANDIDATES),
+      non_bb_rare_threshold(this->compute_non_bb_rare_threshold(version)) {
+  // Random enemies are generated from the rare seed, so maps that have them
+  // can't be shared across seeds
+  auto floor_sections = Map::collect_quest_map_data_sections(
+      this->quest_dat_contents_decompressed->data(), this->quest_dat_contents_decompressed->size());
+  for (const auto& sections : floor_sections) {
+    if ((sections.random_enemy_locations != 0xFFFFFFFF) || (sections.random_enemy_definitions != 0xFFFFFFFF)) {
+      this->use_templates = false;
+      break;
+    }
+  }
+}
+
+uint32_t RareEnemySeedSearch::compute_non_bb_rare_threshold(Version version) {
+  // Find the smallest value for which Map::check_and_log_rare_enemy's
+  // floating-point comparison fails, so we can use an integer comparison
+  // instead without changing any results
+  float threshold = Map::non_bb_rare_enemy_threshold(version);
+  uint32_t ret = 0;
+  while ((ret < 0x10000) && ((static_cast<float>(ret) / 65536.0f) < threshold)) {
+    ret++;
+  }
+  return ret;
+}
+
+shared_ptr<const RareEnemySeedSearch::SearchTemplate> RareEnemySeedSearch::create_template(
+    uint64_t key, const parray<le_uint32_t, 0x20>& variations) const {
+  auto ret = make_shared<SearchTemplate>();
+
+  if (this->quest_dat_contents_decompressed) {
+    auto map = Map::create_template(this->version);
+    map->add_entities_from_quest_data(this->episode, this->difficulty, 0, this->quest_dat_contents_decompressed);
+    ret->map = std::move(map);
+  } else if (this->mode == GameMode::CHALLENGE) {
+    // Lobby::load_maps doesn't load free-roam maps in Challenge mode
+    ret->map = Map::create_template(this->version);
+  } else {
+    using FilenameType = SetDataTableBase::FilenameType;
+    ret->map = Lobby::load_map_template(
+        this->sdt->map_filenames_for_variations(variations, this->episode, this->mode, FilenameType::ENEMIES),
+        this->sdt->map_filenames_for_variations(variations, this->episode, this->mode, FilenameType::OBJECTS),
+        this->sdt->map_filenames_for_variations(variations, this->episode, this->mode, FilenameType::EVENTS),
+        this->version,
+        this->episode,
+        this->difficulty,
+        0,
+        this->get_file_data);
+  }
+
+  for (size_t z = 0; z < ret->map->enemies.size(); z++) {
+    if (enemy_type_is_rare(ret->map->enemies[z].type)) {
+      ret->fixed_rare_enemy_indexes.emplace_back(z);
+    }
+  }
+  if (ret->map->rare_enemy_candidates.size() > MAX_RARE_ENEMY_CANDIDATES) {
+    throw runtime_error(phosg::string_printf("map for variations %016" PRIX64 " has too many rare enemy candidates", key));
+  }
+  for (const auto& candidate : ret->map->rare_enemy_candidates) {
+    // Only types for which enemy_type_is_rare is true are reported (so e.g.
+    // event rappies are not). On non-BB versions the rolls are independent,
+    // so the other candidates can be skipped entirely; on BB they still
+    // consume random values and count toward the rare limit, so they must
+    // be kept.
+    if ((this->version != Version::BB_V4) && !enemy_type_is_rare(candidate.rare_type)) {
+      continue;
+    }
+    ret->candidate_enemy_indexes.emplace_back(candidate.enemy_index);
+    ret->candidate_rare_rates.emplace_back((*this->rare_rates).*candidate.rate);
+    ret->candidate_rare_types.emplace_back(candidate.rare_type);
+  }
+  return ret;
+}
+
+shared_ptr<const RareEnemySeedSearch::SearchTemplate> RareEnemySeedSearch::get_template(
+    WorkerState& ws, uint64_t key, const parray<le_uint32_t, 0x20>& variations) {
+  // Each worker has its own cache, so in the common case, workers don't have
+  // to contend for the shared cache's lock
+  auto ws_it = ws.templates.find(key);
+  if (ws_it != ws.templates.end()) {
+    return ws_it->second;
+  }
+
+  shared_ptr<const SearchTemplate> ret;
+  {
+    shared_lock g(this->templates_lock);
+    auto it = this->templates.find(key);
+    if (it != this->templates.end()) {
+      ret = it->second;
+    }
+  }
+  if (!ret) {
+    unique_lock g(this->templates_lock);
+    auto it = this->templates.find(key);
+    if (it == this->templates.end()) {
+      it = this->templates.emplace(key, this->create_template(key, variations)).first;
+    }
+    ret = it->second;
+  }
+  ws.templates.emplace(key, ret);
+  return ret;
+}
+
+bool RareEnemySeedSearch::check_seed(WorkerState& ws, uint32_t seed, size_t min_count, Result& result) {
+  if (!this->use_templates) {
+    return this->check_seed_full_map(seed, min_count, result);
+  }
+
+  // Replay SetDataTableBase::generate_variations, and compute a unique key for
+  // the resulting variations at the same time
+  parray<le_uint32_t, 0x20> variations;
+  variations.clear(0);
+  uint64_t key = 0;
+  size_t word_index = 0;
+  for (const auto& draw : this->variation_draws) {
+    uint32_t value = this->keystream_model.word(seed, word_index++) % draw.num_values;
+    variations[draw.variation_index] = value;
+    key = (key * draw.num_values) + value;
+  }
+  auto t = this->get_template(ws, key, variations);
+
+  // Replay the rolls from Map::check_and_log_rare_enemy
+  auto& rolled = ws.rolled_candidate_indexes;
+  rolled.clear();
+  size_t num_candidates = t->candidate_enemy_indexes.size();
+  if (this->version == Version::BB_V4) {
+    // On BB, the rolls use the same crypt as the variations, and stop once 16
+    // rares have been chosen
+    size_t num_rolled = 0;
+    for (size_t z = 0; (z < num_candidates) && (num_rolled < 0x10); z++) {
+      if (this->keystream_model.word(seed, word_index++) < t->candidate_rare_rates[z]) {
+        num_rolled++;
+        if (enemy_type_is_rare(t->candidate_rare_types[z])) {
+          rolled.emplace_back(z);
+        }
+      }
+    }
+    if (t->fixed_rare_enemy_indexes.size() + rolled.size() < min_count) {
+      return false;
+    }
+
+  } else {
+    // On other versions, each roll uses the first word of a different crypt,
+    // so the rolls are independent. Count the rares first, since most seeds
+    // don't have enough of them; this loop is easily vectorized.
+    uint32_t a = this->keystream_model.word(0, 0);
+    uint32_t b = this->keystream_model.word(1, 0) - a;
+    uint32_t base_seed = seed + 0x1000;
+    const uint32_t* enemy_indexes = t->candidate_enemy_indexes.data();
+    size_t num_rares = 0;
+    for (size_t z = 0; z < num_candidates; z++) {
+      num_rares += (((a + b * (base_seed + enemy_indexes[z])) >> 16) < this->non_bb_rare_threshold);
+    }
+    if (t->fixed_rare_enemy_indexes.size() + num_rares < min_count) {
+      return false;
+    }
+    for (size_t z = 0; z < num_candidates; z++) {
+      if (((a + b * (base_seed + enemy_indexes[z])) >> 16) < this->non_bb_rare_threshold) {
+        rolled.emplace_back(z);
+      }
+    }
+  }
+
+  // Both lists are sorted by enemy index, so merge them to produce the same
+  // order as scanning the map's enemies would
+  result.seed = seed;
+  result.rare_enemies.clear();
+  size_t fixed_z = 0;
+  size_t rolled_z = 0;
+  while ((fixed_z < t->fixed_rare_enemy_indexes.size()) || (rolled_z < rolled.size())) {
+    uint16_t candidate_index = (rolled_z < rolled.size()) ? rolled[rolled_z] : 0;
+    uint32_t rolled_enemy_index = (rolled_z < rolled.size())
+        ? t->candidate_enemy_indexes[candidate_index]
+        : 0xFFFFFFFF;
+    uint32_t fixed_enemy_index = (fixed_z < t->fixed_rare_enemy_indexes.size())
+        ? t->fixed_rare_enemy_indexes[fixed_z]
+        : 0xFFFFFFFF;
+    if (fixed_enemy_index < rolled_enemy_index) {
+      result.rare_enemies.emplace_back(fixed_enemy_index, t->map->enemies[fixed_enemy_index].type);
+      fixed_z++;
+    } else {
+      result.rare_enemies.emplace_back(rolled_enemy_index, t->candidate_rare_types[candidate_index]);
+      rolled_z++;
+    }
+  }
+  return true;
+}
+
+bool RareEnemySeedSearch::check_seed_full_map(uint32_t seed, size_t min_count, Result& result) const {
+  auto random_crypt = make_shared<PSOV2Encryption>(seed);
+  auto map = Lobby::load_maps(
+      this->version, this->episode, this->difficulty, 0, 0, this->rare_rates, seed, random_crypt, this->quest_dat_contents_decompressed);
+
+  result.seed = seed;
+  result.rare_enemies.clear();
+  for (size_t z = 0; z < map->enemies.size(); z++) {
+    if (enemy_type_is_rare(map->enemies[z].type)) {
+      result.rare_enemies.emplace_back(z, map->enemies[z].type);
+    }
+  }
+  return (result.rare_enemies.size() >= min_count);
+}
+
+void RareEnemySeedSearch::search(
+    uint64_t start_seed,
+    uint64_t end_seed,
+    size_t min_count,
+    size_t num_threads,
+    function<void(const Result&)> on_result,
+    function<void(uint64_t next_seed, size_t num_results)> progress_fn) {
+  // Seeds are checked in blocks; within each block, each thread checks chunks
+  // of seeds and saves the results so they can be returned in seed order
+  // after the entire block is done
+  static constexpr uint64_t CHUNK_SIZE = 0x1000;
+  static constexpr uint64_t BLOCK_SIZE = 0x100000;
+
+  if (num_threads == 0) {
+    num_threads = thread::hardware_concurrency();
+  }
+  num_threads = max<size_t>(num_threads, 1);
+
+  vector<WorkerState> worker_states(num_threads);
+  vector<vector<Result>> chunk_results(BLOCK_SIZE / CHUNK_SIZE);
+  size_t num_results = 0;
+  for (uint64_t block_start = start_seed; block_start < end_seed; block_start += BLOCK_SIZE) {
+    uint64_t block_end = min<uint64_t>(block_start + BLOCK_SIZE, end_seed);
+    size_t num_chunks = (block_end - block_start + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+    phosg::parallel_range<size_t>([&](size_t chunk_index, size_t thread_num) -> bool {
+      auto& ws = worker_states.at(thread_num);
+      auto& results = chunk_results[chunk_index];
+      results.clear();
+      uint64_t chunk_start = block_start + chunk_index * CHUNK_SIZE;
+      uint64_t chunk_end = min<uint64_t>(chunk_start + CHUNK_SIZE, block_end);
+      Result result;
+      for (uint64_t seed = chunk_start; seed < chunk_end; seed++) {
+        if (this->check_seed(ws, seed, min_count, result)) {
+          results.emplace_back(result);
+        }
+      }
+      return false;
+    },
+        0, num_chunks, num_threads, nullptr);
+
+    for (size_t z = 0; z < num_chunks; z++) {
+      for (const auto& result : chunk_results[z]) {
+        on_result(result);
+      }
+      num_results += chunk_results[z].size();
+    }
+    if (progress_fn) {
+      progress_fn(block_end, num_results);
+    }
+  }
+}
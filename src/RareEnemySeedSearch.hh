@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "EnemyType.hh"
+#include "Map.hh"
+#include "PSOEncryption.hh"
+#include "Version.hh"
+
+// RareEnemySeedSearch finds rare seeds that produce rare enemies, for the
+// find-rare-enemy-seeds action. Loading a full map for each seed is far too
+// slow to search all 2^32 seeds, so instead, this builds a map template (see
+// Map::create_template) once for each set of variations, and for each seed
+// only replays the random draws that choose the variations and rare enemies.
+// Since the PSOV2 keystream is an affine function of the seed (see
+// PSOV2KeystreamModel), each of these draws is just a multiply and an add.
+//
+// Quests whose maps contain random enemy sections can't use templates, since
+// the enemies themselves depend on the seed; for these, a full map is loaded
+// for each seed, as before.
+class RareEnemySeedSearch {
+public:
+  struct Result {
+    uint32_t seed;
+    std::vector<std::pair<uint16_t, EnemyType>> rare_enemies; // (enemy index, type)
+  };
+
+  // Searches free-roam maps
+  RareEnemySeedSearch(
+      std::shared_ptr<const SetDataTableBase> sdt,
+      std::function<std::shared_ptr<const std::string>(Version, const std::string&)> get_file_data,
+      Version version,
+      Episode episode,
+      GameMode mode,
+      uint8_t difficulty,
+      std::shared_ptr<const Map::RareEnemyRates> rare_rates);
+  // Searches a quest's map
+  RareEnemySeedSearch(
+      std::shared_ptr<const std::string> quest_dat_contents_decompressed,
+      Version version,
+      Episode episode,
+      uint8_t difficulty,
+      std::shared_ptr<const Map::RareEnemyRates> rare_rates);
+  RareEnemySeedSearch(const RareEnemySeedSearch&) = delete;
+  RareEnemySeedSearch(RareEnemySeedSearch&&) = delete;
+  RareEnemySeedSearch& operator=(const RareEnemySeedSearch&) = delete;
+  RareEnemySeedSearch& operator=(RareEnemySeedSearch&&) = delete;
+  ~RareEnemySeedSearch() = default;
+
+  // Checks all seeds in [start_seed, end_seed) and calls on_result for each
+  // seed that produces at least min_count rare enemies. on_result is always
+  // called on the calling thread, in increasing seed order, so the output of
+  // searches over adjacent seed ranges can simply be concatenated. If
+  // num_threads is 0, one thread per CPU core is used. progress_fn, if given,
+  // is called on the calling thread after each block of seeds is done.
+  void search(
+      uint64_t start_seed,
+      uint64_t end_seed,
+      size_t min_count,
+      size_t num_threads,
+      std::function<void(const Result&)> on_result,
+      std::function<void(uint64_t next_seed, size_t num_results)> progress_fn = nullptr);
+
+private:
+  struct SearchTemplate {
+    std::shared_ptr<const Map> map;
+    // Enemies that are always rare, regardless of the seed
+    std::vector<uint16_t> fixed_rare_enemy_indexes;
+    // Enemies that may be rare (from map->rare_enemy_candidates), split into
+    // separate arrays so the non-BB check loop can be vectorized
+    std::vector<uint32_t> candidate_enemy_indexes;
+    std::vector<uint32_t> candidate_rare_rates;
+    std::vector<EnemyType> candidate_rare_types;
+  };
+  struct VariationDraw {
+    size_t variation_index;
+    uint32_t num_values;
+  };
+  struct WorkerState {
+    std::unordered_map<uint64_t, std::shared_ptr<const SearchTemplate>> templates;
+    std::vector<uint16_t> rolled_candidate_indexes;
+  };
+
+  std::shared_ptr<const SetDataTableBase> sdt;
+  std::function<std::shared_ptr<const std::string>(Version, const std::string&)> get_file_data;
+  std::shared_ptr<const std::string> quest_dat_contents_decompressed;
+  Version version;
+  Episode episode;
+  GameMode mode;
+  uint8_t difficulty;
+  std::shared_ptr<const Map::RareEnemyRates> rare_rates;
+  bool use_templates;
+
+  std::vector<VariationDraw> variation_draws;
+  PSOV2KeystreamModel keystream_model;
+  // On non-BB versions, an enemy is rare if the high 16 bits of the first
+  // keystream word are less than this
+  uint32_t non_bb_rare_threshold;
+
+  std::shared_mutex templates_lock;
+  std::unordered_map<uint64_t, std::shared_ptr<const SearchTemplate>> templates;
+
+  static uint32_t compute_non_bb_rare_threshold(Version version);
+  std::shared_ptr<const SearchTemplate> create_template(uint64_t key, const parray<le_uint32_t, 0x20>& variations) const;
+  std::shared_ptr<const SearchTemplate> get_template(
+      WorkerState& ws, uint64_t key, const parray<le_uint32_t, 0x20>& variations);
+  bool check_seed(WorkerState& ws, uint32_t seed, size_t min_count, Result& result);
+  bool check_seed_full_map(uint32_t seed, size_t min_count, Result& result) const;
+};
@@ -583,24 +583,40 @@ void RareItemSet::print_all_collections(FILE* stream, std::shared_ptr<const Item
   }
 }
 
-std::vector<RareItemSet::ExpandedDrop> RareItemSet::get_enemy_specs(
+const vector<RareItemSet::ExpandedDrop>& RareItemSet::SpecCollection::enemy_specs(uint8_t rt_index) const {
+  static const vector<ExpandedDrop> empty_vector;
+  return (rt_index < this->rt_index_to_specs.size()) ? this->rt_index_to_specs[rt_index] : empty_vector;
+}
+
+const vector<RareItemSet::ExpandedDrop>& RareItemSet::SpecCollection::box_specs(uint8_t area) const {
+  static const vector<ExpandedDrop> empty_vector;
+  return (area < this->box_area_to_specs.size()) ? this->box_area_to_specs[area] : empty_vector;
+}
+
+const vector<RareItemSet::ExpandedDrop>& RareItemSet::get_enemy_specs(
     GameMode mode, Episode episode, uint8_t difficulty, uint8_t secid, uint8_t rt_index) const {
-  try {
-    return this->get_collection(mode, episode, difficulty, secid).rt_index_to_specs.at(rt_index);
-  } catch (const out_of_range&) {
-    static const std::vector<ExpandedDrop> empty_vector;
+  const auto* collection = this->get_collection_if_exists(mode, episode, difficulty, secid);
+  if (!collection) {
+    static const vector<ExpandedDrop> empty_vector;
     return empty_vector;
   }
+  return collection->enemy_specs(rt_index);
 }
 
-std::vector<RareItemSet::ExpandedDrop> RareItemSet::get_box_specs(
+const vector<RareItemSet::ExpandedDrop>& RareItemSet::get_box_specs(
     GameMode mode, Episode episode, uint8_t difficulty, uint8_t secid, uint8_t area) const {
-  try {
-    return this->get_collection(mode, episode, difficulty, secid).box_area_to_specs.at(area);
-  } catch (const out_of_range&) {
-    static const std::vector<ExpandedDrop> empty_vector;
+  const auto* collection = this->get_collection_if_exists(mode, episode, difficulty, secid);
+  if (!collection) {
+    static const vector<ExpandedDrop> empty_vector;
     return empty_vector;
   }
+  return collection->box_specs(area);
+}
+
+const RareItemSet::SpecCollection* RareItemSet::get_collection_if_exists(
+    GameMode mode, Episode episode, uint8_t difficulty, uint8_t secid) const {
+  auto it = this->collections.find(this->key_for_params(mode, episode, difficulty, secid));
+  return (it == this->collections.end()) ? nullptr : &it->second;
 }
 
 const RareItemSet::SpecCollection& RareItemSet::get_collection(
@@ -25,6 +25,17 @@ public:
     std::string str(std::shared_ptr<const ItemNameIndex> name_index) const;
   };
 
+  // All of the rare drops for one combination of mode, episode, difficulty,
+  // and section ID. The enemy_specs and box_specs accessors don't allocate
+  // or throw, so they can be used in the drop path.
+  struct SpecCollection {
+    std::vector<std::vector<ExpandedDrop>> rt_index_to_specs;
+    std::vector<std::vector<ExpandedDrop>> box_area_to_specs;
+
+    const std::vector<ExpandedDrop>& enemy_specs(uint8_t rt_index) const;
+    const std::vector<ExpandedDrop>& box_specs(uint8_t area) const;
+  };
+
   RareItemSet();
   RareItemSet(const AFSArchive& afs, bool is_v1);
   RareItemSet(const GSLArchive& gsl, bool is_big_endian);
@@ -32,8 +43,11 @@ public:
   RareItemSet(const phosg::JSON& json, std::shared_ptr<const ItemNameIndex> name_index = nullptr);
   ~RareItemSet() = default;
 
-  std::vector<ExpandedDrop> get_enemy_specs(GameMode mode, Episode episode, uint8_t difficulty, uint8_t secid, uint8_t rt_index) const;
-  std::vector<ExpandedDrop> get_box_specs(GameMode mode, Episode episode, uint8_t difficulty, uint8_t secid, uint8_t area) const;
+  const std::vector<ExpandedDrop>& get_enemy_specs(GameMode mode, Episode episode, uint8_t difficulty, uint8_t secid, uint8_t rt_index) const;
+  const std::vector<ExpandedDrop>& get_box_specs(GameMode mode, Episode episode, uint8_t difficulty, uint8_t secid, uint8_t area) const;
+  // Returns nullptr if there's no collection for the given parameters. The
+  // returned collection is valid for the lifetime of this object.
+  const SpecCollection* get_collection_if_exists(GameMode mode, Episode episode, uint8_t difficulty, uint8_t secid) const;
 
   std::string serialize_afs(bool is_v1) const;
   std::string serialize_gsl(bool big_endian) const;
@@ -51,11 +65,6 @@ public:
   void print_all_collections(FILE* stream, std::shared_ptr<const ItemNameIndex> name_index = nullptr) const;
 
 protected:
-  struct SpecCollection {
-    std::vector<std::vector<ExpandedDrop>> rt_index_to_specs;
-    std::vector<std::vector<ExpandedDrop>> box_area_to_specs;
-  };
-
   struct ParsedRELData {
     struct PackedDrop {
       uint8_t probability = 0;
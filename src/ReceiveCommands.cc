@@ -17,12 +17,14 @@
 #include "FileContentsCache.hh"
 #include "ItemCreator.hh"
 #include "Loggers.hh"
+#include "Metrics.hh"
 #include "PSOProtocol.hh"
 #include "ProxyServer.hh"
 #include "ReceiveSubcommands.hh"
 #include "SendCommands.hh"
 #include "StaticGameData.hh"
 #include "Text.hh"
+#include "Watchdog.hh"
 
 using namespace std;
 
@@ -3351,7 +3353,7 @@ static void on_61_98(shared_ptr<Client> c, uint16_t command, uint32_t flag, stri
         bb_player->challenge_records = player->challenge_records;
         bb_player->choice_search_config = player->choice_search_config;
         try {
-          Client::save_character_file(filename, c->system_file(), bb_player);
+          Client::save_character_file(filename, c->system_file(), bb_player, true);
           send_text_message(c, "$C7Character data saved\n(basic only)");
         } catch (const exception& e) {
           send_text_message_printf(c, "$C6Character data could\nnot be saved:\n%s", e.what());
@@ -3397,9 +3399,9 @@ static void on_30(shared_ptr<Client> c, uint16_t, uint32_t, string& data) {
     try {
       if (c->version() == Version::GC_EP3_NTE) {
         PSOGCEp3CharacterFile::Character ch(check_size_t<PSOGCEp3NTECharacter>(data));
-        Client::save_ep3_character_file(filename, ch);
+        Client::save_ep3_character_file(filename, ch, true);
       } else {
-        Client::save_ep3_character_file(filename, check_size_t<PSOGCEp3CharacterFile::Character>(data));
+        Client::save_ep3_character_file(filename, check_size_t<PSOGCEp3CharacterFile::Character>(data), true);
       }
       send_text_message(c, "$C7Character data saved\n(full save file)");
     } catch (const exception& e) {
@@ -3440,7 +3442,7 @@ static void on_30(shared_ptr<Client> c, uint16_t, uint32_t, string& data) {
   bb_char->disp.visual.name_color_checksum = 0x00000000;
 
   try {
-    Client::save_character_file(filename, c->system_file(), bb_char);
+    Client::save_character_file(filename, c->system_file(), bb_char, true);
     send_text_message(c, "$C7Character data saved\n(full save file)");
   } catch (const exception& e) {
     send_text_message_printf(c, "$C6Character data could\nnot be saved:\n%s", e.what());
@@ -5736,6 +5738,11 @@ static void check_logged_out_command(Version version, uint8_t command) {
 }
 
 void on_command(shared_ptr<Client> c, uint16_t command, uint32_t flag, string& data) {
+  WatchdogScope watchdog_scope(EventLoopWatchdog::CallbackType::COMMAND, "on_command");
+  if (watchdog_scope.active()) {
+    auto l = c->lobby.lock();
+    watchdog_scope.set_context(command, c->id, l ? l->lobby_id : 0);
+  }
   c->reschedule_ping_and_timeout_events();
 
   // Most of the command handlers assume the client is registered, logged in,
@@ -5747,11 +5754,13 @@ void on_command(shared_ptr<Client> c, uint16_t command, uint32_t flag, string& d
   }
 
   auto fn = handlers[command & 0xFF][static_cast<size_t>(c->version()) - 2];
+  uint64_t handler_start = metrics_now_ns();
   if (fn) {
     fn(c, command, flag, data);
   } else {
     on_unimplemented_command(c, command, flag, data);
   }
+  global_metrics.command_handler_ns[command & 0xFF].record_since(handler_start);
 }
 
 void on_command_with_header(shared_ptr<Client> c, const string& data) {
@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include <memory>
+#include <optional>
 #include <phosg/Random.hh>
 #include <phosg/Strings.hh>
 #include <phosg/Vector.hh>
@@ -15,6 +16,7 @@
 #include "Lobby.hh"
 #include "Loggers.hh"
 #include "Map.hh"
+#include "Metrics.hh"
 #include "PSOProtocol.hh"
 #include "SendCommands.hh"
 #include "StaticGameData.hh"
@@ -146,6 +148,7 @@ static void forward_subcommand(shared_ptr<Client> c, uint8_t command, uint8_t fl
   string nte_data;
   string proto_data;
   string final_data;
+  CommandBroadcaster broadcaster;
   Version c_version = c->version();
   auto send_to_client = [&](shared_ptr<Client> lc) -> void {
     Version lc_version = lc->version();
@@ -196,7 +199,7 @@ static void forward_subcommand(shared_ptr<Client> c, uint8_t command, uint8_t fl
         cmd.flag = flag;
         cmd.data.assign(reinterpret_cast<const char*>(data_to_send), size_to_send);
       } else {
-        send_command(lc, command, flag, data_to_send, size_to_send);
+        broadcaster.send(lc, command, flag, data_to_send, size_to_send);
       }
     }
   };
@@ -2035,7 +2038,7 @@ static void on_pick_up_item_generic(
     auto p = c->character();
     auto s = c->require_server_state();
     auto fi = l->remove_item(floor, item_id, c->lobby_client_id);
-    if (!fi->visible_to_client(c->lobby_client_id)) {
+    if (!fi.visible_to_client(c->lobby_client_id)) {
       l->log.warning("Player %hu requests to pick up %08" PRIX32 ", but is it not visible to them; dropping command",
           client_id, item_id);
       l->add_item(floor, fi);
@@ -2043,7 +2046,7 @@ static void on_pick_up_item_generic(
     }
 
     try {
-      p->add_item(fi->data, *s->item_stack_limits(c->version()));
+      p->add_item(fi.data, *s->item_stack_limits(c->version()));
     } catch (const out_of_range&) {
       // Inventory is full; put the item back where it was
       l->log.warning("Player %hu requests to pick up %08" PRIX32 ", but their inventory is full; dropping command",
@@ -2054,7 +2057,7 @@ static void on_pick_up_item_generic(
 
     if (l->log.should_log(phosg::LogLevel::INFO)) {
       auto s = c->require_server_state();
-      auto name = s->describe_item(c->version(), fi->data, false);
+      auto name = s->describe_item(c->version(), fi.data, false);
       l->log.info("Player %hu picked up %08" PRIX32 " (%s)", client_id, item_id, name.c_str());
       c->print_inventory(stderr);
     }
@@ -2064,16 +2067,16 @@ static void on_pick_up_item_generic(
       if ((!lc) || (!is_request && (lc == c))) {
         continue;
       }
-      if (fi->visible_to_client(z)) {
+      if (fi.visible_to_client(z)) {
         send_pick_up_item_to_client(lc, client_id, item_id, floor);
       } else {
-        send_create_inventory_item_to_client(lc, client_id, fi->data);
+        send_create_inventory_item_to_client(lc, client_id, fi.data);
       }
     }
 
     if (!c->login->account->check_user_flag(Account::UserFlag::DISABLE_DROP_NOTIFICATION_BROADCAST) &&
-        (fi->flags & 0x1000)) {
-      uint32_t pi = fi->data.primary_identifier();
+        (fi.flags & 0x1000)) {
+      uint32_t pi = fi.data.primary_identifier();
       bool should_send_game_notif, should_send_global_notif;
       if (is_v1_or_v2(c->version()) && (c->version() != Version::GC_NTE)) {
         should_send_game_notif = s->notify_game_for_item_primary_identifiers_v1_v2.count(pi);
@@ -2088,8 +2091,8 @@ static void on_pick_up_item_generic(
 
       if (should_send_game_notif || should_send_global_notif) {
         string p_name = p->disp.name.decode();
-        string desc_ingame = s->describe_item(c->version(), fi->data, true);
-        string desc_http = s->describe_item(c->version(), fi->data, false);
+        string desc_ingame = s->describe_item(c->version(), fi.data, true);
+        string desc_http = s->describe_item(c->version(), fi.data, false);
 
         if (s->http_server) {
           auto message = make_shared<phosg::JSON>(phosg::JSON::dict({
@@ -2098,7 +2101,7 @@ static void on_pick_up_item_generic(
               {"PlayerVersion", phosg::name_for_enum(c->version())},
               {"GameName", l->name},
               {"GameDropMode", phosg::name_for_enum(l->drop_mode)},
-              {"ItemData", fi->data.hex()},
+              {"ItemData", fi.data.hex()},
               {"ItemDescription", desc_http},
               {"NotifyGame", should_send_game_notif},
               {"NotifyServer", should_send_global_notif},
@@ -2994,7 +2997,7 @@ static void on_set_entity_set_flag(shared_ptr<Client> c, uint8_t command, uint8_
             event->flags = (event->flags | 0x18) & (~4);
             l->log.info("Set flags on W-%02hhX-%" PRIX32 " to %04hX", event->floor, event->event_id, event->flags);
 
-            phosg::StringReader actions_r(l->map->event_action_stream);
+            phosg::StringReader actions_r(l->map->get_layout().event_action_stream);
             actions_r.go(event->action_stream_offset);
             while (!actions_r.eof()) {
               uint8_t opcode = actions_r.get_u8();
@@ -3806,7 +3809,7 @@ static void on_destroy_floor_item(shared_ptr<Client> c, uint8_t command, uint8_t
   }
 
   auto s = c->require_server_state();
-  shared_ptr<Lobby::FloorItem> fi;
+  optional<Lobby::FloorItem> fi;
   try {
     fi = l->remove_item(cmd.floor, cmd.item_id, 0xFF);
   } catch (const out_of_range&) {
@@ -4926,11 +4929,16 @@ void on_subcommand_multi(shared_ptr<Client> c, uint8_t command, uint8_t flag, st
     void* cmd_data = data.data() + offset;
 
     const auto* def = def_for_subcommand(c->version(), header->subcommand);
+    uint64_t handler_start = metrics_now_ns();
     if (def && def->handler) {
       def->handler(c, command, flag, cmd_data, cmd_size);
     } else {
       on_unimplemented(c, command, flag, cmd_data, cmd_size);
     }
+    // Subcommands are recorded by their final (non-NTE) numbers, since the
+    // NTE and prototype subcommand numbers are translated to those by
+    // def_for_subcommand
+    global_metrics.subcommand_handler_ns[def ? def->final_subcommand : header->subcommand].record_since(handler_start);
     offset += cmd_size;
   }
 }
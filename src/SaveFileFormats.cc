@@ -764,15 +764,14 @@ LoadedPSOCHARFile load_psochar(const string& filename, bool load_system) {
   return ret;
 }
 
-void save_psochar(
-    const std::string& filename,
+string serialize_psochar(
     std::shared_ptr<const PSOBBBaseSystemFile> system,
     std::shared_ptr<const PSOBBCharacterFile> character) {
-  auto f = phosg::fopen_unique(filename, "wb");
+  phosg::StringWriter w;
   PSOCommandHeaderBB header = {sizeof(PSOCommandHeaderBB) + sizeof(PSOBBCharacterFile) + sizeof(PSOBBBaseSystemFile) + sizeof(PSOBBTeamMembership), 0x00E7, 0x00000000};
-  phosg::fwritex(f.get(), header);
-  phosg::fwritex(f.get(), *character);
-  phosg::fwritex(f.get(), *system);
+  w.put(header);
+  w.put(*character);
+  w.put(*system);
   // TODO: Technically, we should write the actual team membership struct to
   // the file here, but that would cause Client to depend on Account, which it
   // currently does not. This data doesn't matter at all for correctness within
@@ -784,7 +783,15 @@ void save_psochar(
   // set of teams with a different set of team IDs anyway, so the membership
   // struct here would be useless either way.
   static const PSOBBTeamMembership empty_membership;
-  phosg::fwritex(f.get(), empty_membership);
+  w.put(empty_membership);
+  return std::move(w.str());
+}
+
+void save_psochar(
+    const std::string& filename,
+    std::shared_ptr<const PSOBBBaseSystemFile> system,
+    std::shared_ptr<const PSOBBCharacterFile> character) {
+  phosg::save_file(filename, serialize_psochar(system, character));
 }
 
 PSODCV2CharacterFile PSOBBCharacterFile::to_dc_v2() const {
@@ -754,6 +754,9 @@ struct LoadedPSOCHARFile {
 };
 
 LoadedPSOCHARFile load_psochar(const std::string& filename, bool load_system);
+std::string serialize_psochar(
+    std::shared_ptr<const PSOBBBaseSystemFile> system,
+    std::shared_ptr<const PSOBBCharacterFile> character);
 void save_psochar(
     const std::string& filename,
     std::shared_ptr<const PSOBBBaseSystemFile> system,
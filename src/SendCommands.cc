@@ -81,23 +81,53 @@ void send_command(shared_ptr<Client> c, uint16_t command, uint32_t flag,
   c->channel.send(command, flag, data, size);
 }
 
-void send_command_excluding_client(shared_ptr<Lobby> l, shared_ptr<Client> c,
+void CommandBroadcaster::send(shared_ptr<Client> c, uint16_t command, uint32_t flag, const void* data, size_t size) {
+  auto& ch = c->channel;
+  if (!ch.connected()) {
+    ch.send(command, flag, data, size); // Logs a warning and drops the command
+    return;
+  }
+  for (const auto& entry : this->entries) {
+    if ((entry.data == data) &&
+        (entry.size == size) &&
+        (entry.msg.command == command) &&
+        (entry.msg.flag == flag) &&
+        ch.can_send(entry.msg)) {
+      ch.send(entry.msg);
+      return;
+    }
+  }
+  auto& entry = this->entries.emplace_back(Entry{
+      .data = data,
+      .size = size,
+      .msg = Channel::prepare(ch.version, ch.crypt_out.get() != nullptr, command, flag, data, size)});
+  ch.send(entry.msg);
+}
+
+static void send_command_excluding_client(CommandBroadcaster& b, shared_ptr<Lobby> l, shared_ptr<Client> c,
     uint16_t command, uint32_t flag, const void* data, size_t size) {
   for (auto& client : l->clients) {
     if (!client || (client == c)) {
       continue;
     }
-    send_command(client, command, flag, data, size);
+    b.send(client, command, flag, data, size);
   }
 }
 
+void send_command_excluding_client(shared_ptr<Lobby> l, shared_ptr<Client> c,
+    uint16_t command, uint32_t flag, const void* data, size_t size) {
+  CommandBroadcaster b;
+  send_command_excluding_client(b, l, c, command, flag, data, size);
+}
+
 void send_command_if_not_loading(shared_ptr<Lobby> l,
     uint16_t command, uint32_t flag, const void* data, size_t size) {
+  CommandBroadcaster b;
   for (auto& client : l->clients) {
     if (!client || client->config.check_flag(Client::Flag::LOADING)) {
       continue;
     }
-    send_command(client, command, flag, data, size);
+    b.send(client, command, flag, data, size);
   }
 }
 
@@ -108,8 +138,9 @@ void send_command(shared_ptr<Lobby> l, uint16_t command, uint32_t flag,
 
 void send_command(shared_ptr<ServerState> s, uint16_t command, uint32_t flag,
     const void* data, size_t size) {
+  CommandBroadcaster b;
   for (auto& l : s->all_lobbies()) {
-    send_command(l, command, flag, data, size);
+    send_command_excluding_client(b, l, nullptr, command, flag, data, size);
   }
 }
 
@@ -2661,12 +2692,12 @@ void send_game_item_state(shared_ptr<Client> c) {
   for (size_t floor = 0; floor < 0x10; floor++) {
     const auto& m = l->floor_item_managers.at(floor);
     // It's important that these are added in increasing order of item_id (hence
-    // why items is a map and not an unordered_map), since the game uses binary
-    // search to find floor items when picking them up. If items aren't in the
-    // correct order, the game may fail to find an item when attempting to pick
-    // it up, causing "ghost items" which are visible but can't be picked up.
-    for (const auto& it : m.items) {
-      const auto& item = it.second;
+    // why FloorItemManager keeps its items sorted by ID), since the game uses
+    // binary search to find floor items when picking them up. If items aren't
+    // in the correct order, the game may fail to find an item when attempting
+    // to pick it up, causing "ghost items" which are visible but can't be
+    // picked up.
+    for (const auto* item : m.items()) {
       if (!item->visible_to_client(c->lobby_client_id)) {
         continue;
       }
@@ -60,6 +60,24 @@ inline void send_command(std::shared_ptr<Client> c, uint16_t command,
   send_command(c, command, flag, nullptr, 0);
 }
 
+// Sends the same command to many clients, building the framed command (header
+// and padding) only once for each distinct version and encryption state among
+// the recipients. Each recipient then only has to copy and encrypt it. The
+// data pointer is part of the cache key, so the same broadcaster can be used
+// for multiple different commands as long as their buffers remain valid.
+class CommandBroadcaster {
+public:
+  void send(std::shared_ptr<Client> c, uint16_t command, uint32_t flag, const void* data, size_t size);
+
+private:
+  struct Entry {
+    const void* data;
+    size_t size;
+    Channel::PreparedMessage msg;
+  };
+  std::vector<Entry> entries;
+};
+
 void send_command_excluding_client(std::shared_ptr<Lobby> l,
     std::shared_ptr<Client> c, uint16_t command, uint32_t flag,
     const void* data, size_t size);
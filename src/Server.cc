@@ -23,6 +23,7 @@
 #include "Loggers.hh"
 #include "PSOProtocol.hh"
 #include "ReceiveCommands.hh"
+#include "Watchdog.hh"
 
 using namespace std;
 using namespace std::placeholders;
@@ -60,6 +61,7 @@ void Server::enqueue_destroy_clients() {
 }
 
 void Server::dispatch_destroy_clients(evutil_socket_t, short, void* ctx) {
+  WatchdogScope watchdog_scope(EventLoopWatchdog::CallbackType::TIMER, "Server::dispatch_destroy_clients");
   reinterpret_cast<Server*>(ctx)->destroy_clients();
 }
 
@@ -12,6 +12,7 @@
 #include "SendCommands.hh"
 #include "ServerState.hh"
 #include "StaticGameData.hh"
+#include "Watchdog.hh"
 
 using namespace std;
 
@@ -306,6 +307,34 @@ CommandDefinition c_reload(
       }
     });
 
+CommandDefinition c_slow_callbacks(
+    "slow-callbacks", "slow-callbacks [--stacks]\n\
+    Show the most recent events that took longer than SlowCallbackThreshold\n\
+    to handle, oldest first. If --stacks is given, also show the stack sample\n\
+    taken while each event was running, if any.",
+    false,
+    +[](CommandArgs& args) {
+      if (!args.s->watchdog || !args.s->watchdog->detects_slow_callbacks()) {
+        throw runtime_error("the event loop watchdog is disabled");
+      }
+      bool show_stacks = (args.args == "--stacks");
+      if (!show_stacks && !args.args.empty()) {
+        throw runtime_error("invalid arguments");
+      }
+      auto slow_callbacks = args.s->watchdog->get_slow_callbacks();
+      if (slow_callbacks.empty()) {
+        fprintf(stderr, "No slow callbacks recorded\n");
+      }
+      for (const auto& cb : slow_callbacks) {
+        fprintf(stderr, "%s\n", cb.str().c_str());
+        if (show_stacks) {
+          for (const auto& frame : cb.stack) {
+            fprintf(stderr, "    %s\n", frame.c_str());
+          }
+        }
+      }
+    });
+
 CommandDefinition c_list_accounts(
     "list-accounts", "list-accounts\n\
     List all accounts registered on the server.",
@@ -2,9 +2,13 @@
 
 #include <string.h>
 
+#include <condition_variable>
+#include <deque>
 #include <memory>
 #include <phosg/Image.hh>
 #include <phosg/Network.hh>
+#include <phosg/Time.hh>
+#include <thread>
 
 #include "Compression.hh"
 #include "EventUtils.hh"
@@ -13,9 +17,11 @@
 #include "IPStackSimulator.hh"
 #include "Loggers.hh"
 #include "NetworkAddresses.hh"
+#include "PSOEncryption.hh"
 #include "SendCommands.hh"
 #include "Text.hh"
 #include "TextIndex.hh"
+#include "Watchdog.hh"
 
 using namespace std;
 
@@ -391,6 +397,7 @@ size_t ServerState::default_min_level_for_game(Version version, Episode episode,
 }
 
 void ServerState::dispatch_destroy_lobbies(evutil_socket_t, short, void* ctx) {
+  WatchdogScope watchdog_scope(EventLoopWatchdog::CallbackType::TIMER, "ServerState::dispatch_destroy_lobbies");
   reinterpret_cast<ServerState*>(ctx)->lobbies_to_destroy.clear();
 }
 
@@ -514,6 +521,7 @@ shared_ptr<const string> ServerState::load_bb_file(
     const string& patch_index_filename,
     const string& gsl_filename,
     const string& bb_directory_filename) const {
+  lock_guard g(this->patch_file_load_lock);
 
   if (this->bb_patch_file_index) {
     // First, look in the patch tree's data directory
@@ -754,9 +762,23 @@ void ServerState::load_config_early() {
     this->banned_ipv4_ranges = make_shared<IPV4RangeSet>();
   }
 
+  string compressed_artifact_cache_dir = this->config_json->get_string("CompressedArtifactCacheDirectory", "system/compressed-cache");
+  uint64_t compressed_artifact_cache_max_size = this->config_json->get_int("CompressedArtifactCacheMaxSize", CompressedArtifactCache::DEFAULT_MAX_SIZE);
+  if (compressed_artifact_cache_dir.empty()) {
+    this->compressed_artifact_cache.reset();
+  } else if (!this->compressed_artifact_cache ||
+      (this->compressed_artifact_cache->get_directory() != compressed_artifact_cache_dir) ||
+      (this->compressed_artifact_cache->get_max_size() != compressed_artifact_cache_max_size)) {
+    this->compressed_artifact_cache = make_shared<CompressedArtifactCache>(compressed_artifact_cache_dir, compressed_artifact_cache_max_size);
+  }
+
+  this->watch_quest_directories = this->config_json->get_bool("WatchQuestDirectories", false);
+
   this->client_ping_interval_usecs = this->config_json->get_int("ClientPingInterval", 30000000);
   this->client_idle_timeout_usecs = this->config_json->get_int("ClientIdleTimeout", 60000000);
   this->patch_client_idle_timeout_usecs = this->config_json->get_int("PatchClientIdleTimeout", 300000000);
+  this->http_snapshot_max_age_usecs = this->config_json->get_int("HTTPSnapshotMaxAge", 1000000);
+  this->slow_callback_threshold_usecs = this->config_json->get_int("SlowCallbackThreshold", 100000);
 
   this->ip_stack_debug = this->config_json->get_bool("IPStackDebug", false);
   this->allow_unregistered_users = this->config_json->get_bool("AllowUnregisteredUsers", false);
@@ -922,7 +944,8 @@ void ServerState::load_config_early() {
       }
 
       if (compressed_gvm_data.empty()) {
-        compressed_gvm_data = prs_compress_optimal(decompressed_gvm_data);
+        compressed_gvm_data = compress_with_artifact_cache(
+            this->compressed_artifact_cache, decompressed_gvm_data, CompressedArtifactCache::Algorithm::PRS_OPTIMAL);
       }
       if (compressed_gvm_data.size() > 0x3800) {
         throw runtime_error(phosg::string_printf("banner %s cannot be compressed small enough (0x%zX bytes; maximum size is 0x3800 bytes compressed)", it->at(2).as_string().c_str(), compressed_gvm_data.size()));
@@ -1500,6 +1523,8 @@ void ServerState::clear_file_caches(bool from_non_event_thread) {
     for (auto& cache : s->map_file_caches) {
       cache = make_shared<ThreadSafeFileCache>();
     }
+    config_log.info("Clearing map template cache");
+    s->map_template_cache = make_shared<MapTemplateCache>();
     config_log.info("Clearing BB stream file cache");
     s->bb_stream_files_cache.reset(new FileContentsCache(3600000000ULL));
     config_log.info("Clearing BB system cache");
@@ -1592,6 +1617,7 @@ void ServerState::load_text_index(bool from_non_event_thread) {
       if (version == Version::BB_V4) {
         return this->load_bb_file(filename);
       } else {
+        lock_guard g(this->patch_file_load_lock);
         return this->pc_patch_file_index->get("Media/PSO/" + filename)->load_data();
       }
     } catch (const out_of_range&) {
@@ -1861,7 +1887,8 @@ void ServerState::load_ep3_cards(bool from_non_event_thread) {
       "system/ep3/card-text.mnr",
       "system/ep3/card-text.mnrd",
       "system/ep3/card-dice-text.mnr",
-      "system/ep3/card-dice-text.mnrd");
+      "system/ep3/card-dice-text.mnrd",
+      this->compressed_artifact_cache);
   config_log.info("Loading Episode 3 trial card definitions");
   auto new_ep3_card_index_trial = make_shared<Episode3::CardIndex>(
       "system/ep3/card-definitions-trial.mnr",
@@ -1869,7 +1896,8 @@ void ServerState::load_ep3_cards(bool from_non_event_thread) {
       "system/ep3/card-text-trial.mnr",
       "system/ep3/card-text-trial.mnrd",
       "system/ep3/card-dice-text-trial.mnr",
-      "system/ep3/card-dice-text-trial.mnrd");
+      "system/ep3/card-dice-text-trial.mnrd",
+      this->compressed_artifact_cache);
   config_log.info("Loading Episode 3 COM decks");
   auto new_ep3_com_deck_index = make_shared<Episode3::COMDeckIndex>("system/ep3/com-decks.json");
 
@@ -1886,7 +1914,7 @@ void ServerState::load_ep3_cards(bool from_non_event_thread) {
 
 void ServerState::load_ep3_maps(bool from_non_event_thread) {
   config_log.info("Collecting Episode 3 maps");
-  auto new_ep3_map_index = make_shared<Episode3::MapIndex>("system/ep3/maps");
+  auto new_ep3_map_index = make_shared<Episode3::MapIndex>("system/ep3/maps", this->compressed_artifact_cache);
 
   auto set = [s = this->shared_from_this(), new_ep3_map_index = std::move(new_ep3_map_index)]() {
     s->ep3_map_index = std::move(new_ep3_map_index);
@@ -1909,10 +1937,23 @@ void ServerState::load_ep3_tournament_state(bool from_non_event_thread) {
 }
 
 void ServerState::load_quest_index(bool from_non_event_thread) {
+  lock_guard g(this->quest_index_load_lock);
   config_log.info("Collecting quests");
-  auto new_default_quest_index = make_shared<QuestIndex>("system/quests", this->quest_category_index, false);
+  auto new_default_quest_index = make_shared<QuestIndex>(
+      "system/quests",
+      this->quest_category_index,
+      false,
+      this->compressed_artifact_cache,
+      this->last_loaded_default_quest_index);
   config_log.info("Collecting Episode 3 download quests");
-  auto new_ep3_download_quest_index = make_shared<QuestIndex>("system/ep3/maps-download", this->quest_category_index, true);
+  auto new_ep3_download_quest_index = make_shared<QuestIndex>(
+      "system/ep3/maps-download",
+      this->quest_category_index,
+      true,
+      this->compressed_artifact_cache,
+      this->last_loaded_ep3_download_quest_index);
+  this->last_loaded_default_quest_index = new_default_quest_index;
+  this->last_loaded_ep3_download_quest_index = new_ep3_download_quest_index;
 
   auto set = [s = this->shared_from_this(),
                  new_default_quest_index = std::move(new_default_quest_index),
@@ -1988,31 +2029,237 @@ void ServerState::create_default_lobbies() {
   }
 }
 
+// While load_all is running a loader on a worker thread, this points to a list
+// of functions that the loader passed to forward_or_call. load_all calls them
+// on its own thread after the loader returns.
+static thread_local vector<function<void()>>* deferred_loader_calls = nullptr;
+
+void ServerState::forward_or_call(bool from_non_event_thread, std::function<void()>&& fn) {
+  if (from_non_event_thread) {
+    ::forward_to_event_thread(this->base, std::move(fn));
+  } else if (deferred_loader_calls) {
+    deferred_loader_calls->emplace_back(std::move(fn));
+  } else {
+    fn();
+  }
+}
+
+namespace {
+
+struct StartupLoader {
+  const char* name;
+  vector<const char*> dependencies;
+  // If true, the loader is called on the thread that called load_all (for
+  // loaders that may only be called from the event thread); otherwise, it's
+  // called on a worker thread.
+  bool on_calling_thread;
+  function<void()> fn;
+};
+
+// Runs the given loaders, each after all of its dependencies have finished.
+// Loaders that don't depend on each other run concurrently on up to
+// num_threads worker threads. Any functions that the loaders pass to
+// forward_or_call are called on this thread, in the order the loaders finish;
+// a loader doesn't count as finished until these functions have been called,
+// so its dependents always see its results. If any loader throws, no more
+// loaders are started, and the exception is rethrown after the running
+// loaders finish. Returns the time taken by each loader.
+vector<uint64_t> run_startup_loaders(const vector<StartupLoader>& loaders, size_t num_threads) {
+  unordered_map<string, size_t> index_for_name;
+  for (size_t z = 0; z < loaders.size(); z++) {
+    if (!index_for_name.emplace(loaders[z].name, z).second) {
+      throw logic_error(phosg::string_printf("duplicate startup loader name: %s", loaders[z].name));
+    }
+  }
+  vector<size_t> num_pending_dependencies(loaders.size(), 0);
+  vector<vector<size_t>> dependents(loaders.size());
+  for (size_t z = 0; z < loaders.size(); z++) {
+    for (const char* dep_name : loaders[z].dependencies) {
+      auto it = index_for_name.find(dep_name);
+      if (it == index_for_name.end()) {
+        throw logic_error(phosg::string_printf("startup loader %s depends on nonexistent loader %s", loaders[z].name, dep_name));
+      }
+      dependents[it->second].emplace_back(z);
+      num_pending_dependencies[z]++;
+    }
+  }
+
+  struct Completion {
+    size_t index;
+    vector<function<void()>> deferred_calls;
+    exception_ptr exc;
+  };
+
+  mutex lock;
+  condition_variable worker_cv;
+  condition_variable completion_cv;
+  deque<size_t> worker_queue;
+  deque<Completion> completions;
+  bool workers_should_exit = false;
+  vector<uint64_t> durations(loaders.size(), 0);
+
+  auto worker_thread_fn = [&]() -> void {
+    unique_lock g(lock);
+    for (;;) {
+      worker_cv.wait(g, [&]() { return workers_should_exit || !worker_queue.empty(); });
+      if (worker_queue.empty()) {
+        return;
+      }
+      size_t index = worker_queue.front();
+      worker_queue.pop_front();
+      g.unlock();
+
+      Completion c{index, {}, nullptr};
+      uint64_t start = phosg::now();
+      deferred_loader_calls = &c.deferred_calls;
+      try {
+        loaders[index].fn();
+      } catch (const exception&) {
+        c.exc = current_exception();
+      }
+      deferred_loader_calls = nullptr;
+      durations[index] = phosg::now() - start;
+
+      g.lock();
+      completions.emplace_back(std::move(c));
+      completion_cv.notify_one();
+    }
+  };
+
+  vector<thread> threads;
+  threads.reserve(num_threads);
+  for (size_t z = 0; z < num_threads; z++) {
+    threads.emplace_back(worker_thread_fn);
+  }
+
+  deque<size_t> calling_thread_queue;
+  size_t num_running = 0;
+  exception_ptr first_exc = nullptr;
+  auto start_loader = [&](size_t index) -> void {
+    // lock must be held by the caller
+    num_running++;
+    if (loaders[index].on_calling_thread) {
+      calling_thread_queue.emplace_back(index);
+    } else {
+      worker_queue.emplace_back(index);
+      worker_cv.notify_one();
+    }
+  };
+
+  unique_lock g(lock);
+  for (size_t z = 0; z < loaders.size(); z++) {
+    if (num_pending_dependencies[z] == 0) {
+      start_loader(z);
+    }
+  }
+  while (num_running > 0) {
+    Completion c;
+    if (!calling_thread_queue.empty()) {
+      c.index = calling_thread_queue.front();
+      calling_thread_queue.pop_front();
+      g.unlock();
+      uint64_t start = phosg::now();
+      try {
+        loaders[c.index].fn();
+      } catch (const exception&) {
+        c.exc = current_exception();
+      }
+      durations[c.index] = phosg::now() - start;
+      g.lock();
+    } else {
+      completion_cv.wait(g, [&]() { return !completions.empty(); });
+      c = std::move(completions.front());
+      completions.pop_front();
+    }
+    num_running--;
+
+    if (!c.exc && !first_exc) {
+      g.unlock();
+      uint64_t start = phosg::now();
+      try {
+        for (auto& fn : c.deferred_calls) {
+          fn();
+        }
+      } catch (const exception&) {
+        c.exc = current_exception();
+      }
+      durations[c.index] += phosg::now() - start;
+      g.lock();
+    }
+
+    if (c.exc) {
+      if (!first_exc) {
+        first_exc = c.exc;
+      }
+    } else if (!first_exc) {
+      for (size_t dependent_index : dependents[c.index]) {
+        if (--num_pending_dependencies[dependent_index] == 0) {
+          start_loader(dependent_index);
+        }
+      }
+    }
+  }
+  workers_should_exit = true;
+  worker_cv.notify_all();
+  g.unlock();
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  if (first_exc) {
+    rethrow_exception(first_exc);
+  }
+  return durations;
+}
+
+} // namespace
+
 void ServerState::load_all() {
+  uint64_t start = phosg::now();
   this->collect_network_addresses();
   this->load_config_early();
-  this->load_bb_private_keys(false);
-  this->load_bb_system_defaults(false);
-  this->load_accounts(false);
-  this->clear_file_caches(false);
-  this->load_patch_indexes(false);
-  this->load_ep3_cards(false);
-  this->load_ep3_maps(false);
-  this->load_ep3_tournament_state(false);
-  this->compile_functions(false);
-  this->load_dol_files(false);
-  this->create_default_lobbies();
-  this->load_set_data_tables(false);
-  this->load_battle_params(false);
-  this->load_level_tables(false);
-  this->load_text_index(false);
-  this->load_word_select_table(false);
-  this->load_item_definitions(false);
-  this->load_item_name_indexes(false);
-  this->load_drop_tables(false);
-  this->load_config_late();
-  this->load_teams(false);
-  this->load_quest_index(false);
+
+  // Everything depends on the configuration, so it's loaded first (above).
+  // The rest of the loaders only need to run after the loaders whose results
+  // they use.
+  vector<StartupLoader> loaders{
+      {"bb_private_keys", {}, false, [&]() { this->load_bb_private_keys(false); }},
+      {"bb_system_defaults", {}, false, [&]() { this->load_bb_system_defaults(false); }},
+      {"accounts", {}, false, [&]() { this->load_accounts(false); }},
+      {"file_caches", {}, false, [&]() { this->clear_file_caches(false); }},
+      {"patch_indexes", {}, false, [&]() { this->load_patch_indexes(false); }},
+      {"ep3_cards", {}, false, [&]() { this->load_ep3_cards(false); }},
+      {"ep3_maps", {}, false, [&]() { this->load_ep3_maps(false); }},
+      {"ep3_tournament_state", {"ep3_cards", "ep3_maps"}, false, [&]() { this->load_ep3_tournament_state(false); }},
+      {"functions", {}, false, [&]() { this->compile_functions(false); }},
+      {"dol_files", {}, false, [&]() { this->load_dol_files(false); }},
+      {"default_lobbies", {}, true, [&]() { this->create_default_lobbies(); }},
+      {"set_data_tables", {"file_caches", "patch_indexes"}, false, [&]() { this->load_set_data_tables(false); }},
+      {"battle_params", {"file_caches", "patch_indexes"}, false, [&]() { this->load_battle_params(false); }},
+      {"level_tables", {"file_caches", "patch_indexes"}, false, [&]() { this->load_level_tables(false); }},
+      {"text_index", {"file_caches", "patch_indexes"}, false, [&]() { this->load_text_index(false); }},
+      {"word_select_table", {"text_index"}, false, [&]() { this->load_word_select_table(false); }},
+      {"item_definitions", {}, false, [&]() { this->load_item_definitions(false); }},
+      {"item_name_indexes", {"item_definitions", "text_index"}, false, [&]() { this->load_item_name_indexes(false); }},
+      {"drop_tables", {"item_name_indexes"}, false, [&]() { this->load_drop_tables(false); }},
+      {"config_late", {"default_lobbies", "item_name_indexes", "ep3_cards"}, true, [&]() { this->load_config_late(); }},
+      {"teams", {}, false, [&]() { this->load_teams(false); }},
+      {"quest_index", {}, false, [&]() { this->load_quest_index(false); }},
+  };
+  size_t num_threads = min<size_t>(max<size_t>(thread::hardware_concurrency(), 1), loaders.size());
+  auto durations = run_startup_loaders(loaders, num_threads);
+
+  config_log.info("Loaded all data in %s using %zu threads; time taken by each loader:",
+      phosg::format_duration(phosg::now() - start).c_str(), num_threads);
+  for (size_t z = 0; z < loaders.size(); z++) {
+    config_log.info("  %-24s %s", loaders[z].name, phosg::format_duration(durations[z]).c_str());
+  }
+
+  if (this->compressed_artifact_cache) {
+    auto stats = this->compressed_artifact_cache->get_stats();
+    config_log.info("Compressed artifact cache: %zu hits, %zu misses, %zu write failures, %zu evictions",
+        stats.hits, stats.misses, stats.write_failures, stats.evictions);
+  }
 }
 
 shared_ptr<PatchServer::Config> ServerState::generate_patch_server_config(bool is_bb) const {
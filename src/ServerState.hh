@@ -5,6 +5,7 @@
 #include <atomic>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <phosg/JSON.hh>
 #include <set>
 #include <string>
@@ -14,6 +15,7 @@
 #include "Account.hh"
 #include "Client.hh"
 #include "CommonItemSet.hh"
+#include "CompressedArtifactCache.hh"
 #include "DNSServer.hh"
 #include "Episode3/DataIndexes.hh"
 #include "Episode3/Tournament.hh"
@@ -37,6 +39,7 @@ class ProxyServer;
 class Server;
 class IPStackSimulator;
 class HTTPServer;
+class EventLoopWatchdog;
 
 struct PortConfiguration {
   std::string name;
@@ -111,6 +114,8 @@ struct ServerState : public std::enable_shared_from_this<ServerState> {
   uint64_t client_ping_interval_usecs = 30000000;
   uint64_t client_idle_timeout_usecs = 60000000;
   uint64_t patch_client_idle_timeout_usecs = 300000000;
+  uint64_t http_snapshot_max_age_usecs = 1000000;
+  uint64_t slow_callback_threshold_usecs = 100000;
   bool ip_stack_debug = false;
   bool allow_unregistered_users = false;
   bool allow_pc_nte = false;
@@ -174,9 +179,15 @@ struct ServerState : public std::enable_shared_from_this<ServerState> {
   std::shared_ptr<const PatchFileIndex> pc_patch_file_index;
   std::shared_ptr<const PatchFileIndex> bb_patch_file_index;
   std::array<std::shared_ptr<ThreadSafeFileCache>, NUM_VERSIONS> map_file_caches;
+  std::shared_ptr<MapTemplateCache> map_template_cache;
   std::shared_ptr<FileContentsCache> bb_stream_files_cache;
   std::shared_ptr<FileContentsCache> bb_system_cache;
   std::shared_ptr<FileContentsCache> gba_files_cache;
+  std::shared_ptr<CompressedArtifactCache> compressed_artifact_cache; // May be null
+  // Held while loading files through bb_patch_file_index, bb_system_cache, or
+  // pc_patch_file_index, none of which are thread-safe. (load_all runs
+  // multiple loaders concurrently, and they may all load files.)
+  mutable std::mutex patch_file_load_lock;
   std::shared_ptr<const DOLFileIndex> dol_file_index;
   std::shared_ptr<const Episode3::CardIndex> ep3_card_index;
   std::shared_ptr<const Episode3::CardIndex> ep3_card_index_trial;
@@ -188,6 +199,15 @@ struct ServerState : public std::enable_shared_from_this<ServerState> {
   std::shared_ptr<const QuestCategoryIndex> quest_category_index;
   std::shared_ptr<const QuestIndex> default_quest_index;
   std::shared_ptr<const QuestIndex> ep3_download_quest_index;
+  // load_quest_index builds each new quest index incrementally from the one
+  // it built last time. These are the indexes it built last time; unlike the
+  // two fields above, they may only be accessed while holding
+  // quest_index_load_lock (which also prevents concurrent reloads).
+  std::mutex quest_index_load_lock;
+  std::shared_ptr<const QuestIndex> last_loaded_default_quest_index;
+  std::shared_ptr<const QuestIndex> last_loaded_ep3_download_quest_index;
+  // If true, a QuestIndexWatcher reloads the quest indexes when files change
+  bool watch_quest_directories = false;
   std::shared_ptr<const LevelTable> level_table_v1_v2;
   std::shared_ptr<const LevelTable> level_table_v3;
   std::shared_ptr<const LevelTable> level_table_v4;
@@ -303,6 +323,7 @@ struct ServerState : public std::enable_shared_from_this<ServerState> {
   std::shared_ptr<PatchServer> pc_patch_server;
   std::shared_ptr<PatchServer> bb_patch_server;
   std::shared_ptr<HTTPServer> http_server;
+  std::shared_ptr<EventLoopWatchdog> watchdog;
 
   explicit ServerState(const std::string& config_filename = "");
   ServerState(std::shared_ptr<struct event_base> base, const std::string& config_filename, bool is_replay);
@@ -390,13 +411,11 @@ struct ServerState : public std::enable_shared_from_this<ServerState> {
   inline void forward_to_event_thread(std::function<void()>&& fn) {
     ::forward_to_event_thread(this->base, std::move(fn));
   }
-  inline void forward_or_call(bool from_non_event_thread, std::function<void()>&& fn) {
-    if (from_non_event_thread) {
-      ::forward_to_event_thread(this->base, std::move(fn));
-    } else {
-      fn();
-    }
-  }
+  // If from_non_event_thread is true, forwards fn to the event thread;
+  // otherwise, calls it immediately. When called from a loader that load_all
+  // is running on a worker thread, fn is instead called on the thread that
+  // called load_all, after the loader returns.
+  void forward_or_call(bool from_non_event_thread, std::function<void()>&& fn);
 
   std::shared_ptr<PatchServer::Config> generate_patch_server_config(bool is_bb) const;
   void update_dependent_server_configs() const;
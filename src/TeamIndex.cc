@@ -4,6 +4,7 @@
 #include <phosg/Image.hh>
 #include <phosg/Random.hh>
 
+#include "AsyncFileWriter.hh"
 #include "BattleParamsIndex.hh"
 #include "GVMEncoder.hh"
 #include "ItemData.hh"
@@ -93,7 +94,7 @@ void TeamIndex::Team::save_config() const {
       {"RewardKeys", std::move(reward_keys_json)},
       {"RewardFlags", this->reward_flags},
   });
-  phosg::save_file(this->json_filename(), root.serialize(phosg::JSON::SerializeOption::FORMAT | phosg::JSON::SerializeOption::HEX_INTEGERS | phosg::JSON::SerializeOption::ESCAPE_CONTROLS_ONLY));
+  save_file_async(this->json_filename(), root.serialize(phosg::JSON::SerializeOption::FORMAT | phosg::JSON::SerializeOption::HEX_INTEGERS | phosg::JSON::SerializeOption::ESCAPE_CONTROLS_ONLY));
 }
 
 void TeamIndex::Team::load_flag() {
@@ -125,7 +126,7 @@ void TeamIndex::Team::save_flag() const {
 void TeamIndex::Team::delete_files() const {
   string json_filename = this->json_filename();
   string flag_filename = this->flag_filename();
-  remove(json_filename.c_str());
+  delete_file_async(json_filename);
   remove(flag_filename.c_str());
 }
 
@@ -302,7 +303,7 @@ vector<shared_ptr<const TeamIndex::Team>> TeamIndex::all() const {
 
 shared_ptr<const TeamIndex::Team> TeamIndex::create(const string& name, uint32_t master_account_id, const string& master_name) {
   auto team = make_shared<Team>(this->next_team_id++);
-  phosg::save_file(this->directory + "/base.json", phosg::JSON::dict({{"NextTeamID", this->next_team_id}}).serialize());
+  save_file_async(this->directory + "/base.json", phosg::JSON::dict({{"NextTeamID", this->next_team_id}}).serialize());
 
   Team::Member m;
   m.account_id = master_account_id;
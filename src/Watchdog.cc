@@ -0,0 +1,268 @@
+#include "Watchdog.hh"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#if !defined(PHOSG_WINDOWS) && __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define HAVE_STACK_SAMPLES
+#endif
+
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+
+#include "Loggers.hh"
+#include "Metrics.hh"
+
+using namespace std;
+
+static_assert(EventLoopWatchdog::NUM_CALLBACK_TYPES == sizeof(ServerMetrics::callback_ns) / sizeof(ServerMetrics::callback_ns[0]),
+    "ServerMetrics::callback_ns must have an entry for each callback type");
+
+thread_local EventLoopWatchdog::ThreadState* EventLoopWatchdog::current_thread_state = nullptr;
+
+const char* EventLoopWatchdog::name_for_callback_type(CallbackType type) {
+  switch (type) {
+    case CallbackType::CHANNEL_INPUT:
+      return "channel_input";
+    case CallbackType::COMMAND:
+      return "command";
+    case CallbackType::TIMER:
+      return "timer";
+    case CallbackType::FORWARDED:
+      return "forwarded";
+    default:
+      return "unknown";
+  }
+}
+
+phosg::JSON EventLoopWatchdog::SlowCallback::json() const {
+  auto stack_json = phosg::JSON::list();
+  for (const auto& frame : this->stack) {
+    stack_json.emplace_back(frame);
+  }
+  return phosg::JSON::dict({
+      {"StartTime", this->start_time},
+      {"DurationUsecs", this->duration_usecs},
+      {"Type", name_for_callback_type(this->type)},
+      {"Name", this->name},
+      {"Command", (this->command >= 0) ? phosg::JSON(this->command) : phosg::JSON(nullptr)},
+      {"ClientID", this->client_id ? phosg::JSON(this->client_id) : phosg::JSON(nullptr)},
+      {"LobbyID", this->lobby_id ? phosg::JSON(this->lobby_id) : phosg::JSON(nullptr)},
+      {"Stack", std::move(stack_json)},
+  });
+}
+
+string EventLoopWatchdog::SlowCallback::str() const {
+  string ret = phosg::string_printf("%s: %s %s took %s",
+      phosg::format_time(this->start_time).c_str(),
+      name_for_callback_type(this->type),
+      this->name,
+      phosg::format_duration(this->duration_usecs).c_str());
+  if (this->command >= 0) {
+    ret += phosg::string_printf(" (command %02" PRIX32, this->command);
+    if (this->client_id) {
+      ret += phosg::string_printf(" from client C-%" PRIX64, this->client_id);
+    }
+    if (this->lobby_id) {
+      ret += phosg::string_printf(" in lobby %08" PRIX32, this->lobby_id);
+    }
+    ret += ")";
+  }
+  return ret;
+}
+
+EventLoopWatchdog::EventLoopWatchdog(uint64_t threshold_usecs, size_t max_slow_callbacks)
+    : threshold_ns(threshold_usecs * 1000),
+      max_slow_callbacks(max_slow_callbacks),
+      should_exit(false) {
+  if (this->threshold_ns) {
+    this->thread = std::thread(&EventLoopWatchdog::thread_fn, this);
+  }
+}
+
+EventLoopWatchdog::~EventLoopWatchdog() {
+  {
+    lock_guard g(this->lock);
+    this->should_exit = true;
+  }
+  this->should_exit_cv.notify_all();
+  if (this->thread.joinable()) {
+    this->thread.join();
+  }
+  if (current_thread_state && (current_thread_state->watchdog == this)) {
+    current_thread_state = nullptr;
+  }
+}
+
+void EventLoopWatchdog::watch_current_thread() {
+  if (current_thread_state) {
+    throw logic_error("current thread is already watched");
+  }
+
+#ifdef HAVE_STACK_SAMPLES
+  if (this->threshold_ns) {
+    // backtrace() may allocate memory the first time it's called (to load the
+    // unwinder), which isn't safe to do in a signal handler, so call it once
+    // here first
+    void* frames[4];
+    backtrace(frames, 4);
+
+    static std::once_flag install_handler_once;
+    std::call_once(install_handler_once, []() -> void {
+      struct sigaction sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_handler = &EventLoopWatchdog::on_sample_signal;
+      sa.sa_flags = SA_RESTART;
+      sigemptyset(&sa.sa_mask);
+      if (sigaction(SIGPROF, &sa, nullptr) != 0) {
+        throw runtime_error("cannot install stack sample signal handler");
+      }
+    });
+  }
+#endif
+
+  auto ts = make_unique<ThreadState>();
+  ts->watchdog = this;
+  ts->thread = pthread_self();
+  current_thread_state = ts.get();
+  lock_guard g(this->lock);
+  this->thread_states.emplace_back(std::move(ts));
+}
+
+vector<EventLoopWatchdog::SlowCallback> EventLoopWatchdog::get_slow_callbacks() const {
+  lock_guard g(this->lock);
+  return vector<SlowCallback>(this->slow_callbacks.begin(), this->slow_callbacks.end());
+}
+
+void EventLoopWatchdog::on_sample_signal(int) {
+#ifdef HAVE_STACK_SAMPLES
+  int prev_errno = errno;
+  ThreadState* ts = current_thread_state;
+  if (ts && ts->depth) {
+    ts->num_sample_frames = backtrace(ts->sample_frames, ThreadState::MAX_SAMPLE_FRAMES);
+    ts->sample_seq = ts->callback_seq.load(memory_order_relaxed);
+  }
+  errno = prev_errno;
+#endif
+}
+
+void EventLoopWatchdog::thread_fn() {
+  // Check for stalled callbacks a few times per threshold interval, so stack
+  // samples are taken soon after a callback becomes slow
+  auto check_interval = chrono::nanoseconds(max<uint64_t>(this->threshold_ns / 4, 1000000));
+  unique_lock g(this->lock);
+  while (!this->should_exit_cv.wait_for(g, check_interval, [this]() { return this->should_exit; })) {
+    uint64_t now_ns = metrics_now_ns();
+    for (auto& ts : this->thread_states) {
+      uint64_t seq = ts->callback_seq.load(memory_order_acquire);
+      uint64_t start_ns = ts->callback_start_ns.load(memory_order_acquire);
+      if (!start_ns ||
+          (now_ns - start_ns < this->threshold_ns) ||
+          (ts->sample_requested_seq.load(memory_order_relaxed) == seq)) {
+        continue;
+      }
+      ts->sample_requested_seq.store(seq, memory_order_relaxed);
+#ifdef HAVE_STACK_SAMPLES
+      pthread_kill(ts->thread, SIGPROF);
+#endif
+    }
+  }
+}
+
+void EventLoopWatchdog::record_slow_callback(ThreadState& ts, uint64_t start_ns, uint64_t end_ns) {
+  SlowCallback cb;
+  cb.duration_usecs = (end_ns - start_ns) / 1000;
+  cb.start_time = phosg::now() - cb.duration_usecs;
+  cb.type = ts.type;
+  cb.name = ts.name;
+  if (ts.reported_duration_ns) {
+    cb.command = ts.reported_command;
+    cb.client_id = ts.reported_client_id;
+    cb.lobby_id = ts.reported_lobby_id;
+  } else {
+    cb.command = ts.command;
+    cb.client_id = ts.client_id;
+    cb.lobby_id = ts.lobby_id;
+  }
+
+#ifdef HAVE_STACK_SAMPLES
+  // The signal handler runs on this thread, so if it ran during this
+  // callback, it's already done writing the sample
+  atomic_signal_fence(memory_order_acquire);
+  if (ts.num_sample_frames && (ts.sample_seq == ts.callback_seq.load(memory_order_relaxed))) {
+    char** symbols = backtrace_symbols(ts.sample_frames, ts.num_sample_frames);
+    if (symbols) {
+      // Skip the signal handler's frame and the signal trampoline
+      for (size_t z = min<size_t>(2, ts.num_sample_frames); z < ts.num_sample_frames; z++) {
+        cb.stack.emplace_back(symbols[z]);
+      }
+      free(symbols);
+    }
+  }
+  ts.num_sample_frames = 0;
+#endif
+
+  server_log.warning("Slow callback: %s", cb.str().c_str());
+
+  lock_guard g(this->lock);
+  this->slow_callbacks.emplace_back(std::move(cb));
+  while (this->slow_callbacks.size() > this->max_slow_callbacks) {
+    this->slow_callbacks.pop_front();
+  }
+}
+
+WatchdogScope::WatchdogScope(EventLoopWatchdog::CallbackType type, const char* name)
+    : ts(EventLoopWatchdog::current_thread_state),
+      type(type),
+      start_ns(0) {
+  if (!this->ts) {
+    return;
+  }
+  this->start_ns = metrics_now_ns();
+  if (this->ts->depth++ == 0) {
+    this->ts->type = type;
+    this->ts->name = name;
+    this->ts->command = -1;
+    this->ts->client_id = 0;
+    this->ts->lobby_id = 0;
+    this->ts->reported_duration_ns = 0;
+    this->ts->callback_seq.fetch_add(1, memory_order_relaxed);
+    this->ts->callback_start_ns.store(this->start_ns, memory_order_release);
+  }
+}
+
+WatchdogScope::~WatchdogScope() {
+  if (!this->ts) {
+    return;
+  }
+  uint64_t end_ns = metrics_now_ns();
+  uint64_t duration_ns = end_ns - this->start_ns;
+  global_metrics.callback_ns[static_cast<size_t>(this->type)].record(duration_ns);
+
+  if (--this->ts->depth) {
+    // This is a nested scope; if it's the slowest one so far and has context,
+    // report its context if the outermost callback turns out to be slow
+    if ((this->ts->command >= 0) && (duration_ns >= this->ts->reported_duration_ns)) {
+      this->ts->reported_duration_ns = duration_ns;
+      this->ts->reported_command = this->ts->command;
+      this->ts->reported_client_id = this->ts->client_id;
+      this->ts->reported_lobby_id = this->ts->lobby_id;
+    }
+    return;
+  }
+
+  this->ts->callback_start_ns.store(0, memory_order_release);
+  if (this->ts->watchdog->threshold_ns && (duration_ns >= this->ts->watchdog->threshold_ns)) {
+    this->ts->watchdog->record_slow_callback(*this->ts, this->start_ns, end_ns);
+  }
+}
+
+void WatchdogScope::set_context(int32_t command, uint64_t client_id, uint32_t lobby_id) {
+  if (this->ts) {
+    this->ts->command = command;
+    this->ts->client_id = client_id;
+    this->ts->lobby_id = lobby_id;
+  }
+}
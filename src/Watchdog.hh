@@ -0,0 +1,155 @@
+#pragma once
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <phosg/JSON.hh>
+#include <string>
+#include <thread>
+#include <vector>
+
+class WatchdogScope;
+
+// EventLoopWatchdog measures how long event callbacks run on the threads it
+// watches. Callbacks are marked with WatchdogScope objects (see below). If a
+// callback runs longer than the threshold, the watchdog's thread interrupts
+// the stalled thread to take a sample of its stack while it's still stuck, and
+// when the callback finally returns, it's recorded (along with the command,
+// client, and lobby it was handling, if any) in a ring buffer of slow
+// callbacks. The durations of all callbacks are also recorded in
+// global_metrics. If the threshold is zero, only the durations are recorded;
+// there is no watchdog thread and no stack samples are taken.
+class EventLoopWatchdog {
+public:
+  enum class CallbackType {
+    CHANNEL_INPUT = 0, // Channel::dispatch_on_input (all commands in one read)
+    COMMAND, // A single command's handler
+    TIMER, // A timer event
+    FORWARDED, // A function passed to forward_to_event_thread
+  };
+  static constexpr size_t NUM_CALLBACK_TYPES = 4;
+
+  struct SlowCallback {
+    uint64_t start_time; // As from phosg::now()
+    uint64_t duration_usecs;
+    CallbackType type;
+    const char* name;
+    // These come from the slowest nested scope that set them, if any, or from
+    // the outermost scope otherwise
+    int32_t command = -1; // -1 = not handling a command
+    uint64_t client_id = 0; // 0 = not handling a client's command
+    uint32_t lobby_id = 0; // 0 = client was not in a lobby
+    std::vector<std::string> stack; // Empty if no sample was taken
+
+    phosg::JSON json() const;
+    std::string str() const;
+  };
+
+  explicit EventLoopWatchdog(uint64_t threshold_usecs, size_t max_slow_callbacks = 64);
+  EventLoopWatchdog(const EventLoopWatchdog&) = delete;
+  EventLoopWatchdog(EventLoopWatchdog&&) = delete;
+  EventLoopWatchdog& operator=(const EventLoopWatchdog&) = delete;
+  EventLoopWatchdog& operator=(EventLoopWatchdog&&) = delete;
+  // Must be called on the same thread that created the watchdog
+  ~EventLoopWatchdog();
+
+  // Starts watching callbacks on the calling thread. WatchdogScopes on
+  // threads that aren't watched do nothing.
+  void watch_current_thread();
+
+  inline uint64_t get_threshold_usecs() const {
+    return this->threshold_ns / 1000;
+  }
+  // Returns false if slow callbacks are not detected (the threshold is zero)
+  inline bool detects_slow_callbacks() const {
+    return this->threshold_ns != 0;
+  }
+  // Returns the recorded slow callbacks, oldest first
+  std::vector<SlowCallback> get_slow_callbacks() const;
+
+  static const char* name_for_callback_type(CallbackType type);
+
+private:
+  friend class WatchdogScope;
+
+  // Everything here except the atomics is only accessed by the watched
+  // thread (including from its signal handler)
+  struct ThreadState {
+    EventLoopWatchdog* watchdog;
+    pthread_t thread;
+    size_t depth = 0;
+
+    // Written by the watched thread, read by the watchdog thread.
+    // callback_start_ns is zero when no callback is running.
+    std::atomic<uint64_t> callback_start_ns = 0;
+    std::atomic<uint64_t> callback_seq = 0;
+    std::atomic<uint64_t> sample_requested_seq = 0;
+
+    // Context for the current outermost callback
+    CallbackType type = CallbackType::CHANNEL_INPUT;
+    const char* name = nullptr;
+    int32_t command = -1;
+    uint64_t client_id = 0;
+    uint32_t lobby_id = 0;
+    // Context from the slowest nested scope that has ended so far
+    uint64_t reported_duration_ns = 0;
+    int32_t reported_command = -1;
+    uint64_t reported_client_id = 0;
+    uint32_t reported_lobby_id = 0;
+
+    // Written by the signal handler on the watched thread
+    static constexpr size_t MAX_SAMPLE_FRAMES = 64;
+    uint64_t sample_seq = 0;
+    void* sample_frames[MAX_SAMPLE_FRAMES];
+    size_t num_sample_frames = 0;
+  };
+
+  static thread_local ThreadState* current_thread_state;
+
+  uint64_t threshold_ns;
+  size_t max_slow_callbacks;
+
+  mutable std::mutex lock;
+  std::condition_variable should_exit_cv;
+  bool should_exit;
+  std::vector<std::unique_ptr<ThreadState>> thread_states;
+  std::deque<SlowCallback> slow_callbacks;
+  std::thread thread;
+
+  void thread_fn();
+  void record_slow_callback(ThreadState& ts, uint64_t start_ns, uint64_t end_ns);
+  static void on_sample_signal(int);
+};
+
+// Marks the lifetime of an event callback (or part of one). Scopes may be
+// nested; only the outermost scope on each thread is checked against the
+// watchdog's threshold, but all scopes' durations are recorded in
+// global_metrics. name must be a string literal.
+class WatchdogScope {
+public:
+  WatchdogScope(EventLoopWatchdog::CallbackType type, const char* name);
+  WatchdogScope(const WatchdogScope&) = delete;
+  WatchdogScope(WatchdogScope&&) = delete;
+  WatchdogScope& operator=(const WatchdogScope&) = delete;
+  WatchdogScope& operator=(WatchdogScope&&) = delete;
+  ~WatchdogScope();
+
+  // Returns true if the current thread is being watched. If this returns
+  // false, set_context does nothing, so callers can skip computing its
+  // arguments.
+  inline bool active() const {
+    return this->ts != nullptr;
+  }
+  void set_context(int32_t command, uint64_t client_id, uint32_t lobby_id);
+
+private:
+  EventLoopWatchdog::ThreadState* ts;
+  EventLoopWatchdog::CallbackType type;
+  uint64_t start_ns;
+};
@@ -2,3 +2,25 @@
 
 set -e
 ./tests/compression.sh prs "$1"
+
+BASENAME="card-defs-test-prs-chained"
+EXECUTABLE="$1"
+if [ -z "$EXECUTABLE" ]; then
+  EXECUTABLE="./newserv"
+fi
+
+echo "... decompress-prs"
+$EXECUTABLE decompress-prs system/ep3/card-definitions.mnr $BASENAME.mnrd
+for LEVEL in 1 4 8 9; do
+  echo "... compress with chained level=$LEVEL"
+  $EXECUTABLE compress-prs --chained=$LEVEL $BASENAME.mnrd $BASENAME.mnrd.prs.c$LEVEL
+  echo "... decompress from chained level=$LEVEL"
+  $EXECUTABLE decompress-prs $BASENAME.mnrd.prs.c$LEVEL $BASENAME.mnrd.prs.c$LEVEL.dec
+  echo "... check result from chained level=$LEVEL"
+  diff $BASENAME.mnrd $BASENAME.mnrd.prs.c$LEVEL.dec
+  rm $BASENAME.mnrd.prs.c$LEVEL $BASENAME.mnrd.prs.c$LEVEL.dec
+done
+echo "... decompression speed test"
+$EXECUTABLE prs-decompression-speed-test --iterations=20 system/ep3/card-definitions.mnr
+echo "... clean up"
+rm $BASENAME.mnrd
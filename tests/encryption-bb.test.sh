@@ -0,0 +1,43 @@
+#!/bin/sh
+
+set -e
+
+EXECUTABLE="$1"
+if [ -z "$EXECUTABLE" ]; then
+  EXECUTABLE="./newserv"
+fi
+
+# The expected checksums were generated with the original block-at-a-time
+# implementation, so these check that the multi-block kernel and the new
+# key expansion produce the same output for each subtype. The input is an odd
+# number of whole blocks, since a truncated last block can't be decrypted.
+BASENAME="encryption-bb-test"
+INPUT="$BASENAME.in"
+SEED="0B30557A9FC4E90E33587DA2C7EC11365B80A5CAEF14395E83A8CDF2173C6186ABD0F51A3F6489AED3F81D42678CB1D6"
+
+echo "... prepare input"
+head -c 28408 system/ep3/card-definitions.mnr > $INPUT
+
+check() {
+  KEY_NAME="$1"
+  EXPECTED="$2"
+  echo "... encrypt with $KEY_NAME"
+  $EXECUTABLE encrypt-data --bb --key=$KEY_NAME --seed=$SEED $INPUT $BASENAME.enc
+  RESULT=$(cksum < $BASENAME.enc | awk '{print $1}')
+  if [ "$RESULT" != "$EXPECTED" ]; then
+    echo "checksum of encrypted data is $RESULT; expected $EXPECTED"
+    exit 1
+  fi
+  echo "... decrypt with $KEY_NAME"
+  $EXECUTABLE decrypt-data --bb --key=$KEY_NAME --seed=$SEED $BASENAME.enc $BASENAME.dec
+  diff $INPUT $BASENAME.dec
+  rm $BASENAME.enc $BASENAME.dec
+}
+
+check default 2143976397
+check mocb1 2073732490
+check tfs1 381469154
+check jsd1 4100691146
+
+echo "... clean up"
+rm $INPUT
@@ -0,0 +1,37 @@
+#!/bin/sh
+
+set -e
+
+EXECUTABLE="$1"
+if [ -z "$EXECUTABLE" ]; then
+  EXECUTABLE="./newserv"
+fi
+
+# The expected checksums were generated with the original one-word-at-a-time
+# implementation, so these check that the bulk keystream kernels (which may be
+# AVX2 or NEON, depending on the CPU) produce the same output. The input is
+# long enough to cross many stream refills for both ciphers.
+INPUT="system/ep3/card-definitions.mnr"
+BASENAME="encryption-lfg-test"
+
+check() {
+  NAME="$1"
+  EXPECTED="$2"
+  shift 2
+  echo "... encrypt $NAME"
+  $EXECUTABLE encrypt-data --seed=1A2B3C4D "$@" $INPUT $BASENAME.enc
+  RESULT=$(cksum < $BASENAME.enc | awk '{print $1}')
+  if [ "$RESULT" != "$EXPECTED" ]; then
+    echo "checksum of encrypted data is $RESULT; expected $EXPECTED"
+    exit 1
+  fi
+  echo "... decrypt $NAME"
+  $EXECUTABLE decrypt-data --seed=1A2B3C4D "$@" $BASENAME.enc $BASENAME.dec
+  diff $INPUT $BASENAME.dec
+  rm $BASENAME.enc $BASENAME.dec
+}
+
+check "V2" 3281716619 --pc
+check "V2 (big-endian)" 563142139 --pc --big-endian
+check "V3" 2134955750 --gc
+check "V3 (big-endian)" 835504279 --gc --big-endian